@@ -272,4 +272,14 @@ Status BinderUpdateEngineAndroidService::setPerformanceMode(bool enable) {
   return Status::ok();
 }
 
+Status BinderUpdateEngineAndroidService::getLastUpdateResourceUsage(
+    android::String16* return_value) {
+  Error error;
+  std::string usage;
+  if (!service_delegate_->GetLastUpdateResourceUsage(&usage, &error))
+    return ErrorPtrToStatus(error);
+  *return_value = android::String16(usage.c_str());
+  return Status::ok();
+}
+
 }  // namespace chromeos_update_engine
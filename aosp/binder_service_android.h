@@ -83,6 +83,8 @@ class BinderUpdateEngineAndroidService final
   ::android::binder::Status triggerPostinstall(
       const ::android::String16& partition) override;
   android::binder::Status setPerformanceMode(bool enable) override;
+  android::binder::Status getLastUpdateResourceUsage(
+      android::String16* return_value) override;
 
  private:
   // Remove the passed |callback| from the list of registered callbacks. Called
@@ -96,7 +96,8 @@ bool ProcessPartition(
                                   cow_writer.get(),
                                   partition.new_partition_info().size(),
                                   partition.old_partition_info().size(),
-                                  false));
+                                  false,
+                                  manifest.minor_version()));
   TEST_AND_RETURN_FALSE(cow_writer->Finalize());
   return true;
 }
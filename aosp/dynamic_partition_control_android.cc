@@ -1503,7 +1503,8 @@ DynamicPartitionControlAndroid::OpenCowWriter(
 std::unique_ptr<FileDescriptor> DynamicPartitionControlAndroid::OpenCowFd(
     const std::string& unsuffixed_partition_name,
     const std::optional<std::string>& source_path,
-    bool is_append) {
+    bool is_append,
+    bool is_delta) {
   auto cow_writer = OpenCowWriter(
       unsuffixed_partition_name, source_path, {kEndOfInstallLabel});
   if (cow_writer == nullptr) {
@@ -1516,7 +1517,7 @@ std::unique_ptr<FileDescriptor> DynamicPartitionControlAndroid::OpenCowFd(
     return nullptr;
   }
   return std::make_unique<CowWriterFileDescriptor>(
-      std::move(cow_writer), std::move(fd), source_path);
+      std::move(cow_writer), std::move(fd), source_path, is_delta);
 }
 
 std::optional<base::FilePath> DynamicPartitionControlAndroid::GetSuperDevice() {
@@ -110,7 +110,8 @@ class DynamicPartitionControlAndroid : public DynamicPartitionControlInterface {
   std::unique_ptr<FileDescriptor> OpenCowFd(
       const std::string& unsuffixed_partition_name,
       const std::optional<std::string>&,
-      bool is_append) override;
+      bool is_append,
+      bool is_delta) override;
 
   bool MapAllPartitions() override;
   bool UnmapAllPartitions() override;
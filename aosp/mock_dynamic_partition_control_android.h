@@ -106,7 +106,8 @@ class MockDynamicPartitionControlAndroid
               OpenCowFd,
               (const std::string& unsuffixed_partition_name,
                const std::optional<std::string>& source_path,
-               bool is_append),
+               bool is_append,
+               bool is_delta),
               (override));
   MOCK_METHOD(bool, MapAllPartitions, (), (override));
   MOCK_METHOD(bool, UnmapAllPartitions, (), (override));
@@ -135,6 +135,11 @@ class ServiceDelegateAndroidInterface {
 
   virtual bool SetPerformanceMode(bool enable, Error* error) = 0;
 
+  // Sets |usage| to the summary of the resources used by each phase of the
+  // last update attempt.
+  virtual bool GetLastUpdateResourceUsage(std::string* usage,
+                                          Error* error) = 0;
+
  protected:
   ServiceDelegateAndroidInterface() = default;
 };
@@ -45,6 +45,8 @@
 #include "update_engine/common/file_fetcher.h"
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector.h"
+#include "update_engine/common/pressure_throttler.h"
+#include "update_engine/common/resource_accountant.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/delta_performer.h"
@@ -83,6 +85,11 @@ namespace {
 const double kBroadcastThresholdProgress = 0.01;  // 1%
 const int kBroadcastThresholdSeconds = 10;
 
+// The highest "some avg10" pressure stall percentage of io, cpu and memory
+// that the update tries to keep the system under. 0, the default, disables the
+// throttling.
+constexpr auto&& kPressureTargetProp = "update_engine.pressure_target_percent";
+
 // Log and set the error on the passed ErrorPtr.
 bool LogAndSetGenericError(Error* error,
                            int line_number,
@@ -722,12 +729,51 @@ bool UpdateAttempterAndroid::SetPerformanceMode(bool enable,
   if (!ret)
     return LogAndSetGenericError(error, __LINE__, __FILE__, "Could not change profiles");
   performance_mode_ = enable;
+  if (pressure_throttler_) {
+    pressure_throttler_->set_enabled(
+        !performance_mode_ && pressure_throttler_->target_pressure() > 0);
+  }
+  return true;
+}
+
+void UpdateAttempterAndroid::ResetPressureThrottler() {
+  pressure_throttler_ = std::make_unique<PressureThrottler>(clock_.get());
+  const int target = std::clamp<int>(
+      android::base::GetIntProperty(
+          kPressureTargetProp,
+          static_cast<int>(PressureThrottler::kDefaultTargetPressure)),
+      0,
+      100);
+  pressure_throttler_->set_target_pressure(target);
+  pressure_throttler_->set_enabled(!performance_mode_ && target > 0);
+}
+
+void UpdateAttempterAndroid::FinishResourceAccounting() {
+  if (!resource_accountant_)
+    return;
+  resource_accountant_->EndPhase();
+  const string summary = resource_accountant_->Summary();
+  LOG(INFO) << "Resources used by the update:\n" << summary;
+  prefs_->SetString(kPrefsLastUpdateResourceUsage, summary);
+  resource_accountant_.reset();
+}
+
+bool UpdateAttempterAndroid::GetLastUpdateResourceUsage(string* usage,
+                                                        Error* error) {
+  if (!prefs_->GetString(kPrefsLastUpdateResourceUsage, usage)) {
+    return LogAndSetGenericError(
+        error, __LINE__, __FILE__, "No update attempt was accounted");
+  }
   return true;
 }
 
 void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
                                             ErrorCode code) {
   LOG(INFO) << "Processing Done.";
+  if (pressure_throttler_) {
+    pressure_throttler_->LogStats();
+  }
+  FinishResourceAccounting();
   metric_bytes_downloaded_.Flush(true);
   metric_total_bytes_downloaded_.Flush(true);
   if (status_ == UpdateStatus::CLEANUP_PREVIOUS_UPDATE) {
@@ -772,6 +818,7 @@ void UpdateAttempterAndroid::ProcessingDone(const ActionProcessor* processor,
 
 void UpdateAttempterAndroid::ProcessingStopped(
     const ActionProcessor* processor) {
+  FinishResourceAccounting();
   TerminateUpdateAndNotify(ErrorCode::kUserCanceled);
 }
 
@@ -786,6 +833,8 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
        status_ == UpdateStatus::CLEANUP_PREVIOUS_UPDATE)) {
     cleanup_previous_update_code_ = code;
     NotifyCleanupPreviousUpdateCallbacksAndClear();
+    if (resource_accountant_)
+      resource_accountant_->EndPhase();
   }
   // download_progress_ is actually used by other actions, such as
   // filesystem_verify_action. Therefore we always clear it.
@@ -801,6 +850,8 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   }
   if (type == UpdateBootFlagsAction::StaticType()) {
     SetStatusAndNotify(UpdateStatus::CLEANUP_PREVIOUS_UPDATE);
+    if (resource_accountant_)
+      resource_accountant_->BeginPhase("cleanup");
   }
   if (type == DownloadAction::StaticType()) {
     auto download_action = static_cast<DownloadAction*>(action);
@@ -809,6 +860,8 @@ void UpdateAttempterAndroid::ActionCompleted(ActionProcessor* processor,
   } else if (type == FilesystemVerifierAction::StaticType()) {
     SetStatusAndNotify(UpdateStatus::FINALIZING);
     prefs_->SetBoolean(kPrefsVerityWritten, true);
+    if (resource_accountant_)
+      resource_accountant_->BeginPhase("postinstall");
   }
 }
 
@@ -944,11 +997,19 @@ void UpdateAttempterAndroid::BuildUpdateActions(HttpFetcher* fetcher) {
                                        update_certificates_path_);
   download_action->set_delegate(this);
   download_action->set_base_offset(base_offset_);
+  ResetPressureThrottler();
+  download_action->set_pressure_throttler(pressure_throttler_.get());
+  resource_accountant_ = std::make_unique<ResourceAccountant>(clock_.get());
+  download_action->set_resource_accountant(resource_accountant_.get());
   auto filesystem_verifier_action = std::make_unique<FilesystemVerifierAction>(
       boot_control_->GetDynamicPartitionControl());
   auto postinstall_runner_action =
       std::make_unique<PostinstallRunnerAction>(boot_control_, hardware_);
   filesystem_verifier_action->set_delegate(this);
+  filesystem_verifier_action->set_prefs(prefs_);
+  filesystem_verifier_action->set_pressure_throttler(pressure_throttler_.get());
+  filesystem_verifier_action->set_resource_accountant(
+      resource_accountant_.get());
   postinstall_runner_action->set_delegate(this);
 
   // Bond them together. We have to use the leaf-types when calling
@@ -1409,6 +1470,13 @@ bool UpdateAttempterAndroid::setShouldSwitchSlotOnReboot(
         std::make_unique<FilesystemVerifierAction>(
             boot_control_->GetDynamicPartitionControl());
     filesystem_verifier_action->set_delegate(this);
+    filesystem_verifier_action->set_prefs(prefs_);
+    ResetPressureThrottler();
+    filesystem_verifier_action->set_pressure_throttler(
+        pressure_throttler_.get());
+    resource_accountant_ = std::make_unique<ResourceAccountant>(clock_.get());
+    filesystem_verifier_action->set_resource_accountant(
+        resource_accountant_.get());
     BondActions(install_plan_action.get(), filesystem_verifier_action.get());
     BondActions(filesystem_verifier_action.get(),
                 postinstall_runner_action.get());
@@ -39,6 +39,8 @@
 #include "update_engine/common/metrics_reporter_interface.h"
 #include "update_engine/common/network_selector_interface.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/pressure_throttler.h"
+#include "update_engine/common/resource_accountant.h"
 #include "update_engine/metrics_utils.h"
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/postinstall_runner_action.h"
@@ -102,6 +104,7 @@ class UpdateAttempterAndroid final
   bool TriggerPostinstall(const std::string& partition, Error* error) override;
 
   bool SetPerformanceMode(bool enable, Error* error) override;
+  bool GetLastUpdateResourceUsage(std::string* usage, Error* error) override;
 
   // ActionProcessorDelegate methods:
   void ProcessingDone(const ActionProcessor* processor,
@@ -167,6 +170,14 @@ class UpdateAttempterAndroid final
   // passed to this function.
   void BuildUpdateActions(HttpFetcher* fetcher);
 
+  // Creates a new |pressure_throttler_| for the actions of an update, with
+  // the pressure target from the system properties.
+  void ResetPressureThrottler();
+
+  // Ends the accounting of the resources used by the update, logs them and
+  // persists them for GetLastUpdateResourceUsage().
+  void FinishResourceAccounting();
+
   // Writes to the processing completed marker. Does nothing if
   // |update_completed_marker_| is empty.
   [[nodiscard]] bool WriteUpdateCompletedMarker();
@@ -295,6 +306,12 @@ class UpdateAttempterAndroid final
 
   bool performance_mode_ = false;
 
+  // Paces the update with the system pressure, unless in performance mode.
+  std::unique_ptr<PressureThrottler> pressure_throttler_;
+
+  // Accounts the resources used by each phase of the current update.
+  std::unique_ptr<ResourceAccountant> resource_accountant_;
+
   DISALLOW_COPY_AND_ASSIGN(UpdateAttempterAndroid);
 };
 
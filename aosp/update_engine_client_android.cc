@@ -175,6 +175,10 @@ int UpdateEngineClientAndroid::OnInit() {
               "Wait for previous update to merge. "
               "Only available after rebooting to new slot.");
   DEFINE_bool(perf_mode, false, "Enable perf mode.");
+  DEFINE_bool(resource_usage,
+              false,
+              "Show the resources used by each phase of the last update "
+              "attempt and exit.");
   // Boilerplate init commands.
   base::CommandLine::Init(argc_, argv_);
   brillo::FlagHelper::Init(argc_, argv_, "Android Update Engine Client");
@@ -307,6 +311,16 @@ int UpdateEngineClientAndroid::OnInit() {
     return ExitWhenIdle(service_->setPerformanceMode(true));
   }
 
+  if (FLAGS_resource_usage) {
+    android::String16 usage;
+    Status status = service_->getLastUpdateResourceUsage(&usage);
+    if (status.isOk()) {
+      LOG(INFO) << "Resources used by the last update attempt:\n"
+                << android::String8(usage).c_str();
+    }
+    return ExitWhenIdle(status);
+  }
+
   if (FLAGS_update) {
     auto and_headers = ParseHeaders(FLAGS_headers);
     Status status = service_->applyPayload(
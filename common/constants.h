@@ -33,6 +33,10 @@ static constexpr const auto& kPowerwashSafePrefsSubDirectory =
 // The location where we store the AU preferences (state etc).
 static constexpr const auto& kPrefsSubDirectory = "prefs";
 
+// The location where we store the data blobs kept for reuse by an update, next
+// to the preferences.
+static constexpr const auto& kReusedBlobsSubDirectory = "reused_blobs";
+
 // Path to the stateful partition on the root filesystem.
 static constexpr const auto& kStatefulPartition = "/mnt/stateful_partition";
 
@@ -92,6 +96,8 @@ static constexpr const auto& kPrefsPingActive = "active";
 static constexpr const auto& kPrefsPingLastActive = "date_last_active";
 static constexpr const auto& kPrefsPingLastRollcall = "date_last_rollcall";
 static constexpr const auto& kPrefsLastFp = "last-fp";
+static constexpr const auto& kPrefsLastUpdateResourceUsage =
+    "last-update-resource-usage";
 static constexpr const auto& kPrefsPostInstallSucceeded =
     "post-install-succeeded";
 static constexpr const auto& kPrefsPreviousVersion = "previous-version";
@@ -147,6 +153,22 @@ static constexpr const auto& kPrefsUpdateBootTimestampStart =
 static constexpr const auto& kPrefsUpdateTimestampStart =
     "update-timestamp-start";
 static constexpr const auto& kPrefsUrlSwitchCount = "url-switch-count";
+static constexpr const auto& kPrefsVerifierCheckpointGuardHash =
+    "verifier-checkpoint-guard-hash";
+static constexpr const auto& kPrefsVerifierCheckpointGuardSize =
+    "verifier-checkpoint-guard-size";
+static constexpr const auto& kPrefsVerifierCheckpointOffset =
+    "verifier-checkpoint-offset";
+static constexpr const auto& kPrefsVerifierCheckpointPartition =
+    "verifier-checkpoint-partition";
+static constexpr const auto& kPrefsVerifierCheckpointPartitionId =
+    "verifier-checkpoint-partition-id";
+static constexpr const auto& kPrefsVerifierCheckpointPartitionSize =
+    "verifier-checkpoint-partition-size";
+static constexpr const auto& kPrefsVerifierCheckpointPlanHash =
+    "verifier-checkpoint-plan-hash";
+static constexpr const auto& kPrefsVerifierCheckpointSHA256Context =
+    "verifier-checkpoint-sha-256-context";
 static constexpr const auto& kPrefsVerityWritten = "verity-written";
 static constexpr const auto& kPrefsWallClockScatteringWaitPeriod =
     "wall-clock-wait-period";
@@ -22,12 +22,15 @@
 #include <sys/types.h>
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 
 #include "update_engine/common/boot_control_interface.h"
 #include "update_engine/common/http_fetcher.h"
 #include "update_engine/common/multi_range_http_fetcher.h"
+#include "update_engine/common/pressure_throttler.h"
+#include "update_engine/common/scoped_task_id.h"
 #include "update_engine/payload_consumer/delta_performer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 
@@ -108,6 +111,18 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
 
   void set_base_offset(int64_t base_offset) { base_offset_ = base_offset; }
 
+  // Sets the throttler pacing the download and the install operations with
+  // the system pressure. Not owned.
+  void set_pressure_throttler(PressureThrottler* pressure_throttler) {
+    pressure_throttler_ = pressure_throttler;
+  }
+
+  // Sets the accountant of the resources used by the DeltaPerformer. Not
+  // owned.
+  void set_resource_accountant(ResourceAccountant* resource_accountant) {
+    resource_accountant_ = resource_accountant;
+  }
+
   HttpFetcher* http_fetcher() { return http_fetcher_.get(); }
 
  private:
@@ -118,6 +133,11 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Start downloading the current payload using delta_performer.
   void StartDownloading();
 
+  // Pauses the transfer after |bytes| bytes were received and applied, if
+  // the system pressure is above the target, and resumes it once the delay
+  // of |pressure_throttler_| elapsed.
+  void Throttle(size_t bytes);
+
   // Pointer to the current payload in install_plan_.payloads.
   InstallPlan::Payload* payload_{nullptr};
 
@@ -153,6 +173,16 @@ class DownloadAction : public InstallPlanAction, public HttpFetcherDelegate {
   // Offset of the payload in the download URL, used by UpdateAttempterAndroid.
   int64_t base_offset_{0};
 
+  // The data to download again once the transfer is terminated, after the
+  // data of an operation failed its hash check.
+  std::optional<DeltaPerformer::Refetch> refetch_;
+
+  PressureThrottler* pressure_throttler_{nullptr};
+  ResourceAccountant* resource_accountant_{nullptr};
+
+  // The task resuming the transfer paused by Throttle().
+  ScopedTaskId throttle_task_id_;
+
   // The path to the zip file with X509 certificates.
   const std::string update_certificates_path_;
 
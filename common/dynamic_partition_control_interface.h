@@ -172,11 +172,13 @@ class DynamicPartitionControlInterface {
       const std::optional<std::string>&,
       std::optional<uint64_t> label) = 0;
   // Open a general purpose FD capable to reading and writing to COW. Note that
-  // writes must be block aligned.
+  // writes must be block aligned. If |is_delta|, the partition is updated from
+  // the source slot and the blocks identical to it aren't written.
   virtual std::unique_ptr<FileDescriptor> OpenCowFd(
       const std::string& unsuffixed_partition_name,
       const std::optional<std::string>&,
-      bool is_append = false) = 0;
+      bool is_append = false,
+      bool is_delta = false) = 0;
 
   virtual bool IsDynamicPartition(const std::string& part_name,
                                   uint32_t slot) = 0;
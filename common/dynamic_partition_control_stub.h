@@ -72,7 +72,8 @@ class DynamicPartitionControlStub final
   std::unique_ptr<FileDescriptor> OpenCowFd(
       const std::string& unsuffixed_partition_name,
       const std::optional<std::string>&,
-      bool is_append = false) override {
+      bool is_append = false,
+      bool is_delta = false) override {
     return nullptr;
   }
 
@@ -120,7 +120,10 @@ class FakeHardware : public HardwareInterface {
   bool IsPowerwashScheduled() { return powerwash_scheduled_; }
 
   bool GetNonVolatileDirectory(base::FilePath* path) const override {
-    return false;
+    if (non_volatile_directory_.empty())
+      return false;
+    *path = non_volatile_directory_;
+    return true;
   }
 
   bool GetPowerwashSafeDirectory(base::FilePath* path) const override {
@@ -190,6 +193,10 @@ class FakeHardware : public HardwareInterface {
     build_timestamp_ = build_timestamp;
   }
 
+  void SetNonVolatileDirectory(const base::FilePath& path) {
+    non_volatile_directory_ = path;
+  }
+
   void SetWarmReset(bool warm_reset) override { warm_reset_ = warm_reset; }
 
   void SetVbmetaDigestForInactiveSlot(bool reset) override {}
@@ -245,6 +252,7 @@ class FakeHardware : public HardwareInterface {
   int64_t build_timestamp_{0};
   bool first_active_omaha_ping_sent_{false};
   bool warm_reset_{false};
+  base::FilePath non_volatile_directory_;
   mutable std::map<std::string, std::string> partition_timestamps_;
 
   DISALLOW_COPY_AND_ASSIGN(FakeHardware);
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/pressure_throttler.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+const char kPressureStallDir[] = "/proc/pressure";
+
+namespace {
+
+const char* const kPressureResources[] = {"io", "cpu", "memory"};
+
+// The kernel updates avg10 every 2 seconds, reading it more often is useless.
+constexpr base::TimeDelta kPollInterval = base::TimeDelta::FromSeconds(1);
+// The delay when the pressure first goes above the target, and the highest
+// one, so the update still makes progress on a busy system.
+constexpr base::TimeDelta kMinDelay = base::TimeDelta::FromMilliseconds(5);
+constexpr base::TimeDelta kMaxDelay = base::TimeDelta::FromMilliseconds(500);
+// How long the work runs between two delays.
+constexpr base::TimeDelta kWorkInterval =
+    base::TimeDelta::FromMilliseconds(200);
+
+}  // namespace
+
+PressureThrottler::PressureThrottler(ClockInterface* clock,
+                                     const string& pressure_dir)
+    : clock_(clock), pressure_dir_(pressure_dir) {}
+
+bool PressureThrottler::ParsePressure(const string& contents, double* avg10) {
+  // The first line is: some avg10=0.00 avg60=0.00 avg300=0.00 total=0
+  constexpr char kPrefix[] = "some avg10=";
+  const size_t pos = contents.find(kPrefix);
+  if (pos == string::npos || (pos != 0 && contents[pos - 1] != '\n'))
+    return false;
+  const char* value = contents.c_str() + pos + sizeof(kPrefix) - 1;
+  char* end = nullptr;
+  *avg10 = strtod(value, &end);
+  return end != value && *avg10 >= 0;
+}
+
+bool PressureThrottler::ReadPressure(double* pressure) {
+  bool found = false;
+  *pressure = 0;
+  for (const char* resource : kPressureResources) {
+    string contents;
+    double avg10;
+    if (!utils::ReadFile(pressure_dir_ + "/" + resource, &contents) ||
+        !ParsePressure(contents, &avg10)) {
+      continue;
+    }
+    found = true;
+    *pressure = std::max(*pressure, avg10);
+  }
+  return found;
+}
+
+void PressureThrottler::UpdateDelay(base::Time now) {
+  if (!last_poll_time_.is_null() && now - last_poll_time_ < kPollInterval)
+    return;
+  last_poll_time_ = now;
+
+  double pressure;
+  if (!ReadPressure(&pressure)) {
+    LOG_IF(WARNING, !logged_unavailable_)
+        << "Pressure stall information isn't available in " << pressure_dir_
+        << ", not throttling the update.";
+    logged_unavailable_ = true;
+    delay_ = base::TimeDelta();
+    return;
+  }
+  last_pressure_ = pressure;
+  max_pressure_ = std::max(max_pressure_, pressure);
+
+  if (pressure > target_pressure_) {
+    delay_ = std::min(std::max(delay_ * 2, kMinDelay), kMaxDelay);
+  } else {
+    delay_ = delay_ / 2;
+    if (delay_ < kMinDelay)
+      delay_ = base::TimeDelta();
+  }
+}
+
+base::TimeDelta PressureThrottler::OnBytesProcessed(uint64_t bytes) {
+  const base::Time now = clock_->GetMonotonicTime();
+  if (start_time_.is_null())
+    start_time_ = now;
+  bytes_processed_ += bytes;
+  if (!enabled_ || target_pressure_ <= 0)
+    return base::TimeDelta();
+  UpdateDelay(now);
+  if (delay_.is_zero() || now - work_start_time_ < kWorkInterval)
+    return base::TimeDelta();
+  work_start_time_ = now + delay_;
+  return delay_;
+}
+
+base::TimeDelta PressureThrottler::elapsed_time() const {
+  if (start_time_.is_null())
+    return base::TimeDelta();
+  return clock_->GetMonotonicTime() - start_time_;
+}
+
+double PressureThrottler::Throughput() const {
+  const double seconds = elapsed_time().InSecondsF();
+  return seconds > 0 ? bytes_processed_ / seconds : 0;
+}
+
+void PressureThrottler::LogStats() const {
+  LOG(INFO) << "Processed " << bytes_processed_ << " bytes in "
+            << utils::FormatTimeDelta(elapsed_time()) << " ("
+            << static_cast<uint64_t>(Throughput()) << " bytes/s), throttled "
+            << utils::FormatTimeDelta(throttled_time_)
+            << ", pressure target " << target_pressure_ << "%, last "
+            << last_pressure_ << "%, max " << max_pressure_ << "%.";
+}
+
+}  // namespace chromeos_update_engine
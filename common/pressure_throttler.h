@@ -0,0 +1,119 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_PRESSURE_THROTTLER_H_
+#define UPDATE_ENGINE_COMMON_PRESSURE_THROTTLER_H_
+
+#include <string>
+
+#include <base/time/time.h>
+
+#include "update_engine/common/clock_interface.h"
+
+namespace chromeos_update_engine {
+
+// The directory where the kernel exports the pressure stall information.
+extern const char kPressureStallDir[];
+
+// Paces the work of the update with the Linux pressure stall information
+// (PSI) of the io, cpu and memory resources, so a background update doesn't
+// slow down the foreground apps. The "some avg10" value of each resource, the
+// percentage of the last 10 seconds during which at least one task stalled on
+// it, is compared to a target: above it the work pauses for a delay after
+// each interval of work, and the delay doubles; below it the delay halves
+// until the work runs at full speed again. The callers wait for the delay by
+// pausing their work and resuming it from a delayed task, never by blocking
+// the message loop.
+class PressureThrottler {
+ public:
+  // The default target of the highest "some avg10" pressure, in percent. 0
+  // disables the throttling, which is opt-in.
+  static constexpr double kDefaultTargetPressure = 0;
+
+  // Reads the pressure files from |pressure_dir|. |clock| is used to measure
+  // the time and isn't owned.
+  PressureThrottler(ClockInterface* clock,
+                    const std::string& pressure_dir = kPressureStallDir);
+
+  // Parses the "some avg10" value of the contents of a pressure file.
+  static bool ParsePressure(const std::string& contents, double* avg10);
+
+  // Whether the work is paced at all, for example not in performance mode.
+  void set_enabled(bool enabled) { enabled_ = enabled; }
+  bool enabled() const { return enabled_; }
+
+  void set_target_pressure(double target_pressure) {
+    target_pressure_ = target_pressure;
+  }
+  double target_pressure() const { return target_pressure_; }
+
+  // Records that |bytes| bytes were processed and returns how long to wait
+  // before processing more. The delay is non-zero at most once per interval
+  // of work, however small the units of work are. The pressure is read at
+  // most once per poll interval, and the delay only changes then.
+  base::TimeDelta OnBytesProcessed(uint64_t bytes);
+
+  // Accounts for a delay returned by OnBytesProcessed() that the caller
+  // waited for.
+  void AddThrottledTime(base::TimeDelta delay) { throttled_time_ += delay; }
+
+  // The statistics of the work paced so far.
+  uint64_t bytes_processed() const { return bytes_processed_; }
+  base::TimeDelta throttled_time() const { return throttled_time_; }
+  base::TimeDelta elapsed_time() const;
+  // In bytes per second, including the time spent throttled.
+  double Throughput() const;
+  double last_pressure() const { return last_pressure_; }
+  double max_pressure() const { return max_pressure_; }
+  base::TimeDelta delay() const { return delay_; }
+
+  // Logs the statistics above.
+  void LogStats() const;
+
+ private:
+  // Reads the highest "some avg10" value of the pressure files, or returns
+  // false if none of them could be read.
+  bool ReadPressure(double* pressure);
+
+  // Reads the pressure and adjusts |delay_| if the poll interval elapsed.
+  void UpdateDelay(base::Time now);
+
+  ClockInterface* clock_;
+  const std::string pressure_dir_;
+
+  bool enabled_{true};
+  double target_pressure_{kDefaultTargetPressure};
+
+  // The current delay between two intervals of work.
+  base::TimeDelta delay_;
+  // When the current interval of work started, at the end of the last delay.
+  base::Time work_start_time_;
+  base::Time start_time_;
+  base::Time last_poll_time_;
+  // Whether the missing pressure files were already logged.
+  bool logged_unavailable_{false};
+
+  uint64_t bytes_processed_{0};
+  base::TimeDelta throttled_time_;
+  double last_pressure_{0};
+  double max_pressure_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(PressureThrottler);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_PRESSURE_THROTTLER_H_
@@ -0,0 +1,147 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/pressure_throttler.h"
+
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_clock.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class PressureThrottlerTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(tempdir_.CreateUniqueTempDir());
+    clock_.SetMonotonicTime(base::Time::FromTimeT(1000));
+  }
+
+  // Writes a fake pressure file for |resource| with a "some avg10" value of
+  // |avg10|.
+  void WritePressure(const string& resource, const string& avg10) {
+    const string contents =
+        "some avg10=" + avg10 +
+        " avg60=1.00 avg300=1.00 total=12345\n"
+        "full avg10=0.00 avg60=0.00 avg300=0.00 total=0\n";
+    ASSERT_TRUE(utils::WriteFile(
+        tempdir_.GetPath().Append(resource).value().c_str(),
+        contents.data(),
+        contents.size()));
+  }
+
+  void AdvanceClock(base::TimeDelta delta) {
+    clock_.SetMonotonicTime(clock_.GetMonotonicTime() + delta);
+  }
+
+  base::ScopedTempDir tempdir_;
+  FakeClock clock_;
+};
+
+TEST_F(PressureThrottlerTest, ParsePressureTest) {
+  double avg10 = 0;
+  EXPECT_TRUE(PressureThrottler::ParsePressure(
+      "some avg10=12.50 avg60=3.00 avg300=1.00 total=42\n", &avg10));
+  EXPECT_DOUBLE_EQ(12.5, avg10);
+  EXPECT_TRUE(PressureThrottler::ParsePressure(
+      "full avg10=1.00 avg60=0.00 avg300=0.00 total=0\n"
+      "some avg10=2.25 avg60=0.00 avg300=0.00 total=0\n",
+      &avg10));
+  EXPECT_DOUBLE_EQ(2.25, avg10);
+  EXPECT_FALSE(PressureThrottler::ParsePressure("", &avg10));
+  EXPECT_FALSE(PressureThrottler::ParsePressure("some avg10=abc", &avg10));
+  EXPECT_FALSE(PressureThrottler::ParsePressure("awesome avg10=1.0", &avg10));
+}
+
+TEST_F(PressureThrottlerTest, NoPressureFilesTest) {
+  PressureThrottler throttler(&clock_, tempdir_.GetPath().value());
+  throttler.set_target_pressure(20);
+  EXPECT_TRUE(throttler.OnBytesProcessed(4096).is_zero());
+  AdvanceClock(base::TimeDelta::FromSeconds(2));
+  EXPECT_TRUE(throttler.OnBytesProcessed(4096).is_zero());
+  EXPECT_EQ(8192u, throttler.bytes_processed());
+}
+
+TEST_F(PressureThrottlerTest, AdaptsDelayToPressureTest) {
+  WritePressure("cpu", "1.00");
+  WritePressure("memory", "0.00");
+  WritePressure("io", "50.00");
+  PressureThrottler throttler(&clock_, tempdir_.GetPath().value());
+  throttler.set_target_pressure(20);
+
+  const base::TimeDelta first_delay = throttler.OnBytesProcessed(4096);
+  EXPECT_FALSE(first_delay.is_zero());
+  EXPECT_DOUBLE_EQ(50, throttler.last_pressure());
+  // The work runs for an interval before the next delay, and the pressure
+  // isn't read again until the poll interval elapsed.
+  AdvanceClock(base::TimeDelta::FromMilliseconds(100));
+  EXPECT_TRUE(throttler.OnBytesProcessed(4096).is_zero());
+  EXPECT_EQ(first_delay, throttler.delay());
+  AdvanceClock(base::TimeDelta::FromSeconds(1));
+  EXPECT_EQ(first_delay * 2, throttler.OnBytesProcessed(4096));
+
+  // Many polls above the target don't grow the delay indefinitely.
+  for (int i = 0; i < 20; i++) {
+    AdvanceClock(base::TimeDelta::FromSeconds(1));
+    throttler.OnBytesProcessed(4096);
+  }
+  const base::TimeDelta max_delay = throttler.delay();
+  EXPECT_LE(max_delay, base::TimeDelta::FromSeconds(1));
+
+  // Below the target, the delay decreases until the work runs at full speed.
+  WritePressure("io", "5.00");
+  AdvanceClock(base::TimeDelta::FromSeconds(1));
+  EXPECT_EQ(max_delay / 2, throttler.OnBytesProcessed(4096));
+  for (int i = 0; i < 20; i++) {
+    AdvanceClock(base::TimeDelta::FromSeconds(1));
+    throttler.OnBytesProcessed(4096);
+  }
+  EXPECT_TRUE(throttler.delay().is_zero());
+  EXPECT_DOUBLE_EQ(5, throttler.last_pressure());
+  EXPECT_DOUBLE_EQ(50, throttler.max_pressure());
+}
+
+TEST_F(PressureThrottlerTest, DisabledTest) {
+  WritePressure("io", "90.00");
+  PressureThrottler throttler(&clock_, tempdir_.GetPath().value());
+  // The throttling is opt-in.
+  EXPECT_TRUE(throttler.OnBytesProcessed(4096).is_zero());
+  throttler.set_target_pressure(20);
+  throttler.set_enabled(false);
+  EXPECT_TRUE(throttler.OnBytesProcessed(4096).is_zero());
+  EXPECT_EQ(8192u, throttler.bytes_processed());
+  throttler.set_enabled(true);
+  EXPECT_FALSE(throttler.OnBytesProcessed(4096).is_zero());
+}
+
+TEST_F(PressureThrottlerTest, StatsTest) {
+  PressureThrottler throttler(&clock_, tempdir_.GetPath().value());
+  EXPECT_EQ(0, throttler.Throughput());
+  throttler.OnBytesProcessed(1000);
+  AdvanceClock(base::TimeDelta::FromSeconds(2));
+  throttler.OnBytesProcessed(3000);
+  throttler.AddThrottledTime(base::TimeDelta::FromMilliseconds(30));
+  EXPECT_EQ(base::TimeDelta::FromSeconds(2), throttler.elapsed_time());
+  EXPECT_DOUBLE_EQ(2000, throttler.Throughput());
+  EXPECT_EQ(base::TimeDelta::FromMilliseconds(30), throttler.throttled_time());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,185 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/resource_accountant.h"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdlib>
+
+#include <android-base/stringprintf.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+const char kProcSelfDir[] = "/proc/self";
+
+namespace {
+
+constexpr uint64_t kMiB = 1024 * 1024;
+
+// Parses the number after "|key|:" at the start of a line of |contents|.
+bool ParseField(const string& contents, const string& key, uint64_t* value) {
+  const string prefix = key + ":";
+  size_t pos = 0;
+  while (pos < contents.size()) {
+    if (contents.compare(pos, prefix.size(), prefix) == 0) {
+      const char* start = contents.c_str() + pos + prefix.size();
+      char* end = nullptr;
+      *value = strtoull(start, &end, 10);
+      return end != start;
+    }
+    pos = contents.find('\n', pos);
+    if (pos == string::npos)
+      break;
+    pos++;
+  }
+  return false;
+}
+
+base::TimeDelta TimevalToTimeDelta(const timeval& tv) {
+  return base::TimeDelta::FromMicroseconds(tv.tv_sec * 1000000LL + tv.tv_usec);
+}
+
+}  // namespace
+
+ResourceAccountant::ResourceAccountant(ClockInterface* clock,
+                                       const string& proc_self_dir)
+    : clock_(clock), proc_self_dir_(proc_self_dir) {}
+
+bool ResourceAccountant::ParseProcIo(const string& contents,
+                                     uint64_t* read_bytes,
+                                     uint64_t* write_bytes) {
+  return ParseField(contents, "read_bytes", read_bytes) &&
+         ParseField(contents, "write_bytes", write_bytes);
+}
+
+bool ResourceAccountant::ParsePeakRss(const string& contents,
+                                      uint64_t* peak_kib) {
+  return ParseField(contents, "VmHWM", peak_kib);
+}
+
+ResourceUsage ResourceAccountant::Capture() const {
+  ResourceUsage usage;
+  usage.wall_time = clock_->GetMonotonicTime() - base::Time();
+  for (int who : {RUSAGE_SELF, RUSAGE_CHILDREN}) {
+    struct rusage rusage {};
+    if (getrusage(who, &rusage) != 0) {
+      PLOG(WARNING) << "getrusage() failed";
+      continue;
+    }
+    usage.user_time += TimevalToTimeDelta(rusage.ru_utime);
+    usage.system_time += TimevalToTimeDelta(rusage.ru_stime);
+    usage.minor_faults += rusage.ru_minflt;
+    usage.major_faults += rusage.ru_majflt;
+    if (who == RUSAGE_SELF)
+      usage.peak_rss_kib = rusage.ru_maxrss;
+  }
+
+  string contents;
+  if (!utils::ReadFile(proc_self_dir_ + "/io", &contents) ||
+      !ParseProcIo(contents, &usage.read_bytes, &usage.write_bytes)) {
+    usage.read_bytes = usage.write_bytes = 0;
+  }
+  // Unlike ru_maxrss, VmHWM can be reset for each phase.
+  uint64_t peak_kib;
+  if (utils::ReadFile(proc_self_dir_ + "/status", &contents) &&
+      ParsePeakRss(contents, &peak_kib)) {
+    usage.peak_rss_kib = peak_kib;
+  }
+  return usage;
+}
+
+void ResourceAccountant::ResetPeakRss() const {
+  // See clear_refs in proc(5). Failing only makes the peak the process one.
+  constexpr char kResetPeakRss[] = "5";
+  utils::WriteFile((proc_self_dir_ + "/clear_refs").c_str(),
+                   kResetPeakRss,
+                   sizeof(kResetPeakRss) - 1);
+}
+
+void ResourceAccountant::BeginPhase(const string& name) {
+  if (name == current_phase_)
+    return;
+  EndPhase();
+  current_phase_ = name;
+  ResetPeakRss();
+  phase_start_ = Capture();
+}
+
+void ResourceAccountant::EndPhase() {
+  if (current_phase_.empty())
+    return;
+  const ResourceUsage end = Capture();
+  auto phase = std::find_if(phases_.begin(), phases_.end(), [this](auto& p) {
+    return p.name == current_phase_;
+  });
+  if (phase == phases_.end()) {
+    phases_.push_back({current_phase_, {}});
+    phase = phases_.end() - 1;
+  }
+  ResourceUsage& usage = phase->usage;
+  usage.wall_time += end.wall_time - phase_start_.wall_time;
+  usage.user_time += end.user_time - phase_start_.user_time;
+  usage.system_time += end.system_time - phase_start_.system_time;
+  // The io counters are 0 if /proc/self/io couldn't be read.
+  usage.read_bytes += end.read_bytes - std::min(end.read_bytes,
+                                                phase_start_.read_bytes);
+  usage.write_bytes += end.write_bytes - std::min(end.write_bytes,
+                                                  phase_start_.write_bytes);
+  usage.minor_faults += end.minor_faults - phase_start_.minor_faults;
+  usage.major_faults += end.major_faults - phase_start_.major_faults;
+  usage.peak_rss_kib = std::max(usage.peak_rss_kib, end.peak_rss_kib);
+  current_phase_.clear();
+}
+
+string ResourceAccountant::Summary() const {
+  string summary = android::base::StringPrintf(
+      "%-24s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+      "phase",
+      "wall(s)",
+      "user(s)",
+      "sys(s)",
+      "read(MiB)",
+      "write(MiB)",
+      "minflt",
+      "majflt",
+      "rss(MiB)");
+  for (const Phase& phase : phases_) {
+    const ResourceUsage& usage = phase.usage;
+    summary += android::base::StringPrintf(
+        "%-24s %10.2f %10.2f %10.2f %10.1f %10.1f %10" PRIu64 " %10" PRIu64
+        " %10.1f\n",
+        phase.name.c_str(),
+        usage.wall_time.InSecondsF(),
+        usage.user_time.InSecondsF(),
+        usage.system_time.InSecondsF(),
+        static_cast<double>(usage.read_bytes) / kMiB,
+        static_cast<double>(usage.write_bytes) / kMiB,
+        usage.minor_faults,
+        usage.major_faults,
+        usage.peak_rss_kib / 1024.0);
+  }
+  return summary;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,113 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_COMMON_RESOURCE_ACCOUNTANT_H_
+#define UPDATE_ENGINE_COMMON_RESOURCE_ACCOUNTANT_H_
+
+#include <string>
+#include <vector>
+
+#include <base/time/time.h>
+
+#include "update_engine/common/clock_interface.h"
+
+namespace chromeos_update_engine {
+
+// The directory with the statistics of the current process.
+extern const char kProcSelfDir[];
+
+// The resources used by the process, either since it started or during a
+// phase of the update.
+struct ResourceUsage {
+  base::TimeDelta wall_time;
+  // CPU time of the process and of its children that were waited for, such
+  // as the postinstall scripts.
+  base::TimeDelta user_time;
+  base::TimeDelta system_time;
+  // Bytes read from and written to the storage, from /proc/self/io.
+  uint64_t read_bytes{0};
+  uint64_t write_bytes{0};
+  uint64_t minor_faults{0};
+  uint64_t major_faults{0};
+  // The highest resident set size, in KiB.
+  uint64_t peak_rss_kib{0};
+};
+
+// Accounts the resources used by each phase of an update, so a slow update
+// can be told CPU, I/O or memory bound. Phases are named; beginning a phase
+// that was already accounted adds to its usage, so a phase interleaved with
+// another, like writing the verity data of each partition between their
+// verification, can be accounted in pieces.
+class ResourceAccountant {
+ public:
+  struct Phase {
+    std::string name;
+    ResourceUsage usage;
+  };
+
+  // Reads the statistics of the process from |proc_self_dir|. |clock| is used
+  // to measure the wall time and isn't owned.
+  ResourceAccountant(ClockInterface* clock,
+                     const std::string& proc_self_dir = kProcSelfDir);
+
+  // Parses the storage bytes of the contents of /proc/self/io.
+  static bool ParseProcIo(const std::string& contents,
+                          uint64_t* read_bytes,
+                          uint64_t* write_bytes);
+
+  // Parses the peak resident set size (VmHWM) of the contents of
+  // /proc/self/status, in KiB.
+  static bool ParsePeakRss(const std::string& contents, uint64_t* peak_kib);
+
+  // Starts accounting to the phase |name|, ending the current phase if it's
+  // another one. Does nothing if |name| is the current phase.
+  void BeginPhase(const std::string& name);
+
+  // Ends the current phase, if any.
+  void EndPhase();
+
+  const std::string& current_phase() const { return current_phase_; }
+
+  // The phases in the order they first began.
+  const std::vector<Phase>& phases() const { return phases_; }
+
+  // Returns a table with the usage of each phase, one per line.
+  std::string Summary() const;
+
+ private:
+  // Captures the resources used by the process so far. The peak resident set
+  // size is the one since the last ResetPeakRss().
+  ResourceUsage Capture() const;
+
+  // Resets the peak resident set size of the process to the current one, so
+  // the peak of each phase can be measured.
+  void ResetPeakRss() const;
+
+  ClockInterface* clock_;
+  const std::string proc_self_dir_;
+
+  std::string current_phase_;
+  // The usage of the process when the current phase began.
+  ResourceUsage phase_start_;
+
+  std::vector<Phase> phases_;
+
+  DISALLOW_COPY_AND_ASSIGN(ResourceAccountant);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_COMMON_RESOURCE_ACCOUNTANT_H_
@@ -0,0 +1,140 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/common/resource_accountant.h"
+
+#include <string>
+
+#include <base/files/scoped_temp_dir.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/fake_clock.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+class ResourceAccountantTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    ASSERT_TRUE(tempdir_.CreateUniqueTempDir());
+    clock_.SetMonotonicTime(base::Time::FromTimeT(1000));
+  }
+
+  // Writes a fake /proc/self/io and /proc/self/status.
+  void WriteProcFiles(uint64_t read_bytes,
+                      uint64_t write_bytes,
+                      uint64_t peak_kib) {
+    WriteFile("io",
+              "rchar: 1000\nwchar: 2000\nsyscr: 10\nsyscw: 20\nread_bytes: " +
+                  std::to_string(read_bytes) +
+                  "\nwrite_bytes: " + std::to_string(write_bytes) +
+                  "\ncancelled_write_bytes: 0\n");
+    WriteFile("status",
+              "Name:\tupdate_engine\nVmPeak:\t  999999 kB\nVmHWM:\t  " +
+                  std::to_string(peak_kib) + " kB\nVmRSS:\t  100 kB\n");
+  }
+
+  void WriteFile(const string& name, const string& contents) {
+    ASSERT_TRUE(
+        utils::WriteFile(tempdir_.GetPath().Append(name).value().c_str(),
+                         contents.data(),
+                         contents.size()));
+  }
+
+  void AdvanceClock(int seconds) {
+    clock_.SetMonotonicTime(clock_.GetMonotonicTime() +
+                            base::TimeDelta::FromSeconds(seconds));
+  }
+
+  base::ScopedTempDir tempdir_;
+  FakeClock clock_;
+};
+
+TEST_F(ResourceAccountantTest, ParseTest) {
+  uint64_t read_bytes = 0, write_bytes = 0, peak_kib = 0;
+  EXPECT_TRUE(ResourceAccountant::ParseProcIo(
+      "rchar: 5\nread_bytes: 4096\nwrite_bytes: 8192\n"
+      "cancelled_write_bytes: 12\n",
+      &read_bytes,
+      &write_bytes));
+  EXPECT_EQ(4096u, read_bytes);
+  EXPECT_EQ(8192u, write_bytes);
+  EXPECT_FALSE(ResourceAccountant::ParseProcIo("rchar: 5\n", &read_bytes,
+                                               &write_bytes));
+
+  EXPECT_TRUE(ResourceAccountant::ParsePeakRss(
+      "Name:\tupdate_engine\nVmHWM:\t   2048 kB\n", &peak_kib));
+  EXPECT_EQ(2048u, peak_kib);
+  EXPECT_FALSE(ResourceAccountant::ParsePeakRss("VmRSS:\t 1 kB\n", &peak_kib));
+}
+
+TEST_F(ResourceAccountantTest, PhasesTest) {
+  ResourceAccountant accountant(&clock_, tempdir_.GetPath().value());
+  WriteProcFiles(1000, 2000, 100);
+  accountant.BeginPhase("manifest");
+  AdvanceClock(1);
+  WriteProcFiles(1500, 2000, 300);
+  // Beginning the current phase again does nothing.
+  accountant.BeginPhase("manifest");
+  EXPECT_EQ("manifest", accountant.current_phase());
+
+  accountant.BeginPhase("apply system");
+  AdvanceClock(2);
+  WriteProcFiles(1500, 6000, 200);
+  accountant.EndPhase();
+  EXPECT_EQ("", accountant.current_phase());
+
+  // Phases begun again add up.
+  accountant.BeginPhase("manifest");
+  AdvanceClock(3);
+  WriteProcFiles(2500, 6000, 250);
+  accountant.EndPhase();
+  // Ending without a phase does nothing.
+  accountant.EndPhase();
+
+  const auto& phases = accountant.phases();
+  ASSERT_EQ(2u, phases.size());
+  EXPECT_EQ("manifest", phases[0].name);
+  EXPECT_EQ(base::TimeDelta::FromSeconds(4), phases[0].usage.wall_time);
+  EXPECT_EQ(1500u, phases[0].usage.read_bytes);
+  EXPECT_EQ(0u, phases[0].usage.write_bytes);
+  EXPECT_EQ(300u, phases[0].usage.peak_rss_kib);
+  EXPECT_EQ("apply system", phases[1].name);
+  EXPECT_EQ(base::TimeDelta::FromSeconds(2), phases[1].usage.wall_time);
+  EXPECT_EQ(0u, phases[1].usage.read_bytes);
+  EXPECT_EQ(4000u, phases[1].usage.write_bytes);
+  EXPECT_EQ(200u, phases[1].usage.peak_rss_kib);
+
+  const string summary = accountant.Summary();
+  EXPECT_NE(string::npos, summary.find("manifest"));
+  EXPECT_NE(string::npos, summary.find("apply system"));
+}
+
+TEST_F(ResourceAccountantTest, MissingProcFilesTest) {
+  ResourceAccountant accountant(&clock_, tempdir_.GetPath().value());
+  accountant.BeginPhase("verify");
+  AdvanceClock(1);
+  accountant.EndPhase();
+  ASSERT_EQ(1u, accountant.phases().size());
+  EXPECT_EQ(0u, accountant.phases()[0].usage.read_bytes);
+  EXPECT_EQ(0u, accountant.phases()[0].usage.write_bytes);
+  // The peak falls back to the one of getrusage().
+  EXPECT_GT(accountant.phases()[0].usage.peak_rss_kib, 0u);
+}
+
+}  // namespace chromeos_update_engine
@@ -411,6 +411,23 @@ bool SendFile(int out_fd, int in_fd, size_t count) {
   return true;
 }
 
+bool SendFileRange(
+    int out_fd, off_t out_offset, int in_fd, off_t in_offset, size_t count) {
+  TEST_AND_RETURN_FALSE_ERRNO(lseek(out_fd, out_offset, SEEK_SET) ==
+                              out_offset);
+  off64_t offset = in_offset;
+  // sendfile() transfers at most 0x7ffff000 bytes per call, so copy at most
+  // 1 GiB at a time.
+  constexpr size_t kMaxChunkSize = 1 << 30;
+  while (count > 0) {
+    const auto bytes_written =
+        sendfile(out_fd, in_fd, &offset, std::min(count, kMaxChunkSize));
+    TEST_AND_RETURN_FALSE_ERRNO(bytes_written > 0);
+    count -= bytes_written;
+  }
+  return true;
+}
+
 bool DeleteDirectory(const char* dirname) {
   if (!std::filesystem::exists(dirname)) {
     return true;
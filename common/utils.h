@@ -161,6 +161,12 @@ off_t FileSize(int fd);
 
 bool SendFile(int out_fd, int in_fd, size_t count);
 
+// Copies |count| bytes of |in_fd| at |in_offset| to |out_fd| at |out_offset|
+// in the kernel, without going through user space buffers. The file offset of
+// |in_fd| is not modified.
+bool SendFileRange(
+    int out_fd, off_t out_offset, int in_fd, off_t in_offset, size_t count);
+
 bool FsyncDirectoryContents(const char* dirname);
 bool FsyncDirectory(const char* dirname);
 bool DeleteDirectory(const char* dirname);
@@ -21,6 +21,7 @@
 #include <sys/mount.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <limits>
 #include <string>
@@ -77,6 +78,30 @@ TEST(UtilsTest, ReadFileChunk) {
   EXPECT_EQ(brillo::Blob(data.begin() + 10, data.begin() + 10 + 20), in_data);
 }
 
+TEST(UtilsTest, SendFileRangeTest) {
+  ScopedTempFile in_file;
+  brillo::Blob data(8192);
+  for (size_t i = 0; i < data.size(); i++) {
+    data[i] = i % 251;
+  }
+  EXPECT_TRUE(test_utils::WriteFileVector(in_file.path(), data));
+
+  ScopedTempFile out_file("SendFileRangeTest.XXXXXX", true);
+  int in_fd = HANDLE_EINTR(open(in_file.path().c_str(), O_RDONLY));
+  ASSERT_GE(in_fd, 0);
+  ScopedFdCloser in_fd_closer(&in_fd);
+  EXPECT_TRUE(utils::SendFileRange(out_file.fd(), 100, in_fd, 1000, 5000));
+  EXPECT_EQ(0, lseek(in_fd, 0, SEEK_CUR));
+
+  brillo::Blob out_data;
+  EXPECT_TRUE(utils::ReadFile(out_file.path(), &out_data));
+  ASSERT_EQ(5100u, out_data.size());
+  EXPECT_EQ(brillo::Blob(100, 0),
+            brillo::Blob(out_data.begin(), out_data.begin() + 100));
+  EXPECT_EQ(brillo::Blob(data.begin() + 1000, data.begin() + 6000),
+            brillo::Blob(out_data.begin() + 100, out_data.end()));
+}
+
 TEST(UtilsTest, IsSymlinkTest) {
   base::ScopedTempDir temp_dir;
   ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
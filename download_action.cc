@@ -18,6 +18,7 @@
 
 #include <string>
 
+#include <base/bind.h>
 #include <base/files/file_path.h>
 #include <base/metrics/statistics_recorder.h>
 #include <android-base/stringprintf.h>
@@ -132,6 +133,7 @@ void DownloadAction::StartDownloading() {
                                               payload_,
                                               interactive_,
                                               update_certificates_path_));
+    delta_performer_->set_resource_accountant(resource_accountant_);
   }
 
   if (install_plan_.is_resume &&
@@ -155,6 +157,7 @@ void DownloadAction::StartDownloading() {
                                              payload_,
                                              interactive_,
                                              update_certificates_path_);
+            delta_performer_->set_resource_accountant(resource_accountant_);
       }
       http_fetcher_->AddRange(base_offset_,
                               manifest_metadata_size + manifest_signature_size);
@@ -187,7 +190,9 @@ void DownloadAction::StartDownloading() {
 }
 
 void DownloadAction::SuspendAction() {
-  http_fetcher_->Pause();
+  // A transfer paused by the throttling stays paused until ResumeAction().
+  if (!throttle_task_id_.Cancel())
+    http_fetcher_->Pause();
 }
 
 void DownloadAction::ResumeAction() {
@@ -200,6 +205,8 @@ void DownloadAction::TerminateProcessing() {
     delta_performer_.reset();
   }
   download_active_ = false;
+  refetch_.reset();
+  throttle_task_id_.Cancel();
   // Terminates the transfer. The action is terminated, if necessary, when the
   // TransferTerminated callback is received.
   http_fetcher_->TerminateTransfer();
@@ -220,6 +227,15 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
         length, bytes_downloaded_total - base_offset_, bytes_total_);
   }
   if (delta_performer_ && !delta_performer_->Write(bytes, length, &code_)) {
+    if (code_ == ErrorCode::kDownloadOperationHashMismatch &&
+        delta_performer_->refetch()) {
+      // Download again the data of the operation once the transfer is
+      // terminated, in the TransferTerminated callback.
+      refetch_ = delta_performer_->refetch();
+      code_ = ErrorCode::kSuccess;
+      http_fetcher_->TerminateTransfer();
+      return false;
+    }
     if (code_ != ErrorCode::kSuccess) {
       LOG(ERROR) << "Error " << utils::ErrorCodeToString(code_) << " (" << code_
                  << ") in DeltaPerformer's Write method when "
@@ -236,9 +252,29 @@ bool DownloadAction::ReceivedBytes(HttpFetcher* fetcher,
     return false;
   }
 
+  if (pressure_throttler_)
+    Throttle(length);
   return true;
 }
 
+void DownloadAction::Throttle(size_t bytes) {
+  const base::TimeDelta delay = pressure_throttler_->OnBytesProcessed(bytes);
+  if (delay.is_zero() || throttle_task_id_.IsScheduled())
+    return;
+  // The operations are applied as their data is received, so pausing the
+  // transfer paces them too, without blocking the message loop.
+  http_fetcher_->Pause();
+  if (!throttle_task_id_.PostTask(
+          FROM_HERE,
+          base::BindOnce(&MultiRangeHttpFetcher::Unpause,
+                         base::Unretained(http_fetcher_.get())),
+          delay)) {
+    http_fetcher_->Unpause();
+    return;
+  }
+  pressure_throttler_->AddThrottledTime(delay);
+}
+
 void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
   if (delta_performer_) {
     LOG_IF(WARNING, delta_performer_->Close() != 0)
@@ -275,7 +311,21 @@ void DownloadAction::TransferComplete(HttpFetcher* fetcher, bool successful) {
 }
 
 void DownloadAction::TransferTerminated(HttpFetcher* fetcher) {
-  if (code_ != ErrorCode::kSuccess) {
+  if (refetch_) {
+    const DeltaPerformer::Refetch refetch = *refetch_;
+    refetch_.reset();
+    // Only the data of the operation is downloaded again, the download then
+    // continues where it stopped.
+    http_fetcher_->ClearRanges();
+    http_fetcher_->AddRange(base_offset_ + refetch.offset, refetch.length);
+    if (!payload_->size) {
+      http_fetcher_->AddRange(base_offset_ + refetch.resume_offset);
+    } else if (refetch.resume_offset < payload_->size) {
+      http_fetcher_->AddRange(base_offset_ + refetch.resume_offset,
+                              payload_->size - refetch.resume_offset);
+    }
+    http_fetcher_->BeginTransfer(install_plan_.download_url);
+  } else if (code_ != ErrorCode::kSuccess) {
     processor_->ActionComplete(this, code_);
   } else if (payload_->already_applied) {
     LOG(INFO) << "TransferTerminated with ErrorCode::kSuccess when the current "
@@ -19,6 +19,8 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <iterator>
+#include <utility>
 
 #include <base/logging.h>
 
@@ -32,36 +34,47 @@ off64_t CachedFileDescriptorBase::Seek(off64_t offset, int whence) {
   // underlying file descriptor each time and it may not be a very good idea.
   CHECK(whence == SEEK_SET || whence == SEEK_CUR);
   off64_t next_offset = whence == SEEK_SET ? offset : offset_ + offset;
-
-  if (next_offset != offset_) {
-    // We sought somewhere other than what we are now. So we have to flush and
-    // move to the new offset.
-    if (!FlushCache()) {
-      return -1;
-    }
-    // Then we have to seek there.
-    if (GetFd()->Seek(next_offset, SEEK_SET) < 0) {
-      return -1;
-    }
-    offset_ = next_offset;
+  if (next_offset < 0) {
+    errno = EINVAL;
+    return -1;
   }
+  // The cached ranges know where they belong, so there is nothing to flush.
+  // The underlying file descriptor is only moved when it's used.
+  offset_ = next_offset;
   return offset_;
 }
 
+ssize_t CachedFileDescriptorBase::Read(void* buf, size_t count) {
+  // An operation may read back what it just wrote, e.g. its own destination.
+  if (IsCached(offset_, count) && !FlushCache()) {
+    return -1;
+  }
+  if (!SeekFd()) {
+    return -1;
+  }
+  ssize_t bytes_read = GetFd()->Read(buf, count);
+  if (bytes_read < 0) {
+    fd_offset_ = -1;
+    return -1;
+  }
+  offset_ += bytes_read;
+  fd_offset_ = offset_;
+  return bytes_read;
+}
+
 ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
   auto bytes = static_cast<const uint8_t*>(buf);
   size_t total_bytes_wrote = 0;
   while (total_bytes_wrote < count) {
     auto bytes_to_cache =
-        std::min(count - total_bytes_wrote, cache_.size() - bytes_cached_);
-    if (bytes_to_cache > 0) {  // Which means |cache_| is still have some space.
-      memcpy(cache_.data() + bytes_cached_,
-             bytes + total_bytes_wrote,
-             bytes_to_cache);
+        std::min(count - total_bytes_wrote, cache_size_ - bytes_cached_);
+    if (bytes_to_cache > 0) {  // Which means the cache still has some space.
+      CacheRange(offset_ + total_bytes_wrote,
+                 bytes + total_bytes_wrote,
+                 bytes_to_cache);
       total_bytes_wrote += bytes_to_cache;
-      bytes_cached_ += bytes_to_cache;
     }
-    if (bytes_cached_ == cache_.size()) {
+    if (bytes_cached_ >= cache_size_) {
       // Cache is full; write it to the |fd_| as long as you can.
       if (!FlushCache()) {
         return -1;
@@ -72,31 +85,147 @@ ssize_t CachedFileDescriptorBase::Write(const void* buf, size_t count) {
   return total_bytes_wrote;
 }
 
+bool CachedFileDescriptorBase::BlkIoctl(int request,
+                                        uint64_t start,
+                                        uint64_t length,
+                                        int* result) {
+  // Cached data in the range was written before the ioctl, so it must not
+  // land on top of its result later.
+  if (IsCached(start, length) && !FlushCache()) {
+    return false;
+  }
+  return GetFd()->BlkIoctl(request, start, length, result);
+}
+
 bool CachedFileDescriptorBase::Flush() {
   return FlushCache() && GetFd()->Flush();
 }
 
 bool CachedFileDescriptorBase::Close() {
   offset_ = 0;
+  fd_offset_ = -1;
   return FlushCache() && GetFd()->Close();
 }
 
-bool CachedFileDescriptorBase::FlushCache() {
-  size_t begin = 0;
-  while (begin < bytes_cached_) {
-    auto bytes_wrote =
-        GetFd()->Write(cache_.data() + begin, bytes_cached_ - begin);
-    if (bytes_wrote < 0) {
-      PLOG(ERROR) << "Failed to flush cached data!";
+void CachedFileDescriptorBase::CacheRange(off64_t offset,
+                                          const uint8_t* buf,
+                                          size_t count) {
+  const off64_t end = offset + count;
+  // Find the first range that overlaps or touches [offset, end).
+  auto it = dirty_ranges_.upper_bound(offset);
+  if (it != dirty_ranges_.begin()) {
+    auto prev = std::prev(it);
+    if (prev->first + static_cast<off64_t>(prev->second.size()) >= offset) {
+      it = prev;
+    }
+  }
+  if (it == dirty_ranges_.end() || it->first > end) {
+    dirty_ranges_.emplace(offset, brillo::Blob(buf, buf + count));
+    bytes_cached_ += count;
+    return;
+  }
+
+  // Merge everything into one range starting at |start|. When the first range
+  // starts there, as it does for sequential writes, it's extended in place.
+  const off64_t start = std::min(offset, it->first);
+  brillo::Blob merged;
+  if (it->first == start) {
+    bytes_cached_ -= it->second.size();
+    merged = std::move(it->second);
+    it = dirty_ranges_.erase(it);
+  }
+  for (; it != dirty_ranges_.end() && it->first <= end;
+       it = dirty_ranges_.erase(it)) {
+    const auto& range = it->second;
+    const size_t range_end = it->first - start + range.size();
+    if (merged.size() < range_end) {
+      merged.resize(range_end);
+    }
+    std::copy(range.begin(), range.end(), merged.begin() + (it->first - start));
+    bytes_cached_ -= range.size();
+  }
+  if (merged.size() < static_cast<size_t>(end - start)) {
+    merged.resize(end - start);
+  }
+  std::copy(buf, buf + count, merged.begin() + (offset - start));
+  bytes_cached_ += merged.size();
+  dirty_ranges_.emplace_hint(it, start, std::move(merged));
+}
+
+bool CachedFileDescriptorBase::IsCached(off64_t offset, size_t count) const {
+  if (count == 0) {
+    return false;
+  }
+  auto it = dirty_ranges_.upper_bound(offset);
+  if (it != dirty_ranges_.end() &&
+      it->first < offset + static_cast<off64_t>(count)) {
+    return true;
+  }
+  if (it == dirty_ranges_.begin()) {
+    return false;
+  }
+  --it;
+  return it->first + static_cast<off64_t>(it->second.size()) > offset;
+}
+
+bool CachedFileDescriptorBase::SeekFd() {
+  if (fd_offset_ != offset_) {
+    if (GetFd()->Seek(offset_, SEEK_SET) < 0) {
+      fd_offset_ = -1;
       return false;
     }
-    begin += bytes_wrote;
+    fd_offset_ = offset_;
   }
+  return true;
+}
+
+bool CachedFileDescriptorBase::ResetFd() {
+  fd_offset_ = -1;
+  if (dirty_ranges_.empty()) {
+    return true;
+  }
+  // The data belongs to the previous descriptor, so it can't be written to
+  // the next one.
+  LOG(ERROR) << "Dropping " << bytes_cached_ << " bytes in "
+             << dirty_ranges_.size()
+             << " ranges not flushed to the replaced file descriptor.";
+  dirty_ranges_.clear();
   bytes_cached_ = 0;
+  return false;
+}
+
+bool CachedFileDescriptorBase::FlushCache() {
+  // The ranges are sorted by offset, and each is contiguous, so this is one
+  // write per range in increasing offset order.
+  for (auto it = dirty_ranges_.begin(); it != dirty_ranges_.end();
+       it = dirty_ranges_.erase(it)) {
+    const auto& range = it->second;
+    if (fd_offset_ != it->first &&
+        GetFd()->Seek(it->first, SEEK_SET) < 0) {
+      PLOG(ERROR) << "Failed to seek to cached data at " << it->first;
+      fd_offset_ = -1;
+      return false;
+    }
+    fd_offset_ = it->first;
+    size_t begin = 0;
+    while (begin < range.size()) {
+      auto bytes_wrote =
+          GetFd()->Write(range.data() + begin, range.size() - begin);
+      if (bytes_wrote < 0) {
+        PLOG(ERROR) << "Failed to flush cached data!";
+        fd_offset_ = -1;
+        return false;
+      }
+      begin += bytes_wrote;
+      fd_offset_ += bytes_wrote;
+    }
+    bytes_cached_ -= range.size();
+  }
   return true;
 }
 
-void UnownedCachedFileDescriptor::SetFD(FileDescriptor* fd) {
+bool UnownedCachedFileDescriptor::SetFD(FileDescriptor* fd) {
   fd_ = fd;
+  return ResetFd();
 }
 }  // namespace chromeos_update_engine
@@ -20,6 +20,7 @@
 #include <errno.h>
 #include <sys/types.h>
 
+#include <map>
 #include <memory>
 #include <vector>
 
@@ -29,29 +30,33 @@
 
 namespace chromeos_update_engine {
 
+// A write-back cache on top of a FileDescriptor. Writes are kept in memory as
+// a set of dirty ranges, merging the ones that overlap or touch, so seeking
+// between scattered writes doesn't force a flush. The ranges are written to
+// the underlying descriptor in offset order once |cache_size| bytes are
+// cached, on Flush() and on Close(). Reads of cached data flush it first.
 class CachedFileDescriptorBase : public FileDescriptor {
  public:
-  explicit CachedFileDescriptorBase(size_t cache_size) : cache_(cache_size) {}
+  explicit CachedFileDescriptorBase(size_t cache_size)
+      : cache_size_(cache_size) {}
   ~CachedFileDescriptorBase() override = default;
 
   bool Open(const char* path, int flags, mode_t mode) override {
+    fd_offset_ = -1;
     return GetFd()->Open(path, flags, mode);
   }
   bool Open(const char* path, int flags) override {
+    fd_offset_ = -1;
     return GetFd()->Open(path, flags);
   }
-  ssize_t Read(void* buf, size_t count) override {
-    return GetFd()->Read(buf, count);
-  }
+  ssize_t Read(void* buf, size_t count) override;
   ssize_t Write(const void* buf, size_t count) override;
   off64_t Seek(off64_t offset, int whence) override;
   uint64_t BlockDevSize() override { return GetFd()->BlockDevSize(); }
   bool BlkIoctl(int request,
                 uint64_t start,
                 uint64_t length,
-                int* result) override {
-    return GetFd()->BlkIoctl(request, start, length, result);
-  }
+                int* result) override;
   bool Flush() override;
   bool Close() override;
   bool IsSettingErrno() override { return GetFd()->IsSettingErrno(); }
@@ -60,13 +65,32 @@ class CachedFileDescriptorBase : public FileDescriptor {
  protected:
   virtual FileDescriptor* GetFd() = 0;
 
+  // Forgets the offset of the underlying descriptor before it's replaced. The
+  // cached data should have been flushed to the previous one; if a flush
+  // failed, the data left in the cache is dropped and false is returned.
+  bool ResetFd();
+
  private:
   // Internal flush without the need to call |fd_->Flush()|.
   bool FlushCache();
 
-  brillo::Blob cache_;
+  // Copies |count| bytes from |buf| to the cache at |offset|, merging the
+  // dirty ranges it overlaps or touches.
+  void CacheRange(off64_t offset, const uint8_t* buf, size_t count);
+
+  // Returns whether any cached byte is in [offset, offset + count).
+  bool IsCached(off64_t offset, size_t count) const;
+
+  // Moves the underlying descriptor to |offset_| if it isn't there already.
+  bool SeekFd();
+
+  const size_t cache_size_;
+  // Non-overlapping, non-adjacent dirty ranges keyed by their offset.
+  std::map<off64_t, brillo::Blob> dirty_ranges_;
   size_t bytes_cached_{0};
   off64_t offset_{0};
+  // Offset of the underlying descriptor, or -1 if unknown.
+  off64_t fd_offset_{-1};
 
   DISALLOW_COPY_AND_ASSIGN(CachedFileDescriptorBase);
 };
@@ -85,8 +109,9 @@ class UnownedCachedFileDescriptor final : public CachedFileDescriptorBase {
  public:
   UnownedCachedFileDescriptor(FileDescriptor* fd, size_t cache_size)
       : CachedFileDescriptorBase(cache_size), fd_(fd) {}
-  // used for EnocdeFEC
-  void SetFD(FileDescriptor* fd);
+  // used for EnocdeFEC. Returns false if data that failed to be flushed to
+  // the previous descriptor was dropped; |fd| is used either way.
+  bool SetFD(FileDescriptor* fd);
 
  protected:
   virtual FileDescriptor* GetFd() { return fd_; }
@@ -20,6 +20,7 @@
 
 #include <algorithm>
 #include <string>
+#include <utility>
 #include <vector>
 
 #include <gtest/gtest.h>
@@ -57,6 +58,13 @@ class CachedFileDescriptorTest : public ::testing::Test {
     }
   }
 
+  // Writes |blob| at the current offset of |cfd| and flushes it.
+  void Write(FileDescriptor* cfd, const brillo::Blob& blob) {
+    ASSERT_EQ(static_cast<ssize_t>(blob.size()),
+              cfd->Write(blob.data(), blob.size()));
+    ASSERT_TRUE(cfd->Flush());
+  }
+
   void Close() { EXPECT_TRUE(cfd_->Close()); }
 
   void SetUp() override {
@@ -190,15 +198,136 @@ TEST_F(CachedFileDescriptorTest, SeekAfterWriteTest) {
   EXPECT_EQ(cfd_->Seek(seek, SEEK_SET), seek);
   brillo::Blob blob_in(kFileSize, 0);
   std::fill_n(&blob_in[seek], less_than_cache_size, value_);
-  // We are writing less than  one cache size; then it should not be committed.
   Write(&blob_in[seek], less_than_cache_size);
 
-  // Then we seek, it should've written the cache after seek.
+  // Seeking elsewhere keeps the data cached.
   EXPECT_EQ(cfd_->Seek(200, SEEK_SET), 200);
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(brillo::Blob(kFileSize, 0), blob_out);
+
+  EXPECT_TRUE(cfd_->Flush());
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+TEST_F(CachedFileDescriptorTest, ScatteredWritesTest) {
+  brillo::Blob blob_in(kFileSize, 0);
+  // Out of order writes, some touching or overlapping each other, adding up
+  // to less than the cache size.
+  const vector<std::pair<size_t, size_t>> writes = {
+      {500, 10}, {100, 20}, {120, 5}, {490, 15}, {900, 30}, {110, 4}};
+  for (const auto& [offset, size] : writes) {
+    std::fill_n(&blob_in[offset], size, value_++);
+    EXPECT_EQ(cfd_->Seek(offset, SEEK_SET), static_cast<off64_t>(offset));
+    Write(&blob_in[offset], size);
+  }
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(brillo::Blob(kFileSize, 0), blob_out);
+
+  EXPECT_TRUE(cfd_->Flush());
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(blob_in, blob_out);
+}
+
+TEST_F(CachedFileDescriptorTest, ScatteredWritesOverCacheSizeTest) {
+  brillo::Blob blob_in(kFileSize, 0);
+  // Each write is in a different range; the cache is flushed once they add up
+  // to its size.
+  for (size_t offset = 0; offset < kFileSize; offset += 2 * kCacheSize / 5) {
+    std::fill_n(&blob_in[offset], kCacheSize / 5, value_);
+    EXPECT_EQ(cfd_->Seek(offset, SEEK_SET), static_cast<off64_t>(offset));
+    Write(&blob_in[offset], kCacheSize / 5);
+  }
 
   brillo::Blob blob_out;
   EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
+  EXPECT_EQ(brillo::Blob(blob_in.begin(), blob_in.begin() + 8 * kCacheSize / 5),
+            brillo::Blob(blob_out.begin(),
+                         blob_out.begin() + 8 * kCacheSize / 5));
+  EXPECT_NE(blob_in, blob_out);
+
+  EXPECT_TRUE(cfd_->Flush());
+  EXPECT_TRUE(utils::ReadFile(temp_file_.path(), &blob_out));
   EXPECT_EQ(blob_in, blob_out);
 }
 
+TEST_F(CachedFileDescriptorTest, ReadAfterWriteTest) {
+  brillo::Blob blob_in(kCacheSize / 2, value_);
+  EXPECT_EQ(cfd_->Seek(10, SEEK_SET), 10);
+  Write(blob_in.data(), blob_in.size());
+
+  // Reading the cached range returns the written data.
+  brillo::Blob blob_out(blob_in.size() + 20);
+  EXPECT_EQ(cfd_->Seek(0, SEEK_SET), 0);
+  EXPECT_EQ(static_cast<ssize_t>(blob_out.size()),
+            cfd_->Read(blob_out.data(), blob_out.size()));
+  brillo::Blob expected(blob_out.size(), 0);
+  std::copy(blob_in.begin(), blob_in.end(), expected.begin() + 10);
+  EXPECT_EQ(expected, blob_out);
+  EXPECT_EQ(cfd_->Seek(0, SEEK_CUR), static_cast<off64_t>(blob_out.size()));
+}
+
+TEST_F(CachedFileDescriptorTest, SetFDTest) {
+  UnownedCachedFileDescriptor cfd(fd_.get(), kCacheSize);
+  brillo::Blob blob_in(10, value_);
+  EXPECT_EQ(cfd.Seek(10, SEEK_SET), 10);
+  Write(&cfd, blob_in);
+
+  // The new descriptor is at its start, so the cache must seek it even though
+  // the previous one was left where the next write goes.
+  ScopedTempFile other_file("CachedFileDescriptor-other.XXXXXX");
+  brillo::Blob zero_blob(kFileSize, 0);
+  ASSERT_TRUE(utils::WriteFile(
+      other_file.path().c_str(), zero_blob.data(), zero_blob.size()));
+  EintrSafeFileDescriptor other_fd;
+  ASSERT_TRUE(other_fd.Open(other_file.path().c_str(), O_RDWR, 0600));
+  cfd.SetFD(&other_fd);
+  EXPECT_EQ(cfd.Seek(20, SEEK_SET), 20);
+  Write(&cfd, blob_in);
+  EXPECT_TRUE(other_fd.Close());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(other_file.path(), &blob_out));
+  brillo::Blob expected(kFileSize, 0);
+  std::copy(blob_in.begin(), blob_in.end(), expected.begin() + 20);
+  EXPECT_EQ(expected, blob_out);
+}
+
+TEST_F(CachedFileDescriptorTest, SetFDAfterFailedFlushTest) {
+  // Writes to a read-only descriptor fail once the cache is flushed.
+  EintrSafeFileDescriptor read_only_fd;
+  ASSERT_TRUE(read_only_fd.Open(temp_file_.path().c_str(), O_RDONLY));
+  UnownedCachedFileDescriptor cfd(&read_only_fd, kCacheSize);
+  brillo::Blob blob_in(10, value_);
+  EXPECT_EQ(cfd.Seek(10, SEEK_SET), 10);
+  EXPECT_EQ(static_cast<ssize_t>(blob_in.size()),
+            cfd.Write(blob_in.data(), blob_in.size()));
+  EXPECT_FALSE(cfd.Flush());
+  EXPECT_TRUE(read_only_fd.Close());
+
+  // The data left in the cache is dropped instead of written to the new
+  // descriptor.
+  ScopedTempFile other_file("CachedFileDescriptor-other.XXXXXX");
+  brillo::Blob zero_blob(kFileSize, 0);
+  ASSERT_TRUE(utils::WriteFile(
+      other_file.path().c_str(), zero_blob.data(), zero_blob.size()));
+  EintrSafeFileDescriptor other_fd;
+  ASSERT_TRUE(other_fd.Open(other_file.path().c_str(), O_RDWR, 0600));
+  EXPECT_FALSE(cfd.SetFD(&other_fd));
+  EXPECT_EQ(cfd.Seek(20, SEEK_SET), 20);
+  Write(&cfd, blob_in);
+  // Nothing is left to drop.
+  EXPECT_TRUE(cfd.SetFD(&other_fd));
+  EXPECT_TRUE(other_fd.Close());
+
+  brillo::Blob blob_out;
+  EXPECT_TRUE(utils::ReadFile(other_file.path(), &blob_out));
+  brillo::Blob expected(kFileSize, 0);
+  std::copy(blob_in.begin(), blob_in.end(), expected.begin() + 20);
+  EXPECT_EQ(expected, blob_out);
+}
+
 }  // namespace chromeos_update_engine
@@ -16,9 +16,13 @@
 
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 
+#include <fcntl.h>
+
+#include <cstring>
 #include <memory>
 #include <string>
 #include <utility>
+#include <vector>
 
 #include <base/logging.h>
 
@@ -30,12 +34,21 @@ namespace chromeos_update_engine {
 CowWriterFileDescriptor::CowWriterFileDescriptor(
     std::unique_ptr<android::snapshot::ICowWriter> cow_writer,
     std::unique_ptr<FileDescriptor> cow_reader,
-    const std::optional<std::string>& source_device)
+    const std::optional<std::string>& source_device,
+    bool is_delta)
     : cow_writer_(std::move(cow_writer)),
       cow_reader_(std::move(cow_reader)),
       source_device_(source_device) {
   CHECK_NE(cow_writer_, nullptr);
   CHECK_NE(cow_reader_, nullptr);
+  if (is_delta && source_device_.has_value()) {
+    source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+    if (!source_fd_->Open(source_device_->c_str(), O_RDONLY)) {
+      PLOG(WARNING) << "Failed to open " << *source_device_
+                    << ", writing all the blocks to the COW.";
+      source_fd_.reset();
+    }
+  }
 }
 
 bool CowWriterFileDescriptor::Open(const char* path, int flags, mode_t mode) {
@@ -83,19 +96,71 @@ ssize_t CowWriterFileDescriptor::Read(void* buf, size_t count) {
   return cow_reader_->Read(buf, count);
 }
 
+std::vector<bool> CowWriterFileDescriptor::FindUnchangedBlocks(
+    uint64_t first_block, const uint8_t* data, size_t count) {
+  const size_t block_size = cow_writer_->GetBlockSize();
+  if (count % block_size != 0)
+    return {};
+  std::vector<bool> unchanged(count / block_size, false);
+  if (!source_fd_)
+    return unchanged;
+  source_buffer_.resize(count);
+  ssize_t bytes_read = 0;
+  // The target partition may be bigger than the source one.
+  if (!utils::PReadAll(source_fd_,
+                       source_buffer_.data(),
+                       count,
+                       first_block * block_size,
+                       &bytes_read) ||
+      bytes_read < 0) {
+    return unchanged;
+  }
+  for (size_t i = 0; i < bytes_read / block_size; i++) {
+    unchanged[i] = !written_blocks_.ContainsBlock(first_block + i) &&
+                   memcmp(data + i * block_size,
+                          source_buffer_.data() + i * block_size,
+                          block_size) == 0;
+  }
+  return unchanged;
+}
+
 ssize_t CowWriterFileDescriptor::Write(const void* buf, size_t count) {
   auto offset = cow_reader_->Seek(0, SEEK_CUR);
-  CHECK_EQ(offset % cow_writer_->GetBlockSize(), 0);
-  auto success = cow_writer_->AddRawBlocks(
-      offset / cow_writer_->GetBlockSize(), buf, count);
-  if (success) {
-    if (cow_reader_->Seek(count, SEEK_CUR) < 0) {
+  const size_t block_size = cow_writer_->GetBlockSize();
+  CHECK_EQ(offset % block_size, 0);
+  const uint64_t first_block = offset / block_size;
+  const uint8_t* data = static_cast<const uint8_t*>(buf);
+  const std::vector<bool> unchanged =
+      FindUnchangedBlocks(first_block, data, count);
+  if (unchanged.empty()) {
+    // Let the COW writer fail the writes not aligned to blocks.
+    if (!cow_writer_->AddRawBlocks(first_block, buf, count))
+      return -1;
+    dirty_ = true;
+  }
+  // Write the runs of changed blocks.
+  for (size_t i = 0; i < unchanged.size();) {
+    if (unchanged[i]) {
+      skipped_blocks_++;
+      i++;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < unchanged.size() && !unchanged[end])
+      end++;
+    if (!cow_writer_->AddRawBlocks(first_block + i,
+                                   data + i * block_size,
+                                   (end - i) * block_size)) {
       return -1;
     }
+    written_blocks_.AddExtent(ExtentForRange(first_block + i, end - i));
     dirty_ = true;
-    return count;
+    i = end;
+  }
+  if (cow_reader_->Seek(count, SEEK_CUR) < 0) {
+    return -1;
   }
-  return -1;
+  return count;
 }
 
 off64_t CowWriterFileDescriptor::Seek(const off64_t offset, int whence) {
@@ -122,6 +187,10 @@ bool CowWriterFileDescriptor::Flush() {
 
 bool CowWriterFileDescriptor::Close() {
   if (cow_writer_) {
+    if (skipped_blocks_ > 0) {
+      LOG(INFO) << "Skipped writing " << skipped_blocks_
+                << " blocks identical to the source partition to the COW.";
+    }
     // b/186196758
     // When calling
     // InitializeAppend(kEndOfInstall), the SnapshotWriter only reads up to the
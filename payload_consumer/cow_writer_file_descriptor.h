@@ -17,16 +17,26 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <vector>
 
+#include <brillo/secure_blob.h>
 #include <libsnapshot/cow_writer.h>
 
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
 // A Readable/Writable FileDescriptor class. This is a simple wrapper around
 // CowWriter. Only intended to be used by FileSystemVerifierAction for writing
 // FEC. Writes must be block aligned(4096) or write will fail.
+//
+// On delta partitions, blocks identical to |source_device| at the same offset
+// aren't written, the COW already reads them from the source partition when it
+// has no op for them. Full partitions are written as a whole, the source slot
+// isn't part of their update. This assumes that the blocks not written through
+// this class have no op in the COW, which holds for the hash tree and FEC: they
+// are excluded from the operations of the payload.
 class CowWriterFileDescriptor final : public FileDescriptor {
  public:
   // |cow_reader| should be obtained by calling
@@ -34,7 +44,8 @@ class CowWriterFileDescriptor final : public FileDescriptor {
   CowWriterFileDescriptor(
       std::unique_ptr<android::snapshot::ICowWriter> cow_writer,
       std::unique_ptr<FileDescriptor> cow_reader,
-      const std::optional<std::string>& source_device);
+      const std::optional<std::string>& source_device,
+      bool is_delta);
   ~CowWriterFileDescriptor();
 
   bool Open(const char* path, int flags, mode_t mode) override;
@@ -63,10 +74,27 @@ class CowWriterFileDescriptor final : public FileDescriptor {
 
   bool IsOpen() override;
 
+  // The number of blocks Write() skipped because they were identical to the
+  // source partition.
+  uint64_t skipped_blocks() const { return skipped_blocks_; }
+
  private:
+  // Returns whether each of the blocks of the |count| bytes of |data|
+  // written at |first_block| can be skipped.
+  std::vector<bool> FindUnchangedBlocks(uint64_t first_block,
+                                        const uint8_t* data,
+                                        size_t count);
+
   std::unique_ptr<android::snapshot::ICowWriter> cow_writer_;
   FileDescriptorPtr cow_reader_;
   std::optional<std::string> source_device_;
   bool dirty_ = false;
+
+  // The source partition, to compare the written blocks with.
+  FileDescriptorPtr source_fd_;
+  brillo::Blob source_buffer_;
+  // The blocks written to the COW, which can't be skipped anymore.
+  ExtentRanges written_blocks_;
+  uint64_t skipped_blocks_ = 0;
 };
 }  // namespace chromeos_update_engine
@@ -16,6 +16,7 @@
 
 #include "update_engine/payload_consumer/cow_writer_file_descriptor.h"
 
+#include <algorithm>
 #include <cstring>
 #include <memory>
 #include <string>
@@ -56,14 +57,14 @@ class CowWriterFileDescriptorUnittest : public ::testing::Test {
     return android::snapshot::CreateCowWriter(
         kTestCowVersion, options, unique_fd{fd});
   }
-  std::unique_ptr<CowWriterFileDescriptor> GetCowFd() {
+  std::unique_ptr<CowWriterFileDescriptor> GetCowFd(bool is_delta = true) {
     auto cow_writer = GetCowWriter();
     EXPECT_NE(cow_writer, nullptr);
     auto fd = cow_writer->OpenFileDescriptor({cow_source_file_.path()});
     EXPECT_NE(fd, nullptr);
     auto source_path = std::optional<std::string>{cow_source_file_.path()};
     return std::make_unique<CowWriterFileDescriptor>(
-        std::move(cow_writer), std::move(fd), source_path);
+        std::move(cow_writer), std::move(fd), source_path, is_delta);
   }
 
   ScopedTempFile cow_source_file_{"cow_source.XXXXXX", true};
@@ -113,4 +114,57 @@ TEST_F(CowWriterFileDescriptorUnittest, ReadAfterWrite) {
          "is open, Finalize() should not be called.";
 }
 
+TEST_F(CowWriterFileDescriptorUnittest, SkipsBlocksIdenticalToSource) {
+  // Each block of the source is filled with its number.
+  std::vector<unsigned char> source(PARTITION_SIZE);
+  for (size_t i = 0; i < PARTITION_SIZE / BLOCK_SIZE; i++) {
+    std::fill(source.begin() + i * BLOCK_SIZE,
+              source.begin() + (i + 1) * BLOCK_SIZE,
+              i);
+  }
+  ASSERT_TRUE(utils::WriteFile(
+      cow_source_file_.path().c_str(), source.data(), source.size()));
+
+  auto cow_fd = GetCowFd();
+  // Blocks 2 and 4 are unchanged, block 3 isn't.
+  std::vector<unsigned char> data(source.begin() + BLOCK_SIZE * 2,
+                                  source.begin() + BLOCK_SIZE * 5);
+  std::fill(data.begin() + BLOCK_SIZE, data.begin() + BLOCK_SIZE * 2, 0xAA);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd->Seek(BLOCK_SIZE * 2, SEEK_SET));
+  ASSERT_EQ((ssize_t)data.size(), cow_fd->Write(data.data(), data.size()));
+  EXPECT_EQ(2u, cow_fd->skipped_blocks());
+
+  std::vector<unsigned char> read_back(data.size());
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd->Seek(BLOCK_SIZE * 2, SEEK_SET));
+  ASSERT_EQ((ssize_t)read_back.size(),
+            cow_fd->Read(read_back.data(), read_back.size()));
+  ASSERT_EQ(data, read_back);
+
+  // A block already written to the COW is written again, even if it's back
+  // to the source data.
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 3, cow_fd->Seek(BLOCK_SIZE * 3, SEEK_SET));
+  ASSERT_EQ((ssize_t)BLOCK_SIZE,
+            cow_fd->Write(source.data() + BLOCK_SIZE * 3, BLOCK_SIZE));
+  EXPECT_EQ(2u, cow_fd->skipped_blocks());
+
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2, cow_fd->Seek(BLOCK_SIZE * 2, SEEK_SET));
+  ASSERT_EQ((ssize_t)read_back.size(),
+            cow_fd->Read(read_back.data(), read_back.size()));
+  ASSERT_TRUE(std::equal(
+      read_back.begin(), read_back.end(), source.begin() + BLOCK_SIZE * 2));
+}
+
+TEST_F(CowWriterFileDescriptorUnittest, WritesAllBlocksOfFullPartitions) {
+  std::vector<unsigned char> source(PARTITION_SIZE, 0x55);
+  ASSERT_TRUE(utils::WriteFile(
+      cow_source_file_.path().c_str(), source.data(), source.size()));
+
+  // A full partition doesn't depend on the source slot, even where it's
+  // identical to it.
+  auto cow_fd = GetCowFd(false);
+  ASSERT_EQ((ssize_t)BLOCK_SIZE * 2,
+            cow_fd->Write(source.data(), BLOCK_SIZE * 2));
+  EXPECT_EQ(0u, cow_fd->skipped_blocks());
+}
+
 }  // namespace chromeos_update_engine
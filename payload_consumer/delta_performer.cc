@@ -21,6 +21,8 @@
 #include <algorithm>
 #include <chrono>
 #include <cstring>
+#include <filesystem>
+#include <map>
 #include <memory>
 #include <set>
 #include <string>
@@ -47,6 +49,7 @@
 #include "update_engine/common/error_code_utils.h"
 #include "update_engine/common/hardware_interface.h"
 #include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/resource_accountant.h"
 #include "update_engine/common/terminator.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/partition_update_generator_interface.h"
@@ -59,6 +62,7 @@
 #include "update_engine/payload_consumer/payload_verifier.h"
 
 using google::protobuf::RepeatedPtrField;
+using std::map;
 using std::min;
 using std::string;
 using std::vector;
@@ -69,6 +73,7 @@ const unsigned DeltaPerformer::kProgressLogTimeoutSeconds = 30;
 const unsigned DeltaPerformer::kProgressDownloadWeight = 50;
 const unsigned DeltaPerformer::kProgressOperationsWeight = 50;
 const uint64_t DeltaPerformer::kCheckpointFrequencySeconds = 1;
+const unsigned DeltaPerformer::kMaxOperationRefetches = 3;
 
 namespace {
 const int kUpdateStateOperationInvalid = -1;
@@ -221,8 +226,12 @@ int DeltaPerformer::CloseCurrentPartition() {
   if (!partition_writer_) {
     return 0;
   }
+  // An interrupted streamed operation is applied again on resume.
+  streamed_op_writer_.reset();
   int err = partition_writer_->Close();
   partition_writer_ = nullptr;
+  if (resource_accountant_)
+    resource_accountant_->EndPhase();
   return err;
 }
 
@@ -235,6 +244,12 @@ bool DeltaPerformer::OpenCurrentPartition() {
       install_plan_->partitions.size() - partitions_.size();
   const InstallPlan::Partition& install_part =
       install_plan_->partitions[num_previous_partitions + current_partition_];
+  // The partition is accounted from when it's opened to when it's closed. Its
+  // operations are applied as their data is downloaded, so the download of
+  // the data is part of the phase; accounting each operation on its own
+  // would cost more than some of them.
+  if (resource_accountant_)
+    resource_accountant_->BeginPhase("apply " + partition.partition_name());
   auto dynamic_control = boot_control_->GetDynamicPartitionControl();
   partition_writer_ = CreatePartitionWriter(
       partition,
@@ -399,6 +414,29 @@ MetadataParseResult DeltaPerformer::ParsePayloadMetadata(
       base::TimeDelta::FromMinutes(5),                                      \
       20);
 
+void DeltaPerformer::ApplyPartitionCompressionFactors() {
+  auto* metadata = manifest_.mutable_dynamic_partition_metadata();
+  const uint64_t compression_factor = metadata->compression_factor();
+  if (compression_factor <= block_size_)
+    return;
+  // Only the partitions written to a COW have an estimated COW size.
+  uint64_t needed_factor = 0;
+  for (const auto& partition : manifest_.partitions()) {
+    if (!partition.has_estimate_cow_size())
+      continue;
+    needed_factor = std::max(needed_factor,
+                             partition.has_compression_factor()
+                                 ? partition.compression_factor()
+                                 : compression_factor);
+  }
+  if (needed_factor == 0 || needed_factor >= compression_factor)
+    return;
+  LOG(INFO) << "Lowering the VABC compression factor from "
+            << compression_factor << " to " << needed_factor
+            << ", larger chunks don't compress better in this payload.";
+  metadata->set_compression_factor(needed_factor);
+}
+
 bool DeltaPerformer::CheckSPLDowngrade() {
   if (!manifest_.has_security_patch_level()) {
     return true;
@@ -447,21 +485,31 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     return false;
   }
   *error = ErrorCode::kSuccess;
+  refetch_.reset();
   const char* c_bytes = reinterpret_cast<const char*>(bytes);
-
+  // The bytes received after the data of an operation downloaded again.
+  brillo::Blob refetch_tail;
   // Update the total byte downloaded count and the progress logs.
   total_bytes_received_ += count;
   UpdateOverallProgress(false, "Completed ");
 
-  while (!manifest_valid_) {
-    bool insufficient_bytes = false;
-    if (!ParseManifest(&c_bytes, &count, error, &insufficient_bytes)) {
-      LOG(ERROR) << "Failed to parse manifest";
-      return false;
-    }
-    if (insufficient_bytes) {
-      return true;
+  if (!manifest_valid_) {
+    // The phase lasts until the manifest is parsed, which may take more than
+    // one call. Beginning it again is a no-op.
+    if (resource_accountant_)
+      resource_accountant_->BeginPhase("manifest");
+    while (!manifest_valid_) {
+      bool insufficient_bytes = false;
+      if (!ParseManifest(&c_bytes, &count, error, &insufficient_bytes)) {
+        LOG(ERROR) << "Failed to parse manifest";
+        return false;
+      }
+      if (insufficient_bytes) {
+        return true;
+      }
     }
+    if (resource_accountant_)
+      resource_accountant_->EndPhase();
   }
 
   while (next_operation_num_ < num_total_operations_) {
@@ -500,19 +548,64 @@ bool DeltaPerformer::Write(const void* bytes, size_t count, ErrorCode* error) {
     const InstallOperation& op =
         partitions_[current_partition_].operations(GetPartitionOperationNum());
 
-    CopyDataToBuffer(&c_bytes, &count, op.data_length());
+    if (IsStreamedOperation(op)) {
+      // The data of this operation is applied as it's downloaded.
+      if (!StreamOperation(op, &c_bytes, &count, error)) {
+        LOG(ERROR) << "unable to stream operation: "
+                   << InstallOperationTypeName(op.type())
+                   << " Error: " << utils::ErrorCodeToString(*error);
+        // Only the corrupt chunk is downloaded again, the chunks before it
+        // were already written.
+        if (operation_data_invalid_ &&
+            !PrepareOperationRefetch(op, c_bytes, count)) {
+          LOG(ERROR) << "Not downloading the chunk again.";
+        }
+        return false;
+      }
+      if (streamed_op_writer_) {
+        // A chunk downloaded again is followed by the rest of the operation
+        // data received the first time.
+        if (!TakeRefetchTail(&refetch_tail, &c_bytes, &count))
+          return true;
+        continue;
+      }
+    } else if (IsReusedBlob(op)) {
+      // The data of this operation was already downloaded for a previous one.
+      if (!LoadReusedBlob(op)) {
+        *error = ErrorCode::kDownloadOperationExecutionError;
+        return false;
+      }
+    } else {
+      CopyDataToBuffer(&c_bytes, &count, op.data_length());
 
-    // Check whether we received all of the next operation's data payload.
-    if (!CanPerformInstallOperation(op))
-      return true;
-    if (!ProcessOperation(&op, error)) {
-      LOG(ERROR) << "unable to process operation: "
-                 << InstallOperationTypeName(op.type())
-                 << " Error: " << utils::ErrorCodeToString(*error);
-      return false;
+      // Check whether we received all of the next operation's data payload.
+      if (!CanPerformInstallOperation(op))
+        return true;
+      if (!KeepReusedBlob(op)) {
+        *error = ErrorCode::kDownloadOperationExecutionError;
+        return false;
+      }
+    }
+    if (!IsStreamedOperation(op)) {
+      if (!ProcessOperation(&op, error)) {
+        LOG(ERROR) << "unable to process operation: "
+                   << InstallOperationTypeName(op.type())
+                   << " Error: " << utils::ErrorCodeToString(*error);
+        // The data may have been corrupted while downloaded, download it again
+        // rather than failing the update. A reused blob was already checked
+        // when it was downloaded, so its mismatch fails the update.
+        if (operation_data_invalid_ &&
+            (buffer_reused_ || !PrepareOperationRefetch(op, c_bytes, count))) {
+          LOG(ERROR) << "Not downloading the data of operation "
+                     << next_operation_num_ << " again.";
+        }
+        return false;
+      }
     }
+    ReleaseReusedBlob(op);
 
     next_operation_num_++;
+    TakeRefetchTail(&refetch_tail, &c_bytes, &count);
     UpdateOverallProgress(false, "Completed ");
     CheckpointUpdateProgress(false);
   }
@@ -649,6 +742,8 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
       LOG(INFO) << "New COW size for partition " << partition.partition_name()
                 << " is " << partition.estimate_cow_size();
     }
+  } else {
+    ApplyPartitionCompressionFactors();
   }
   if (install_plan_->disable_vabc) {
     manifest_.mutable_dynamic_partition_metadata()->set_vabc_enabled(false);
@@ -699,6 +794,45 @@ bool DeltaPerformer::ParseManifest(const char** c_bytes,
     return false;
   }
 
+  // Count the operations left that use each data blob, to keep the blobs used
+  // by more than one of them.
+  blob_refs_.clear();
+  if (manifest_.minor_version() >= kBlobReuseMinorPayloadVersion) {
+    map<uint64_t, uint32_t> refs;
+    for (size_t i = 0, op_num = 0; i < partitions_.size(); i++) {
+      for (const InstallOperation& op : partitions_[i].operations()) {
+        if (op_num++ >= next_operation_num_ && op.data_length() > 0)
+          refs[op.data_offset()]++;
+      }
+    }
+    // A resumed update also keeps the blobs downloaded before it was
+    // interrupted, for the operations left that use them.
+    for (const auto& [offset, num_operations] : refs) {
+      if (num_operations > 1 || offset < buffer_offset_)
+        blob_refs_[offset] = num_operations;
+    }
+    reused_blobs_dir_ = base::FilePath();
+    released_blobs_.clear();
+    base::FilePath non_volatile_dir;
+    if (hardware_->GetNonVolatileDirectory(&non_volatile_dir)) {
+      reused_blobs_dir_ = non_volatile_dir.Append(kReusedBlobsSubDirectory);
+      // The blobs left by a previous update aren't used by this one.
+      if (next_operation_num_ == 0 &&
+          !utils::DeleteDirectory(reused_blobs_dir_.value().c_str())) {
+        LOG(WARNING) << "Unable to delete " << reused_blobs_dir_.value();
+      }
+      if (!base::CreateDirectory(reused_blobs_dir_)) {
+        LOG(WARNING) << "Unable to create " << reused_blobs_dir_.value()
+                     << ", the blobs kept for reuse won't be saved.";
+        reused_blobs_dir_ = base::FilePath();
+      }
+    }
+    if (!RestoreReusedBlobs()) {
+      *error = ErrorCode::kDownloadStateInitializationError;
+      return false;
+    }
+  }
+
   if (next_operation_num_ < acc_num_operations_[current_partition_]) {
     if (!OpenCurrentPartition()) {
       *error = ErrorCode::kInstallDeviceOpenError;
@@ -721,10 +855,13 @@ bool DeltaPerformer::ProcessOperation(const InstallOperation* op,
   // Note: Validate must be called only if CanPerformInstallOperation is
   // called. Otherwise, we might be failing operations before even if there
   // isn't sufficient data to compute the proper hash.
+  operation_data_invalid_ = false;
   *error = ValidateOperationHash(*op);
   if (*error != ErrorCode::kSuccess) {
     if (install_plan_->hash_checks_mandatory) {
       LOG(ERROR) << "Mandatory operation hash check failed";
+      operation_data_invalid_ =
+          *error == ErrorCode::kDownloadOperationHashMismatch;
       return false;
     }
 
@@ -951,6 +1088,276 @@ bool DeltaPerformer::CanPerformInstallOperation(
           buffer_offset_ + buffer_.size());
 }
 
+bool DeltaPerformer::IsReusedBlob(const InstallOperation& operation) const {
+  return operation.data_length() > 0 &&
+         operation.data_offset() < buffer_offset_ &&
+         blob_refs_.count(operation.data_offset()) != 0;
+}
+
+bool DeltaPerformer::LoadReusedBlob(const InstallOperation& operation) {
+  const auto blob = reused_blobs_.find(operation.data_offset());
+  if (blob == reused_blobs_.end() ||
+      blob->second.size() != operation.data_length() || !buffer_.empty()) {
+    LOG(ERROR) << "The data blob at offset " << operation.data_offset()
+               << " wasn't kept for reuse.";
+    return false;
+  }
+  buffer_ = blob->second;
+  buffer_reused_ = true;
+  return true;
+}
+
+bool DeltaPerformer::KeepReusedBlob(const InstallOperation& operation) {
+  const auto refs = blob_refs_.find(operation.data_offset());
+  if (operation.data_length() == 0 || refs == blob_refs_.end())
+    return true;
+  if (reused_blobs_size_ + operation.data_length() > kMaxReusedBlobsSize) {
+    LOG(ERROR) << "Keeping the data blob at offset " << operation.data_offset()
+               << " would exceed " << kMaxReusedBlobsSize
+               << " bytes of reused blobs.";
+    return false;
+  }
+  brillo::Blob& blob = reused_blobs_[operation.data_offset()];
+  blob.assign(buffer_.begin(), buffer_.begin() + operation.data_length());
+  reused_blobs_size_ += operation.data_length();
+  // Checkpoints taken before the blob is released need it on resume.
+  const base::FilePath path = GetReusedBlobPath(operation.data_offset());
+  if (!path.empty() &&
+      !utils::WriteStringToFileAtomic(
+          path.value(),
+          std::string_view(reinterpret_cast<const char*>(blob.data()),
+                           blob.size()))) {
+    LOG(WARNING) << "Unable to save the data blob at offset "
+                 << operation.data_offset()
+                 << ", resuming the update will start it again.";
+  }
+  return true;
+}
+
+void DeltaPerformer::ReleaseReusedBlob(const InstallOperation& operation) {
+  const auto refs = blob_refs_.find(operation.data_offset());
+  if (operation.data_length() == 0 || refs == blob_refs_.end())
+    return;
+  if (--refs->second > 0)
+    return;
+  blob_refs_.erase(refs);
+  const auto blob = reused_blobs_.find(operation.data_offset());
+  if (blob != reused_blobs_.end()) {
+    reused_blobs_size_ -= blob->second.size();
+    reused_blobs_.erase(blob);
+    released_blobs_.push_back(operation.data_offset());
+  }
+}
+
+base::FilePath DeltaPerformer::GetReusedBlobPath(uint64_t data_offset) const {
+  if (reused_blobs_dir_.empty())
+    return {};
+  return reused_blobs_dir_.Append(std::to_string(data_offset));
+}
+
+bool DeltaPerformer::RestoreReusedBlobs() {
+  reused_blobs_.clear();
+  reused_blobs_size_ = 0;
+  for (size_t i = 0, op_num = 0; i < partitions_.size(); i++) {
+    for (const InstallOperation& op : partitions_[i].operations()) {
+      if (op_num++ < next_operation_num_ || op.data_length() == 0 ||
+          op.data_offset() >= buffer_offset_ ||
+          blob_refs_.count(op.data_offset()) == 0 ||
+          reused_blobs_.count(op.data_offset()) != 0)
+        continue;
+      const base::FilePath path = GetReusedBlobPath(op.data_offset());
+      brillo::Blob blob, hash;
+      if (path.empty() || !utils::ReadFile(path.value(), &blob) ||
+          blob.size() != op.data_length() ||
+          !HashCalculator::RawHashOfData(blob, &hash) ||
+          (op.has_data_sha256_hash() &&
+           hash != brillo::Blob(op.data_sha256_hash().begin(),
+                                op.data_sha256_hash().end()))) {
+        LOG(ERROR) << "The data blob at offset " << op.data_offset()
+                   << " kept for reuse is missing or corrupt.";
+        return false;
+      }
+      reused_blobs_size_ += blob.size();
+      reused_blobs_.emplace(op.data_offset(), std::move(blob));
+    }
+  }
+  return true;
+}
+
+void DeltaPerformer::DeleteReleasedBlobs() {
+  for (uint64_t data_offset : released_blobs_) {
+    const base::FilePath path = GetReusedBlobPath(data_offset);
+    std::error_code ec;
+    if (!path.empty() && !std::filesystem::remove(path.value(), ec) && ec) {
+      LOG(WARNING) << "Unable to delete " << path.value() << ": "
+                   << ec.message();
+    }
+  }
+  released_blobs_.clear();
+}
+
+bool DeltaPerformer::PrepareOperationRefetch(
+    const InstallOperation& operation, const char* bytes, size_t count) {
+  if (refetched_operation_num_ != next_operation_num_) {
+    refetched_operation_num_ = next_operation_num_;
+    operation_refetches_ = 0;
+  }
+  if (operation_refetches_ >= kMaxOperationRefetches) {
+    LOG(ERROR) << "The data of operation " << next_operation_num_
+               << " was already downloaded " << operation_refetches_
+               << " times.";
+    return false;
+  }
+  operation_refetches_++;
+  // The whole data of the operation, or the chunk of a streamed operation.
+  const uint64_t data_length = buffer_.size();
+
+  // The blob kept for the next operations is as corrupt as the buffer.
+  const auto blob = reused_blobs_.find(operation.data_offset());
+  if (blob != reused_blobs_.end()) {
+    reused_blobs_size_ -= blob->second.size();
+    reused_blobs_.erase(blob);
+  }
+  // The buffer isn't added to the payload hashes, only the data downloaded
+  // again will be. The bytes after it are still valid, they are kept for
+  // after the data downloaded again rather than downloaded again too.
+  brillo::Blob().swap(buffer_);
+  refetch_tail_.insert(refetch_tail_.end(), bytes, bytes + count);
+  refetch_end_offset_ = buffer_offset_ + data_length;
+  total_bytes_received_ -=
+      std::min<uint64_t>(total_bytes_received_, data_length);
+  refetched_bytes_ += data_length;
+  LOCAL_HISTOGRAM_CUSTOM_COUNTS("UpdateEngine.DownloadAction.RefetchedBytes",
+                                data_length,
+                                1,
+                                1 << 30,
+                                50);
+  const uint64_t offset =
+      metadata_size_ + metadata_signature_size_ + buffer_offset_;
+  refetch_ = Refetch{.offset = offset,
+                     .length = data_length,
+                     .resume_offset =
+                         offset + data_length + refetch_tail_.size()};
+  LOG(WARNING) << "Downloading again " << data_length
+               << " bytes of data of operation " << next_operation_num_
+               << " from payload offset " << offset << ", attempt "
+               << operation_refetches_ << " of " << kMaxOperationRefetches
+               << ".";
+  return true;
+}
+
+bool DeltaPerformer::TakeRefetchTail(brillo::Blob* tail,
+                                     const char** bytes,
+                                     size_t* count) {
+  if (refetch_tail_.empty() || buffer_offset_ < refetch_end_offset_)
+    return false;
+  // The data downloaded again ends where the bytes received after it the
+  // first time start.
+  tail->swap(refetch_tail_);
+  refetch_tail_.clear();
+  tail->insert(tail->end(), *bytes, *bytes + *count);
+  *bytes = reinterpret_cast<const char*>(tail->data());
+  *count = tail->size();
+  return true;
+}
+
+bool DeltaPerformer::IsStreamedOperation(
+    const InstallOperation& operation) const {
+  return operation.data_chunk_size() > 0 &&
+         operation.data_chunk_sha256_hash_size() > 0 &&
+         operation.data_length() > 0 &&
+         (operation.type() == InstallOperation::REPLACE ||
+          operation.type() == InstallOperation::REPLACE_BZ ||
+          operation.type() == InstallOperation::REPLACE_XZ) &&
+         blob_refs_.count(operation.data_offset()) == 0;
+}
+
+bool DeltaPerformer::StreamOperation(const InstallOperation& operation,
+                                     const char** bytes_p,
+                                     size_t* count_p,
+                                     ErrorCode* error) {
+  operation_data_invalid_ = false;
+  const uint64_t chunk_size = operation.data_chunk_size();
+  if (!streamed_op_writer_) {
+    if (static_cast<uint64_t>(operation.data_chunk_sha256_hash_size()) !=
+            utils::DivRoundUp(operation.data_length(), chunk_size) ||
+        operation.data_offset() != buffer_offset_ || !buffer_.empty()) {
+      LOG(ERROR) << "Operation " << next_operation_num_
+                 << " has " << operation.data_chunk_sha256_hash_size()
+                 << " data chunk hashes for " << operation.data_length()
+                 << " bytes at offset " << operation.data_offset()
+                 << " in chunks of " << chunk_size << " bytes.";
+      *error = ErrorCode::kDownloadOperationHashVerificationError;
+      return false;
+    }
+    streamed_op_writer_ = partition_writer_->CreateReplaceWriter(operation);
+    if (!streamed_op_writer_) {
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+    streamed_op_bytes_ = 0;
+    streamed_op_hash_ = std::make_unique<HashCalculator>();
+  }
+
+  while (streamed_op_bytes_ < operation.data_length()) {
+    const size_t chunk_length =
+        min(chunk_size, operation.data_length() - streamed_op_bytes_);
+    CopyDataToBuffer(bytes_p, count_p, chunk_length);
+    if (buffer_.size() < chunk_length)
+      return true;
+
+    // Each chunk is checked against its signed hash before being written, so
+    // corrupt data never reaches the partition.
+    const auto& expected_hash =
+        operation.data_chunk_sha256_hash(streamed_op_bytes_ / chunk_size);
+    brillo::Blob chunk_hash;
+    if (!HashCalculator::RawHashOfData(buffer_, &chunk_hash)) {
+      *error = ErrorCode::kDownloadOperationHashVerificationError;
+      return false;
+    }
+    if (brillo::Blob(expected_hash.begin(), expected_hash.end()) !=
+        chunk_hash) {
+      LOG(ERROR) << "Hash verification failed for the chunk at offset "
+                 << streamed_op_bytes_ << " of operation "
+                 << next_operation_num_;
+      if (install_plan_->hash_checks_mandatory) {
+        // The chunk is still in |buffer_| and can be downloaded again.
+        operation_data_invalid_ = true;
+        *error = ErrorCode::kDownloadOperationHashMismatch;
+        return false;
+      }
+      LOG(WARNING) << "Ignoring operation validation errors";
+    }
+    if (!streamed_op_hash_->Update(buffer_.data(), buffer_.size()) ||
+        !streamed_op_writer_->Write(buffer_.data(), buffer_.size())) {
+      *error = ErrorCode::kDownloadOperationExecutionError;
+      return false;
+    }
+    streamed_op_bytes_ += buffer_.size();
+    DiscardBuffer(true, buffer_.size());
+  }
+
+  // The hash of the whole blob is checked too when the payload has it. Its
+  // chunks matched their hashes and were written, so a mismatch here isn't
+  // fixed by downloading them again.
+  if (operation.has_data_sha256_hash() &&
+      (!streamed_op_hash_->Finalize() ||
+       streamed_op_hash_->raw_hash() !=
+           brillo::Blob(operation.data_sha256_hash().begin(),
+                        operation.data_sha256_hash().end()))) {
+    LOG(ERROR) << "Hash verification failed for operation "
+               << next_operation_num_;
+    if (install_plan_->hash_checks_mandatory) {
+      *error = ErrorCode::kDownloadOperationHashMismatch;
+      return false;
+    }
+    LOG(WARNING) << "Ignoring operation validation errors";
+  }
+  streamed_op_writer_.reset();
+  streamed_op_hash_.reset();
+  return true;
+}
+
 bool DeltaPerformer::PerformReplaceOperation(
     const InstallOperation& operation) {
   CHECK(operation.type() == InstallOperation::REPLACE ||
@@ -1016,7 +1423,8 @@ bool DeltaPerformer::PerformDiffOperation(const InstallOperation& operation,
                                           ErrorCode* error) {
   // Since we delete data off the beginning of the buffer as we use it,
   // the data we need should be exactly at the beginning of the buffer.
-  TEST_AND_RETURN_FALSE(buffer_offset_ == operation.data_offset());
+  TEST_AND_RETURN_FALSE(buffer_reused_ ||
+                        buffer_offset_ == operation.data_offset());
   TEST_AND_RETURN_FALSE(buffer_.size() >= operation.data_length());
   if (operation.has_src_length())
     TEST_AND_RETURN_FALSE(operation.src_length() % block_size_ == 0);
@@ -1374,6 +1782,13 @@ ErrorCode DeltaPerformer::VerifyPayload(
 
 void DeltaPerformer::DiscardBuffer(bool do_advance_offset,
                                    size_t signed_hash_buffer_size) {
+  // A reused blob was already hashed and counted when it was downloaded.
+  if (buffer_reused_) {
+    brillo::Blob().swap(buffer_);
+    buffer_reused_ = false;
+    return;
+  }
+
   // Update the buffer offset.
   if (do_advance_offset)
     buffer_offset_ += buffer_.size();
@@ -1461,6 +1876,8 @@ bool DeltaPerformer::ResetUpdateProgress(
     bool skip_dynamic_partititon_metadata_updated) {
   TEST_AND_RETURN_FALSE(prefs->SetInt64(kPrefsUpdateStateNextOperation,
                                         kUpdateStateOperationInvalid));
+  // The partitions will be written again, so their verification too.
+  prefs->Delete(kPrefsVerifierCheckpointPartition);
   if (!quick) {
     prefs->SetInt64(kPrefsUpdateStateNextDataOffset, -1);
     prefs->SetInt64(kPrefsUpdateStateNextDataLength, 0);
@@ -1493,6 +1910,11 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
   if (!force && !ShouldCheckpoint()) {
     return false;
   }
+  // The operation being streamed is applied again from its start, so the
+  // last checkpoint is kept.
+  if (streamed_op_writer_) {
+    return false;
+  }
   Terminator::set_exit_blocked(true);
   LOG_IF(WARNING, !prefs_->StartTransaction())
       << "unable to start transaction in checkpointing";
@@ -1553,7 +1975,10 @@ bool DeltaPerformer::CheckpointUpdateProgress(bool force) {
       prefs_->SetInt64(kPrefsUpdateStateNextOperation, next_operation_num_));
   if (!prefs_->SubmitTransaction()) {
     LOG(ERROR) << "Failed to submit transaction in checkpointing";
+    return true;
   }
+  // The operations after the checkpoint don't use the released blobs.
+  DeleteReleasedBlobs();
   return true;
 }
 
@@ -20,11 +20,14 @@
 #include <inttypes.h>
 
 #include <limits>
+#include <map>
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <base/files/file_path.h>
 #include <base/time/time.h>
 #include <brillo/secure_blob.h>
 #include <google/protobuf/repeated_field.h>
@@ -32,6 +35,7 @@
 
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/platform_constants.h"
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/payload_consumer/partition_writer_interface.h"
@@ -45,6 +49,7 @@ class DownloadActionDelegate;
 class BootControlInterface;
 class HardwareInterface;
 class PrefsInterface;
+class ResourceAccountant;
 
 // This class performs the actions in a delta update synchronously. The delta
 // update itself should be passed in in chunks as it is received.
@@ -63,6 +68,9 @@ class DeltaPerformer : public FileWriter {
   static const unsigned kProgressDownloadWeight;
   static const unsigned kProgressOperationsWeight;
   static const uint64_t kCheckpointFrequencySeconds;
+  // The number of times the data of an operation failing its hash check is
+  // downloaded again before failing the update.
+  static const unsigned kMaxOperationRefetches;
 
   DeltaPerformer(
       PrefsInterface* prefs,
@@ -164,9 +172,37 @@ class DeltaPerformer : public FileWriter {
     public_key_path_ = public_key_path;
   }
 
+  // Sets the accountant of the resources used to parse the manifest and to
+  // download and apply each partition, or nullptr. Not owned.
+  void set_resource_accountant(ResourceAccountant* resource_accountant) {
+    resource_accountant_ = resource_accountant;
+  }
+
   // Return true if header parsing is finished and no errors occurred.
   bool IsHeaderParsed() const;
 
+  // The payload range of the data of an operation to download again, and the
+  // payload offset to continue the download from once it's applied.
+  struct Refetch {
+    uint64_t offset;
+    uint64_t length;
+    uint64_t resume_offset;
+  };
+
+  // After Write() failed with kDownloadOperationHashMismatch because the
+  // downloaded data of an operation is corrupt, returns the range to download
+  // again, or nullopt if the mismatch isn't in the downloaded data or if it was
+  // already downloaded again too many times. Only the corrupt chunk of a
+  // streamed operation is downloaded again; a mismatch of its whole data once
+  // its chunks were written isn't. The bytes passed to Write() after
+  // the data of the operation are kept and applied right after it, so the
+  // download continues at |resume_offset|.
+  std::optional<Refetch> refetch() const { return refetch_; }
+
+  // Returns the number of bytes to download again for the operations that
+  // failed their hash check.
+  uint64_t refetched_bytes() const { return refetched_bytes_; }
+
   // Checkpoints the update progress into persistent storage to allow this
   // update attempt to be resumed after reboot.
   // If |force| is false, checkpoint may be throttled.
@@ -212,6 +248,7 @@ class DeltaPerformer : public FileWriter {
   FRIEND_TEST(DeltaPerformerTest, BrilloMetadataSignatureSizeTest);
   FRIEND_TEST(DeltaPerformerTest, BrilloParsePayloadMetadataTest);
   FRIEND_TEST(DeltaPerformerTest, UsePublicKeyFromResponse);
+  FRIEND_TEST(DeltaPerformerTest, ReusedBlobsCheckpointTest);
 
   // Obtain the operation index for current partition. If all operations for
   // current partition is are finished, return # of operations. This is mostly
@@ -275,6 +312,61 @@ class DeltaPerformer : public FileWriter {
   bool PerformDiffOperation(const InstallOperation& operation,
                             ErrorCode* error = nullptr);
 
+  // Returns whether the REPLACE* |operation| has data chunk hashes and is
+  // applied chunk by chunk as its data is downloaded rather than all at once.
+  bool IsStreamedOperation(const InstallOperation& operation) const;
+
+  // Validates and applies the chunks of the data of the streamed |operation|
+  // found in |bytes_p|, and finishes the operation once all of its data was
+  // applied. |streamed_op_writer_| is left set while chunks are missing.
+  bool StreamOperation(const InstallOperation& operation,
+                       const char** bytes_p,
+                       size_t* count_p,
+                       ErrorCode* error);
+
+  // Returns whether |operation| uses the data blob of a previous operation,
+  // which was kept in memory instead of being downloaded again.
+  bool IsReusedBlob(const InstallOperation& operation) const;
+
+  // Loads the blob kept for |operation| into |buffer_|.
+  bool LoadReusedBlob(const InstallOperation& operation);
+
+  // Keeps a copy of the blob of |operation| in |buffer_| if other operations
+  // left use it. Fails if the blobs kept would exceed kMaxReusedBlobsSize.
+  bool KeepReusedBlob(const InstallOperation& operation);
+
+  // Releases the blob of |operation| once no operation left uses it.
+  void ReleaseReusedBlob(const InstallOperation& operation);
+
+  // Each blob kept for reuse is also written once to a file in
+  // |reused_blobs_dir_|, so the checkpoints don't need to save it and a
+  // resumed update has the blobs it already downloaded. Returns the path of
+  // the file of the blob at |data_offset|, empty if blobs aren't saved.
+  base::FilePath GetReusedBlobPath(uint64_t data_offset) const;
+
+  // Loads the blobs the operations left use that were downloaded before the
+  // update was interrupted from their files, checking them against the hash
+  // of their operation.
+  bool RestoreReusedBlobs();
+
+  // Deletes the files of the blobs released before the last checkpoint.
+  void DeleteReleasedBlobs();
+
+  // Discards the data of |operation| in |buffer_|, which failed its hash
+  // check, keeps the |count| bytes of |bytes| received after it, and sets
+  // |refetch_| to download the data again. For a streamed operation, the
+  // data is the chunk which failed its hash check. Returns false if the data
+  // of the operation was already downloaded again kMaxOperationRefetches
+  // times.
+  bool PrepareOperationRefetch(const InstallOperation& operation,
+                               const char* bytes,
+                               size_t count);
+
+  // Once the data downloaded again was applied, moves the bytes received after
+  // it the first time to |tail| followed by the |count| bytes of |bytes|, and
+  // points |bytes| and |count| to them. Returns whether there were such bytes.
+  bool TakeRefetchTail(brillo::Blob* tail, const char** bytes, size_t* count);
+
   // Extracts the payload signature message from the current |buffer_| if the
   // offset matches the one specified by the manifest. Returns whether the
   // signature was extracted.
@@ -325,6 +417,11 @@ class DeltaPerformer : public FileWriter {
 
   bool CheckSPLDowngrade();
 
+  // Lowers the COW compression factor of the manifest to the highest of the
+  // factors measured for each partition by the generator, if they're all
+  // lower.
+  void ApplyPartitionCompressionFactors();
+
   // Update Engine preference store.
   PrefsInterface* prefs_;
 
@@ -382,6 +479,43 @@ class DeltaPerformer : public FileWriter {
   // Offset of buffer_ in the binary blobs section of the update.
   uint64_t buffer_offset_{0};
 
+  // On payloads that reuse data blobs, the number of operations left that use
+  // each blob, by data offset, for the blobs used by more than one operation.
+  std::map<uint64_t, uint32_t> blob_refs_;
+  // The blobs kept for the operations left that use them, by data offset, and
+  // their total size.
+  std::map<uint64_t, brillo::Blob> reused_blobs_;
+  uint64_t reused_blobs_size_{0};
+  // The directory the kept blobs are saved to, empty if they aren't, and the
+  // data offsets of the blobs released since the last checkpoint, whose files
+  // the last checkpoint may still need.
+  base::FilePath reused_blobs_dir_;
+  std::vector<uint64_t> released_blobs_;
+  // Whether |buffer_| holds a reused blob rather than downloaded data.
+  bool buffer_reused_{false};
+
+  // The writer of the streamed operation being applied, the number of bytes of
+  // its data applied so far and the hash of these bytes.
+  std::unique_ptr<ExtentWriter> streamed_op_writer_;
+  uint64_t streamed_op_bytes_{0};
+  std::unique_ptr<HashCalculator> streamed_op_hash_;
+
+  // Whether the last operation processed failed because its downloaded data,
+  // or a chunk of it for a streamed operation, didn't match its hash.
+  bool operation_data_invalid_{false};
+
+  // The data to download again after the last Write(), the bytes received
+  // after it to apply once the data downloaded again ends at
+  // |refetch_end_offset_| of the blobs, the total number of bytes to download
+  // again, and the number of times the data of |refetched_operation_num_| was
+  // downloaded again.
+  std::optional<Refetch> refetch_;
+  brillo::Blob refetch_tail_;
+  uint64_t refetch_end_offset_{0};
+  uint64_t refetched_bytes_{0};
+  size_t refetched_operation_num_{0};
+  unsigned operation_refetches_{0};
+
   // Last |next_operation_num_| value updated as part of the progress update.
   uint64_t last_updated_operation_num_{std::numeric_limits<uint64_t>::max()};
 
@@ -434,6 +568,8 @@ class DeltaPerformer : public FileWriter {
 
   std::unique_ptr<PartitionWriterInterface> partition_writer_;
 
+  ResourceAccountant* resource_accountant_{nullptr};
+
   DISALLOW_COPY_AND_ASSIGN(DeltaPerformer);
 };
 
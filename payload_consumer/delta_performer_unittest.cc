@@ -22,6 +22,7 @@
 #include <algorithm>
 #include <map>
 #include <memory>
+#include <random>
 #include <string>
 #include <vector>
 
@@ -548,6 +549,248 @@ TEST_F(DeltaPerformerTest, ReplaceXzOperationTest) {
   EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
 }
 
+TEST_F(DeltaPerformerTest, StreamedReplaceOperationTest) {
+  brillo::Blob expected_data(3 * 4096);
+  std::mt19937 gen(5);
+  std::generate(
+      expected_data.begin(), expected_data.end(), [&gen] { return gen(); });
+
+  // The data is applied in chunks of 5000 bytes, the last one shorter.
+  constexpr size_t kChunkSize = 5000;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 3);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_chunk_size(kChunkSize);
+  for (size_t offset = 0; offset < expected_data.size(); offset += kChunkSize) {
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        expected_data.data() + offset,
+        std::min(kChunkSize, expected_data.size() - offset),
+        &hash));
+    aop.op.add_data_chunk_sha256_hash(hash.data(), hash.size());
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, false);
+  EXPECT_EQ(expected_data, ApplyPayload(payload_data, "/dev/null", true));
+}
+
+TEST_F(DeltaPerformerTest, StreamedReplaceChunkHashMismatchTest) {
+  brillo::Blob expected_data(2 * 4096, 'a');
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 2);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_chunk_size(4096);
+  brillo::Blob hash;
+  EXPECT_TRUE(
+      HashCalculator::RawHashOfBytes(expected_data.data(), 4096, &hash));
+  aop.op.add_data_chunk_sha256_hash(hash.data(), hash.size());
+  aop.op.add_data_chunk_sha256_hash(string(32, 'h'));
+
+  // Mandatory hash checks need a signed payload.
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, true);
+  ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+      payload_data.data(),
+      payload_.metadata_size,
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &payload_.metadata_signature));
+  install_plan_.hash_checks_mandatory = true;
+
+  // The chunk before the corrupt one was already applied, but not the corrupt
+  // one.
+  EXPECT_EQ(brillo::Blob(4096, 'a'),
+            ApplyPayload(payload_data, "/dev/null", false));
+}
+
+TEST_F(DeltaPerformerTest, RefetchCorruptedOperationDataTest) {
+  brillo::Blob expected_data(4096, 'a');
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+
+  // Mandatory hash checks need a signed payload.
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, true);
+  ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+      payload_data.data(),
+      payload_.metadata_size,
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &payload_.metadata_signature));
+  install_plan_.hash_checks_mandatory = true;
+  const size_t data_pos =
+      std::search(
+          payload_data.begin(), payload_data.end(), expected_data.begin(),
+          expected_data.end()) -
+      payload_data.begin();
+  ASSERT_LT(data_pos, payload_data.size());
+  brillo::Blob corrupt_data = payload_data;
+  corrupt_data[data_pos + 100] ^= 0xff;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  payload_.size = payload_data.size();
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  for (const char* name : {kPartitionNameRoot, kPartitionNameKernel}) {
+    fake_boot_control_.SetPartitionDevice(
+        name, install_plan_.source_slot, "/dev/null");
+  }
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // Only the operation data is downloaded again on each mismatch, the
+  // signature received after it is kept and applied after it.
+  const size_t data_size = expected_data.size();
+  ErrorCode error;
+  EXPECT_FALSE(performer_.Write(corrupt_data.data(), corrupt_data.size(),
+                                &error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationHashMismatch, error);
+  for (unsigned i = 1; i <= DeltaPerformer::kMaxOperationRefetches; i++) {
+    auto refetch = performer_.refetch();
+    ASSERT_TRUE(refetch);
+    EXPECT_EQ(data_pos, refetch->offset);
+    EXPECT_EQ(data_size, refetch->length);
+    EXPECT_EQ(payload_data.size(), refetch->resume_offset);
+    if (i == DeltaPerformer::kMaxOperationRefetches)
+      break;
+    EXPECT_FALSE(performer_.Write(
+        corrupt_data.data() + data_pos, data_size, &error));
+  }
+  EXPECT_EQ(DeltaPerformer::kMaxOperationRefetches * data_size,
+            performer_.refetched_bytes());
+  EXPECT_TRUE(
+      performer_.Write(payload_data.data() + data_pos, data_size, &error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_FALSE(performer_.refetch());
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
+TEST_F(DeltaPerformerTest, RefetchCorruptedOperationDataLimitTest) {
+  brillo::Blob expected_data(4096, 'a');
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 1);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, true);
+  ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+      payload_data.data(),
+      payload_.metadata_size,
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &payload_.metadata_signature));
+  install_plan_.hash_checks_mandatory = true;
+  const size_t data_pos =
+      std::search(
+          payload_data.begin(), payload_data.end(), expected_data.begin(),
+          expected_data.end()) -
+      payload_data.begin();
+  ASSERT_LT(data_pos, payload_data.size());
+  payload_data[data_pos] ^= 0xff;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  payload_.size = payload_data.size();
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  for (const char* name : {kPartitionNameRoot, kPartitionNameKernel}) {
+    fake_boot_control_.SetPartitionDevice(
+        name, install_plan_.source_slot, "/dev/null");
+  }
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // The update fails once the corrupt data was downloaded again too many
+  // times.
+  ErrorCode error;
+  EXPECT_FALSE(performer_.Write(payload_data.data(), payload_data.size(),
+                                &error));
+  for (unsigned i = 0; i < DeltaPerformer::kMaxOperationRefetches; i++) {
+    ASSERT_TRUE(performer_.refetch());
+    EXPECT_EQ(data_pos, performer_.refetch()->offset);
+    EXPECT_FALSE(performer_.Write(payload_data.data() + data_pos,
+                                  expected_data.size(),
+                                  &error));
+    EXPECT_EQ(ErrorCode::kDownloadOperationHashMismatch, error);
+  }
+  EXPECT_FALSE(performer_.refetch());
+}
+
+TEST_F(DeltaPerformerTest, RefetchCorruptedStreamedChunkTest) {
+  brillo::Blob expected_data(3 * 4096);
+  std::mt19937 gen(7);
+  std::generate(
+      expected_data.begin(), expected_data.end(), [&gen] { return gen(); });
+  constexpr size_t kChunkSize = 4096;
+  AnnotatedOperation aop;
+  *(aop.op.add_dst_extents()) = ExtentForRange(0, 3);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(expected_data.size());
+  aop.op.set_type(InstallOperation::REPLACE);
+  aop.op.set_data_chunk_size(kChunkSize);
+  for (size_t offset = 0; offset < expected_data.size(); offset += kChunkSize) {
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfBytes(
+        expected_data.data() + offset, kChunkSize, &hash));
+    aop.op.add_data_chunk_sha256_hash(hash.data(), hash.size());
+  }
+
+  brillo::Blob payload_data = GeneratePayload(expected_data, {aop}, true);
+  ASSERT_TRUE(PayloadSigner::GetMetadataSignature(
+      payload_data.data(),
+      payload_.metadata_size,
+      GetBuildArtifactsPath(kUnittestPrivateKeyPath),
+      &payload_.metadata_signature));
+  install_plan_.hash_checks_mandatory = true;
+  const size_t data_pos =
+      std::search(
+          payload_data.begin(), payload_data.end(), expected_data.begin(),
+          expected_data.end()) -
+      payload_data.begin();
+  ASSERT_LT(data_pos, payload_data.size());
+  brillo::Blob corrupt_data = payload_data;
+  corrupt_data[data_pos + kChunkSize + 100] ^= 0xff;
+
+  ScopedTempFile new_part("Partition-XXXXXX");
+  payload_.size = payload_data.size();
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameRoot, install_plan_.target_slot, new_part.path());
+  for (const char* name : {kPartitionNameRoot, kPartitionNameKernel}) {
+    fake_boot_control_.SetPartitionDevice(
+        name, install_plan_.source_slot, "/dev/null");
+  }
+  fake_boot_control_.SetPartitionDevice(
+      kPartitionNameKernel, install_plan_.target_slot, "/dev/null");
+
+  // Only the corrupt chunk is downloaded again, the chunk written before it
+  // is kept and the chunk received after it is applied after it.
+  ErrorCode error;
+  EXPECT_FALSE(performer_.Write(corrupt_data.data(), corrupt_data.size(),
+                                &error));
+  EXPECT_EQ(ErrorCode::kDownloadOperationHashMismatch, error);
+  auto refetch = performer_.refetch();
+  ASSERT_TRUE(refetch);
+  EXPECT_EQ(data_pos + kChunkSize, refetch->offset);
+  EXPECT_EQ(kChunkSize, refetch->length);
+  EXPECT_EQ(payload_data.size(), refetch->resume_offset);
+  EXPECT_TRUE(performer_.Write(
+      payload_data.data() + data_pos + kChunkSize, kChunkSize, &error));
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_FALSE(performer_.refetch());
+  EXPECT_EQ(kChunkSize, performer_.refetched_bytes());
+  EXPECT_EQ(0, performer_.Close());
+
+  brillo::Blob partition_data;
+  EXPECT_TRUE(utils::ReadFile(new_part.path(), &partition_data));
+  EXPECT_EQ(expected_data, partition_data);
+}
+
 TEST_F(DeltaPerformerTest, ZeroOperationTest) {
   brillo::Blob existing_data = brillo::Blob(4096 * 10, 'a');
   brillo::Blob expected_data = existing_data;
@@ -624,6 +867,60 @@ TEST_F(DeltaPerformerTest, PuffdiffOperationTest) {
   EXPECT_EQ(dst, ApplyPayload(payload_data, source.path(), true));
 }
 
+TEST_F(DeltaPerformerTest, ReusedBlobsCheckpointTest) {
+  base::ScopedTempDir temp_dir;
+  ASSERT_TRUE(temp_dir.CreateUniqueTempDir());
+  const brillo::Blob blob = {'a', 'b', 'c'};
+  brillo::Blob hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(blob, &hash));
+  InstallOperation op;
+  op.set_data_offset(100);
+  op.set_data_length(blob.size());
+  op.set_data_sha256_hash(hash.data(), hash.size());
+
+  // A blob kept for the operations left is saved once, when downloaded.
+  performer_.reused_blobs_dir_ = temp_dir.GetPath();
+  performer_.blob_refs_[100] = 2;
+  performer_.buffer_ = blob;
+  EXPECT_TRUE(performer_.KeepReusedBlob(op));
+  const string path = performer_.GetReusedBlobPath(100).value();
+  brillo::Blob saved;
+  EXPECT_TRUE(utils::ReadFile(path, &saved));
+  EXPECT_EQ(blob, saved);
+
+  // An update resumed after the first operation gets the blob it kept.
+  DeltaPerformer resumed(&prefs_,
+                         &fake_boot_control_,
+                         &fake_hardware_,
+                         &mock_delegate_,
+                         &install_plan_,
+                         &payload_,
+                         false /* interactive */,
+                         "" /* Update certs path */);
+  resumed.reused_blobs_dir_ = temp_dir.GetPath();
+  PartitionUpdate& partition = resumed.partitions_.emplace_back();
+  *partition.add_operations() = op;
+  *partition.add_operations() = op;
+  resumed.next_operation_num_ = 1;
+  resumed.buffer_offset_ = 100 + blob.size();
+  resumed.blob_refs_[100] = 1;
+  EXPECT_TRUE(resumed.RestoreReusedBlobs());
+  EXPECT_EQ(performer_.reused_blobs_, resumed.reused_blobs_);
+  EXPECT_EQ(blob.size(), resumed.reused_blobs_size_);
+
+  // A corrupt blob isn't used.
+  ASSERT_TRUE(test_utils::WriteFileString(path, "abd"));
+  EXPECT_FALSE(resumed.RestoreReusedBlobs());
+
+  // The file of a released blob is only deleted after the next checkpoint.
+  performer_.ReleaseReusedBlob(op);
+  performer_.ReleaseReusedBlob(op);
+  EXPECT_TRUE(performer_.reused_blobs_.empty());
+  EXPECT_TRUE(utils::FileExists(path.c_str()));
+  performer_.DeleteReleasedBlobs();
+  EXPECT_FALSE(utils::FileExists(path.c_str()));
+}
+
 TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   brillo::Blob expected_data = {'f', 'o', 'o'};
   brillo::Blob actual_data = {'b', 'a', 'r'};
@@ -651,6 +948,8 @@ TEST_F(DeltaPerformerTest, SourceHashMismatchTest) {
   // When source hash mismatches, PartitionWriter will refuse to write anything.
   // Therefore we should expect an empty blob.
   EXPECT_EQ(brillo::Blob{}, ApplyPayload(payload_data, source.path(), false));
+  // The downloaded data isn't at fault, downloading it again wouldn't help.
+  EXPECT_FALSE(performer_.refetch());
 }
 
 TEST_F(DeltaPerformerTest, ExtentsToByteStringTest) {
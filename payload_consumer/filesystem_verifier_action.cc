@@ -36,6 +36,7 @@
 #include <brillo/secure_blob.h>
 #include <brillo/streams/file_stream.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
@@ -81,6 +82,40 @@ namespace {
 const off_t kReadFileBufferSize = 128 * 1024;
 constexpr float kVerityProgressPercent = 0.3;
 constexpr float kEncodeFECPercent = 0.3;
+// The hashing progress is checkpointed every this many bytes hashed.
+constexpr uint64_t kCheckpointIntervalBytes = 64 * 1024 * 1024;
+
+// Returns the hash of the partitions to verify and of their expected hashes,
+// so a checkpoint is only used to verify the same update again.
+string PlanHash(const InstallPlan& install_plan) {
+  string plan = std::to_string(install_plan.target_slot);
+  for (const auto& partition : install_plan.partitions) {
+    plan += '\0' + partition.name + '\0';
+    plan.append(partition.target_hash.begin(), partition.target_hash.end());
+  }
+  return HashCalculator::SHA256Digest(plan);
+}
+
+// Returns what identifies |partition| of |slot| and the layout of its verity
+// data, so a checkpoint isn't used for another partition or slot, or after
+// the hash tree or FEC data moved. The device path isn't part of it, as the
+// device mapper may number the devices differently after a reboot.
+string PartitionId(const InstallPlan::Partition& partition,
+                   uint32_t slot,
+                   bool read_from_snapshot) {
+  return partition.name + '\0' + std::to_string(slot) + '\0' +
+         (read_from_snapshot ? "snapshot" : "device") + '\0' +
+         std::to_string(partition.hash_tree_data_offset) + ',' +
+         std::to_string(partition.hash_tree_data_size) + ',' +
+         std::to_string(partition.hash_tree_offset) + ',' +
+         std::to_string(partition.hash_tree_size) + ',' +
+         partition.hash_tree_algorithm + '\0' +
+         std::to_string(partition.fec_data_offset) + ',' +
+         std::to_string(partition.fec_data_size) + ',' +
+         std::to_string(partition.fec_offset) + ',' +
+         std::to_string(partition.fec_size) + ',' +
+         std::to_string(partition.fec_roots);
+}
 
 }  // namespace
 
@@ -122,16 +157,25 @@ void FilesystemVerifierAction::PerformAction() {
       !install_plan_.write_verity) {
     dynamic_control_->MapAllPartitions();
   }
+  LoadCheckpoint();
   StartPartitionHashing();
   abort_action_completer.set_should_complete(false);
 }
 
 void FilesystemVerifierAction::TerminateProcessing() {
+  // Save what was hashed since the last checkpoint, the data read last is
+  // still in |buffer_|.
+  if (hasher_ && hashed_offset_ > checkpoint_offset_ &&
+      hashed_offset_ < partition_size_) {
+    WriteCheckpoint(buffer_.data(), last_read_size_);
+  }
   cancelled_ = true;
   Cleanup(ErrorCode::kSuccess);  // error code is ignored if canceled_ is true.
 }
 
 void FilesystemVerifierAction::Cleanup(ErrorCode code) {
+  if (resource_accountant_)
+    resource_accountant_->EndPhase();
   partition_fd_.reset();
   // This memory is not used anymore.
   buffer_.clear();
@@ -146,6 +190,8 @@ void FilesystemVerifierAction::Cleanup(ErrorCode code) {
 
   if (cancelled_)
     return;
+  // The verification is over, the next one starts from the beginning.
+  ClearCheckpoint();
   if (code == ErrorCode::kSuccess && HasOutputPipe())
     SetOutputObject(install_plan_);
   UpdateProgress(1.0);
@@ -194,8 +240,8 @@ bool FilesystemVerifierAction::InitializeFdVABC(bool should_write_verity) {
     }
     return InitializeFd(partition.readonly_target_path);
   }
-  partition_fd_ =
-      dynamic_control_->OpenCowFd(partition.name, partition.source_path, true);
+  partition_fd_ = dynamic_control_->OpenCowFd(
+      partition.name, partition.source_path, true, partition.source_size > 0);
   if (!partition_fd_) {
     LOG(ERROR) << "OpenCowReader(" << partition.name << ", "
                << partition.source_path << ") failed.";
@@ -223,6 +269,7 @@ bool FilesystemVerifierAction::InitializeFd(const std::string& part_path) {
 void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
                                                void* buffer,
                                                const size_t buffer_size) {
+  BeginPhase("verity");
   if (verity_writer_->FECFinished()) {
     LOG(INFO) << "EncodeFEC is completed. Resuming other tasks";
     if (dynamic_control_->UpdateUsesSnapshotCompression()) {
@@ -233,6 +280,9 @@ void FilesystemVerifierAction::WriteVerityData(FileDescriptor* fd,
         return;
       }
     }
+    // Don't write the verity data again if the verification is interrupted.
+    if (partition_fd_->Flush())
+      WriteCheckpoint(nullptr, 0);
     HashPartition(0, partition_size_, buffer, buffer_size);
     return;
   }
@@ -256,6 +306,7 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
     const off64_t end_offset,
     void* buffer,
     const size_t buffer_size) {
+  BeginPhase("verity");
   auto fd = partition_fd_.get();
   TEST_AND_RETURN(fd != nullptr);
   if (start_offset >= end_offset) {
@@ -295,13 +346,15 @@ void FilesystemVerifierAction::WriteVerityAndHashPartition(
                      start_offset + bytes_read,
                      end_offset,
                      buffer,
-                     buffer_size)));
+                     buffer_size),
+      ReadDelay(bytes_read)));
 }
 
 void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
                                              const off64_t end_offset,
                                              void* buffer,
                                              const size_t buffer_size) {
+  BeginPhase("verify");
   auto fd = partition_fd_.get();
   TEST_AND_RETURN(fd != nullptr);
   if (start_offset >= end_offset) {
@@ -331,6 +384,12 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
     Cleanup(ErrorCode::kFilesystemVerifierError);
     return;
   }
+  hashed_offset_ = start_offset + bytes_read;
+  last_read_size_ = read_size;
+  if (hashed_offset_ < static_cast<uint64_t>(end_offset) &&
+      hashed_offset_ - checkpoint_offset_ >= kCheckpointIntervalBytes) {
+    WriteCheckpoint(buffer, read_size);
+  }
   const auto progress = (start_offset + bytes_read) * 1.0f / partition_size_;
   // If we are writing verity, then the progress bar will be split between
   // verity writes and partition hashing. Otherwise, the entire progress bar is
@@ -349,7 +408,8 @@ void FilesystemVerifierAction::HashPartition(const off64_t start_offset,
                      start_offset + bytes_read,
                      end_offset,
                      buffer,
-                     buffer_size)));
+                     buffer_size),
+      ReadDelay(bytes_read)));
 }
 
 void FilesystemVerifierAction::StartPartitionHashing() {
@@ -375,17 +435,22 @@ void FilesystemVerifierAction::StartPartitionHashing() {
       install_plan_.partitions[partition_index_];
   const auto& part_path = GetPartitionPath();
   partition_size_ = GetPartitionSize();
+  hashed_offset_ = 0;
+  checkpoint_offset_ = 0;
+  last_read_size_ = 0;
 
   LOG(INFO) << "Hashing partition " << partition_index_ << " ("
             << partition.name << ") on device " << part_path;
   auto success = false;
   if (IsVABC(partition)) {
-    success = InitializeFdVABC(ShouldWriteVerity());
+    // The verity data of a resumed partition was already written.
+    success = InitializeFdVABC(ShouldWriteVerity() && !resume_offset_);
   } else {
     if (part_path.empty()) {
       if (partition_size_ == 0) {
         LOG(INFO) << "Skip hashing partition " << partition_index_ << " ("
                   << partition.name << ") because size is 0.";
+        resume_offset_.reset();
         partition_index_++;
         StartPartitionHashing();
         return;
@@ -416,6 +481,19 @@ void FilesystemVerifierAction::StartPartitionHashing() {
   } else if (partition.fec_offset != 0) {
     filesystem_data_end_ = partition.fec_offset;
   }
+  if (resume_offset_) {
+    if (ResumeFromCheckpoint(buffer_.data(), buffer_.size())) {
+      HashPartition(
+          hashed_offset_, partition_size_, buffer_.data(), buffer_.size());
+      return;
+    }
+    LOG(WARNING) << "Can't resume from the checkpoint, verifying all the "
+                    "partitions again.";
+    ClearCheckpoint();
+    partition_index_ = 0;
+    StartPartitionHashing();
+    return;
+  }
   if (ShouldWriteVerity()) {
     LOG(INFO) << "Verity writes enabled on partition " << partition.name;
     if (!verity_writer_->Init(partition)) {
@@ -465,6 +543,147 @@ uint64_t FilesystemVerifierAction::GetPartitionSize() const {
   }
 }
 
+base::TimeDelta FilesystemVerifierAction::ReadDelay(uint64_t bytes) {
+  if (pressure_throttler_ == nullptr)
+    return base::TimeDelta();
+  const base::TimeDelta delay = pressure_throttler_->OnBytesProcessed(bytes);
+  pressure_throttler_->AddThrottledTime(delay);
+  return delay;
+}
+
+void FilesystemVerifierAction::LoadCheckpoint() {
+  if (prefs_ == nullptr || !prefs_->Exists(kPrefsVerifierCheckpointPartition))
+    return;
+  string plan_hash;
+  int64_t partition_index = -1, offset = -1, guard_size = -1;
+  int64_t partition_size = -1;
+  if (!prefs_->GetString(kPrefsVerifierCheckpointPlanHash, &plan_hash) ||
+      plan_hash != PlanHash(install_plan_) ||
+      !prefs_->GetInt64(kPrefsVerifierCheckpointPartition, &partition_index) ||
+      partition_index < 0 ||
+      static_cast<size_t>(partition_index) >= install_plan_.partitions.size() ||
+      !prefs_->GetInt64(kPrefsVerifierCheckpointOffset, &offset) ||
+      offset < 0 ||
+      !prefs_->GetString(kPrefsVerifierCheckpointSHA256Context,
+                         &resume_context_) ||
+      !prefs_->GetString(kPrefsVerifierCheckpointGuardHash,
+                         &resume_guard_hash_) ||
+      !prefs_->GetInt64(kPrefsVerifierCheckpointGuardSize, &guard_size) ||
+      guard_size < 0 || guard_size > offset ||
+      !prefs_->GetInt64(kPrefsVerifierCheckpointPartitionSize,
+                        &partition_size) ||
+      partition_size < offset ||
+      !prefs_->GetString(kPrefsVerifierCheckpointPartitionId,
+                         &resume_partition_id_)) {
+    LOG(WARNING) << "Ignoring the checkpoint of a different verification.";
+    ClearCheckpoint();
+    return;
+  }
+  // The partitions before the checkpoint were already verified.
+  partition_index_ = partition_index;
+  resume_offset_ = offset;
+  resume_guard_size_ = guard_size;
+  resume_partition_size_ = partition_size;
+}
+
+void FilesystemVerifierAction::WriteCheckpoint(const void* guard,
+                                               size_t guard_size) {
+  if (prefs_ == nullptr || verifier_step_ != VerifierStep::kVerifyTargetHash)
+    return;
+  brillo::Blob guard_hash;
+  if (guard_size > 0 &&
+      !HashCalculator::RawHashOfBytes(guard, guard_size, &guard_hash)) {
+    return;
+  }
+  LOG_IF(WARNING, !prefs_->StartTransaction())
+      << "unable to start transaction in checkpointing";
+  if (!prefs_->SetString(kPrefsVerifierCheckpointPlanHash,
+                         PlanHash(install_plan_)) ||
+      !prefs_->SetInt64(kPrefsVerifierCheckpointPartition, partition_index_) ||
+      !prefs_->SetInt64(kPrefsVerifierCheckpointOffset, hashed_offset_) ||
+      !prefs_->SetString(kPrefsVerifierCheckpointSHA256Context,
+                         hasher_->GetContext()) ||
+      !prefs_->SetString(kPrefsVerifierCheckpointGuardHash,
+                         string(guard_hash.begin(), guard_hash.end())) ||
+      !prefs_->SetInt64(kPrefsVerifierCheckpointGuardSize, guard_size) ||
+      !prefs_->SetInt64(kPrefsVerifierCheckpointPartitionSize,
+                        partition_size_) ||
+      !prefs_->SetString(kPrefsVerifierCheckpointPartitionId,
+                         CheckpointPartitionId())) {
+    LOG(ERROR) << "Failed to checkpoint the verification.";
+    prefs_->CancelTransaction();
+    return;
+  }
+  if (!prefs_->SubmitTransaction()) {
+    LOG(ERROR) << "Failed to submit transaction in checkpointing";
+  }
+  checkpoint_offset_ = hashed_offset_;
+}
+
+bool FilesystemVerifierAction::ResumeFromCheckpoint(void* buffer,
+                                                    size_t buffer_size) {
+  const uint64_t offset = *resume_offset_;
+  resume_offset_.reset();
+  if (resume_partition_size_ != partition_size_ ||
+      resume_partition_id_ != CheckpointPartitionId()) {
+    LOG(WARNING) << "The checkpoint is of another partition or layout.";
+    return false;
+  }
+  if (offset > partition_size_ || !hasher_->SetContext(resume_context_))
+    return false;
+  // Compare the data read last before the checkpoint with what it was then.
+  // This only re-reads the guard region, at most one read buffer right before
+  // the checkpoint; the data hashed before it isn't read again and is trusted
+  // to be unchanged, as the checkpoint is bound to this update, partition,
+  // slot, size and verity layout.
+  const uint64_t guard_size = resume_guard_size_;
+  if (guard_size > buffer_size)
+    return false;
+  if (guard_size > 0) {
+    brillo::Blob guard_hash;
+    if (partition_fd_->Seek(offset - guard_size, SEEK_SET) !=
+            static_cast<off64_t>(offset - guard_size) ||
+        partition_fd_->Read(buffer, guard_size) !=
+            static_cast<ssize_t>(guard_size) ||
+        !HashCalculator::RawHashOfBytes(buffer, guard_size, &guard_hash) ||
+        string(guard_hash.begin(), guard_hash.end()) != resume_guard_hash_) {
+      LOG(WARNING) << "The data before the checkpoint changed.";
+      return false;
+    }
+  }
+  LOG(INFO) << "Resuming the hashing of partition "
+            << install_plan_.partitions[partition_index_].name
+            << " at offset " << offset;
+  hashed_offset_ = offset;
+  checkpoint_offset_ = offset;
+  last_read_size_ = guard_size;
+  return true;
+}
+
+void FilesystemVerifierAction::ClearCheckpoint() {
+  if (prefs_ == nullptr)
+    return;
+  prefs_->Delete(kPrefsVerifierCheckpointPlanHash);
+  prefs_->Delete(kPrefsVerifierCheckpointPartition);
+  prefs_->Delete(kPrefsVerifierCheckpointOffset);
+  prefs_->Delete(kPrefsVerifierCheckpointSHA256Context);
+  prefs_->Delete(kPrefsVerifierCheckpointGuardHash);
+  prefs_->Delete(kPrefsVerifierCheckpointGuardSize);
+  prefs_->Delete(kPrefsVerifierCheckpointPartitionSize);
+  prefs_->Delete(kPrefsVerifierCheckpointPartitionId);
+}
+
+string FilesystemVerifierAction::CheckpointPartitionId() const {
+  const InstallPlan::Partition& partition =
+      install_plan_.partitions[partition_index_];
+  return PartitionId(partition, install_plan_.target_slot, IsVABC(partition));
+}
+
+void FilesystemVerifierAction::BeginPhase(const std::string& name) {
+  if (resource_accountant_)
+    resource_accountant_->BeginPhase(name);
+}
+
 bool FilesystemVerifierAction::ShouldWriteVerity() {
   const InstallPlan::Partition& partition =
       install_plan_.partitions[partition_index_];
@@ -21,6 +21,7 @@
 #include <sys/types.h>
 
 #include <memory>
+#include <optional>
 #include <string>
 #include <utility>
 #include <vector>
@@ -29,6 +30,9 @@
 
 #include "update_engine/common/action.h"
 #include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/prefs_interface.h"
+#include "update_engine/common/pressure_throttler.h"
+#include "update_engine/common/resource_accountant.h"
 #include "update_engine/common/scoped_task_id.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/install_plan.h"
@@ -80,6 +84,22 @@ class FilesystemVerifierAction : public InstallPlanAction {
     return this->delegate_;
   }
 
+  // Sets the prefs the hashing progress is checkpointed to, so an interrupted
+  // verification resumes where it stopped. Not owned.
+  void set_prefs(PrefsInterface* prefs) { prefs_ = prefs; }
+
+  // Sets the throttler pacing the partition reads with the system pressure.
+  // Not owned.
+  void set_pressure_throttler(PressureThrottler* pressure_throttler) {
+    pressure_throttler_ = pressure_throttler;
+  }
+
+  // Sets the accountant of the resources used to write verity and to verify
+  // the partitions. Not owned.
+  void set_resource_accountant(ResourceAccountant* resource_accountant) {
+    resource_accountant_ = resource_accountant;
+  }
+
   // Debugging/logging
   static std::string StaticType() { return "FilesystemVerifierAction"; }
   std::string Type() const override { return StaticType(); }
@@ -99,6 +119,13 @@ class FilesystemVerifierAction : public InstallPlanAction {
                      void* buffer,
                      const size_t buffer_size);
 
+  // Returns how long to wait before reading the next chunk after |bytes|
+  // bytes were read, to keep the system pressure under the target.
+  base::TimeDelta ReadDelay(uint64_t bytes);
+
+  // Accounts the resources used from now on to the phase |name|.
+  void BeginPhase(const std::string& name);
+
   // Return true if we need to write verity bytes.
   bool ShouldWriteVerity();
   // Starts the hashing of the current partition. If there aren't any partitions
@@ -120,6 +147,32 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // true if TerminateProcessing() was called.
   void Cleanup(ErrorCode code);
 
+  // Loads the checkpoint of a previous run verifying the same partitions, if
+  // any, to resume from it.
+  void LoadCheckpoint();
+
+  // Saves the partition being hashed, its size and identity, how much of it
+  // was hashed and the hash context so far, with the hash of the last
+  // |guard_size| bytes read from |guard| to detect changes to the partition
+  // before the verification resumes. Verity data is always written before the
+  // hashing starts, so a checkpoint also means it was written for that
+  // partition.
+  void WriteCheckpoint(const void* guard, size_t guard_size);
+
+  // Restores the hash context of the checkpoint if it's of the same partition,
+  // size and verity layout, and checks that the guard bytes read last before
+  // its offset still match it. Only the guard, at most |buffer_size| bytes, is
+  // read again, so a change to the partition before the guard isn't detected
+  // by the resumed verification.
+  // Returns false if hashing the partition needs to start over.
+  bool ResumeFromCheckpoint(void* buffer, size_t buffer_size);
+
+  void ClearCheckpoint();
+
+  // Returns the identity of the partition at |partition_index_| saved in the
+  // checkpoint, see PartitionId().
+  std::string CheckpointPartitionId() const;
+
   // Invoke delegate callback to report progress, if delegate is not null
   void UpdateProgress(double progress);
 
@@ -169,6 +222,29 @@ class FilesystemVerifierAction : public InstallPlanAction {
   // An observer that observes progress updates of this action.
   FilesystemVerifyDelegate* delegate_{};
 
+  PrefsInterface* prefs_{nullptr};
+
+  // How much of the current partition was hashed, and at which offset its last
+  // checkpoint was saved.
+  uint64_t hashed_offset_{0};
+  uint64_t checkpoint_offset_{0};
+  // How many bytes were read last into |buffer_|, right before
+  // |hashed_offset_|.
+  size_t last_read_size_{0};
+
+  // The offset, hash context and guard of the checkpoint the partition at
+  // |partition_index_| resumes from, if any.
+  std::optional<uint64_t> resume_offset_;
+  std::string resume_context_;
+  std::string resume_guard_hash_;
+  uint64_t resume_guard_size_{0};
+  // The size and identity of the partition the checkpoint was saved for.
+  uint64_t resume_partition_size_{0};
+  std::string resume_partition_id_;
+
+  PressureThrottler* pressure_throttler_{nullptr};
+  ResourceAccountant* resource_accountant_{nullptr};
+
   // Callback that should be cancelled on |TerminateProcessing|. Usually this
   // points to pending read callbacks from async stream.
   ScopedTaskId pending_task_id_;
@@ -32,7 +32,9 @@
 #include <libsnapshot/cow_writer.h>
 #include <sys/stat.h>
 
+#include "update_engine/common/constants.h"
 #include "update_engine/common/dynamic_partition_control_stub.h"
+#include "update_engine/common/fake_prefs.h"
 #include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/mock_dynamic_partition_control.h"
 #include "update_engine/common/test_utils.h"
@@ -103,6 +105,21 @@ class FilesystemVerifierActionTest : public ::testing::Test {
 
   void DoTestVABC(bool clear_target_hash, bool enable_verity);
 
+  // Starts verifying |install_plan_| and stops after |num_reads| more reads,
+  // returning the offset of the checkpoint saved.
+  int64_t InterruptVerification(int num_reads);
+
+  // Stops |processor| once |num_reads| more reads were posted before this.
+  static void StopAfterReads(ActionProcessor* processor, int num_reads) {
+    if (num_reads == 0) {
+      processor->StopProcessing();
+      return;
+    }
+    MessageLoop::current()->PostTask(
+        FROM_HERE,
+        base::BindOnce(&StopAfterReads, processor, num_reads - 1));
+  }
+
   // Returns true iff test has completed successfully.
   bool DoTest(bool terminate_early, bool hash_fail);
 
@@ -192,6 +209,7 @@ class FilesystemVerifierActionTest : public ::testing::Test {
   brillo::FakeMessageLoop loop_{nullptr};
   ActionProcessor processor_;
   DynamicPartitionControlStub dynamic_control_stub_;
+  FakePrefs prefs_;
   std::vector<unsigned char> fec_data_;
   std::vector<unsigned char> hash_tree_data_;
   static ScopedTempFile source_part_;
@@ -352,6 +370,7 @@ void FilesystemVerifierActionTest::BuildActions(
       std::make_unique<ObjectCollectorAction<InstallPlan>>();
 
   feeder_action->set_obj(install_plan);
+  verifier_action->set_prefs(&prefs_);
 
   BondActions(feeder_action.get(), verifier_action.get());
   BondActions(verifier_action.get(), collector_action.get());
@@ -366,6 +385,24 @@ void FilesystemVerifierActionTest::BuildActions(
   BuildActions(install_plan, &dynamic_control_stub_);
 }
 
+int64_t FilesystemVerifierActionTest::InterruptVerification(int num_reads) {
+  BuildActions(install_plan_);
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.PostTask(FROM_HERE,
+                 base::BindOnce(&StopAfterReads, &processor_, num_reads));
+  loop_.Run();
+  EXPECT_FALSE(delegate.ran());
+  while (loop_.RunOnce(false)) {
+  }
+  int64_t offset = -1;
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsVerifierCheckpointOffset, &offset));
+  return offset;
+}
+
 class FilesystemVerifierActionTest2Delegate : public ActionProcessorDelegate {
  public:
   void ActionCompleted(ActionProcessor* processor,
@@ -436,6 +473,87 @@ TEST_F(FilesystemVerifierActionTest, RunAsRootTerminateEarlyTest) {
   }
 }
 
+TEST_F(FilesystemVerifierActionTest, ResumeFromCheckpointTest) {
+  AddFakePartition(&install_plan_);
+  // The checkpoint is past the last read, which is checked again on resume.
+  const int64_t offset = InterruptVerification(4);
+  EXPECT_GT(offset, 128 * 1024);
+  EXPECT_LT(offset, static_cast<int64_t>(PARTITION_SIZE));
+  int64_t guard_size = 0;
+  EXPECT_TRUE(prefs_.GetInt64(kPrefsVerifierCheckpointGuardSize, &guard_size));
+  EXPECT_EQ(128 * 1024, guard_size);
+
+  // The first block isn't read again, so changing it goes unnoticed.
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(fd->Open(target_part_.path().c_str(), O_RDWR));
+  ZeroRange(fd, 0, 1);
+  fd->Close();
+
+  BuildActions(install_plan_);
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kSuccess, delegate.code());
+  EXPECT_FALSE(prefs_.Exists(kPrefsVerifierCheckpointOffset));
+}
+
+TEST_F(FilesystemVerifierActionTest, CheckpointGuardTest) {
+  AddFakePartition(&install_plan_);
+  const int64_t offset = InterruptVerification(4);
+  ASSERT_GT(offset, 0);
+
+  // The block right before the checkpoint changed, so the whole partition is
+  // hashed again.
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(fd->Open(target_part_.path().c_str(), O_RDWR));
+  ZeroRange(fd, offset / BLOCK_SIZE - 1, 1);
+  fd->Close();
+
+  BuildActions(install_plan_);
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
+TEST_F(FilesystemVerifierActionTest, CheckpointOfOtherPartitionTest) {
+  AddFakePartition(&install_plan_);
+  ASSERT_GT(InterruptVerification(4), 0);
+  string partition_id;
+  EXPECT_TRUE(
+      prefs_.GetString(kPrefsVerifierCheckpointPartitionId, &partition_id));
+  int64_t partition_size = 0;
+  EXPECT_TRUE(
+      prefs_.GetInt64(kPrefsVerifierCheckpointPartitionSize, &partition_size));
+  EXPECT_EQ(static_cast<int64_t>(PARTITION_SIZE), partition_size);
+
+  // The checkpoint was saved for another partition, so it isn't resumed from
+  // and the change to the first block is found.
+  ASSERT_TRUE(prefs_.SetString(kPrefsVerifierCheckpointPartitionId, "other"));
+  auto fd = std::make_shared<EintrSafeFileDescriptor>();
+  ASSERT_TRUE(fd->Open(target_part_.path().c_str(), O_RDWR));
+  ZeroRange(fd, 0, 1);
+  fd->Close();
+
+  BuildActions(install_plan_);
+  FilesystemVerifierActionTestDelegate delegate;
+  processor_.set_delegate(&delegate);
+  loop_.PostTask(FROM_HERE,
+                 base::Bind(&ActionProcessor::StartProcessing,
+                            base::Unretained(&processor_)));
+  loop_.Run();
+  EXPECT_TRUE(delegate.ran());
+  EXPECT_EQ(ErrorCode::kNewRootfsVerificationError, delegate.code());
+}
+
 #ifdef __ANDROID__
 TEST_F(FilesystemVerifierActionTest, RunAsRootWriteVerityTest) {
   ScopedTempFile part_file("part_file.XXXXXX");
@@ -579,9 +697,9 @@ void FilesystemVerifierActionTest::DoTestVABC(bool clear_target_hash,
   }
 
   if (enable_verity) {
-    ON_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _))
+    ON_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _, _))
         .WillByDefault(open_cow);
-    EXPECT_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _))
+    EXPECT_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _, _))
         .Times(AtLeast(1));
 
     // fs verification isn't supposed to write to |readonly_target_path|. All
@@ -593,7 +711,7 @@ void FilesystemVerifierActionTest::DoTestVABC(bool clear_target_hash,
   } else {
     // Since we are not writing verity, we should not attempt to OpenCowFd()
     // reads should go through regular file descriptors on mapped partitions.
-    EXPECT_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _))
+    EXPECT_CALL(dynamic_control, OpenCowFd(part.name, {part.source_path}, _, _))
         .Times(0);
     EXPECT_CALL(dynamic_control, MapAllPartitions()).Times(AtLeast(1));
   }
@@ -0,0 +1,233 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/incremental_hash_tree.h"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <utility>
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+IncrementalHashTree::IncrementalHashTree(uint32_t block_size, const EVP_MD* md)
+    : block_size_(block_size), md_(md), hash_size_(EVP_MD_size(md)) {}
+
+uint64_t IncrementalHashTree::LevelBlocks(uint64_t data_size,
+                                          size_t level) const {
+  const uint64_t hashes_per_block = block_size_ / hash_size_;
+  uint64_t blocks = utils::DivRoundUp(data_size, block_size_);
+  for (size_t i = 0; i <= level; i++) {
+    blocks = utils::DivRoundUp(blocks, hashes_per_block);
+  }
+  return blocks;
+}
+
+uint64_t IncrementalHashTree::CalculateSize(uint64_t data_size) const {
+  uint64_t size = 0;
+  uint64_t level_blocks;
+  size_t level = 0;
+  do {
+    level_blocks = LevelBlocks(data_size, level++);
+    size += level_blocks * block_size_;
+  } while (level_blocks > 1);
+  return size;
+}
+
+bool IncrementalHashTree::HashBlock(const uint8_t* block, uint8_t* out) const {
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(
+      EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  TEST_AND_RETURN_FALSE(ctx != nullptr);
+  TEST_AND_RETURN_FALSE(EVP_DigestInit_ex(ctx.get(), md_, nullptr) == 1);
+  TEST_AND_RETURN_FALSE(
+      EVP_DigestUpdate(ctx.get(), salt_.data(), salt_.size()) == 1);
+  TEST_AND_RETURN_FALSE(EVP_DigestUpdate(ctx.get(), block, block_size_) == 1);
+  unsigned int size = 0;
+  TEST_AND_RETURN_FALSE(EVP_DigestFinal_ex(ctx.get(), out, &size) == 1);
+  TEST_AND_RETURN_FALSE(size == hash_size_);
+  return true;
+}
+
+bool IncrementalHashTree::Initialize(uint64_t data_size,
+                                     const brillo::Blob& salt,
+                                     FileDescriptor* source_fd,
+                                     uint64_t source_hash_tree_offset,
+                                     const vector<Extent>& unchanged_extents) {
+  TEST_AND_RETURN_FALSE(data_size % block_size_ == 0);
+  TEST_AND_RETURN_FALSE(hash_size_ * 2 < block_size_);
+  data_size_ = data_size;
+  salt_ = salt;
+  source_fd_ = source_fd;
+  source_hash_tree_offset_ = source_hash_tree_offset;
+
+  levels_.clear();
+  uint64_t level_blocks;
+  do {
+    level_blocks = LevelBlocks(data_size_, levels_.size());
+    levels_.emplace_back(level_blocks * block_size_);
+  } while (level_blocks > 1);
+
+  const uint64_t num_blocks = data_size_ / block_size_;
+  unchanged_.assign(num_blocks, false);
+  uint64_t num_unchanged = 0;
+  for (const Extent& extent : unchanged_extents) {
+    const uint64_t end =
+        std::min(extent.start_block() + extent.num_blocks(), num_blocks);
+    for (uint64_t block = extent.start_block(); block < end; block++) {
+      num_unchanged += unchanged_[block] ? 0 : 1;
+      unchanged_[block] = true;
+    }
+  }
+
+  next_block_ = 0;
+  partial_block_.clear();
+  hashed_blocks_ = 0;
+  reused_blocks_ = 0;
+  source_checked_ = false;
+  reuse_ = source_fd_ != nullptr && num_unchanged > 0;
+  if (reuse_) {
+    // The hashes of the data blocks that changed are overwritten in Update().
+    TEST_AND_RETURN_FALSE(ReadSourceLevel(0, num_blocks));
+    LOG(INFO) << "Reusing the source hash tree for " << num_unchanged
+              << " of " << num_blocks << " data blocks.";
+  }
+  return true;
+}
+
+bool IncrementalHashTree::ReadSourceLevel(size_t level, uint64_t num_hashes) {
+  // The levels are stored from the top one to the data hashes.
+  uint64_t offset = source_hash_tree_offset_;
+  for (size_t i = level + 1; i < levels_.size(); i++) {
+    offset += levels_[i].size();
+  }
+  brillo::Blob& hashes = levels_[level];
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(
+      source_fd_, hashes.data(), hashes.size(), offset, &bytes_read));
+  if (static_cast<size_t>(bytes_read) != hashes.size()) {
+    LOG(ERROR) << "Failed to read level " << level
+               << " of the source hash tree at offset " << offset;
+    return false;
+  }
+  std::fill(hashes.begin() + num_hashes * hash_size_, hashes.end(), 0);
+  return true;
+}
+
+bool IncrementalHashTree::AddDataBlock(const uint8_t* block) {
+  uint8_t* hash = levels_[0].data() + next_block_ * hash_size_;
+  const bool unchanged = reuse_ && unchanged_[next_block_];
+  next_block_++;
+  if (unchanged && source_checked_) {
+    reused_blocks_++;
+    return true;
+  }
+
+  brillo::Blob block_hash(hash_size_);
+  TEST_AND_RETURN_FALSE(HashBlock(block, block_hash.data()));
+  hashed_blocks_++;
+  if (unchanged) {
+    // Check that the source hash tree was built the same way, once.
+    source_checked_ = true;
+    if (memcmp(block_hash.data(), hash, hash_size_) != 0) {
+      LOG(WARNING) << "The source hash tree doesn't match data block "
+                   << next_block_ - 1 << ", computing the whole hash tree.";
+      reuse_ = false;
+    }
+  }
+  std::copy(block_hash.begin(), block_hash.end(), hash);
+  return true;
+}
+
+bool IncrementalHashTree::Update(const uint8_t* data, size_t size) {
+  if (next_block_ * block_size_ + partial_block_.size() + size > data_size_) {
+    LOG(ERROR) << "Hashing more than " << data_size_ << " bytes of data.";
+    return false;
+  }
+  if (!partial_block_.empty()) {
+    const size_t copied =
+        std::min<size_t>(size, block_size_ - partial_block_.size());
+    partial_block_.insert(partial_block_.end(), data, data + copied);
+    data += copied;
+    size -= copied;
+    if (partial_block_.size() == block_size_) {
+      TEST_AND_RETURN_FALSE(AddDataBlock(partial_block_.data()));
+      partial_block_.clear();
+    }
+  }
+  for (; size >= block_size_; data += block_size_, size -= block_size_) {
+    TEST_AND_RETURN_FALSE(AddDataBlock(data));
+  }
+  partial_block_.insert(partial_block_.end(), data, data + size);
+  return true;
+}
+
+bool IncrementalHashTree::BuildHashTree() {
+  if (next_block_ * block_size_ != data_size_) {
+    LOG(ERROR) << "Only " << next_block_ * block_size_ + partial_block_.size()
+               << " of " << data_size_ << " bytes of data were hashed.";
+    return false;
+  }
+
+  // Whether each hash of the current level may differ from the source one.
+  // A node is copied from the source if none of the hashes it covers changed.
+  const uint64_t hashes_per_block = block_size_ / hash_size_;
+  vector<bool> changed(unchanged_.size());
+  for (size_t i = 0; i < unchanged_.size(); i++) {
+    changed[i] = !reuse_ || !unchanged_[i];
+  }
+  uint64_t computed_nodes = 0;
+  for (size_t level = 0; level + 1 < levels_.size(); level++) {
+    const uint64_t num_hashes = levels_[level].size() / block_size_;
+    vector<bool> next_changed(num_hashes, !reuse_);
+    if (reuse_) {
+      for (size_t i = 0; i < changed.size(); i++) {
+        if (changed[i])
+          next_changed[i / hashes_per_block] = true;
+      }
+      TEST_AND_RETURN_FALSE(ReadSourceLevel(level + 1, num_hashes));
+    }
+    for (uint64_t i = 0; i < num_hashes; i++) {
+      if (!next_changed[i])
+        continue;
+      TEST_AND_RETURN_FALSE(
+          HashBlock(levels_[level].data() + i * block_size_,
+                    levels_[level + 1].data() + i * hash_size_));
+      computed_nodes++;
+    }
+    changed = std::move(next_changed);
+  }
+  LOG(INFO) << "Hashed " << hashed_blocks_ << " data blocks and "
+            << computed_nodes << " hash tree blocks, copied the hashes of "
+            << reused_blocks_ << " data blocks from the source hash tree.";
+  return true;
+}
+
+bool IncrementalHashTree::WriteHashTree(
+    const std::function<bool(const void*, size_t)>& callback) const {
+  for (size_t i = levels_.size(); i > 0; i--) {
+    const brillo::Blob& level = levels_[i - 1];
+    TEST_AND_RETURN_FALSE(callback(level.data(), level.size()));
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
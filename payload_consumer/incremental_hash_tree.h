@@ -0,0 +1,121 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_CONSUMER_INCREMENTAL_HASH_TREE_H_
+#define UPDATE_ENGINE_PAYLOAD_CONSUMER_INCREMENTAL_HASH_TREE_H_
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <android-base/macros.h>
+#include <brillo/secure_blob.h>
+#include <openssl/evp.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Builds a dm-verity hash tree with the same layout as HashTreeBuilder, but
+// copies the nodes covering data blocks that are unchanged from the hash tree
+// of the source partition instead of computing them. Only the data blocks that
+// changed are hashed, and only the nodes above them are computed again.
+class IncrementalHashTree {
+ public:
+  IncrementalHashTree(uint32_t block_size, const EVP_MD* md);
+
+  // Returns the size of the hash tree of |data_size| bytes of data.
+  uint64_t CalculateSize(uint64_t data_size) const;
+
+  // Prepares to hash |data_size| bytes of data with |salt|. The data blocks
+  // in |unchanged_extents| are the same as in the source partition, whose
+  // hash tree is at |source_hash_tree_offset| in |source_fd|. Without a
+  // |source_fd|, every block is hashed.
+  bool Initialize(uint64_t data_size,
+                  const brillo::Blob& salt,
+                  FileDescriptor* source_fd,
+                  uint64_t source_hash_tree_offset,
+                  const std::vector<Extent>& unchanged_extents);
+
+  // Hashes the next |size| bytes of data, skipping the unchanged blocks. The
+  // first unchanged block is hashed anyway and checked against the source
+  // hash tree; if they differ, for example because the source was built with
+  // another salt, the source hash tree isn't used at all.
+  bool Update(const uint8_t* data, size_t size);
+
+  // Computes the levels of the hash tree above the data hashes, once all the
+  // data was passed to Update().
+  bool BuildHashTree();
+
+  // Writes the hash tree with |callback|, from the top level to the data
+  // hashes, as HashTreeBuilder::WriteHashTree() does.
+  bool WriteHashTree(
+      const std::function<bool(const void*, size_t)>& callback) const;
+
+  // The number of data blocks hashed, and of those whose hash was copied
+  // from the source hash tree.
+  uint64_t hashed_blocks() const { return hashed_blocks_; }
+  uint64_t reused_blocks() const { return reused_blocks_; }
+
+ private:
+  // Returns the number of blocks of the |level|th level of the hash tree of
+  // |data_size| bytes, level 0 being the hashes of the data blocks.
+  uint64_t LevelBlocks(uint64_t data_size, size_t level) const;
+
+  // Stores the salted hash of the |block_size_| bytes in |block| to |out|.
+  bool HashBlock(const uint8_t* block, uint8_t* out) const;
+
+  // Reads the |level|th level of the source hash tree into |levels_|, keeping
+  // only the first |num_hashes| hashes.
+  bool ReadSourceLevel(size_t level, uint64_t num_hashes);
+
+  // Hashes one data block, or copies its hash if it's unchanged.
+  bool AddDataBlock(const uint8_t* block);
+
+  const uint32_t block_size_;
+  const EVP_MD* md_;
+  const size_t hash_size_;
+
+  uint64_t data_size_{0};
+  brillo::Blob salt_;
+  FileDescriptor* source_fd_{nullptr};
+  uint64_t source_hash_tree_offset_{0};
+
+  // Whether the nodes of the source hash tree are used. This is cleared if
+  // the first unchanged block doesn't have the same hash as in the source.
+  bool reuse_{false};
+  bool source_checked_{false};
+  // Whether each data block is the same as in the source partition.
+  std::vector<bool> unchanged_;
+
+  // The levels of the hash tree, level 0 being the hashes of the data blocks,
+  // each padded with zeros to a multiple of |block_size_|.
+  std::vector<brillo::Blob> levels_;
+
+  // The index of the next data block, and the bytes of it received so far.
+  uint64_t next_block_{0};
+  brillo::Blob partial_block_;
+
+  uint64_t hashed_blocks_{0};
+  uint64_t reused_blocks_{0};
+
+  DISALLOW_COPY_AND_ASSIGN(IncrementalHashTree);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_CONSUMER_INCREMENTAL_HASH_TREE_H_
@@ -0,0 +1,155 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_consumer/incremental_hash_tree.h"
+
+#include <fcntl.h>
+
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <verity/hash_tree_builder.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kBlockSize = 4096;
+// More than one block of sha256 hashes, so the hash tree has two levels.
+constexpr uint64_t kNumBlocks = 300;
+
+}  // namespace
+
+class IncrementalHashTreeTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    source_data_.resize(kNumBlocks * kBlockSize);
+    for (size_t i = 0; i < source_data_.size(); i++) {
+      source_data_[i] = (i / kBlockSize * 7 + i) & 0xff;
+    }
+    target_data_ = source_data_;
+    target_data_[5 * kBlockSize] ^= 1;
+    target_data_[200 * kBlockSize + 10] ^= 1;
+  }
+
+  // Builds the hash tree of |data| with |tree|, passing the data in chunks
+  // that aren't aligned to blocks.
+  brillo::Blob BuildTree(IncrementalHashTree* tree, const brillo::Blob& data) {
+    constexpr size_t kChunkSize = 10000;
+    for (size_t offset = 0; offset < data.size(); offset += kChunkSize) {
+      EXPECT_TRUE(tree->Update(
+          data.data() + offset, std::min(kChunkSize, data.size() - offset)));
+    }
+    EXPECT_TRUE(tree->BuildHashTree());
+    brillo::Blob hash_tree;
+    EXPECT_TRUE(tree->WriteHashTree([&hash_tree](auto data, auto size) {
+      auto bytes = static_cast<const uint8_t*>(data);
+      hash_tree.insert(hash_tree.end(), bytes, bytes + size);
+      return true;
+    }));
+    return hash_tree;
+  }
+
+  // Builds the whole hash tree of |data| with |salt|.
+  brillo::Blob FullTree(const brillo::Blob& data, const brillo::Blob& salt) {
+    IncrementalHashTree tree(kBlockSize, md_);
+    EXPECT_TRUE(tree.Initialize(data.size(), salt, nullptr, 0, {}));
+    return BuildTree(&tree, data);
+  }
+
+  // Writes the source partition, with its hash tree built with |salt| right
+  // after the data.
+  void WriteSource(const brillo::Blob& salt) {
+    brillo::Blob source = source_data_;
+    const brillo::Blob hash_tree = FullTree(source_data_, salt);
+    source.insert(source.end(), hash_tree.begin(), hash_tree.end());
+    ASSERT_TRUE(test_utils::WriteFileVector(source_file_.path(), source));
+    ASSERT_TRUE(source_fd_.Open(source_file_.path().c_str(), O_RDONLY));
+  }
+
+  const EVP_MD* md_{HashTreeBuilder::HashFunction("sha256")};
+  const brillo::Blob salt_{1, 2, 3, 4};
+  brillo::Blob source_data_;
+  brillo::Blob target_data_;
+  const vector<Extent> unchanged_extents_{ExtentForRange(0, 5),
+                                          ExtentForRange(6, 194),
+                                          ExtentForRange(201, 99)};
+
+  ScopedTempFile source_file_{"IncrementalHashTreeTest_source.XXXXXX"};
+  EintrSafeFileDescriptor source_fd_;
+};
+
+TEST_F(IncrementalHashTreeTest, MatchesHashTreeBuilderTest) {
+  HashTreeBuilder builder(kBlockSize, md_);
+  ASSERT_TRUE(builder.Initialize(target_data_.size(), salt_));
+  ASSERT_TRUE(builder.Update(target_data_.data(), target_data_.size()));
+  ASSERT_TRUE(builder.BuildHashTree());
+  brillo::Blob expected;
+  ASSERT_TRUE(builder.WriteHashTree([&expected](auto data, auto size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    expected.insert(expected.end(), bytes, bytes + size);
+    return true;
+  }));
+
+  IncrementalHashTree tree(kBlockSize, md_);
+  EXPECT_EQ(builder.CalculateSize(target_data_.size()),
+            tree.CalculateSize(target_data_.size()));
+  EXPECT_EQ(expected, FullTree(target_data_, salt_));
+}
+
+TEST_F(IncrementalHashTreeTest, ReuseSourceHashTreeTest) {
+  WriteSource(salt_);
+  IncrementalHashTree tree(kBlockSize, md_);
+  ASSERT_TRUE(tree.Initialize(target_data_.size(),
+                              salt_,
+                              &source_fd_,
+                              source_data_.size(),
+                              unchanged_extents_));
+  EXPECT_EQ(FullTree(target_data_, salt_), BuildTree(&tree, target_data_));
+  // The two changed blocks, and the first unchanged one to check the source.
+  EXPECT_EQ(3u, tree.hashed_blocks());
+  EXPECT_EQ(kNumBlocks - 3, tree.reused_blocks());
+}
+
+TEST_F(IncrementalHashTreeTest, SourceSaltMismatchTest) {
+  WriteSource({5, 6, 7, 8});
+  IncrementalHashTree tree(kBlockSize, md_);
+  ASSERT_TRUE(tree.Initialize(target_data_.size(),
+                              salt_,
+                              &source_fd_,
+                              source_data_.size(),
+                              unchanged_extents_));
+  EXPECT_EQ(FullTree(target_data_, salt_), BuildTree(&tree, target_data_));
+  EXPECT_EQ(kNumBlocks, tree.hashed_blocks());
+  EXPECT_EQ(0u, tree.reused_blocks());
+}
+
+TEST_F(IncrementalHashTreeTest, TooMuchDataTest) {
+  IncrementalHashTree tree(kBlockSize, md_);
+  ASSERT_TRUE(tree.Initialize(kBlockSize, salt_, nullptr, 0, {}));
+  brillo::Blob data(kBlockSize + 1);
+  EXPECT_FALSE(tree.Update(data.data(), data.size()));
+  EXPECT_FALSE(tree.BuildHashTree());
+}
+
+}  // namespace chromeos_update_engine
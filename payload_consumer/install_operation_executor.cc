@@ -41,6 +41,7 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/xz_extent_writer.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -175,20 +176,34 @@ class PuffinExtentStream : public puffin::StreamInterface {
   DISALLOW_COPY_AND_ASSIGN(PuffinExtentStream);
 };
 
-bool InstallOperationExecutor::ExecuteReplaceOperation(
-    const InstallOperation& operation,
-    std::unique_ptr<ExtentWriter> writer,
-    const void* data) {
-  TEST_AND_RETURN_FALSE(operation.type() == InstallOperation::REPLACE ||
-                        operation.type() == InstallOperation::REPLACE_BZ ||
-                        operation.type() == InstallOperation::REPLACE_XZ);
+std::unique_ptr<ExtentWriter> InstallOperationExecutor::CreateReplaceWriter(
+    const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer) {
+  if (operation.type() != InstallOperation::REPLACE &&
+      operation.type() != InstallOperation::REPLACE_BZ &&
+      operation.type() != InstallOperation::REPLACE_XZ) {
+    LOG(ERROR) << "Not a REPLACE operation: "
+               << InstallOperationTypeName(operation.type());
+    return nullptr;
+  }
   // Setup the ExtentWriter stack based on the operation type.
   if (operation.type() == InstallOperation::REPLACE_BZ) {
     writer.reset(new BzipExtentWriter(std::move(writer)));
   } else if (operation.type() == InstallOperation::REPLACE_XZ) {
     writer.reset(new XzExtentWriter(std::move(writer)));
   }
-  TEST_AND_RETURN_FALSE(writer->Init(operation.dst_extents(), block_size_));
+  if (!writer->Init(operation.dst_extents(), block_size_)) {
+    LOG(ERROR) << "Failed to initialize the extent writer.";
+    return nullptr;
+  }
+  return writer;
+}
+
+bool InstallOperationExecutor::ExecuteReplaceOperation(
+    const InstallOperation& operation,
+    std::unique_ptr<ExtentWriter> writer,
+    const void* data) {
+  writer = CreateReplaceWriter(operation, std::move(writer));
+  TEST_AND_RETURN_FALSE(writer != nullptr);
   TEST_AND_RETURN_FALSE(writer->Write(data, operation.data_length()));
 
   return true;
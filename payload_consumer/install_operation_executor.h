@@ -30,6 +30,12 @@ class InstallOperationExecutor {
   explicit InstallOperationExecutor(size_t block_size)
       : block_size_(block_size) {}
 
+  // Stacks the decompressor of the REPLACE* |operation| on top of |writer| and
+  // initializes it, so the data blob can be written to the returned writer in
+  // as many pieces as needed. Returns nullptr on error.
+  std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation, std::unique_ptr<ExtentWriter> writer);
+
   // data should point to the memory of operation.data_length() bytes
   bool ExecuteReplaceOperation(const InstallOperation& operation,
                                std::unique_ptr<ExtentWriter> writer,
@@ -25,6 +25,7 @@
 #include <android-base/stringprintf.h>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::string;
@@ -182,6 +183,45 @@ bool InstallPlan::Partition::operator==(
           postinstall_optional == that.postinstall_optional);
 }
 
+namespace {
+// Appends the blocks that |operation| copies to the same block numbers to
+// |extents|.
+void AddCopiedInPlaceBlocks(const InstallOperation& operation,
+                            vector<Extent>* extents) {
+  int src = 0, dst = 0;
+  uint64_t src_offset = 0, dst_offset = 0;
+  while (src < operation.src_extents_size() &&
+         dst < operation.dst_extents_size()) {
+    const Extent& src_extent = operation.src_extents(src);
+    const Extent& dst_extent = operation.dst_extents(dst);
+    const uint64_t num_blocks = std::min(src_extent.num_blocks() - src_offset,
+                                         dst_extent.num_blocks() - dst_offset);
+    const uint64_t start_block = dst_extent.start_block() + dst_offset;
+    if (num_blocks > 0 &&
+        src_extent.start_block() + src_offset == start_block) {
+      if (!extents->empty() &&
+          extents->back().start_block() + extents->back().num_blocks() ==
+              start_block) {
+        extents->back().set_num_blocks(extents->back().num_blocks() +
+                                       num_blocks);
+      } else {
+        extents->push_back(ExtentForRange(start_block, num_blocks));
+      }
+    }
+    src_offset += num_blocks;
+    dst_offset += num_blocks;
+    if (src_offset == src_extent.num_blocks()) {
+      src++;
+      src_offset = 0;
+    }
+    if (dst_offset == dst_extent.num_blocks()) {
+      dst++;
+      dst_offset = 0;
+    }
+  }
+}
+}  // namespace
+
 bool InstallPlan::Partition::ParseVerityConfig(
     const PartitionUpdate& partition) {
   if (partition.has_hash_tree_extent()) {
@@ -201,6 +241,14 @@ bool InstallPlan::Partition::ParseVerityConfig(
     hash_tree_algorithm = partition.hash_tree_algorithm();
     hash_tree_salt.assign(partition.hash_tree_salt().begin(),
                           partition.hash_tree_salt().end());
+    hash_tree_unchanged_extents.clear();
+    if (partition.has_old_partition_info()) {
+      for (const InstallOperation& operation : partition.operations()) {
+        if (operation.type() == InstallOperation::SOURCE_COPY) {
+          AddCopiedInPlaceBlocks(operation, &hash_tree_unchanged_extents);
+        }
+      }
+    }
   }
   if (partition.has_fec_extent()) {
     Extent extent = partition.fec_data_extent();
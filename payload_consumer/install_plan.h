@@ -152,6 +152,9 @@ struct InstallPlan {
     uint64_t hash_tree_size{0};
     std::string hash_tree_algorithm;
     brillo::Blob hash_tree_salt;
+    // The blocks SOURCE_COPY'ed from the same blocks of the source partition,
+    // whose hashes can be copied from the source hash tree.
+    std::vector<Extent> hash_tree_unchanged_extents;
 
     uint64_t fec_data_offset{0};
     uint64_t fec_data_size{0};
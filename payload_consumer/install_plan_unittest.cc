@@ -17,6 +17,8 @@
 #include <gtest/gtest.h>
 
 #include "update_engine/payload_consumer/install_plan.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
 
 namespace chromeos_update_engine {
 
@@ -78,4 +80,28 @@ Payload: 0
   already_applied: false)");
 }
 
+TEST(InstallPlanTest, HashTreeUnchangedExtentsTest) {
+  PartitionUpdate update;
+  update.mutable_old_partition_info()->set_size(16 * 4096);
+  *update.mutable_hash_tree_data_extent() = ExtentForRange(0, 12);
+  *update.mutable_hash_tree_extent() = ExtentForRange(12, 1);
+  // Blocks 2-3 and 5 are copied in place, blocks 6-7 are moved.
+  InstallOperation* op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(2, 4);
+  *op->add_dst_extents() = ExtentForRange(2, 2);
+  *op->add_dst_extents() = ExtentForRange(10, 1);
+  *op->add_dst_extents() = ExtentForRange(5, 1);
+  op = update.add_operations();
+  op->set_type(InstallOperation::SOURCE_COPY);
+  *op->add_src_extents() = ExtentForRange(7, 2);
+  *op->add_dst_extents() = ExtentForRange(6, 2);
+
+  InstallPlan::Partition partition;
+  partition.block_size = 4096;
+  ASSERT_TRUE(partition.ParseVerityConfig(update));
+  EXPECT_EQ((std::vector<Extent>{ExtentForRange(2, 2), ExtentForRange(5, 1)}),
+            partition.hash_tree_unchanged_extents);
+}
+
 }  // namespace chromeos_update_engine
@@ -138,6 +138,13 @@ bool PartitionWriter::OpenSourcePartition(uint32_t source_slot,
                  << ", file " << source_path_;
       return false;
     }
+    // The verity parameters of the target partition may differ from the
+    // source ones, the source hash tree is described by its own footer.
+    if (!verified_source_fd_.LoadSourceHashTree(install_part_.source_size)) {
+      LOG(INFO) << "No hash tree found for the source partition "
+                << install_part_.name << ", corrupted source operations will "
+                << "be read from the error corrected device as a whole.";
+    }
   }
   return true;
 }
@@ -186,10 +193,16 @@ bool PartitionWriter::Init(const InstallPlan* install_plan,
 bool PartitionWriter::PerformReplaceOperation(const InstallOperation& operation,
                                               const void* data,
                                               size_t count) {
+  std::unique_ptr<ExtentWriter> writer = CreateReplaceWriter(operation);
+  TEST_AND_RETURN_FALSE(writer != nullptr);
+  return writer->Write(data, operation.data_length());
+}
+
+std::unique_ptr<ExtentWriter> PartitionWriter::CreateReplaceWriter(
+    const InstallOperation& operation) {
   // Setup the ExtentWriter stack based on the operation type.
-  std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
-  return install_op_executor_.ExecuteReplaceOperation(
-      operation, std::move(writer), data);
+  return install_op_executor_.CreateReplaceWriter(operation,
+                                                  CreateBaseExtentWriter());
 }
 
 bool PartitionWriter::PerformZeroOrDiscardOperation(
@@ -75,6 +75,8 @@ class PartitionWriter : public PartitionWriterInterface {
   [[nodiscard]] bool PerformReplaceOperation(const InstallOperation& operation,
                                              const void* data,
                                              size_t count) override;
+  [[nodiscard]] std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation) override;
   [[nodiscard]] bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) override;
 
@@ -93,6 +95,10 @@ class PartitionWriter : public PartitionWriterInterface {
  private:
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDCorrectsBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, LoadSourceHashTreeTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDSkipsVerifiedBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseXorSourceFDTest);
 
   [[nodiscard]] bool OpenSourcePartition(uint32_t source_slot,
                                          bool source_may_exist);
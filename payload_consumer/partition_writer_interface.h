@@ -18,11 +18,13 @@
 #define UPDATE_ENGINE_PARTITION_WRITER_INTERFACE_H_
 
 #include <cstdint>
+#include <memory>
 #include <string>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
 
+#include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/install_plan.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -54,6 +56,11 @@ class PartitionWriterInterface {
   // set even if it fails.
   [[nodiscard]] virtual bool PerformReplaceOperation(
       const InstallOperation& operation, const void* data, size_t count) = 0;
+  // Returns the writer the data blob of the REPLACE* |operation| is written
+  // to, in as many pieces as needed, to apply it without holding the whole
+  // blob. Returns nullptr on error.
+  [[nodiscard]] virtual std::unique_ptr<ExtentWriter> CreateReplaceWriter(
+      const InstallOperation& operation) = 0;
   [[nodiscard]] virtual bool PerformZeroOrDiscardOperation(
       const InstallOperation& operation) = 0;
 
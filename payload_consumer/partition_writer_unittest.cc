@@ -14,11 +14,14 @@
 // limitations under the License.
 //
 
+#include <cstring>
 #include <memory>
 #include <vector>
 
 #include <brillo/secure_blob.h>
 #include <gtest/gtest.h>
+#include <libavb/libavb.h>
+#include <verity/hash_tree_builder.h>
 
 #include "update_engine/common/dynamic_partition_control_stub.h"
 #include "update_engine/common/error_code.h"
@@ -212,4 +215,234 @@ TEST_F(PartitionWriterTest, ChooseSourceFDTest) {
   ASSERT_EQ(1U, GetSourceEccRecoveredFailures());
 }
 
+TEST_F(PartitionWriterTest, ChooseSourceFDCorrectsBlocksTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kSourceSize);
+  const brillo::Blob salt = {1, 2, 3, 4};
+  HashTreeBuilder builder(4096, HashTreeBuilder::HashFunction("sha256"));
+  ASSERT_TRUE(builder.Initialize(kSourceSize, salt));
+  ASSERT_TRUE(builder.Update(expected_data.data(), expected_data.size()));
+  ASSERT_TRUE(builder.BuildHashTree());
+  brillo::Blob hash_tree;
+  ASSERT_TRUE(builder.WriteHashTree([&hash_tree](auto data, auto size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    hash_tree.insert(hash_tree.end(), bytes, bytes + size);
+    return true;
+  }));
+
+  // Corrupt the third block of the source, followed by its hash tree.
+  ScopedTempFile source("Source-XXXXXX");
+  brillo::Blob source_data = expected_data;
+  source_data[2 * 4096 + 10] ^= 0xff;
+  source_data.insert(source_data.end(), hash_tree.begin(), hash_tree.end());
+  ASSERT_TRUE(test_utils::WriteFileVector(source.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source.path().c_str(), O_RDONLY);
+  verified_source_fd.SetSourceHashTree(
+      kSourceSize, kSourceSize, "sha256", salt);
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kSourceSize);
+
+  InstallOperation op;
+  *(op.add_src_extents()) = ExtentForRange(0, kSourceSize / 4096);
+  brillo::Blob src_hash;
+  ASSERT_TRUE(HashCalculator::RawHashOfData(expected_data, &src_hash));
+  op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+
+  ErrorCode error = ErrorCode::kSuccess;
+  FileDescriptorPtr fd = writer_.ChooseSourceFD(op, &error);
+  ASSERT_NE(fd, nullptr);
+  ASSERT_EQ(ErrorCode::kSuccess, error);
+  // Only the corrupted block was read from the error corrected device.
+  ASSERT_EQ(1U, fake_fec->GetReadOps().size());
+  EXPECT_EQ(2U * 4096, fake_fec->GetReadOps()[0].first);
+  EXPECT_EQ(1U, verified_source_fd.source_ecc_corrected_blocks());
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadExtents(fd, op.src_extents(), &data, 4096));
+  EXPECT_EQ(expected_data, data);
+
+  // The corrected block is reused by the following operations, even if it
+  // couldn't be written back to the source partition.
+  ASSERT_TRUE(test_utils::WriteFileVector(source.path(), source_data));
+  InstallOperation block_op;
+  *(block_op.add_src_extents()) = ExtentForRange(2, 1);
+  ASSERT_TRUE(HashCalculator::RawHashOfData(
+      brillo::Blob(expected_data.begin() + 2 * 4096,
+                   expected_data.begin() + 3 * 4096),
+      &src_hash));
+  block_op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+  ASSERT_NE(writer_.ChooseSourceFD(block_op, &error), nullptr);
+  ASSERT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(1U, fake_fec->GetReadOps().size());
+  EXPECT_EQ(2U, GetSourceEccRecoveredFailures());
+}
+
+TEST_F(PartitionWriterTest, ChooseXorSourceFDTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob expected_data = FakeFileDescriptorData(kSourceSize);
+  const brillo::Blob salt = {1, 2, 3, 4};
+  HashTreeBuilder builder(4096, HashTreeBuilder::HashFunction("sha256"));
+  ASSERT_TRUE(builder.Initialize(kSourceSize, salt));
+  ASSERT_TRUE(builder.Update(expected_data.data(), expected_data.size()));
+  ASSERT_TRUE(builder.BuildHashTree());
+  brillo::Blob hash_tree;
+  ASSERT_TRUE(builder.WriteHashTree([&hash_tree](auto data, auto size) {
+    auto bytes = static_cast<const uint8_t*>(data);
+    hash_tree.insert(hash_tree.end(), bytes, bytes + size);
+    return true;
+  }));
+
+  // Corrupt the third block of the source partition, followed by its hash
+  // tree.
+  brillo::Blob source_data = expected_data;
+  source_data[2 * 4096 + 10] ^= 0xff;
+  source_data.insert(source_data.end(), hash_tree.begin(), hash_tree.end());
+  ASSERT_TRUE(
+      test_utils::WriteFileVector(source_partition.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source_partition.path().c_str(),
+                                      O_RDONLY);
+  google::protobuf::RepeatedPtrField<Extent> extents;
+  *extents.Add() = ExtentForRange(1, 2);
+
+  // Without the hash tree, the blocks are read as they are.
+  EXPECT_EQ(verified_source_fd.source_fd_,
+            verified_source_fd.ChooseXorSourceFD(extents));
+
+  // With it, the corrupted block is corrected and written back to the source
+  // partition, which the merge reads.
+  verified_source_fd.SetSourceHashTree(
+      kSourceSize, kSourceSize, "sha256", salt);
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kSourceSize);
+  EXPECT_EQ(verified_source_fd.source_fd_,
+            verified_source_fd.ChooseXorSourceFD(extents));
+  ASSERT_EQ(1U, fake_fec->GetReadOps().size());
+  EXPECT_EQ(2U * 4096, fake_fec->GetReadOps()[0].first);
+  brillo::Blob data;
+  ASSERT_TRUE(utils::ReadExtents(
+      verified_source_fd.source_fd_, extents, &data, 4096));
+  EXPECT_EQ(brillo::Blob(expected_data.begin() + 4096,
+                         expected_data.begin() + 3 * 4096),
+            data);
+}
+
+TEST_F(PartitionWriterTest, LoadSourceHashTreeTest) {
+  constexpr size_t kDataSize = 4 * 4096;
+  constexpr size_t kPartitionSize = kDataSize + 3 * 4096;
+  const brillo::Blob salt = {5, 6, 7, 8};
+  const std::string kPartitionName = "system";
+
+  // The hashtree descriptor of a tree right after the data, followed by the
+  // name of the partition and the salt.
+  AvbHashtreeDescriptor hashtree{};
+  const size_t descriptor_size =
+      utils::DivRoundUp(
+          sizeof(hashtree) + kPartitionName.size() + salt.size(), 8) *
+      8;
+  hashtree.parent_descriptor.tag = avb_htobe64(AVB_DESCRIPTOR_TAG_HASHTREE);
+  hashtree.parent_descriptor.num_bytes_following =
+      avb_htobe64(descriptor_size - sizeof(AvbDescriptor));
+  hashtree.dm_verity_version = avb_htobe32(1);
+  hashtree.image_size = avb_htobe64(kDataSize);
+  hashtree.tree_offset = avb_htobe64(kDataSize);
+  hashtree.tree_size = avb_htobe64(4096);
+  hashtree.data_block_size = avb_htobe32(4096);
+  hashtree.hash_block_size = avb_htobe32(4096);
+  memcpy(hashtree.hash_algorithm, "sha256", 6);
+  hashtree.partition_name_len = avb_htobe32(kPartitionName.size());
+  hashtree.salt_len = avb_htobe32(salt.size());
+
+  // The vbmeta, with no authentication data, in the block after the tree.
+  AvbVBMetaImageHeader header{};
+  memcpy(header.magic, AVB_MAGIC, AVB_MAGIC_LEN);
+  header.auxiliary_data_block_size = avb_htobe64(descriptor_size);
+  header.descriptors_size = avb_htobe64(descriptor_size);
+  brillo::Blob vbmeta(sizeof(header) + descriptor_size);
+  memcpy(vbmeta.data(), &header, sizeof(header));
+  memcpy(vbmeta.data() + sizeof(header), &hashtree, sizeof(hashtree));
+  memcpy(vbmeta.data() + sizeof(header) + sizeof(hashtree),
+         kPartitionName.data(),
+         kPartitionName.size());
+  memcpy(vbmeta.data() + sizeof(header) + sizeof(hashtree) +
+             kPartitionName.size(),
+         salt.data(),
+         salt.size());
+
+  AvbFooter footer{};
+  memcpy(footer.magic, AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN);
+  footer.version_major = avb_htobe32(AVB_FOOTER_VERSION_MAJOR);
+  footer.original_image_size = avb_htobe64(kDataSize);
+  footer.vbmeta_offset = avb_htobe64(kDataSize + 4096);
+  footer.vbmeta_size = avb_htobe64(vbmeta.size());
+
+  brillo::Blob source_data(kPartitionSize);
+  memcpy(source_data.data() + kDataSize + 4096, vbmeta.data(), vbmeta.size());
+  memcpy(source_data.data() + kPartitionSize - sizeof(footer),
+         &footer,
+         sizeof(footer));
+  ScopedTempFile source("Source-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(source.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source.path().c_str(), O_RDONLY);
+
+  // The parameters come from the source partition itself.
+  ASSERT_TRUE(verified_source_fd.LoadSourceHashTree(kPartitionSize));
+  EXPECT_NE(nullptr, verified_source_fd.hash_function_);
+  EXPECT_EQ(kDataSize, verified_source_fd.hash_tree_data_size_);
+  EXPECT_EQ(kDataSize, verified_source_fd.hash_tree_offset_);
+  EXPECT_EQ(salt, verified_source_fd.hash_tree_salt_);
+
+  // Without an AVB footer, there is no source hash tree.
+  EXPECT_FALSE(verified_source_fd.LoadSourceHashTree(kDataSize));
+}
+
+TEST_F(PartitionWriterTest, ChooseSourceFDSkipsVerifiedBlocksTest) {
+  constexpr size_t kSourceSize = 4 * 4096;
+  brillo::Blob source_data = FakeFileDescriptorData(kSourceSize);
+  ScopedTempFile source("Source-XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(source.path(), source_data));
+  auto& verified_source_fd = writer_.verified_source_fd_;
+  verified_source_fd.source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  verified_source_fd.source_fd_->Open(source.path().c_str(), O_RDONLY);
+
+  auto source_op = [&source_data](uint64_t start_block, uint64_t num_blocks) {
+    InstallOperation op;
+    *(op.add_src_extents()) = ExtentForRange(start_block, num_blocks);
+    brillo::Blob src_hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfData(
+        brillo::Blob(source_data.begin() + start_block * 4096,
+                     source_data.begin() + (start_block + num_blocks) * 4096),
+        &src_hash));
+    op.set_src_sha256_hash(src_hash.data(), src_hash.size());
+    return op;
+  };
+  ErrorCode error = ErrorCode::kSuccess;
+  ASSERT_EQ(writer_.ChooseSourceFD(source_op(0, 2), &error),
+            verified_source_fd.source_fd_);
+  ASSERT_EQ(ErrorCode::kSuccess, error);
+
+  // Corrupt the source to tell which operations are verified again.
+  brillo::Blob corrupted_data = source_data;
+  for (size_t i = 0; i < corrupted_data.size(); i += 4096)
+    corrupted_data[i] ^= 0xff;
+  ASSERT_TRUE(test_utils::WriteFileVector(source.path(), corrupted_data));
+
+  // The source blocks all verified by the first operation aren't read again.
+  ASSERT_EQ(writer_.ChooseSourceFD(source_op(1, 1), &error),
+            verified_source_fd.source_fd_);
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(4096U, verified_source_fd.skipped_verification_bytes());
+
+  // Operations with blocks not verified yet are, and fall back to the error
+  // corrected device.
+  FakeFileDescriptor* fake_fec = SetFakeECCFile(kSourceSize);
+  EXPECT_NE(writer_.ChooseSourceFD(source_op(1, 2), &error), nullptr);
+  EXPECT_EQ(ErrorCode::kSuccess, error);
+  EXPECT_EQ(1U, fake_fec->GetReadOps().size());
+  EXPECT_EQ(1U, GetSourceEccRecoveredFailures());
+  EXPECT_EQ(4096U, verified_source_fd.skipped_verification_bytes());
+}
+
 }  // namespace chromeos_update_engine
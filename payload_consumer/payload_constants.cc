@@ -37,7 +37,8 @@ const uint32_t kPartialUpdateMinorPayloadVersion = 7;
 const uint32_t kZucchiniMinorPayloadVersion = 8;
 
 const uint32_t kMinSupportedMinorPayloadVersion = kSourceMinorPayloadVersion;
-const uint32_t kMaxSupportedMinorPayloadVersion = kLZ4DIFFMinorPayloadVersion;
+const uint32_t kMaxSupportedMinorPayloadVersion =
+    kReplaceXorMinorPayloadVersion;
 
 const uint64_t kMaxPayloadHeaderSize = 24;
 
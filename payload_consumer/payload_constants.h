@@ -65,6 +65,22 @@ extern const uint32_t kZucchiniMinorPayloadVersion;
 // THe minor version that allows LZ4DIFF operation
 constexpr uint32_t kLZ4DIFFMinorPayloadVersion = 9;
 
+// The minor version that allows several operations to use the same data blob.
+constexpr uint32_t kBlobReuseMinorPayloadVersion = 10;
+
+// The minor version that allows the blocks written by full operations to have
+// XOR sources in the COW. Older clients write these blocks raw.
+constexpr uint32_t kReplaceXorMinorPayloadVersion = 11;
+
+// The maximum size of the data blobs a client keeps in memory at any time for
+// the operations that use them again, in payloads that reuse blobs.
+constexpr uint64_t kMaxReusedBlobsSize = 16 * 1024 * 1024;
+
+// The maximum number of operations after the one downloading a blob that use
+// it again. This bounds how long a client keeps a blob: the data of operations
+// further apart, e.g. in different partitions, is stored again instead.
+constexpr uint64_t kMaxReusedBlobOperations = 1024;
+
 // The minimum and maximum supported minor version.
 extern const uint32_t kMinSupportedMinorPayloadVersion;
 extern const uint32_t kMaxSupportedMinorPayloadVersion;
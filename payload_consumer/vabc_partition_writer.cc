@@ -76,6 +76,34 @@ static ExtentMap<const CowMergeOperation*, ExtentLess> ComputeXorMap(
   return xor_map;
 }
 
+// Compute the source blocks read to XOR the blocks written by |op|. A source
+// at an offset in its first block also reads the block after its last one,
+// unless it's past the |num_source_blocks| of the source partition.
+static RepeatedPtrField<Extent> ComputeXorSourceExtents(
+    const InstallOperation& op,
+    const ExtentMap<const CowMergeOperation*, ExtentLess>& xor_map,
+    uint64_t num_source_blocks) {
+  RepeatedPtrField<Extent> src_extents;
+  for (const auto& extent : op.dst_extents()) {
+    for (const auto& xor_ext : xor_map.GetIntersectingExtents(extent)) {
+      const auto merge_op = xor_map.Get(xor_ext);
+      if (!merge_op.has_value()) {
+        continue;
+      }
+      const uint64_t src_block = merge_op.value()->src_extent().start_block() +
+                                 xor_ext.start_block() -
+                                 merge_op.value()->dst_extent().start_block();
+      uint64_t num_blocks = xor_ext.num_blocks();
+      if (merge_op.value()->src_offset() > 0 &&
+          src_block + num_blocks < num_source_blocks) {
+        num_blocks++;
+      }
+      *src_extents.Add() = ExtentForRange(src_block, num_blocks);
+    }
+  }
+  return src_extents;
+}
+
 VABCPartitionWriter::VABCPartitionWriter(
     const PartitionUpdate& partition_update,
     const InstallPlan::Partition& install_part,
@@ -221,6 +249,13 @@ bool VABCPartitionWriter::Init(const InstallPlan* install_plan,
   if (source_may_exist && install_part_.source_size > 0) {
     TEST_AND_RETURN_FALSE(!install_part_.source_path.empty());
     TEST_AND_RETURN_FALSE(verified_source_fd_.Open());
+    // The verity parameters of the target partition may differ from the
+    // source ones, the source hash tree is described by its own footer.
+    if (!verified_source_fd_.LoadSourceHashTree(install_part_.source_size)) {
+      LOG(INFO) << "No hash tree found for the source partition "
+                << install_part_.name << ", corrupted source operations will "
+                << "be read from the error corrected device as a whole.";
+    }
   }
   std::optional<std::string> source_path;
   if (!install_part_.source_path.empty()) {
@@ -357,10 +392,42 @@ std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateBaseExtentWriter() {
 bool VABCPartitionWriter::PerformReplaceOperation(const InstallOperation& op,
                                                   const void* data,
                                                   size_t count) {
-  // Setup the ExtentWriter stack based on the operation type.
-  std::unique_ptr<ExtentWriter> writer = CreateBaseExtentWriter();
+  std::unique_ptr<ExtentWriter> writer = CreateReplaceWriter(op);
+  TEST_AND_RETURN_FALSE(writer != nullptr);
+  return writer->Write(data, op.data_length());
+}
 
-  return executor_.ExecuteReplaceOperation(op, std::move(writer), data);
+std::unique_ptr<ExtentWriter> VABCPartitionWriter::CreateReplaceWriter(
+    const InstallOperation& op) {
+  // Setup the ExtentWriter stack based on the operation type. From
+  // kReplaceXorMinorPayloadVersion, the generator may give XOR sources to the
+  // blocks of full operations too, their XOR is taken with the source
+  // partition as merging will read it. The merge operations of older payloads
+  // have no XOR sources for these blocks, which are then written raw. These
+  // operations have no source hash, so their XOR sources are checked with the
+  // source hash tree, and the blocks are written raw too if they can't be
+  // corrected.
+  FileDescriptorPtr source_fd = verified_source_fd_.source_fd();
+  if (IsXorEnabled() && source_fd != nullptr && source_fd->IsOpen()) {
+    source_fd = verified_source_fd_.ChooseXorSourceFD(ComputeXorSourceExtents(
+        op,
+        xor_map_,
+        partition_update_.old_partition_info().size() / block_size_));
+    LOG_IF(WARNING, source_fd == nullptr)
+        << "Writing the blocks of an operation without XOR, their XOR sources "
+           "are corrupted.";
+  }
+  std::unique_ptr<ExtentWriter> writer =
+      IsXorEnabled() && source_fd != nullptr && source_fd->IsOpen()
+          ? std::make_unique<XORExtentWriter>(
+                op,
+                source_fd,
+                cow_writer_.get(),
+                xor_map_,
+                partition_update_.old_partition_info().size())
+          : CreateBaseExtentWriter();
+
+  return executor_.CreateReplaceWriter(op, std::move(writer));
 }
 
 bool VABCPartitionWriter::PerformDiffOperation(
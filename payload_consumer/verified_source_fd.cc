@@ -18,11 +18,15 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 
+#include <algorithm>
+#include <cstring>
 #include <memory>
 #include <vector>
 
 #include <base/strings/string_number_conversions.h>
 #include <android-base/stringprintf.h>
+#include <libavb/libavb.h>
+#include <verity/hash_tree_builder.h>
 
 #include "update_engine/common/error_code.h"
 #include "update_engine/common/hash_calculator.h"
@@ -30,7 +34,9 @@
 #include "update_engine/payload_consumer/extent_writer.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/file_descriptor_utils.h"
+#include "update_engine/payload_consumer/incremental_hash_tree.h"
 #include "update_engine/payload_consumer/partition_writer.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/update_metadata.pb.h"
 #if USE_FEC
 #include "update_engine/payload_consumer/fec_file_descriptor.h"
@@ -38,6 +44,353 @@
 
 namespace chromeos_update_engine {
 using std::string;
+using std::vector;
+
+namespace {
+
+// Reads the source partition through |fd|, replacing the blocks that were
+// corrupted with their error corrected data.
+class CorrectedFileDescriptor final : public FileDescriptor {
+ public:
+  CorrectedFileDescriptor(FileDescriptorPtr fd,
+                          const std::map<uint64_t, brillo::Blob>* blocks,
+                          size_t block_size)
+      : fd_(std::move(fd)), blocks_(blocks), block_size_(block_size) {}
+
+  bool Open(const char* path, int flags, mode_t mode) override {
+    return false;
+  }
+  bool Open(const char* path, int flags) override { return false; }
+
+  ssize_t Read(void* buf, size_t count) override {
+    const off64_t offset = fd_->Seek(0, SEEK_CUR);
+    if (offset < 0)
+      return -1;
+    const ssize_t bytes_read = fd_->Read(buf, count);
+    if (bytes_read <= 0)
+      return bytes_read;
+    const uint64_t end = offset + bytes_read;
+    for (auto it = blocks_->lower_bound(offset / block_size_);
+         it != blocks_->end() && it->first * block_size_ < end;
+         it++) {
+      const uint64_t block_start = it->first * block_size_;
+      const uint64_t begin = std::max<uint64_t>(block_start, offset);
+      const uint64_t stop = std::min<uint64_t>(block_start + block_size_, end);
+      memcpy(static_cast<uint8_t*>(buf) + (begin - offset),
+             it->second.data() + (begin - block_start),
+             stop - begin);
+    }
+    return bytes_read;
+  }
+
+  ssize_t Write(const void* buf, size_t count) override {
+    errno = EROFS;
+    return -1;
+  }
+
+  off64_t Seek(off64_t offset, int whence) override {
+    return fd_->Seek(offset, whence);
+  }
+
+  uint64_t BlockDevSize() override { return fd_->BlockDevSize(); }
+
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return false;
+  }
+
+  bool Flush() override { return true; }
+  bool Close() override { return true; }
+  bool IsSettingErrno() override { return fd_->IsSettingErrno(); }
+  bool IsOpen() override { return fd_->IsOpen(); }
+
+ private:
+  FileDescriptorPtr fd_;
+  const std::map<uint64_t, brillo::Blob>* blocks_;
+  const size_t block_size_;
+
+  DISALLOW_COPY_AND_ASSIGN(CorrectedFileDescriptor);
+};
+
+// Stores the hash of |salt| followed by |size| bytes of |data| in |out|.
+bool HashSaltedData(const EVP_MD* md,
+                    const brillo::Blob& salt,
+                    const uint8_t* data,
+                    size_t size,
+                    brillo::Blob* out) {
+  std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)> ctx(
+      EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+  TEST_AND_RETURN_FALSE(ctx != nullptr);
+  TEST_AND_RETURN_FALSE(EVP_DigestInit_ex(ctx.get(), md, nullptr) == 1);
+  TEST_AND_RETURN_FALSE(
+      EVP_DigestUpdate(ctx.get(), salt.data(), salt.size()) == 1);
+  TEST_AND_RETURN_FALSE(EVP_DigestUpdate(ctx.get(), data, size) == 1);
+  out->resize(EVP_MD_size(md));
+  TEST_AND_RETURN_FALSE(EVP_DigestFinal_ex(ctx.get(), out->data(), nullptr) ==
+                        1);
+  return true;
+}
+
+// The dm-verity hash tree of a partition, from the hashtree descriptor of the
+// vbmeta in its AVB footer.
+struct HashTreeDescriptor {
+  bool found{false};
+  uint64_t data_size{0};
+  uint64_t hash_tree_offset{0};
+  uint32_t block_size{0};
+  string algorithm;
+  brillo::Blob salt;
+};
+
+bool AvbHashTreeDescriptorCallback(const AvbDescriptor* descriptor,
+                                   void* user_data) {
+  HashTreeDescriptor* tree = static_cast<HashTreeDescriptor*>(user_data);
+  AvbDescriptor desc;
+  TEST_AND_RETURN_FALSE(
+      avb_descriptor_validate_and_byteswap(descriptor, &desc));
+  if (desc.tag != AVB_DESCRIPTOR_TAG_HASHTREE)
+    return true;
+
+  AvbHashtreeDescriptor hashtree;
+  TEST_AND_RETURN_FALSE(avb_hashtree_descriptor_validate_and_byteswap(
+      reinterpret_cast<const AvbHashtreeDescriptor*>(descriptor), &hashtree));
+  TEST_AND_RETURN_FALSE(hashtree.dm_verity_version == 1);
+  TEST_AND_RETURN_FALSE(hashtree.data_block_size == hashtree.hash_block_size);
+  const char* algorithm =
+      reinterpret_cast<const char*>(hashtree.hash_algorithm);
+  tree->algorithm.assign(
+      algorithm, strnlen(algorithm, sizeof(hashtree.hash_algorithm)));
+  const uint8_t* salt = reinterpret_cast<const uint8_t*>(descriptor) +
+                        sizeof(AvbHashtreeDescriptor) +
+                        hashtree.partition_name_len;
+  tree->salt.assign(salt, salt + hashtree.salt_len);
+  tree->data_size = hashtree.image_size;
+  tree->hash_tree_offset = hashtree.tree_offset;
+  tree->block_size = hashtree.data_block_size;
+  tree->found = true;
+  return true;
+}
+
+}  // namespace
+
+VerifiedSourceFd::~VerifiedSourceFd() {
+  if (source_ecc_recovered_failures_ > 0) {
+    LOG(INFO) << "Recovered " << source_ecc_recovered_failures_
+              << " operations on " << source_path_ << " by reading "
+              << source_ecc_corrected_blocks_
+              << " blocks from the error corrected device in "
+              << source_ecc_time_;
+  }
+  if (skipped_verification_bytes_ > 0) {
+    LOG(INFO) << "Skipped verifying " << skipped_verification_bytes_
+              << " bytes of " << source_path_
+              << " already verified by previous operations, saving about "
+              << saved_verification_time();
+  }
+}
+
+base::TimeDelta VerifiedSourceFd::saved_verification_time() const {
+  if (verified_bytes_ == 0)
+    return base::TimeDelta();
+  return base::TimeDelta::FromMicroseconds(static_cast<int64_t>(
+      static_cast<double>(verification_time_.InMicroseconds()) *
+      skipped_verification_bytes_ / verified_bytes_));
+}
+
+bool VerifiedSourceFd::AreBlocksVerified(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) const {
+  if (extents.empty())
+    return false;
+  for (const Extent& extent : extents) {
+    if (utils::BlocksInExtents(verified_blocks_.GetIntersectingExtents(
+            extent)) != extent.num_blocks()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool VerifiedSourceFd::SetSourceHashTree(uint64_t data_size,
+                                         uint64_t hash_tree_offset,
+                                         const string& algorithm,
+                                         const brillo::Blob& salt) {
+  hash_function_ = HashTreeBuilder::HashFunction(algorithm);
+  if (hash_function_ == nullptr) {
+    LOG(WARNING) << "Unsupported hash tree algorithm " << algorithm;
+    return false;
+  }
+  hash_tree_data_size_ = data_size;
+  hash_tree_offset_ = hash_tree_offset;
+  hash_tree_salt_ = salt;
+  return true;
+}
+
+bool VerifiedSourceFd::LoadSourceHashTree(uint64_t partition_size) {
+  TEST_AND_RETURN_FALSE(source_fd_ != nullptr);
+  TEST_AND_RETURN_FALSE(partition_size > sizeof(AvbFooter));
+  brillo::Blob buffer(sizeof(AvbFooter));
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd_,
+                                        buffer.data(),
+                                        buffer.size(),
+                                        partition_size - sizeof(AvbFooter),
+                                        &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
+  if (memcmp(buffer.data(), AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN) != 0) {
+    LOG(INFO) << "The source partition " << source_path_
+              << " has no AVB footer.";
+    return false;
+  }
+  AvbFooter footer;
+  TEST_AND_RETURN_FALSE(avb_footer_validate_and_byteswap(
+      reinterpret_cast<const AvbFooter*>(buffer.data()), &footer));
+  TEST_AND_RETURN_FALSE(footer.vbmeta_size >= sizeof(AvbVBMetaImageHeader) &&
+                        footer.vbmeta_offset <= partition_size &&
+                        footer.vbmeta_size <=
+                            partition_size - footer.vbmeta_offset);
+  buffer.resize(footer.vbmeta_size);
+  TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd_,
+                                        buffer.data(),
+                                        buffer.size(),
+                                        footer.vbmeta_offset,
+                                        &bytes_read));
+  TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
+
+  HashTreeDescriptor tree;
+  TEST_AND_RETURN_FALSE(avb_descriptor_foreach(
+      buffer.data(), buffer.size(), AvbHashTreeDescriptorCallback, &tree));
+  if (!tree.found) {
+    LOG(INFO) << "The AVB footer of the source partition " << source_path_
+              << " has no hashtree descriptor.";
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(tree.block_size == block_size_);
+  TEST_AND_RETURN_FALSE(tree.data_size <= tree.hash_tree_offset &&
+                        tree.hash_tree_offset <= partition_size);
+  return SetSourceHashTree(
+      tree.data_size, tree.hash_tree_offset, tree.algorithm, tree.salt);
+}
+
+bool VerifiedSourceFd::FindCorruptedBlocks(
+    const google::protobuf::RepeatedPtrField<Extent>& extents,
+    vector<uint64_t>* blocks) {
+  const size_t hash_size = EVP_MD_size(hash_function_);
+  const uint64_t num_blocks = hash_tree_data_size_ / block_size_;
+  // The hashes of the data blocks are the last level of the hash tree.
+  IncrementalHashTree hash_tree(block_size_, hash_function_);
+  const uint64_t hashes_offset =
+      hash_tree_offset_ + hash_tree.CalculateSize(hash_tree_data_size_) -
+      utils::DivRoundUp(num_blocks * hash_size, block_size_) * block_size_;
+
+  brillo::Blob data(block_size_);
+  brillo::Blob hash;
+  for (const Extent& extent : extents) {
+    if (extent.start_block() + extent.num_blocks() > num_blocks) {
+      LOG(WARNING) << "Source extent " << extent.start_block() << ":"
+                   << extent.num_blocks()
+                   << " isn't covered by the source hash tree.";
+      return false;
+    }
+    brillo::Blob expected_hashes(extent.num_blocks() * hash_size);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        source_fd_,
+        expected_hashes.data(),
+        expected_hashes.size(),
+        hashes_offset + extent.start_block() * hash_size,
+        &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) ==
+                          expected_hashes.size());
+    for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+      const uint64_t block = extent.start_block() + i;
+      if (corrected_blocks_.count(block) > 0)
+        continue;
+      TEST_AND_RETURN_FALSE(utils::PReadAll(source_fd_,
+                                            data.data(),
+                                            data.size(),
+                                            block * block_size_,
+                                            &bytes_read));
+      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == data.size());
+      TEST_AND_RETURN_FALSE(HashSaltedData(
+          hash_function_, hash_tree_salt_, data.data(), data.size(), &hash));
+      if (memcmp(hash.data(),
+                 expected_hashes.data() + i * hash_size,
+                 hash_size) != 0) {
+        blocks->push_back(block);
+      }
+    }
+  }
+  std::sort(blocks->begin(), blocks->end());
+  blocks->erase(std::unique(blocks->begin(), blocks->end()), blocks->end());
+  return true;
+}
+
+bool VerifiedSourceFd::CorrectBlocks(const vector<uint64_t>& blocks) {
+  const base::TimeTicks start = base::TimeTicks::Now();
+  DEFER {
+    source_ecc_time_ += base::TimeTicks::Now() - start;
+  };
+  for (uint64_t block : blocks) {
+    brillo::Blob data(block_size_);
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(source_ecc_fd_,
+                                          data.data(),
+                                          data.size(),
+                                          block * block_size_,
+                                          &bytes_read));
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == data.size());
+    corrected_blocks_[block] = std::move(data);
+  }
+  source_ecc_corrected_blocks_ += blocks.size();
+  return true;
+}
+
+FileDescriptorPtr VerifiedSourceFd::ChooseCorrectedSourceFD(
+    const InstallOperation& operation,
+    const brillo::Blob& expected_source_hash) {
+  vector<uint64_t> blocks;
+  if (!FindCorruptedBlocks(operation.src_extents(), &blocks))
+    return nullptr;
+  if (!CorrectBlocks(blocks)) {
+    for (uint64_t block : blocks)
+      corrected_blocks_.erase(block);
+    return nullptr;
+  }
+  if (!source_corrected_fd_) {
+    source_corrected_fd_ = std::make_shared<CorrectedFileDescriptor>(
+        source_fd_, &corrected_blocks_, block_size_);
+  }
+  brillo::Blob source_hash;
+  if (!fd_utils::ReadAndHashExtents(source_corrected_fd_,
+                                    operation.src_extents(),
+                                    block_size_,
+                                    &source_hash) ||
+      source_hash != expected_source_hash) {
+    LOG(WARNING) << "The source hash still mismatches after correcting "
+                 << blocks.size() << " blocks found with the source hash tree.";
+    for (uint64_t block : blocks)
+      corrected_blocks_.erase(block);
+    return nullptr;
+  }
+  LOG(INFO) << "Corrected " << blocks.size()
+            << " corrupted source blocks with the error corrected device.";
+
+  // Also repair the source partition, as when the whole operation is read
+  // from the error corrected device.
+  if (!blocks.empty()) {
+    google::protobuf::RepeatedPtrField<Extent> extents;
+    brillo::Blob data;
+    for (uint64_t block : blocks) {
+      *extents.Add() = ExtentForRange(block, 1);
+      const brillo::Blob& block_data = corrected_blocks_[block];
+      data.insert(data.end(), block_data.begin(), block_data.end());
+    }
+    WriteBackCorrectedSourceBlocks(data, extents);
+  }
+  return source_corrected_fd_;
+}
 
 bool VerifiedSourceFd::OpenCurrentECCPartition() {
   // No support for ECC for full payloads.
@@ -67,6 +420,7 @@ bool VerifiedSourceFd::OpenCurrentECCPartition() {
 bool VerifiedSourceFd::WriteBackCorrectedSourceBlocks(
     const std::vector<unsigned char>& source_data,
     const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  verified_blocks_.SubtractRepeatedExtents(extents);
   utils::SetBlockDeviceReadOnly(source_path_, false);
   DEFER {
     utils::SetBlockDeviceReadOnly(source_path_, true);
@@ -79,6 +433,57 @@ bool VerifiedSourceFd::WriteBackCorrectedSourceBlocks(
   return true;
 }
 
+FileDescriptorPtr VerifiedSourceFd::ChooseXorSourceFD(
+    const google::protobuf::RepeatedPtrField<Extent>& extents) {
+  if (source_fd_ == nullptr)
+    return nullptr;
+  // Without the source hash tree, the blocks are XORed as the merge will
+  // read them.
+  if (hash_function_ == nullptr || AreBlocksVerified(extents))
+    return source_fd_;
+
+  vector<uint64_t> blocks;
+  if (!FindCorruptedBlocks(extents, &blocks))
+    return nullptr;
+  if (!blocks.empty() &&
+      (!OpenCurrentECCPartition() || !CorrectBlocks(blocks))) {
+    LOG(WARNING) << "Failed to correct " << blocks.size()
+                 << " corrupted XOR source blocks.";
+    for (uint64_t block : blocks)
+      corrected_blocks_.erase(block);
+    return nullptr;
+  }
+  // The blocks corrected for previous operations may not have been written
+  // back, they are written again with the ones just corrected.
+  for (const Extent& extent : extents) {
+    for (uint64_t i = 0; i < extent.num_blocks(); i++) {
+      if (corrected_blocks_.count(extent.start_block() + i) > 0)
+        blocks.push_back(extent.start_block() + i);
+    }
+  }
+  std::sort(blocks.begin(), blocks.end());
+  blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+  if (!blocks.empty()) {
+    google::protobuf::RepeatedPtrField<Extent> corrected_extents;
+    brillo::Blob data;
+    for (uint64_t block : blocks) {
+      *corrected_extents.Add() = ExtentForRange(block, 1);
+      const brillo::Blob& block_data = corrected_blocks_[block];
+      data.insert(data.end(), block_data.begin(), block_data.end());
+    }
+    if (!WriteBackCorrectedSourceBlocks(data, corrected_extents)) {
+      LOG(WARNING) << "Failed to write back " << blocks.size()
+                   << " corrected XOR source blocks.";
+      return nullptr;
+    }
+    LOG(INFO) << "Corrected " << blocks.size()
+              << " corrupted XOR source blocks with the error corrected "
+                 "device.";
+  }
+  verified_blocks_.AddRepeatedExtents(extents);
+  return source_fd_;
+}
+
 FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     const InstallOperation& operation, ErrorCode* error) {
   if (source_fd_ == nullptr) {
@@ -114,9 +519,19 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     return source_fd_;
   }
 
+  // The data of the source blocks doesn't change once verified, unless the
+  // source partition is repaired.
+  const uint64_t source_bytes =
+      utils::BlocksInExtents(operation.src_extents()) * block_size_;
+  if (AreBlocksVerified(operation.src_extents())) {
+    skipped_verification_bytes_ += source_bytes;
+    return source_fd_;
+  }
+
   brillo::Blob source_hash;
   brillo::Blob expected_source_hash(operation.src_sha256_hash().begin(),
                                     operation.src_sha256_hash().end());
+  const base::TimeTicks verification_start = base::TimeTicks::Now();
   if (!fd_utils::ReadAndHashExtents(
           source_fd_, operation.src_extents(), block_size_, &source_hash)) {
     LOG(ERROR) << "Failed to compute hash for operation " << operation.type()
@@ -126,7 +541,10 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
     }
     return nullptr;
   }
+  verification_time_ += base::TimeTicks::Now() - verification_start;
+  verified_bytes_ += source_bytes;
   if (source_hash == expected_source_hash) {
+    verified_blocks_.AddRepeatedExtents(operation.src_extents());
     return source_fd_;
   }
   if (error) {
@@ -148,11 +566,28 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
                << base::HexEncode(expected_source_hash.data(),
                                   expected_source_hash.size());
 
+  // With the source hash tree, only the corrupted blocks are read from the
+  // error corrected device, and they are kept for the following operations.
+  if (hash_function_ != nullptr) {
+    FileDescriptorPtr fd =
+        ChooseCorrectedSourceFD(operation, expected_source_hash);
+    if (fd) {
+      source_ecc_recovered_failures_++;
+      if (error) {
+        *error = ErrorCode::kSuccess;
+      }
+      return fd;
+    }
+  }
+
   std::vector<unsigned char> source_data;
+  const base::TimeTicks ecc_start = base::TimeTicks::Now();
   if (!utils::ReadExtents(
           source_ecc_fd_, operation.src_extents(), &source_data, block_size_)) {
     return nullptr;
   }
+  source_ecc_time_ += base::TimeTicks::Now() - ecc_start;
+  source_ecc_corrected_blocks_ += source_data.size() / block_size_;
   if (!HashCalculator::RawHashOfData(source_data, &source_hash)) {
     return nullptr;
   }
@@ -163,6 +598,7 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
       if (error) {
         *error = ErrorCode::kSuccess;
       }
+      verified_blocks_.AddRepeatedExtents(operation.src_extents());
       return source_fd_;
     }
     return source_ecc_fd_;
@@ -171,6 +607,7 @@ FileDescriptorPtr VerifiedSourceFd::ChooseSourceFD(
 }
 
 bool VerifiedSourceFd::Open() {
+  verified_blocks_ = ExtentRanges();
   source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
   if (source_fd_ == nullptr)
     return false;
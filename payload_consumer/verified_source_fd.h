@@ -18,14 +18,20 @@
 
 #include <cstddef>
 
+#include <map>
 #include <string>
 #include <utility>
+#include <vector>
 
+#include <base/time/time.h>
+#include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>
+#include <openssl/evp.h>
 #include <update_engine/update_metadata.pb.h>
 
 #include "update_engine/common/error_code.h"
 #include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/extent_ranges.h"
 
 namespace chromeos_update_engine {
 
@@ -33,12 +39,74 @@ class VerifiedSourceFd {
  public:
   explicit VerifiedSourceFd(size_t block_size, std::string source_path)
       : block_size_(block_size), source_path_(std::move(source_path)) {}
+  ~VerifiedSourceFd();
   FileDescriptorPtr ChooseSourceFD(const InstallOperation& operation,
                                    ErrorCode* error);
 
   [[nodiscard]] bool Open();
 
+  // Returns a file descriptor to read the source |extents| to XOR with, such
+  // as the XOR sources of full operations, which have no source hash. The
+  // merge reads the source partition as is, so the corrupted blocks found
+  // with the source hash tree are corrected and written back to it first.
+  // Returns nullptr if they can't be, so the blocks are written without XOR.
+  FileDescriptorPtr ChooseXorSourceFD(
+      const google::protobuf::RepeatedPtrField<Extent>& extents);
+
+  // The source partition as is, without verification or error correction,
+  // or nullptr if it isn't opened.
+  FileDescriptorPtr source_fd() const { return source_fd_; }
+
+  // Loads the dm-verity hash tree of the source partition from the hashtree
+  // descriptor in the AVB footer at the end of its |partition_size| bytes.
+  // The tree is used to find which source blocks are corrupted, so that only
+  // those are read from the error corrected device. Returns false if the
+  // source partition has no such descriptor.
+  bool LoadSourceHashTree(uint64_t partition_size);
+
+  // Sets the dm-verity hash tree of the source partition: |data_size| bytes
+  // of data hashed with |algorithm| and |salt|, and the tree at
+  // |hash_tree_offset|.
+  bool SetSourceHashTree(uint64_t data_size,
+                         uint64_t hash_tree_offset,
+                         const std::string& algorithm,
+                         const brillo::Blob& salt);
+
+  // The number of source blocks read from the error corrected device, and
+  // the time spent reading them.
+  uint64_t source_ecc_corrected_blocks() const {
+    return source_ecc_corrected_blocks_;
+  }
+  base::TimeDelta source_ecc_time() const { return source_ecc_time_; }
+
+  // The number of source bytes of operations not verified again since all
+  // their blocks were verified by previous operations, and the estimated time
+  // it saved.
+  uint64_t skipped_verification_bytes() const {
+    return skipped_verification_bytes_;
+  }
+  base::TimeDelta saved_verification_time() const;
+
  private:
+  // Returns whether all the |extents| were verified by previous operations.
+  bool AreBlocksVerified(
+      const google::protobuf::RepeatedPtrField<Extent>& extents) const;
+
+  // Returns a file descriptor to the source partition with the corrupted
+  // blocks of |operation| replaced by their error corrected data, or nullptr
+  // if the source hash tree can't tell which blocks are corrupted or the
+  // corrected data doesn't match |expected_source_hash|.
+  FileDescriptorPtr ChooseCorrectedSourceFD(
+      const InstallOperation& operation,
+      const brillo::Blob& expected_source_hash);
+  // Stores the source blocks of |extents| that weren't corrected yet and
+  // whose hash doesn't match the source hash tree in |blocks|.
+  bool FindCorruptedBlocks(
+      const google::protobuf::RepeatedPtrField<Extent>& extents,
+      std::vector<uint64_t>* blocks);
+  // Reads |blocks| from the error corrected device into |corrected_blocks_|.
+  bool CorrectBlocks(const std::vector<uint64_t>& blocks);
+
   bool WriteBackCorrectedSourceBlocks(
       const std::vector<unsigned char>& source_data,
       const google::protobuf::RepeatedPtrField<Extent>& extents);
@@ -48,11 +116,37 @@ class VerifiedSourceFd {
   FileDescriptorPtr source_ecc_fd_;
   FileDescriptorPtr source_fd_;
 
+  // The source hash tree, if set.
+  const EVP_MD* hash_function_{nullptr};
+  uint64_t hash_tree_data_size_{0};
+  uint64_t hash_tree_offset_{0};
+  brillo::Blob hash_tree_salt_;
+
+  // The source blocks corrected so far, by block number, and the source
+  // partition read with them.
+  std::map<uint64_t, brillo::Blob> corrected_blocks_;
+  FileDescriptorPtr source_corrected_fd_;
+
   friend class PartitionWriterTest;
   FRIEND_TEST(PartitionWriterTest, ChooseSourceFDTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDCorrectsBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, LoadSourceHashTreeTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseSourceFDSkipsVerifiedBlocksTest);
+  FRIEND_TEST(PartitionWriterTest, ChooseXorSourceFDTest);
   // The total number of operations that failed source hash verification but
   // passed after falling back to the error-corrected |source_ecc_fd_| device.
   uint64_t source_ecc_recovered_failures_{0};
+  uint64_t source_ecc_corrected_blocks_{0};
+  base::TimeDelta source_ecc_time_;
+
+  // The source blocks whose data matched the source hash of an operation when
+  // read from |source_fd_|. They are forgotten when the source partition is
+  // written to or opened again.
+  ExtentRanges verified_blocks_;
+  // The source bytes read to verify operations, and the time it took.
+  uint64_t verified_bytes_{0};
+  base::TimeDelta verification_time_;
+  uint64_t skipped_verification_bytes_{0};
 
   // Whether opening the current partition as an error-corrected device failed.
   // Used to avoid re-opening the same source partition if it is not actually
@@ -35,6 +35,54 @@ extern "C" {
 
 namespace chromeos_update_engine {
 
+namespace {
+// Encodes round |round| out of |rounds| of the FEC data covering
+// [data_offset, data_offset + data_size) and stores the |block_size| *
+// |fec_roots| parity bytes in |fec|. |read_block| is called as
+// read_block(buffer, size, offset) to read the data blocks.
+template <typename ReadBlock>
+bool EncodeFECRound(const ReadBlock& read_block,
+                    void* rs_char,
+                    uint64_t data_offset,
+                    uint64_t data_size,
+                    uint32_t fec_roots,
+                    uint32_t block_size,
+                    uint64_t rounds,
+                    uint64_t round,
+                    brillo::Blob* fec) {
+  // This is the N in RS(M, N), which is the number of bytes for each rs
+  // block.
+  const size_t rs_n = FEC_RSM - fec_roots;
+  // Encodes |block_size| number of rs blocks each round so that we can read
+  // one block each time instead of 1 byte to increase random read
+  // performance. This uses about 1 MiB memory for 4K block size.
+  brillo::Blob rs_blocks(block_size * rs_n);
+  brillo::Blob buffer(block_size);
+  for (size_t j = 0; j < rs_n; j++) {
+    uint64_t offset =
+        fec_ecc_interleave(round * rs_n * block_size + j, rs_n, rounds);
+    // Don't read past |data_size|, treat them as 0.
+    if (offset < data_size) {
+      TEST_AND_RETURN_FALSE(
+          read_block(buffer.data(), buffer.size(), data_offset + offset));
+    } else {
+      std::fill(buffer.begin(), buffer.end(), 0);
+    }
+    for (size_t k = 0; k < buffer.size(); k++) {
+      rs_blocks[k * rs_n + j] = buffer[k];
+    }
+  }
+  fec->resize(block_size * fec_roots);
+  for (size_t j = 0; j < block_size; j++) {
+    // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write
+    // |fec_roots| number of parity bytes to |j * fec_roots| in |fec|.
+    encode_rs_char(
+        rs_char, rs_blocks.data() + j * rs_n, fec->data() + j * fec_roots);
+  }
+  return true;
+}
+}  // namespace
+
 bool IncrementalEncodeFEC::Init(const uint64_t _data_offset,
                                 const uint64_t _data_size,
                                 const uint64_t _fec_offset,
@@ -72,7 +120,11 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
   if (current_step_ == EncodeFECStep::kInitFDStep) {
     read_fd_ = _read_fd;
     write_fd_ = _write_fd;
-    cache_fd_.SetFD(write_fd_);
+    // FEC data the previous partition failed to flush is dropped; that
+    // partition already failed.
+    if (!cache_fd_.SetFD(write_fd_)) {
+      LOG(WARNING) << "Dropped FEC data not written by a previous partition.";
+    }
     write_fd_ = &cache_fd_;
   } else if (current_step_ == EncodeFECStep::kEncodeRoundStep) {
     // Encodes |block_size| number of rs blocks each round so that we can read
@@ -129,7 +181,10 @@ bool IncrementalEncodeFEC::Compute(FileDescriptor* _read_fd,
     fec_offset_ += fec_.size();
     current_round_++;
   } else if (current_step_ == EncodeFECStep::kWriteStep) {
-    write_fd_->Flush();
+    if (!write_fd_->Flush()) {
+      PLOG(ERROR) << "Failed to flush the FEC data";
+      return false;
+    }
   }
   UpdateState();
   return true;
@@ -194,11 +249,89 @@ bool VerityWriterAndroid::Init(const InstallPlan::Partition& partition) {
                         partition_->hash_tree_data_size);
       return false;
     }
+    incremental_hash_tree_.reset();
+    source_fd_.reset();
+    if (!partition_->hash_tree_unchanged_extents.empty() &&
+        InitIncrementalHashTree(hash_function)) {
+      hash_tree_builder_.reset();
+    }
   }
   total_offset_ = 0;
   return true;
 }
 
+bool VerityWriterAndroid::InitIncrementalHashTree(const EVP_MD* hash_function) {
+  // The source hash tree is expected at the same offset as the target one.
+  if (partition_->source_path.empty() ||
+      partition_->source_size <
+          partition_->hash_tree_offset + partition_->hash_tree_size) {
+    return false;
+  }
+  source_fd_ = std::make_shared<EintrSafeFileDescriptor>();
+  if (!source_fd_->Open(partition_->source_path.c_str(), O_RDONLY)) {
+    PLOG(WARNING) << "Failed to open " << partition_->source_path
+                  << ", computing the whole hash tree.";
+    source_fd_.reset();
+    return false;
+  }
+
+  // Only keep the unchanged blocks within the hash tree data, relative to it.
+  const uint64_t data_start_block =
+      partition_->hash_tree_data_offset / partition_->block_size;
+  const uint64_t data_end_block =
+      data_start_block +
+      partition_->hash_tree_data_size / partition_->block_size;
+  std::vector<Extent> unchanged_extents;
+  for (const Extent& extent : partition_->hash_tree_unchanged_extents) {
+    const uint64_t start = std::max(extent.start_block(), data_start_block);
+    const uint64_t end = std::min(extent.start_block() + extent.num_blocks(),
+                                  data_end_block);
+    if (start < end) {
+      Extent& data_extent = unchanged_extents.emplace_back();
+      data_extent.set_start_block(start - data_start_block);
+      data_extent.set_num_blocks(end - start);
+    }
+  }
+
+  incremental_hash_tree_ = std::make_unique<IncrementalHashTree>(
+      partition_->block_size, hash_function);
+  if (!incremental_hash_tree_->Initialize(partition_->hash_tree_data_size,
+                                          partition_->hash_tree_salt,
+                                          source_fd_.get(),
+                                          partition_->hash_tree_offset,
+                                          unchanged_extents)) {
+    LOG(WARNING) << "Failed to use the source hash tree of "
+                 << partition_->name << ", computing the whole hash tree.";
+    incremental_hash_tree_.reset();
+    source_fd_.reset();
+    return false;
+  }
+  return true;
+}
+
+bool VerityWriterAndroid::WriteHashTree(FileDescriptor* write_fd) {
+  auto write = [write_fd](auto data, auto size) {
+    return utils::WriteAll(write_fd, data, size);
+  };
+  if (hash_tree_builder_) {
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
+    TEST_AND_RETURN_FALSE_ERRNO(
+        write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
+    // hashtree builder already prints error messages.
+    TEST_AND_RETURN_FALSE(hash_tree_builder_->WriteHashTree(write));
+    hash_tree_builder_.reset();
+  }
+  if (incremental_hash_tree_) {
+    TEST_AND_RETURN_FALSE(incremental_hash_tree_->BuildHashTree());
+    TEST_AND_RETURN_FALSE_ERRNO(
+        write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
+    TEST_AND_RETURN_FALSE(incremental_hash_tree_->WriteHashTree(write));
+    incremental_hash_tree_.reset();
+    source_fd_.reset();
+  }
+  return true;
+}
+
 bool VerityWriterAndroid::Update(const uint64_t offset,
                                  const uint8_t* buffer,
                                  size_t size) {
@@ -221,8 +354,13 @@ bool VerityWriterAndroid::Update(const uint64_t offset,
     }
     const uint64_t end_offset = std::min(offset + size, hash_tree_data_end);
     if (start_offset < end_offset) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
-          buffer + start_offset - offset, end_offset - start_offset));
+      if (incremental_hash_tree_) {
+        TEST_AND_RETURN_FALSE(incremental_hash_tree_->Update(
+            buffer + start_offset - offset, end_offset - start_offset));
+      } else {
+        TEST_AND_RETURN_FALSE(hash_tree_builder_->Update(
+            buffer + start_offset - offset, end_offset - start_offset));
+      }
 
       if (end_offset == hash_tree_data_end) {
         LOG(INFO)
@@ -248,18 +386,7 @@ bool VerityWriterAndroid::Finalize(FileDescriptor* read_fd,
   // All hash tree data blocks has been hashed, write hash tree to disk.
   LOG(INFO) << "Writing verity hash tree to "
             << partition_->readonly_target_path;
-  if (hash_tree_builder_) {
-    TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
-    TEST_AND_RETURN_FALSE_ERRNO(
-        write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-    auto success =
-        hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
-          return utils::WriteAll(write_fd, data, size);
-        });
-    // hashtree builder already prints error messages.
-    TEST_AND_RETURN_FALSE(success);
-    hash_tree_builder_.reset();
-  }
+  TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
   if (partition_->fec_size != 0) {
     LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
     TEST_AND_RETURN_FALSE(EncodeFEC(read_fd,
@@ -291,18 +418,7 @@ bool VerityWriterAndroid::IncrementalFinalize(FileDescriptor* read_fd,
     // All hash tree data blocks has been hashed, write hash tree to disk.
     LOG(INFO) << "Writing verity hash tree to "
               << partition_->readonly_target_path;
-    if (hash_tree_builder_) {
-      TEST_AND_RETURN_FALSE(hash_tree_builder_->BuildHashTree());
-      TEST_AND_RETURN_FALSE_ERRNO(
-          write_fd->Seek(partition_->hash_tree_offset, SEEK_SET));
-      auto success =
-          hash_tree_builder_->WriteHashTree([write_fd](auto data, auto size) {
-            return utils::WriteAll(write_fd, data, size);
-          });
-      // hashtree builder already prints error messages.
-      TEST_AND_RETURN_FALSE(success);
-      hash_tree_builder_.reset();
-    }
+    TEST_AND_RETURN_FALSE(WriteHashTree(write_fd));
     hash_tree_written_ = true;
     if (partition_->fec_size != 0) {
       LOG(INFO) << "Writing verity FEC to " << partition_->readonly_target_path;
@@ -351,46 +467,30 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
   UnownedCachedFileDescriptor cache_fd(write_fd, 1 * (1 << 20));
   write_fd = &cache_fd;
 
+  auto read_block = [read_fd](uint8_t* buffer, size_t size, uint64_t offset) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::PReadAll(read_fd, buffer, size, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read >= 0);
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == size);
+    return true;
+  };
+  brillo::Blob fec;
   for (size_t i = 0; i < rounds; i++) {
-    // Encodes |block_size| number of rs blocks each round so that we can read
-    // one block each time instead of 1 byte to increase random read
-    // performance. This uses about 1 MiB memory for 4K block size.
-    brillo::Blob rs_blocks(block_size * rs_n);
-    for (size_t j = 0; j < rs_n; j++) {
-      brillo::Blob buffer(block_size, 0);
-      uint64_t offset =
-          fec_ecc_interleave(i * rs_n * block_size + j, rs_n, rounds);
-      // Don't read past |data_size|, treat them as 0.
-      if (offset < data_size) {
-        ssize_t bytes_read = 0;
-        TEST_AND_RETURN_FALSE(utils::PReadAll(read_fd,
-                                              buffer.data(),
-                                              buffer.size(),
-                                              data_offset + offset,
-                                              &bytes_read));
-        TEST_AND_RETURN_FALSE(bytes_read >= 0);
-        TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == buffer.size());
-      }
-      for (size_t k = 0; k < buffer.size(); k++) {
-        rs_blocks[k * rs_n + j] = buffer[k];
-      }
-    }
-    brillo::Blob fec(block_size * fec_roots);
-    for (size_t j = 0; j < block_size; j++) {
-      // Encode [j * rs_n : (j + 1) * rs_n) in |rs_blocks| and write
-      // |fec_roots| number of parity bytes to |j * fec_roots| in |fec|.
-      encode_rs_char(rs_char.get(),
-                     rs_blocks.data() + j * rs_n,
-                     fec.data() + j * fec_roots);
-    }
+    TEST_AND_RETURN_FALSE(EncodeFECRound(read_block,
+                                         rs_char.get(),
+                                         data_offset,
+                                         data_size,
+                                         fec_roots,
+                                         block_size,
+                                         rounds,
+                                         i,
+                                         &fec));
 
     if (verify_mode) {
       brillo::Blob fec_read(fec.size());
-      ssize_t bytes_read = 0;
-      TEST_AND_RETURN_FALSE(utils::PReadAll(
-          read_fd, fec_read.data(), fec_read.size(), fec_offset, &bytes_read));
-      TEST_AND_RETURN_FALSE(bytes_read >= 0);
-      TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == fec_read.size());
+      TEST_AND_RETURN_FALSE(
+          read_block(fec_read.data(), fec_read.size(), fec_offset));
       TEST_AND_RETURN_FALSE(fec == fec_read);
     } else {
       CHECK(write_fd);
@@ -402,10 +502,69 @@ bool VerityWriterAndroid::EncodeFEC(FileDescriptor* read_fd,
     }
     fec_offset += fec.size();
   }
-  write_fd->Flush();
+  if (!write_fd->Flush()) {
+    PLOG(ERROR) << "Failed to flush the FEC data";
+    return false;
+  }
   return true;
 }
 
+bool VerityWriterAndroid::VerifyFECRounds(FileDescriptor* fd,
+                                          uint64_t data_offset,
+                                          uint64_t data_size,
+                                          uint64_t fec_offset,
+                                          uint64_t fec_size,
+                                          uint32_t fec_roots,
+                                          uint32_t block_size,
+                                          uint64_t first_round,
+                                          uint64_t last_round) {
+  TEST_AND_RETURN_FALSE(data_size % block_size == 0);
+  TEST_AND_RETURN_FALSE(fec_roots >= 0 && fec_roots < FEC_RSM);
+  const uint64_t rounds = GetFECRounds(data_size, fec_roots, block_size);
+  TEST_AND_RETURN_FALSE(rounds * fec_roots * block_size == fec_size);
+  TEST_AND_RETURN_FALSE(first_round <= last_round && last_round <= rounds);
+
+  std::unique_ptr<void, decltype(&free_rs_char)> rs_char(
+      init_rs_char(FEC_PARAMS(fec_roots)), &free_rs_char);
+  TEST_AND_RETURN_FALSE(rs_char != nullptr);
+
+  auto read_block = [fd](uint8_t* buffer, size_t size, uint64_t offset) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadAll(fd, buffer, size, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read >= 0);
+    TEST_AND_RETURN_FALSE(static_cast<size_t>(bytes_read) == size);
+    return true;
+  };
+  brillo::Blob fec;
+  brillo::Blob fec_read;
+  for (uint64_t i = first_round; i < last_round; i++) {
+    TEST_AND_RETURN_FALSE(EncodeFECRound(read_block,
+                                         rs_char.get(),
+                                         data_offset,
+                                         data_size,
+                                         fec_roots,
+                                         block_size,
+                                         rounds,
+                                         i,
+                                         &fec));
+    fec_read.resize(fec.size());
+    TEST_AND_RETURN_FALSE(read_block(
+        fec_read.data(), fec_read.size(), fec_offset + i * fec.size()));
+    if (fec != fec_read) {
+      LOG(ERROR) << "FEC mismatch in round " << i << " of " << rounds;
+      return false;
+    }
+  }
+  return true;
+}
+
+uint64_t VerityWriterAndroid::GetFECRounds(uint64_t data_size,
+                                           uint32_t fec_roots,
+                                           uint32_t block_size) {
+  return utils::DivRoundUp(data_size / block_size, FEC_RSM - fec_roots);
+}
+
 bool VerityWriterAndroid::EncodeFEC(const std::string& path,
                                     uint64_t data_offset,
                                     uint64_t data_size,
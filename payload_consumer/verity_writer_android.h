@@ -30,6 +30,7 @@ extern "C" {
 
 #include "payload_consumer/file_descriptor.h"
 #include "update_engine/payload_consumer/cached_file_descriptor.h"
+#include "update_engine/payload_consumer/incremental_hash_tree.h"
 #include "update_engine/payload_consumer/verity_writer_interface.h"
 
 namespace chromeos_update_engine {
@@ -115,13 +116,45 @@ class VerityWriterAndroid : public VerityWriterInterface {
                         uint32_t block_size,
                         bool verify_mode);
 
+  // Verify rounds [first_round, last_round) of the FEC data stored at
+  // |fec_offset| in |fd| against a freshly encoded one, see EncodeFEC() for
+  // the layout. Disjoint round ranges of the same file can be verified from
+  // multiple threads at once, each with its own |fd|.
+  static bool VerifyFECRounds(FileDescriptor* fd,
+                              uint64_t data_offset,
+                              uint64_t data_size,
+                              uint64_t fec_offset,
+                              uint64_t fec_size,
+                              uint32_t fec_roots,
+                              uint32_t block_size,
+                              uint64_t first_round,
+                              uint64_t last_round);
+
+  // Returns the number of rounds EncodeFEC() needs to encode |data_size|
+  // bytes of data.
+  static uint64_t GetFECRounds(uint64_t data_size,
+                               uint32_t fec_roots,
+                               uint32_t block_size);
+
  private:
+  // Prepares |incremental_hash_tree_| to copy the hashes of the unchanged
+  // blocks from the hash tree of the source partition. Returns false if the
+  // source hash tree can't be used.
+  bool InitIncrementalHashTree(const EVP_MD* hash_function);
+
+  // Builds the hash tree and writes it to |write_fd|.
+  bool WriteHashTree(FileDescriptor* write_fd);
+
   // stores the state of EncodeFEC
   IncrementalEncodeFEC encodeFEC_;
   bool hash_tree_written_ = false;
   const InstallPlan::Partition* partition_ = nullptr;
 
   std::unique_ptr<HashTreeBuilder> hash_tree_builder_;
+  // Used instead of |hash_tree_builder_| when the hash tree of the source
+  // partition can be reused, with |source_fd_| to read it.
+  std::unique_ptr<IncrementalHashTree> incremental_hash_tree_;
+  FileDescriptorPtr source_fd_;
   uint64_t total_offset_ = 0;
   DISALLOW_COPY_AND_ASSIGN(VerityWriterAndroid);
 };
@@ -165,6 +165,29 @@ TEST_F(VerityWriterAndroidTest, FECTest) {
   ASSERT_EQ(part_data, actual_part);
 }
 
+TEST_F(VerityWriterAndroidTest, VerifyFECRoundsTest) {
+  brillo::Blob part_data(3 * 4096, 0x1);
+  for (size_t i = 4096; i < part_data.size(); i += 2) {
+    part_data[i] = 0x8e;
+    part_data[i + 1] = 0x8f;
+  }
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+  EXPECT_EQ(1u, VerityWriterAndroid::GetFECRounds(4096, 2, 4096));
+  EXPECT_TRUE(VerityWriterAndroid::VerifyFECRounds(
+      partition_fd_.get(), 0, 4096, 4096, 2 * 4096, 2, 4096, 0, 1));
+  // An empty range of rounds is trivially valid.
+  EXPECT_TRUE(VerityWriterAndroid::VerifyFECRounds(
+      partition_fd_.get(), 0, 4096, 4096, 2 * 4096, 2, 4096, 1, 1));
+  // Rounds out of range.
+  EXPECT_FALSE(VerityWriterAndroid::VerifyFECRounds(
+      partition_fd_.get(), 0, 4096, 4096, 2 * 4096, 2, 4096, 0, 2));
+
+  part_data[4096] ^= 1;
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+  EXPECT_FALSE(VerityWriterAndroid::VerifyFECRounds(
+      partition_fd_.get(), 0, 4096, 4096, 2 * 4096, 2, 4096, 0, 1));
+}
+
 TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
   partition_.hash_tree_size = 0;
   partition_.hash_tree_data_size = 0;
@@ -183,4 +206,45 @@ TEST_F(VerityWriterAndroidTest, HashTreeDisabled) {
       verity_writer_.Finalize(partition_fd_.get(), partition_fd_.get()));
 }
 
+TEST_F(VerityWriterAndroidTest, IncrementalFECFlushFailureTest) {
+  partition_.hash_tree_size = 0;
+  partition_.hash_tree_data_size = 0;
+  partition_.hash_tree_offset = 0;
+  partition_.hash_tree_data_offset = 0;
+
+  partition_.fec_data_offset = 0;
+  partition_.fec_data_size = 4096;
+  partition_.fec_offset = 4096;
+  partition_.fec_size = 2 * 4096;
+  brillo::Blob part_data(3 * 4096, 0x1);
+  test_utils::WriteFileVector(partition_.target_path, part_data);
+
+  // The FEC data is cached until the last step, where writing it to a read
+  // only descriptor fails.
+  EintrSafeFileDescriptor read_only_fd;
+  ASSERT_TRUE(read_only_fd.Open(partition_.target_path.c_str(), O_RDONLY));
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  ASSERT_TRUE(verity_writer_.Update(0, part_data.data(), part_data.size()));
+  bool failed = false;
+  while (!failed && !verity_writer_.FECFinished()) {
+    failed = !verity_writer_.IncrementalFinalize(&read_only_fd, &read_only_fd);
+  }
+  EXPECT_TRUE(failed);
+
+  // The data left in the cache doesn't prevent writing the FEC again.
+  ASSERT_TRUE(verity_writer_.Init(partition_));
+  ASSERT_TRUE(verity_writer_.Update(0, part_data.data(), part_data.size()));
+  while (!verity_writer_.FECFinished()) {
+    ASSERT_TRUE(verity_writer_.IncrementalFinalize(partition_fd_.get(),
+                                                   partition_fd_.get()));
+  }
+  brillo::Blob actual_part;
+  utils::ReadFile(partition_.target_path, &actual_part);
+  for (size_t i = 4096; i < part_data.size(); i += 2) {
+    part_data[i] = 0x8e;
+    part_data[i + 1] = 0x8f;
+  }
+  ASSERT_EQ(part_data, actual_part);
+}
+
 }  // namespace chromeos_update_engine
@@ -27,6 +27,8 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/image_file.h"
+#include "update_engine/payload_generator/xor_source_finder.h"
 
 using chromeos_update_engine::diff_utils::IsAReplaceOperation;
 using std::string;
@@ -72,6 +74,19 @@ bool ABGenerator::GenerateOperations(const PayloadGenerationConfig& config,
       aops, config.version, merge_chunk_blocks, new_part.path, blob_file));
   LOG(INFO) << aops->size() << " operations after merge.";
 
+  // Older clients write the blocks of full operations raw, whatever their
+  // XOR sources.
+  if (config.enable_vabc_xor && config.enable_xor_similarity_search &&
+      config.version.minor >= kReplaceXorMinorPayloadVersion) {
+    XorSourceFinder xor_source_finder(config.block_size);
+    uint64_t saved_bytes = 0;
+    TEST_AND_RETURN_FALSE(xor_source_finder.Init(old_part.path, old_part.size));
+    TEST_AND_RETURN_FALSE(
+        xor_source_finder.PopulateXorOps(new_part.path, aops, &saved_bytes));
+    LOG(INFO) << "XOR sources of full operations save about " << saved_bytes
+              << " bytes of COW in partition " << new_part.name;
+  }
+
   if (config.version.minor >= kOpSrcHashMinorPayloadVersion)
     TEST_AND_RETURN_FALSE(AddSourceHash(aops, old_part.path));
 
@@ -273,7 +288,7 @@ bool ABGenerator::AddDataAndSetType(AnnotatedOperation* aop,
   vector<Extent> dst_extents;
   ExtentsToVector(aop->op.dst_extents(), &dst_extents);
   brillo::Blob data(utils::BlocksInExtents(dst_extents) * kBlockSize);
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(
+  TEST_AND_RETURN_FALSE(image_file::ReadExtents(
       target_part_path, dst_extents, &data, data.size(), kBlockSize));
 
   brillo::Blob blob;
@@ -304,7 +319,7 @@ bool ABGenerator::AddSourceHash(vector<AnnotatedOperation>* aops,
         aop.op.has_src_length()
             ? aop.op.src_length()
             : utils::BlocksInExtents(aop.op.src_extents()) * kBlockSize;
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(
+    TEST_AND_RETURN_FALSE(image_file::ReadExtents(
         source_part_path, src_extents, &src_data, src_length, kBlockSize));
     TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfData(src_data, &src_hash));
     aop.op.set_src_sha256_hash(src_hash.data(), src_hash.size());
@@ -16,16 +16,20 @@
 
 #include "update_engine/payload_generator/block_mapping.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <unistd.h>
 
 #include <functional>
+#include <limits>
 #include <string>
 #include <utility>
 #include <vector>
 
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/image_file.h"
 
 using std::string;
 using std::vector;
@@ -42,36 +46,106 @@ size_t HashValue(const brillo::Blob& blob) {
 namespace chromeos_update_engine {
 
 BlockMapping::BlockId BlockMapping::AddBlock(const brillo::Blob& block_data) {
-  return AddBlock(-1, 0, block_data);
+  return AddBlock(nullptr, 0, block_data);
 }
 
-BlockMapping::BlockId BlockMapping::AddDiskBlock(int fd, off_t byte_offset) {
+BlockMapping::BlockId BlockMapping::AddDiskBlock(FileDescriptor* fd,
+                                                 off_t byte_offset) {
   brillo::Blob blob(block_size_);
   ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size_, byte_offset, &bytes_read))
+  if (!utils::ReadAll(fd, blob.data(), block_size_, byte_offset, &bytes_read))
     return -1;
   if (static_cast<size_t>(bytes_read) != block_size_)
     return -1;
   return AddBlock(fd, byte_offset, blob);
 }
 
-bool BlockMapping::AddManyDiskBlocks(int fd,
+bool BlockMapping::AddManyDiskBlocks(FileDescriptor* fd,
                                      off_t initial_byte_offset,
                                      size_t num_blocks,
                                      vector<BlockId>* block_ids) {
+  return LookupManyDiskBlocks(
+      fd, initial_byte_offset, num_blocks, true, block_ids);
+}
+
+bool BlockMapping::FindManyDiskBlocks(FileDescriptor* fd,
+                                      off_t initial_byte_offset,
+                                      size_t num_blocks,
+                                      vector<BlockId>* block_ids) {
+  return LookupManyDiskBlocks(
+      fd, initial_byte_offset, num_blocks, false, block_ids);
+}
+
+bool BlockMapping::LookupManyDiskBlocks(FileDescriptor* fd,
+                                        off_t initial_byte_offset,
+                                        size_t num_blocks,
+                                        bool add,
+                                        vector<BlockId>* block_ids) {
   bool ret = true;
   block_ids->resize(num_blocks);
+  // Blocks entirely inside a hole of a sparse file, or of an Android sparse
+  // image read in place, are zeros, so there's no need to read them.
+  // [data_start, data_end) is the next data region at or after the current
+  // block.
+  off_t data_start = -1;
+  off_t data_end = -1;
+  BlockId zero_block_id = -1;
+  brillo::Blob blob(block_size_);
   for (size_t block = 0; block < num_blocks; block++) {
-    (*block_ids)[block] =
-        AddDiskBlock(fd, initial_byte_offset + block * block_size_);
+    const off_t byte_offset = initial_byte_offset + block * block_size_;
+    if (byte_offset >= data_end) {
+      FindNextData(fd, byte_offset, &data_start, &data_end);
+    }
+    if (byte_offset + static_cast<off_t>(block_size_) <= data_start) {
+      if (zero_block_id == -1) {
+        zero_block_id =
+            LookupBlock(nullptr, 0, brillo::Blob(block_size_, 0), add);
+      }
+      (*block_ids)[block] = zero_block_id;
+    } else {
+      ssize_t bytes_read = 0;
+      if (!utils::ReadAll(
+              fd, blob.data(), block_size_, byte_offset, &bytes_read) ||
+          static_cast<size_t>(bytes_read) != block_size_) {
+        (*block_ids)[block] = -1;
+      } else {
+        (*block_ids)[block] = LookupBlock(fd, byte_offset, blob, add);
+      }
+    }
     ret = ret && (*block_ids)[block] != -1;
   }
   return ret;
 }
 
-BlockMapping::BlockId BlockMapping::AddBlock(int fd,
+void BlockMapping::FindNextData(FileDescriptor* fd,
+                                off_t offset,
+                                off_t* data_start,
+                                off_t* data_end) {
+  constexpr off_t kMaxOffset = std::numeric_limits<off_t>::max();
+  *data_start = fd->Seek(offset, SEEK_DATA);
+  if (*data_start < 0) {
+    // ENXIO means there's no more data after |offset|. Any other error, such
+    // as SEEK_DATA not being supported, means we have to read everything.
+    *data_start = errno == ENXIO ? kMaxOffset : offset;
+    *data_end = kMaxOffset;
+    return;
+  }
+  *data_end = fd->Seek(*data_start, SEEK_HOLE);
+  if (*data_end < 0) {
+    *data_end = kMaxOffset;
+  }
+}
+
+BlockMapping::BlockId BlockMapping::AddBlock(FileDescriptor* fd,
                                              off_t byte_offset,
                                              const brillo::Blob& block_data) {
+  return LookupBlock(fd, byte_offset, block_data, true);
+}
+
+BlockMapping::BlockId BlockMapping::LookupBlock(FileDescriptor* fd,
+                                                off_t byte_offset,
+                                                const brillo::Blob& block_data,
+                                                bool add) {
   if (block_data.size() != block_size_)
     return -1;
   size_t h = HashValue(block_data);
@@ -83,6 +157,8 @@ BlockMapping::BlockId BlockMapping::AddBlock(int fd,
 
   auto mapping_it = mapping_.find(h);
   if (mapping_it == mapping_.end()) {
+    if (!add)
+      return kNotFound;
     bucket = &mapping_[h];
   } else {
     for (UniqueBlock& existing_block : mapping_it->second) {
@@ -92,6 +168,8 @@ BlockMapping::BlockId BlockMapping::AddBlock(int fd,
       if (equals)
         return existing_block.block_id;
     }
+    if (!add)
+      return kNotFound;
     bucket = &mapping_it->second;
   }
 
@@ -105,7 +183,7 @@ BlockMapping::BlockId BlockMapping::AddBlock(int fd,
   new_ublock->byte_offset = byte_offset;
   new_ublock->block_id = used_block_ids++;
   // We need to cache blocks that are not referencing any disk location.
-  if (fd == -1)
+  if (!fd)
     new_ublock->block_data = block_data;
 
   return new_ublock->block_id;
@@ -120,7 +198,7 @@ bool BlockMapping::UniqueBlock::CompareData(const brillo::Blob& other_block,
   const size_t block_size = other_block.size();
   brillo::Blob blob(block_size);
   ssize_t bytes_read = 0;
-  if (!utils::PReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
+  if (!utils::ReadAll(fd, blob.data(), block_size, byte_offset, &bytes_read))
     return false;
   if (static_cast<size_t>(bytes_read) != block_size)
     return false;
@@ -147,15 +225,14 @@ bool MapPartitionBlocks(const string& old_part,
   BlockMapping mapping(block_size);
   if (mapping.AddBlock(brillo::Blob(block_size, '\0')) != 0)
     return false;
-  int old_fd = HANDLE_EINTR(open(old_part.c_str(), O_RDONLY));
-  int new_fd = HANDLE_EINTR(open(new_part.c_str(), O_RDONLY));
-  ScopedFdCloser old_fd_closer(&old_fd);
-  ScopedFdCloser new_fd_closer(&new_fd);
+  FileDescriptorPtr old_fd = image_file::Open(old_part);
+  FileDescriptorPtr new_fd = image_file::Open(new_part);
+  TEST_AND_RETURN_FALSE(old_fd && new_fd);
 
   TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      old_fd, 0, old_size / block_size, old_block_ids));
+      old_fd.get(), 0, old_size / block_size, old_block_ids));
   TEST_AND_RETURN_FALSE(mapping.AddManyDiskBlocks(
-      new_fd, 0, new_size / block_size, new_block_ids));
+      new_fd.get(), 0, new_size / block_size, new_block_ids));
   return true;
 }
 
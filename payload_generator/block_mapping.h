@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_BLOCK_MAPPING_H_
 
+#include <limits>
 #include <map>
 #include <string>
 #include <vector>
@@ -24,6 +25,7 @@
 #include <brillo/secure_blob.h>
 #include <gtest/gtest_prod.h>  // for FRIEND_TEST
 
+#include "update_engine/payload_consumer/file_descriptor.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 
 namespace chromeos_update_engine {
@@ -37,6 +39,9 @@ class BlockMapping {
  public:
   using BlockId = int64_t;
 
+  // The block id returned by the Find methods for blocks not in the mapping.
+  static constexpr BlockId kNotFound = std::numeric_limits<BlockId>::max();
+
   explicit BlockMapping(size_t block_size) : block_size_(block_size) {}
 
   // Add a single data block to the mapping. Returns its unique block id.
@@ -47,24 +52,57 @@ class BlockMapping {
   // offset in bytes |byte_offset|. The data block may or may not be cached, so
   // the file descriptor must be available until the BlockMapping is destroyed.
   // Returns the unique block id of the added block or -1 in case of error.
-  BlockId AddDiskBlock(int fd, off_t byte_offset);
+  BlockId AddDiskBlock(FileDescriptor* fd, off_t byte_offset);
 
   // This is a helper method to add |num_blocks| contiguous blocks reading them
   // from the file descriptor |fd| starting at offset |initial_byte_offset|.
+  // Blocks in holes of |fd| are mapped to the zero block without reading them.
   // Returns whether it succeeded to add all the disk blocks and stores in
   // |block_ids| the block id for each one of the added blocks.
-  bool AddManyDiskBlocks(int fd,
+  bool AddManyDiskBlocks(FileDescriptor* fd,
                          off_t initial_byte_offset,
                          size_t num_blocks,
                          std::vector<BlockId>* block_ids);
 
+  // Like AddManyDiskBlocks() but without adding the blocks to the mapping:
+  // the blocks not already in it get the id |kNotFound|. Nothing is kept
+  // referencing |fd|.
+  bool FindManyDiskBlocks(FileDescriptor* fd,
+                          off_t initial_byte_offset,
+                          size_t num_blocks,
+                          std::vector<BlockId>* block_ids);
+
  private:
   FRIEND_TEST(BlockMappingTest, BlocksAreNotKeptInMemory);
 
-  // Add a single block passed in |block_data|. If |fd| is not -1, the block
+  // Finds the first region of |fd| at or after |offset| which is not a hole
+  // and stores it in [|data_start|, |data_end|). If |fd| doesn't support
+  // SEEK_DATA, the whole file is considered data.
+  static void FindNextData(FileDescriptor* fd,
+                           off_t offset,
+                           off_t* data_start,
+                           off_t* data_end);
+
+  // Add a single block passed in |block_data|. If |fd| is not null, the block
   // can be discarded to save RAM and retrieved later from |fd| at the position
   // |byte_offset|.
-  BlockId AddBlock(int fd, off_t byte_offset, const brillo::Blob& block_data);
+  BlockId AddBlock(FileDescriptor* fd,
+                   off_t byte_offset,
+                   const brillo::Blob& block_data);
+
+  // Returns the block id of |block_data|, adding it like AddBlock() if |add|
+  // or returning |kNotFound| otherwise when it's not in the mapping yet.
+  BlockId LookupBlock(FileDescriptor* fd,
+                      off_t byte_offset,
+                      const brillo::Blob& block_data,
+                      bool add);
+
+  // Shared implementation of AddManyDiskBlocks() and FindManyDiskBlocks().
+  bool LookupManyDiskBlocks(FileDescriptor* fd,
+                            off_t initial_byte_offset,
+                            size_t num_blocks,
+                            bool add,
+                            std::vector<BlockId>* block_ids);
 
   size_t block_size_;
 
@@ -79,7 +117,8 @@ class BlockMapping {
     BlockId block_id;
 
     // The location on this unique block on disk (if not cached in block_data).
-    int fd{-1};
+    // Not owned.
+    FileDescriptor* fd{nullptr};
     off_t byte_offset{0};
 
     // Number of times we have seen this data block. Used for caching.
@@ -55,10 +55,10 @@ TEST_F(BlockMappingTest, FirstAddedBlockIsZero) {
 
 TEST_F(BlockMappingTest, BlocksAreNotKeptInMemory) {
   test_utils::WriteFileString(old_part_.path(), string(block_size_, 'a'));
-  int old_fd = HANDLE_EINTR(open(old_part_.path().c_str(), O_RDONLY));
-  ScopedFdCloser old_fd_closer(&old_fd);
+  EintrSafeFileDescriptor old_fd;
+  ASSERT_TRUE(old_fd.Open(old_part_.path().c_str(), O_RDONLY));
 
-  EXPECT_EQ(0, bm_.AddDiskBlock(old_fd, 0));
+  EXPECT_EQ(0, bm_.AddDiskBlock(&old_fd, 0));
 
   // Check that the block_data is not stored on memory if we just used the block
   // once.
@@ -112,4 +112,49 @@ TEST_F(BlockMappingTest, MapPartitionBlocks) {
   EXPECT_EQ((vector<BlockMapping::BlockId>{0, 11, 12, 13, 1, 2}), new_ids);
 }
 
+TEST_F(BlockMappingTest, AddManyDiskBlocksWithHolesTest) {
+  // A file with a data block, a hole of three blocks, a data block of zeros
+  // and a trailing hole of two blocks.
+  EintrSafeFileDescriptor fd;
+  ASSERT_TRUE(fd.Open(old_part_.path().c_str(), O_RDWR));
+  ASSERT_EQ(0, ftruncate(fd.Fd(), 7 * block_size_));
+  brillo::Blob data(block_size_, 'a');
+  ASSERT_TRUE(utils::PWriteAll(fd.Fd(), data.data(), data.size(), 0));
+  brillo::Blob zeros(block_size_, 0);
+  ASSERT_TRUE(
+      utils::PWriteAll(fd.Fd(), zeros.data(), zeros.size(), 4 * block_size_));
+
+  EXPECT_EQ(0, bm_.AddBlock(zeros));
+  vector<BlockMapping::BlockId> ids;
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(&fd, 0, 7, &ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{1, 0, 0, 0, 0, 0, 0}), ids);
+}
+
+TEST_F(BlockMappingTest, FindManyDiskBlocksTest) {
+  string new_contents(3 * block_size_, '\0');
+  for (size_t i = 0; i < new_contents.size(); ++i)
+    new_contents[i] = i / block_size_;
+  test_utils::WriteFileString(new_part_.path(), new_contents);
+  // Blocks 2, 3 and 0 of the new file, then a block not in it.
+  string old_contents(4 * block_size_, '\0');
+  for (size_t i = 0; i < old_contents.size(); ++i)
+    old_contents[i] = (2 + i / block_size_) % 4;
+  test_utils::WriteFileString(old_part_.path(), old_contents);
+
+  EintrSafeFileDescriptor new_fd, old_fd;
+  ASSERT_TRUE(new_fd.Open(new_part_.path().c_str(), O_RDONLY));
+  ASSERT_TRUE(old_fd.Open(old_part_.path().c_str(), O_RDONLY));
+
+  vector<BlockMapping::BlockId> new_ids, old_ids;
+  EXPECT_TRUE(bm_.AddManyDiskBlocks(&new_fd, 0, 3, &new_ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{0, 1, 2}), new_ids);
+  EXPECT_TRUE(bm_.FindManyDiskBlocks(&old_fd, 0, 4, &old_ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{2, BlockMapping::kNotFound, 0, 1}),
+            old_ids);
+
+  // The blocks not found weren't added.
+  EXPECT_TRUE(bm_.FindManyDiskBlocks(&old_fd, block_size_, 1, &old_ids));
+  EXPECT_EQ((vector<BlockMapping::BlockId>{BlockMapping::kNotFound}), old_ids);
+}
+
 }  // namespace chromeos_update_engine
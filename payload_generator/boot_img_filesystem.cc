@@ -18,17 +18,15 @@
 
 #include <array>
 
-#include <android-base/unique_fd.h>
-#include <android-base/file.h>
 #include <base/logging.h>
 #include <bootimg.h>
 #include <brillo/secure_blob.h>
 #include <puffin/utils.h>
-#include <sys/stat.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/image_file.h"
 
 using std::string;
 using std::unique_ptr;
@@ -41,23 +39,26 @@ unique_ptr<BootImgFilesystem> BootImgFilesystem::CreateFromFile(
   if (filename.empty()) {
     return nullptr;
   }
-  android::base::unique_fd fd(open(filename.c_str(), O_RDONLY));
-  if (!fd.ok()) {
-    PLOG(ERROR) << "Failed to open " << filename;
+  FileDescriptorPtr fd = image_file::Open(filename);
+  if (!fd) {
     return nullptr;
   }
-  struct stat st {};
-  if (fstat(fd.get(), &st) < 0) {
+  const off_t file_size = image_file::Size(filename);
+  if (file_size < 0) {
     return nullptr;
   }
-  if (static_cast<size_t>(st.st_size) < sizeof(boot_img_hdr_v0)) {
+  if (static_cast<size_t>(file_size) < sizeof(boot_img_hdr_v0)) {
     LOG(INFO) << "Image " << filename
-              << " is too small to be a boot image. file size: " << st.st_size;
+              << " is too small to be a boot image. file size: " << file_size;
     return nullptr;
   }
+  auto read_fully = [&fd](void* buf, size_t count, off_t offset) {
+    ssize_t bytes_read = 0;
+    return utils::ReadAll(fd, buf, count, offset, &bytes_read) &&
+           bytes_read == static_cast<ssize_t>(count);
+  };
   std::array<char, BOOT_MAGIC_SIZE> header_magic{};
-  if (!android::base::ReadFullyAtOffset(
-          fd, header_magic.data(), BOOT_MAGIC_SIZE, 0) ||
+  if (!read_fully(header_magic.data(), BOOT_MAGIC_SIZE, 0) ||
       memcmp(header_magic.data(), BOOT_MAGIC, BOOT_MAGIC_SIZE) != 0) {
     return nullptr;
   }
@@ -69,10 +70,9 @@ unique_ptr<BootImgFilesystem> BootImgFilesystem::CreateFromFile(
   constexpr size_t header_version_offset =
       BOOT_MAGIC_SIZE + 8 * sizeof(uint32_t);
   std::array<char, sizeof(uint32_t)> header_version_blob{};
-  if (!android::base::ReadFullyAtOffset(fd,
-                                        header_version_blob.data(),
-                                        sizeof(uint32_t),
-                                        header_version_offset)) {
+  if (!read_fully(header_version_blob.data(),
+                  sizeof(uint32_t),
+                  header_version_offset)) {
     return nullptr;
   }
   uint32_t header_version =
@@ -87,7 +87,7 @@ unique_ptr<BootImgFilesystem> BootImgFilesystem::CreateFromFile(
   size_t header_size =
       header_version == 3 ? sizeof(boot_img_hdr_v3) : sizeof(boot_img_hdr_v0);
   brillo::Blob header_blob(header_size);
-  if (!ReadFullyAtOffset(fd, header_blob.data(), header_size, 0)) {
+  if (!read_fully(header_blob.data(), header_size, 0)) {
     return nullptr;
   }
 
@@ -129,7 +129,7 @@ size_t BootImgFilesystem::GetBlockSize() const {
 }
 
 size_t BootImgFilesystem::GetBlockCount() const {
-  return utils::DivRoundUp(utils::FileSize(filename_), kBlockSize);
+  return utils::DivRoundUp(image_file::Size(filename_), kBlockSize);
 }
 
 FilesystemInterface::File BootImgFilesystem::GetFile(const string& name,
@@ -140,7 +140,7 @@ FilesystemInterface::File BootImgFilesystem::GetFile(const string& name,
   file.extents = {ExtentForBytes(kBlockSize, offset, size)};
 
   brillo::Blob data;
-  if (utils::ReadFileChunk(filename_, offset, size, &data) &&
+  if (image_file::ReadChunk(filename_, offset, size, &data) &&
       data.size() == size) {
     constexpr size_t kGZipHeaderSize = 10;
     // Check GZip header magic.
@@ -161,7 +161,7 @@ FilesystemInterface::File BootImgFilesystem::GetFile(const string& name,
 
 bool BootImgFilesystem::GetFiles(vector<File>* files) const {
   files->clear();
-  const uint64_t file_size = utils::FileSize(filename_);
+  const uint64_t file_size = image_file::Size(filename_);
   // The first page is header.
   uint64_t offset = page_size_;
   if (kernel_size_ > 0 && offset + kernel_size_ <= file_size) {
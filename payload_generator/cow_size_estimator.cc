@@ -26,6 +26,7 @@
 #include <libsnapshot/cow_format.h>
 
 #include "update_engine/payload_consumer/block_extent_writer.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_consumer/snapshot_extent_writer.h"
 #include "update_engine/payload_consumer/xor_extent_writer.h"
 #include "update_engine/common/utils.h"
@@ -59,7 +60,8 @@ bool CowDryRun(
     android::snapshot::ICowWriter* cow_writer,
     const size_t new_partition_size,
     const size_t old_partition_size,
-    const bool xor_enabled) {
+    const bool xor_enabled,
+    uint32_t minor_version) {
   CHECK_NE(target_fd, nullptr);
   CHECK(target_fd->IsOpen());
   VABCPartitionWriter::WriteMergeSequence(merge_operations, cow_writer);
@@ -74,15 +76,26 @@ bool CowDryRun(
     }
     copy_blocks.AddExtent(cow_op.dst_extent());
   }
+  const bool replace_xor_enabled =
+      xor_enabled && minor_version >= kReplaceXorMinorPayloadVersion;
   for (const auto& op : operations) {
+    const bool is_replace = op.type() == InstallOperation::REPLACE ||
+                            op.type() == InstallOperation::REPLACE_BZ ||
+                            op.type() == InstallOperation::REPLACE_XZ;
     switch (op.type()) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
       case InstallOperation::PUFFDIFF:
       case InstallOperation::ZUCCHINI:
       case InstallOperation::LZ4DIFF_PUFFDIFF:
-      case InstallOperation::LZ4DIFF_BSDIFF: {
-        if (xor_enabled) {
+      case InstallOperation::LZ4DIFF_BSDIFF:
+      // The blocks of full operations may have XOR sources too, in the
+      // payloads of the clients that write them XOR'd.
+      case InstallOperation::REPLACE:
+      case InstallOperation::REPLACE_BZ:
+      case InstallOperation::REPLACE_XZ: {
+        if ((is_replace ? replace_xor_enabled : xor_enabled) &&
+            source_fd != nullptr && source_fd->IsOpen()) {
           std::unique_ptr<XORExtentWriter> writer =
               std::make_unique<XORExtentWriter>(
                   op, source_fd, cow_writer, xor_map, old_partition_size);
@@ -109,11 +122,6 @@ bool CowDryRun(
           cow_writer->AddLabel(0);
           break;
         }
-        [[fallthrough]];
-      }
-      case InstallOperation::REPLACE:
-      case InstallOperation::REPLACE_BZ:
-      case InstallOperation::REPLACE_XZ: {
         TEST_AND_RETURN_FALSE(extent_writer.Init(op.dst_extents(), block_size));
         for (const auto& ext : op.dst_extents()) {
           visited.AddExtent(ext);
@@ -207,6 +215,7 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     const size_t new_partition_size,
     const size_t old_partition_size,
     const bool xor_enabled,
+    uint32_t minor_version,
     uint32_t cow_version,
     uint64_t compression_factor) {
   android::snapshot::CowOptions options{
@@ -224,7 +233,8 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
                   cow_writer.get(),
                   new_partition_size,
                   old_partition_size,
-                  xor_enabled));
+                  xor_enabled,
+                  minor_version));
   return cow_writer->GetCowSizeInfo();
 }
 
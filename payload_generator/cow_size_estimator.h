@@ -27,7 +27,9 @@ namespace chromeos_update_engine {
 // Virtual AB Compression enabled device. This is intended to be used by update
 // generators to put an estimate cow size in OTA payload. When installing an OTA
 // update, libsnapshot will take this estimate as a hint to allocate spaces.
-// If |xor_enabled| is true, then |source_fd| must be non-null.
+// If |xor_enabled| is true, then |source_fd| must be non-null. The blocks of
+// full operations are XOR'd with their sources only if the payload's
+// |minor_version| allows it, as older clients write them raw.
 android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     FileDescriptorPtr source_fd,
     FileDescriptorPtr target_fd,
@@ -39,6 +41,7 @@ android::snapshot::CowSizeInfo EstimateCowSizeInfo(
     const size_t new_partition_size,
     const size_t old_partition_size,
     bool xor_enabled,
+    uint32_t minor_version,
     uint32_t cow_version,
     uint64_t compression_factor);
 
@@ -53,6 +56,7 @@ bool CowDryRun(
     android::snapshot::ICowWriter* cow_writer,
     const size_t new_partition_size,
     const size_t old_partition_size,
-    bool xor_enabled);
+    bool xor_enabled,
+    uint32_t minor_version);
 
 }  // namespace chromeos_update_engine
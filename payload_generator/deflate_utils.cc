@@ -17,15 +17,24 @@
 #include "update_engine/payload_generator/deflate_utils.h"
 
 #include <algorithm>
+#include <atomic>
+#include <iterator>
+#include <map>
+#include <memory>
 #include <string>
 #include <utility>
 
+#include <android-base/strings.h>
 #include <base/files/file_util.h>
 #include <base/logging.h>
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/erofs_filesystem.h"
+#include "update_engine/payload_generator/ext2_filesystem.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/image_file.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
 #include "update_engine/update_metadata.pb.h"
@@ -48,6 +57,27 @@ constexpr std::ostream& operator<<(std::ostream& out,
 // The minimum size for a squashfs image to be processed.
 const uint64_t kMinimumSquashfsImageSize = 1 * 1024 * 1024;  // bytes
 
+// The zip entry of an APEX with its filesystem image.
+constexpr char kApexPayloadName[] = "apex_payload.img";
+
+// Zip signatures and the sizes of the fixed parts of its records.
+constexpr uint32_t kZipLocalHeaderSignature = 0x04034b50;
+constexpr uint32_t kZipCentralHeaderSignature = 0x02014b50;
+constexpr uint32_t kZipEndOfCentralDirSignature = 0x06054b50;
+constexpr size_t kZipLocalHeaderSize = 30;
+constexpr size_t kZipCentralHeaderSize = 46;
+constexpr size_t kZipEndOfCentralDirSize = 22;
+constexpr size_t kZipMaxCommentSize = 0xffff;
+
+uint16_t ReadLe16(const brillo::Blob& data, size_t offset) {
+  return data[offset] | (data[offset + 1] << 8);
+}
+
+uint32_t ReadLe32(const brillo::Blob& data, size_t offset) {
+  return ReadLe16(data, offset) |
+         (static_cast<uint32_t>(ReadLe16(data, offset + 2)) << 16);
+}
+
 // TODO(*): Optimize this so we don't have to read all extents into memory in
 // case it is large.
 bool CopyExtentsToFile(const string& in_path,
@@ -55,8 +85,8 @@ bool CopyExtentsToFile(const string& in_path,
                        const string& out_path,
                        size_t block_size) {
   brillo::Blob data(utils::BlocksInExtents(extents) * block_size);
-  TEST_AND_RETURN_FALSE(
-      utils::ReadExtents(in_path, extents, &data, data.size(), block_size));
+  TEST_AND_RETURN_FALSE(image_file::ReadExtents(
+      in_path, extents, &data, data.size(), block_size));
   TEST_AND_RETURN_FALSE(
       utils::WriteFile(out_path.c_str(), data.data(), data.size()));
   return true;
@@ -70,10 +100,10 @@ bool IsSquashfsImage(const string& part_path,
           kMinimumSquashfsImageSize / kBlockSize) {
     brillo::Blob super_block;
     TEST_AND_RETURN_FALSE(
-        utils::ReadFileChunk(part_path,
-                             file.extents[0].start_block() * kBlockSize,
-                             100,
-                             &super_block));
+        image_file::ReadChunk(part_path,
+                              file.extents[0].start_block() * kBlockSize,
+                              100,
+                              &super_block));
     return SquashfsFilesystem::IsSquashfsImage(super_block);
   }
   return false;
@@ -110,6 +140,159 @@ bool RealignSplittedFiles(const FilesystemInterface::File& file,
   return true;
 }
 
+// Returns the blocks of |file| in the partition image |part_path| as an image
+// of their own, read in place, and sets |size| to the size of |file|.
+std::unique_ptr<SparseImage> OpenFileImage(
+    const string& part_path,
+    const FilesystemInterface::File& file,
+    uint64_t* size) {
+  std::shared_ptr<const SparseImage> part_image =
+      image_file::GetImage(part_path);
+  if (!part_image) {
+    const off_t part_size = image_file::Size(part_path);
+    if (part_size < 0) {
+      PLOG(ERROR) << "Failed to get the size of " << part_path;
+      return nullptr;
+    }
+    part_image = SparseImage::OpenRaw(part_path, 0, part_size);
+    if (!part_image)
+      return nullptr;
+  }
+  vector<SparseImage::Range> ranges;
+  for (const Extent& extent : file.extents) {
+    ranges.push_back({extent.start_block() * kBlockSize,
+                      extent.num_blocks() * kBlockSize});
+  }
+  std::unique_ptr<SparseImage> image = part_image->Slice(ranges);
+  if (!image)
+    return nullptr;
+  // The last block may have trailing garbage after the end of the file.
+  *size = image->size();
+  if (file.file_stat.st_size > 0 &&
+      static_cast<uint64_t>(file.file_stat.st_size) < *size) {
+    *size = file.file_stat.st_size;
+  }
+  return image;
+}
+
+// Locates the payload of the APEX |file| of the partition image |part_path|
+// like LocateApexPayload(), and returns the APEX as an image of its own.
+std::unique_ptr<SparseImage> OpenApexFile(const string& part_path,
+                                          const FilesystemInterface::File& file,
+                                          uint64_t* offset,
+                                          uint64_t* size,
+                                          brillo::Blob* central_dir) {
+  uint64_t apex_size;
+  std::unique_ptr<SparseImage> apex =
+      OpenFileImage(part_path, file, &apex_size);
+  if (!apex)
+    return nullptr;
+  auto read = [&apex, apex_size](
+                  uint64_t offset, size_t size, brillo::Blob* out_data) {
+    TEST_AND_RETURN_FALSE(offset <= apex_size && size <= apex_size - offset);
+    out_data->resize(size);
+    return apex->Read(offset, out_data->data(), size);
+  };
+  if (!LocateApexPayload(apex_size, read, offset, size, central_dir))
+    return nullptr;
+  return apex;
+}
+
+// Replaces the APEX |file| with the files of the filesystem image stored in
+// it, so they can be diffed against the same files of the source APEX. The
+// blocks of the APEX outside of the image, like the other zip entries, are
+// put in a "<zip>" file. Only the zip metadata is read, and the image is read
+// in place from the partition. Returns false if |file| can't be split, for
+// example because the image is compressed or not aligned to blocks, or if
+// |other_file| of |other_part_path| is the same APEX.
+bool SplitApexFile(const string& part_path,
+                   const FilesystemInterface::File& file,
+                   const string& other_part_path,
+                   const FilesystemInterface::File* other_file,
+                   vector<FilesystemInterface::File>* files) {
+  uint64_t offset, size;
+  brillo::Blob central_dir;
+  std::unique_ptr<SparseImage> apex =
+      OpenApexFile(part_path, file, &offset, &size, &central_dir);
+  if (!apex)
+    return false;
+  if (offset % kBlockSize != 0 || size % kBlockSize != 0 || size == 0) {
+    LOG(INFO) << "The payload of " << file.name
+              << " isn't aligned to blocks, not splitting it.";
+    return false;
+  }
+  if (other_file) {
+    // The central directory has the CRC-32 and the offset of every entry.
+    uint64_t other_offset, other_size;
+    brillo::Blob other_central_dir;
+    if (OpenApexFile(other_part_path,
+                     *other_file,
+                     &other_offset,
+                     &other_size,
+                     &other_central_dir) &&
+        other_offset == offset && other_size == size &&
+        other_central_dir == central_dir) {
+      LOG(INFO) << file.name << " is unchanged, not splitting it.";
+      return false;
+    }
+  }
+
+  // The image is registered under a path of its own while it's listed. The
+  // same partition may be preprocessed by several threads.
+  static std::atomic<uint64_t> next_image_id{0};
+  const string image_path = part_path + "#" + std::to_string(next_image_id++) +
+                            file.name + "/" + kApexPayloadName;
+  std::unique_ptr<SparseImage> image = apex->Slice({{offset, size}});
+  TEST_AND_RETURN_FALSE(image);
+  apex.reset();
+  ScopedImageFile scoped_image(image_path, std::move(image));
+  std::unique_ptr<FilesystemInterface> fs;
+  if (diff_utils::IsExtFilesystem(image_path)) {
+    fs = Ext2Filesystem::CreateFromFile(image_path);
+  } else {
+    fs = ErofsFilesystem::CreateFromFile(image_path);
+  }
+  vector<FilesystemInterface::File> image_files;
+  if (!fs || !fs->GetFiles(&image_files)) {
+    LOG(INFO) << "The payload of " << file.name
+              << " isn't an ext4 or EROFS image, not splitting it.";
+    return false;
+  }
+
+  // The blocks of the image files are relative to the image, and are shifted
+  // to the APEX, then to the partition.
+  const uint64_t num_blocks = utils::BlocksInExtents(file.extents);
+  const uint64_t image_start_block = offset / kBlockSize;
+  ExtentRanges zip_blocks;
+  zip_blocks.AddExtent(ExtentForRange(0, num_blocks));
+  for (auto& image_file : image_files) {
+    for (Extent& extent : image_file.extents) {
+      extent.set_start_block(extent.start_block() + image_start_block);
+    }
+    zip_blocks.SubtractExtents(image_file.extents);
+    image_file.deflates.clear();
+    const string name = android::base::StartsWith(image_file.name, "/")
+                            ? image_file.name.substr(1)
+                            : image_file.name;
+    image_file.name = string(kApexPayloadName) + "/" + name;
+  }
+  FilesystemInterface::File zip_file;
+  zip_file.name = "<zip>";
+  zip_file.extents.assign(zip_blocks.extent_set().begin(),
+                          zip_blocks.extent_set().end());
+  image_files.push_back(std::move(zip_file));
+
+  for (auto& image_file : image_files) {
+    TEST_AND_RETURN_FALSE(
+        ShiftExtentsOverExtents(file.extents, &image_file.extents));
+    image_file.name = file.name + "/" + image_file.name;
+  }
+  LOG(INFO) << "Split " << file.name << " into the " << image_files.size() - 1
+            << " files of its " << fs->GetBlockCount() << " blocks image.";
+  *files = std::move(image_files);
+  return true;
+}
+
 bool IsBitExtentInExtent(const Extent& extent, const BitExtent& bit_extent) {
   return (bit_extent.offset / 8) >= (extent.start_block() * kBlockSize) &&
          ((bit_extent.offset + bit_extent.length + 7) / 8) <=
@@ -121,6 +304,83 @@ bool IsBitExtentInExtent(const Extent& extent, const BitExtent& bit_extent) {
 
 }  // namespace
 
+bool LocateApexPayload(uint64_t zip_size,
+                       const ReadFunction& read,
+                       uint64_t* offset,
+                       uint64_t* size,
+                       brillo::Blob* central_dir) {
+  // Find the end of central directory record, followed by a comment.
+  if (zip_size < kZipEndOfCentralDirSize)
+    return false;
+  const uint64_t tail_size = std::min<uint64_t>(
+      zip_size, kZipEndOfCentralDirSize + kZipMaxCommentSize);
+  const uint64_t tail_offset = zip_size - tail_size;
+  brillo::Blob tail;
+  TEST_AND_RETURN_FALSE(read(tail_offset, tail_size, &tail));
+  size_t eocd = tail.size() - kZipEndOfCentralDirSize;
+  while (ReadLe32(tail, eocd) != kZipEndOfCentralDirSignature) {
+    if (eocd == 0)
+      return false;
+    eocd--;
+  }
+  const uint16_t num_entries = ReadLe16(tail, eocd + 10);
+  const uint64_t dir_size = ReadLe32(tail, eocd + 12);
+  const uint64_t dir_offset = ReadLe32(tail, eocd + 16);
+  if (dir_offset + dir_size > tail_offset + eocd) {
+    LOG(ERROR) << "Invalid zip central directory at " << dir_offset;
+    return false;
+  }
+  brillo::Blob dir;
+  TEST_AND_RETURN_FALSE(read(dir_offset, dir_size, &dir));
+
+  size_t entry = 0;
+  for (uint16_t i = 0; i < num_entries; i++) {
+    if (entry + kZipCentralHeaderSize > dir.size() ||
+        ReadLe32(dir, entry) != kZipCentralHeaderSignature) {
+      LOG(ERROR) << "Invalid zip central directory entry at "
+                 << dir_offset + entry;
+      return false;
+    }
+    const uint16_t method = ReadLe16(dir, entry + 10);
+    const uint32_t compressed_size = ReadLe32(dir, entry + 20);
+    const uint32_t uncompressed_size = ReadLe32(dir, entry + 24);
+    const uint16_t name_size = ReadLe16(dir, entry + 28);
+    const size_t extra_size =
+        ReadLe16(dir, entry + 30) + ReadLe16(dir, entry + 32);
+    const uint64_t local_header = ReadLe32(dir, entry + 42);
+    TEST_AND_RETURN_FALSE(entry + kZipCentralHeaderSize + name_size <=
+                          dir.size());
+    const string name(dir.begin() + entry + kZipCentralHeaderSize,
+                      dir.begin() + entry + kZipCentralHeaderSize + name_size);
+    entry += kZipCentralHeaderSize + name_size + extra_size;
+    if (name != kApexPayloadName)
+      continue;
+
+    // Only a stored image can be split, compressed APEXes are diffed whole.
+    if (method != 0 || compressed_size != uncompressed_size) {
+      LOG(INFO) << kApexPayloadName << " is compressed.";
+      return false;
+    }
+    brillo::Blob header;
+    if (local_header + kZipLocalHeaderSize > dir_offset ||
+        !read(local_header, kZipLocalHeaderSize, &header) ||
+        ReadLe32(header, 0) != kZipLocalHeaderSignature) {
+      LOG(ERROR) << "Invalid zip local header at " << local_header;
+      return false;
+    }
+    *offset = local_header + kZipLocalHeaderSize + ReadLe16(header, 26) +
+              ReadLe16(header, 28);
+    *size = uncompressed_size;
+    TEST_AND_RETURN_FALSE(*offset + *size <= dir_offset);
+    if (central_dir) {
+      *central_dir = std::move(dir);
+      central_dir->insert(central_dir->end(), tail.begin() + eocd, tail.end());
+    }
+    return true;
+  }
+  return false;
+}
+
 constexpr base::StringPiece ToStringPiece(std::string_view s) {
   return base::StringPiece(s.data(), s.length());
 }
@@ -307,15 +567,45 @@ bool DeflatePreprocessFileData(const std::string_view filename,
 
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               vector<FilesystemInterface::File>* result_files,
-                              bool extract_deflates) {
+                              bool extract_deflates,
+                              const PartitionConfig* other_part) {
   // Get the file system files.
   vector<FilesystemInterface::File> tmp_files;
   part.fs_interface->GetFiles(&tmp_files);
   result_files->reserve(tmp_files.size());
 
-  for (auto& file : tmp_files) {
+  // The files of |other_part| by name, only listed if there's an APEX.
+  std::map<string, FilesystemInterface::File> other_files;
+  bool other_files_listed = false;
+
+  // The files split from APEXes are appended to |tmp_files| to be processed
+  // like the others.
+  for (size_t i = 0; i < tmp_files.size(); i++) {
+    FilesystemInterface::File file = std::move(tmp_files[i]);
     auto is_regular_file = IsRegularFile(file);
 
+    if (IsFileExtensions(file.name, {".apex"})) {
+      if (other_part && other_part->fs_interface && !other_files_listed) {
+        vector<FilesystemInterface::File> files;
+        other_part->fs_interface->GetFiles(&files);
+        for (auto& other_file : files) {
+          other_files.emplace(other_file.name, std::move(other_file));
+        }
+        other_files_listed = true;
+      }
+      auto other_file = other_files.find(file.name);
+      vector<FilesystemInterface::File> files;
+      if (SplitApexFile(part.path,
+                        file,
+                        other_part ? other_part->path : "",
+                        other_file == other_files.end() ? nullptr
+                                                        : &other_file->second,
+                        &files)) {
+        std::move(files.begin(), files.end(), std::back_inserter(tmp_files));
+        continue;
+      }
+    }
+
     if (is_regular_file && IsSquashfsImage(part.path, file)) {
       // Read the image into a file.
       base::FilePath path;
@@ -355,7 +645,7 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
       bool is_gzip = IsFileExtensions(file.name, {".gz", ".gzip", ".tgz"});
       if (is_zip || is_gzip) {
         brillo::Blob data;
-        TEST_AND_RETURN_FALSE(utils::ReadExtents(
+        TEST_AND_RETURN_FALSE(image_file::ReadExtents(
             part.path,
             file.extents,
             &data,
@@ -383,7 +673,7 @@ bool PreprocessPartitionFiles(const PartitionConfig& part,
       }
     }
 
-    result_files->push_back(file);
+    result_files->push_back(std::move(file));
   }
   return true;
 }
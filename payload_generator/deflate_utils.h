@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
 
+#include <functional>
 #include <string>
 #include <vector>
 
@@ -31,10 +32,15 @@ namespace deflate_utils {
 // Gets the files from the partition and processes all its files. Processing
 // includes:
 //  - splitting large Squashfs containers into its smaller files.
+//  - splitting APEXes into the files of their ext4 or EROFS image.
 //  - extracting deflates in zip and gzip files.
+// If |other_part| is given, an APEX with the same zip metadata in the file of
+// the same name in |other_part|, so the same entries with the same CRC-32s, is
+// not split: its blocks are found unchanged before the files are diffed.
 bool PreprocessPartitionFiles(const PartitionConfig& part,
                               std::vector<FilesystemInterface::File>* result,
-                              bool extract_deflates);
+                              bool extract_deflates,
+                              const PartitionConfig* other_part = nullptr);
 
 // Spreads all extents in |over_extents| over |base_extents|. Here we assume the
 // |over_extents| are non-overlapping and sorted by their offset.
@@ -103,6 +109,22 @@ bool DeflatePreprocessFileData(const std::string_view filename,
                                const brillo::Blob& data,
                                std::vector<puffin::BitExtent>* deflates);
 
+// Reads |size| bytes at |offset| of a file into |out_data|.
+using ReadFunction = std::function<bool(
+    uint64_t offset, size_t size, brillo::Blob* out_data)>;
+
+// Finds the stored apex_payload.img entry of the APEX zip of |zip_size| bytes
+// read with |read|, and sets |offset| and |size| to its bytes in the zip. Only
+// the end of central directory record, the central directory and the local
+// header of the entry are read. If |central_dir| isn't null, it's set to the
+// central directory followed by the end of central directory record. Returns
+// false if there is no such entry or if it's compressed.
+bool LocateApexPayload(uint64_t zip_size,
+                       const ReadFunction& read,
+                       uint64_t* offset,
+                       uint64_t* size,
+                       brillo::Blob* central_dir = nullptr);
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
 #endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_DEFLATE_UTILS_H_
@@ -19,6 +19,7 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <string>
 #include <utility>
 #include <vector>
 
@@ -26,11 +27,14 @@
 
 #include "update_engine/common/test_utils.h"
 #include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/fake_filesystem.h"
 
 using puffin::BitExtent;
 using puffin::ByteExtent;
+using std::string;
 using std::vector;
 
 namespace chromeos_update_engine {
@@ -46,6 +50,71 @@ vector<BitExtent> ByteToBitExtent(const vector<ByteExtent>& byte_extents) {
   return bit_extents;
 }
 
+void AppendLe16(uint16_t value, brillo::Blob* data) {
+  data->push_back(value & 0xff);
+  data->push_back(value >> 8);
+}
+
+void AppendLe32(uint32_t value, brillo::Blob* data) {
+  AppendLe16(value & 0xffff, data);
+  AppendLe16(value >> 16, data);
+}
+
+// Creates a zip with the stored entries |entries|, padding the local header
+// extra field so the data of the entries starts at a multiple of |alignment|,
+// like apexer does for apex_payload.img.
+brillo::Blob CreateStoredZip(
+    const vector<std::pair<string, brillo::Blob>>& entries, size_t alignment) {
+  brillo::Blob zip, central_dir;
+  for (const auto& [name, data] : entries) {
+    const uint32_t local_header = zip.size();
+    const size_t header_end = zip.size() + 30 + name.size();
+    const uint16_t padding = (alignment - header_end % alignment) % alignment;
+    AppendLe32(0x04034b50, &zip);
+    AppendLe16(10, &zip);  // Version needed.
+    AppendLe16(0, &zip);   // Flags.
+    AppendLe16(0, &zip);   // Stored.
+    AppendLe32(0, &zip);   // Time and date.
+    AppendLe32(0, &zip);   // CRC32, not checked.
+    AppendLe32(data.size(), &zip);
+    AppendLe32(data.size(), &zip);
+    AppendLe16(name.size(), &zip);
+    AppendLe16(padding, &zip);
+    zip.insert(zip.end(), name.begin(), name.end());
+    zip.insert(zip.end(), padding, 0);
+    zip.insert(zip.end(), data.begin(), data.end());
+
+    AppendLe32(0x02014b50, &central_dir);
+    AppendLe16(10, &central_dir);  // Version made by.
+    AppendLe16(10, &central_dir);  // Version needed.
+    AppendLe16(0, &central_dir);   // Flags.
+    AppendLe16(0, &central_dir);   // Stored.
+    AppendLe32(0, &central_dir);   // Time and date.
+    AppendLe32(0, &central_dir);   // CRC32.
+    AppendLe32(data.size(), &central_dir);
+    AppendLe32(data.size(), &central_dir);
+    AppendLe16(name.size(), &central_dir);
+    AppendLe16(0, &central_dir);  // Extra field.
+    AppendLe16(0, &central_dir);  // Comment.
+    AppendLe16(0, &central_dir);  // Disk number.
+    AppendLe16(0, &central_dir);  // Internal attributes.
+    AppendLe32(0, &central_dir);  // External attributes.
+    AppendLe32(local_header, &central_dir);
+    central_dir.insert(central_dir.end(), name.begin(), name.end());
+  }
+  const uint32_t central_dir_offset = zip.size();
+  zip.insert(zip.end(), central_dir.begin(), central_dir.end());
+  AppendLe32(0x06054b50, &zip);
+  AppendLe16(0, &zip);  // Disk numbers.
+  AppendLe16(0, &zip);
+  AppendLe16(entries.size(), &zip);
+  AppendLe16(entries.size(), &zip);
+  AppendLe32(central_dir.size(), &zip);
+  AppendLe32(central_dir_offset, &zip);
+  AppendLe16(0, &zip);  // Comment.
+  return zip;
+}
+
 TEST(DeflateUtilsTest, ExtentsShiftTest) {
   vector<Extent> base_extents = {ExtentForRange(10, 10),
                                  ExtentForRange(70, 10),
@@ -186,5 +255,138 @@ TEST(DeflateUtilsTest, CompactBoundaryTest) {
   EXPECT_EQ(out_deflates, expected_out_deflates);
 }
 
+bool LocateApexPayloadInBlob(const brillo::Blob& zip,
+                             uint64_t* offset,
+                             uint64_t* size,
+                             brillo::Blob* central_dir = nullptr,
+                             uint64_t* bytes_read = nullptr) {
+  auto read = [&zip, bytes_read](
+                  uint64_t offset, size_t size, brillo::Blob* out_data) {
+    if (offset + size > zip.size())
+      return false;
+    out_data->assign(zip.begin() + offset, zip.begin() + offset + size);
+    if (bytes_read)
+      *bytes_read += size;
+    return true;
+  };
+  return LocateApexPayload(zip.size(), read, offset, size, central_dir);
+}
+
+TEST(DeflateUtilsTest, LocateApexPayloadTest) {
+  const brillo::Blob payload(20 * kBlockSize, 'p');
+  const brillo::Blob zip = CreateStoredZip(
+      {{"apex_manifest.pb", brillo::Blob(10, 'm')},
+       {"apex_payload.img", payload},
+       {"apex_pubkey", brillo::Blob(20, 'k')}},
+      kBlockSize);
+  uint64_t offset = 0, size = 0, bytes_read = 0;
+  brillo::Blob central_dir;
+  ASSERT_TRUE(LocateApexPayloadInBlob(
+      zip, &offset, &size, &central_dir, &bytes_read));
+  EXPECT_EQ(0u, offset % kBlockSize);
+  EXPECT_EQ(payload.size(), size);
+  EXPECT_EQ(payload,
+            brillo::Blob(zip.begin() + offset, zip.begin() + offset + size));
+  // Only the zip metadata is read, not the entries.
+  EXPECT_LT(bytes_read, payload.size());
+  EXPECT_FALSE(central_dir.empty());
+  EXPECT_EQ(brillo::Blob(zip.end() - central_dir.size(), zip.end()),
+            central_dir);
+
+  EXPECT_FALSE(LocateApexPayloadInBlob(
+      CreateStoredZip({{"apex_manifest.pb", brillo::Blob(10, 'm')}}, 1),
+      &offset,
+      &size));
+  EXPECT_FALSE(LocateApexPayloadInBlob(brillo::Blob(100, 0), &offset, &size));
+}
+
+// Stores an APEX with the ext4 test image and |manifest| in two extents of the
+// partition |part| backed by |partition_file|, with a gap between them, and
+// sets |apex_extents| to its blocks.
+void CreateApexPartition(const brillo::Blob& manifest,
+                         const ScopedTempFile& partition_file,
+                         PartitionConfig* part,
+                         vector<Extent>* apex_extents) {
+  brillo::Blob image;
+  ASSERT_TRUE(utils::ReadFile(
+      test_utils::GetBuildArtifactsPath("gen/disk_ext2_4k.img"), &image));
+  brillo::Blob apex = CreateStoredZip(
+      {{"apex_manifest.pb", manifest}, {"apex_payload.img", image}},
+      kBlockSize);
+  apex.resize(utils::DivRoundUp(apex.size(), kBlockSize) * kBlockSize);
+  const uint64_t apex_blocks = apex.size() / kBlockSize;
+
+  *apex_extents = {ExtentForRange(1, 3), ExtentForRange(6, apex_blocks - 3)};
+  brillo::Blob partition((apex_blocks + 6) * kBlockSize);
+  std::copy(apex.begin(),
+            apex.begin() + 3 * kBlockSize,
+            partition.begin() + kBlockSize);
+  std::copy(apex.begin() + 3 * kBlockSize,
+            apex.end(),
+            partition.begin() + 6 * kBlockSize);
+  ASSERT_TRUE(test_utils::WriteFileVector(partition_file.path(), partition));
+
+  part->path = partition_file.path();
+  auto fs = std::make_unique<FakeFilesystem>(kBlockSize, apex_blocks + 6);
+  fs->AddFile("/apex/com.android.test.apex", *apex_extents);
+  part->fs_interface = std::move(fs);
+}
+
+TEST(DeflateUtilsTest, SplitApexTest) {
+  ScopedTempFile partition_file("DeflateUtilsTest_partition.XXXXXX");
+  PartitionConfig part("system");
+  vector<Extent> apex_extents;
+  ASSERT_NO_FATAL_FAILURE(CreateApexPartition(
+      brillo::Blob(10, 'm'), partition_file, &part, &apex_extents));
+
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files, false));
+  ExtentRanges blocks;
+  bool found_zip = false, found_image_root = false;
+  for (const auto& file : files) {
+    EXPECT_EQ(0u, file.name.find("/apex/com.android.test.apex/"))
+        << file.name;
+    found_zip |= file.name == "/apex/com.android.test.apex/<zip>";
+    found_image_root |=
+        file.name == "/apex/com.android.test.apex/apex_payload.img/";
+    blocks.AddExtents(file.extents);
+  }
+  EXPECT_TRUE(found_zip);
+  EXPECT_TRUE(found_image_root);
+  // The files of the image and the rest of the zip cover the whole APEX.
+  ExtentRanges expected_blocks;
+  expected_blocks.AddExtents(apex_extents);
+  EXPECT_EQ(expected_blocks.extent_set(), blocks.extent_set());
+}
+
+TEST(DeflateUtilsTest, SplitApexAgainstOtherPartitionTest) {
+  ScopedTempFile partition_file("DeflateUtilsTest_partition.XXXXXX");
+  PartitionConfig part("system");
+  vector<Extent> apex_extents;
+  ASSERT_NO_FATAL_FAILURE(CreateApexPartition(
+      brillo::Blob(10, 'm'), partition_file, &part, &apex_extents));
+
+  // The same APEX isn't split.
+  ScopedTempFile same_file("DeflateUtilsTest_same.XXXXXX");
+  PartitionConfig same_part("system");
+  vector<Extent> same_extents;
+  ASSERT_NO_FATAL_FAILURE(CreateApexPartition(
+      brillo::Blob(10, 'm'), same_file, &same_part, &same_extents));
+  vector<FilesystemInterface::File> files;
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files, false, &same_part));
+  ASSERT_EQ(1u, files.size());
+  EXPECT_EQ("/apex/com.android.test.apex", files[0].name);
+
+  // An APEX with another manifest is.
+  ScopedTempFile other_file("DeflateUtilsTest_other.XXXXXX");
+  PartitionConfig other_part("system");
+  vector<Extent> other_extents;
+  ASSERT_NO_FATAL_FAILURE(CreateApexPartition(
+      brillo::Blob(11, 'n'), other_file, &other_part, &other_extents));
+  files.clear();
+  ASSERT_TRUE(PreprocessPartitionFiles(part, &files, false, &other_part));
+  EXPECT_LT(1u, files.size());
+}
+
 }  // namespace deflate_utils
 }  // namespace chromeos_update_engine
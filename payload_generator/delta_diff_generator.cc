@@ -37,6 +37,7 @@
 #include "update_engine/payload_generator/cow_size_estimator.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/full_update_generator.h"
+#include "update_engine/payload_generator/image_file.h"
 #include "update_engine/payload_generator/merge_sequence_generator.h"
 #include "update_engine/payload_generator/payload_file.h"
 #include "update_engine/update_metadata.pb.h"
@@ -50,6 +51,10 @@ namespace chromeos_update_engine {
 // bytes
 const size_t kRootFSPartitionSize = static_cast<size_t>(2) * 1024 * 1024 * 1024;
 
+// The COW space a compression factor larger than a block must save for a
+// partition, in percents, to be worth compressing its larger chunks.
+constexpr uint64_t kMinCompressionFactorSavingsPercent = 2;
+
 class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
   bool IsDynamicPartition(const std::string& partition_name) {
     for (const auto& group :
@@ -72,6 +77,7 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       std::vector<AnnotatedOperation>* aops,
       std::vector<CowMergeOperation>* cow_merge_sequence,
       android::snapshot::CowSizeInfo* cow_info,
+      uint64_t* compression_factor,
       std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy)
       : config_(config),
         old_part_(old_part),
@@ -80,6 +86,7 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
         aops_(aops),
         cow_merge_sequence_(cow_merge_sequence),
         cow_info_(cow_info),
+        compression_factor_(compression_factor),
         strategy_(std::move(strategy)) {}
   PartitionProcessor(PartitionProcessor&&) noexcept = default;
 
@@ -115,8 +122,8 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
     LOG(INFO) << "Estimating COW size for partition: " << new_part_.name;
     // Need the contents of source/target image bytes when doing
     // dry run.
-    auto target_fd = std::make_unique<EintrSafeFileDescriptor>();
-    target_fd->Open(new_part_.path.c_str(), O_RDONLY);
+    FileDescriptorPtr target_fd = image_file::Open(new_part_.path);
+    CHECK(target_fd) << "Failed to open " << new_part_.path;
 
     google::protobuf::RepeatedPtrField<InstallOperation> operations;
 
@@ -124,21 +131,53 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
       *operations.Add() = aop.op;
     }
 
-    FileDescriptorPtr source_fd = std::make_shared<EintrSafeFileDescriptor>();
-    source_fd->Open(old_part_.path.c_str(), O_RDONLY);
-
-    *cow_info_ = EstimateCowSizeInfo(
-        std::move(source_fd),
-        std::move(target_fd),
-        std::move(operations),
-        {cow_merge_sequence_->begin(), cow_merge_sequence_->end()},
-        config_.block_size,
-        config_.target.dynamic_partition_metadata->vabc_compression_param(),
-        new_part_.size,
-        old_part_.size,
-        config_.enable_vabc_xor,
-        config_.target.dynamic_partition_metadata->cow_version(),
-        config_.target.dynamic_partition_metadata->compression_factor());
+    FileDescriptorPtr source_fd;
+    if (!old_part_.path.empty()) {
+      source_fd = image_file::Open(old_part_.path);
+    }
+
+    const auto& metadata = *config_.target.dynamic_partition_metadata;
+    auto estimate_cow_size_info = [&](uint64_t compression_factor) {
+      return EstimateCowSizeInfo(
+          source_fd,
+          target_fd,
+          operations,
+          {cow_merge_sequence_->begin(), cow_merge_sequence_->end()},
+          config_.block_size,
+          metadata.vabc_compression_param(),
+          new_part_.size,
+          old_part_.size,
+          config_.enable_vabc_xor,
+          config_.version.minor,
+          metadata.cow_version(),
+          compression_factor);
+    };
+    *cow_info_ = estimate_cow_size_info(metadata.compression_factor());
+
+    // Only v3 COWs compress several blocks at once.
+    if (config_.tune_vabc_compression_factor &&
+        metadata.compression_factor() > config_.block_size &&
+        metadata.cow_version() >= 3 &&
+        metadata.vabc_compression_param() != "none") {
+      const android::snapshot::CowSizeInfo block_cow_info =
+          estimate_cow_size_info(config_.block_size);
+      LOG(INFO) << "COW size for partition " << new_part_.name << " with "
+                << metadata.compression_factor()
+                << " bytes compression factor: " << cow_info_->cow_size
+                << ", with " << config_.block_size
+                << " bytes: " << block_cow_info.cow_size;
+      const uint64_t min_savings =
+          block_cow_info.cow_size * kMinCompressionFactorSavingsPercent / 100;
+      if (block_cow_info.cow_size <= cow_info_->cow_size + min_savings) {
+        // The device may still use the larger factor if another partition
+        // needs it, so the estimate must hold for both.
+        *compression_factor_ = config_.block_size;
+        cow_info_->cow_size =
+            std::max(cow_info_->cow_size, block_cow_info.cow_size);
+        cow_info_->op_count_max =
+            std::max(cow_info_->op_count_max, block_cow_info.op_count_max);
+      }
+    }
 
     // add a 1% overhead to our estimation
     cow_info_->cow_size = cow_info_->cow_size * 1.01;
@@ -159,6 +198,7 @@ class PartitionProcessor : public base::DelegateSimpleThread::Delegate {
   std::vector<AnnotatedOperation>* aops_;
   std::vector<CowMergeOperation>* cow_merge_sequence_;
   android::snapshot::CowSizeInfo* cow_info_;
+  uint64_t* compression_factor_;
   std::unique_ptr<chromeos_update_engine::OperationsGenerator> strategy_;
   DISALLOW_COPY_AND_ASSIGN(PartitionProcessor);
 };
@@ -193,6 +233,8 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
 
     std::vector<android::snapshot::CowSizeInfo> all_cow_info(
         config.target.partitions.size());
+    std::vector<uint64_t> all_compression_factors(
+        config.target.partitions.size());
 
     std::vector<PartitionProcessor> partition_tasks{};
     auto thread_count = std::min<size_t>(diff_utils::GetMaxThreads(),
@@ -236,6 +278,7 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                                    &all_aops[i],
                                                    &all_merge_sequences[i],
                                                    &all_cow_info[i],
+                                                   &all_compression_factors[i],
                                                    std::move(strategy)));
     }
     thread_pool.Start();
@@ -253,7 +296,8 @@ bool GenerateUpdatePayloadFile(const PayloadGenerationConfig& config,
                                new_part,
                                std::move(all_aops[i]),
                                std::move(all_merge_sequences[i]),
-                               all_cow_info[i]));
+                               all_cow_info[i],
+                               all_compression_factors[i]));
     }
   }
   data_file.CloseFd();
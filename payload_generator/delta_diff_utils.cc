@@ -66,6 +66,8 @@
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/image_file.h"
+#include "update_engine/payload_generator/target_cache.h"
 #include "update_engine/payload_generator/xz.h"
 
 using std::list;
@@ -92,6 +94,23 @@ const uint64_t kMaxPuffdiffDestinationSize = 150 * 1024 * 1024;  // bytes
 // as zucchini tends to use more peak memory.
 const uint64_t kMaxZucchiniDestinationSize = 150 * 1024 * 1024;  // bytes
 
+// Files bigger than all the limits above would only get full operations, so
+// they are split in chunks that are diffed separately instead. The source
+// region of a chunk must fit in the smallest limit.
+const uint64_t kMaxDiffDestinationSize =
+    std::max({kMaxBsdiffDestinationSize,
+              kMaxPuffdiffDestinationSize,
+              kMaxZucchiniDestinationSize});
+const uint64_t kMinDiffDestinationSize =
+    std::min({kMaxBsdiffDestinationSize,
+              kMaxPuffdiffDestinationSize,
+              kMaxZucchiniDestinationSize});
+
+// The peak memory used to diff a chunk of a large file, per byte of the chunk.
+// bsdiff keeps a suffix array of 8 bytes per source byte next to the source
+// and target data, and the source region of a chunk is 1.5 times its size.
+const uint64_t kDiffMemoryPerChunkByte = 15;
+
 const int kBrotliCompressionQuality = 11;
 
 // Storing a diff operation has more overhead over replace operation in the
@@ -143,6 +162,29 @@ int LevenshteinDistance(const string& a, const string& b) {
   return distances.back();
 }
 
+// The number of old files sharing the most name trigrams with a new file which
+// names are compared to find the most similar one.
+constexpr size_t kMaxSimilarFileCandidates = 32;
+
+// The number of bytes at the start of the data of the files compared to tell
+// apart files with equally similar names.
+constexpr size_t kContentSignatureSize = 16;
+
+// Returns the distinct trigrams of |name|, padded so its first and last
+// characters are part of as many trigrams as the others.
+vector<uint32_t> NameTrigrams(const string& name) {
+  const string padded = '\0' + name + '\0';
+  vector<uint32_t> trigrams;
+  for (size_t i = 0; i + 3 <= padded.size(); i++) {
+    trigrams.push_back(static_cast<uint8_t>(padded[i]) << 16 |
+                       static_cast<uint8_t>(padded[i + 1]) << 8 |
+                       static_cast<uint8_t>(padded[i + 2]));
+  }
+  std::sort(trigrams.begin(), trigrams.end());
+  trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+  return trigrams;
+}
+
 static bool ShouldCreateNewOp(const std::vector<CowMergeOperation>& ops,
                               size_t src_block,
                               size_t dst_block,
@@ -160,6 +202,10 @@ static bool ShouldCreateNewOp(const std::vector<CowMergeOperation>& ops,
          dst_extent.start_block() + dst_extent.num_blocks() != dst_block;
 }
 
+}  // namespace
+
+namespace diff_utils {
+
 void AppendXorBlock(std::vector<CowMergeOperation>* ops,
                     size_t src_block,
                     size_t dst_block,
@@ -186,9 +232,6 @@ void AppendXorBlock(std::vector<CowMergeOperation>* ops,
   }
 }
 
-}  // namespace
-
-namespace diff_utils {
 bool BestDiffGenerator::GenerateBestDiffOperation(AnnotatedOperation* aop,
                                                   brillo::Blob* data_blob) {
   std::vector<std::pair<InstallOperation_Type, size_t>> diff_candidates = {
@@ -217,12 +260,17 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       config_.OperationEnabled(InstallOperation::LZ4DIFF_PUFFDIFF)) {
     brillo::Blob patch;
     InstallOperation::Type op_type{};
+    const base::TimeTicks start = base::TimeTicks::Now();
     if (Lz4Diff(old_data_,
                 new_data_,
                 old_block_info_,
                 new_block_info_,
                 &patch,
                 &op_type)) {
+      if (profile_) {
+        profile_->AddCandidate(
+            op_type, base::TimeTicks::Now() - start, patch.size());
+      }
       aop->op.set_type(op_type);
       // LZ4DIFF is likely significantly better than BSDIFF/PUFFDIFF when
       // working with EROFS. So no need to even try other diffing algorithms.
@@ -253,6 +301,8 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       op_type = InstallOperation::BROTLI_BSDIFF;
     }
 
+    const base::TimeTicks start = base::TimeTicks::Now();
+    candidate_size_ = 0;
     switch (op_type) {
       case InstallOperation::SOURCE_BSDIFF:
       case InstallOperation::BROTLI_BSDIFF:
@@ -268,6 +318,14 @@ bool BestDiffGenerator::GenerateBestDiffOperation(
       default:
         NOTREACHED();
     }
+    if (profile_ && candidate_size_ > 0) {
+      profile_->AddCandidate(
+          op_type, base::TimeTicks::Now() - start, candidate_size_);
+      profile_->peak_memory = std::max<uint64_t>(
+          profile_->peak_memory,
+          old_data_.size() + new_data_.size() + data_blob->size() +
+              candidate_size_);
+    }
   }
 
   return true;
@@ -299,6 +357,7 @@ bool BestDiffGenerator::TryBsdiffAndUpdateOperation(
 
   TEST_AND_RETURN_FALSE(utils::ReadFile(patch.value(), &bsdiff_delta));
   TEST_AND_RETURN_FALSE(!bsdiff_delta.empty());
+  candidate_size_ = bsdiff_delta.size();
 
   InstallOperation& operation = aop->op;
   if (IsDiffOperationBetter(operation,
@@ -331,6 +390,7 @@ bool BestDiffGenerator::TryPuffdiffAndUpdateOperation(AnnotatedOperation* aop,
                                            temp_file.path(),
                                            &puffdiff_delta));
     TEST_AND_RETURN_FALSE(!puffdiff_delta.empty());
+    candidate_size_ = puffdiff_delta.size();
 
     InstallOperation& operation = aop->op;
     if (IsDiffOperationBetter(operation,
@@ -376,6 +436,7 @@ bool BestDiffGenerator::TryZucchiniAndUpdateOperation(AnnotatedOperation* aop,
   brillo::Blob compressed_delta;
   TEST_AND_RETURN_FALSE(puffin::BrotliEncode(
       zucchini_delta.data(), zucchini_delta.size(), &compressed_delta));
+  candidate_size_ = compressed_delta.size();
 
   InstallOperation& operation = aop->op;
   if (IsDiffOperationBetter(operation,
@@ -426,6 +487,21 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   // Merge each file processor's ops list to aops.
   bool MergeOperation(vector<AnnotatedOperation>* aops);
 
+  // Marks this processor as diffing a chunk of |large_file|, which is too big
+  // to be diffed as a whole.
+  void SetLargeFile(const string& large_file) { large_file_ = large_file; }
+  const string& large_file() const { return large_file_; }
+
+  // The size of the blobs of the operations, and of those of the best full
+  // operations they replace.
+  uint64_t data_size() const;
+  uint64_t full_data_size() const { return full_data_size_; }
+  base::TimeDelta elapsed() const { return elapsed_; }
+
+  // The profile of the generation of the operations, when the config collects
+  // one.
+  GenerationProfile::File TakeProfile() { return std::move(profile_); }
+
  private:
   const string& old_part_;  // NOLINT(runtime/member_string_references)
   const string& new_part_;  // NOLINT(runtime/member_string_references)
@@ -439,11 +515,15 @@ class FileDeltaProcessor : public base::DelegateSimpleThread::Delegate {
   // Block limit of one aop.
   const ssize_t chunk_blocks_;
   BlobFileWriter* blob_file_;
+  string large_file_;
 
   // The list of ops to reach the new file from the old file.
   vector<AnnotatedOperation> file_aops_;
 
+  uint64_t full_data_size_ = 0;
+  base::TimeDelta elapsed_;
   bool failed_ = false;
+  GenerationProfile::File profile_;
 
   DISALLOW_COPY_AND_ASSIGN(FileDeltaProcessor);
 };
@@ -459,7 +539,9 @@ void FileDeltaProcessor::Run() {
                      new_extents_,
                      chunk_blocks_,
                      config_,
-                     blob_file_)) {
+                     blob_file_,
+                     &full_data_size_,
+                     config_.generation_profile ? &profile_ : nullptr)) {
     LOG(ERROR) << "Failed to generate delta for " << name_ << " ("
                << new_extents_blocks_ << " blocks)";
     failed_ = true;
@@ -473,8 +555,29 @@ void FileDeltaProcessor::Run() {
     return;
   }
 
+  elapsed_ = base::TimeTicks::Now() - start;
   LOG(INFO) << "Encoded file " << name_ << " (" << new_extents_blocks_
-            << " blocks) in " << (base::TimeTicks::Now() - start);
+            << " blocks) in " << elapsed_;
+
+  if (config_.generation_profile) {
+    profile_.name = name_;
+    profile_.large_file = large_file_;
+    profile_.source_file = old_extents_.name;
+    profile_.num_blocks = new_extents_blocks_;
+    for (const AnnotatedOperation& aop : file_aops_)
+      profile_.operation_types[aop.op.type()]++;
+    profile_.data_size = data_size();
+    profile_.full_data_size = full_data_size_;
+    profile_.elapsed = elapsed_;
+  }
+}
+
+uint64_t FileDeltaProcessor::data_size() const {
+  uint64_t size = 0;
+  for (const AnnotatedOperation& aop : file_aops_) {
+    size += aop.op.data_length();
+  }
+  return size;
 }
 
 bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
@@ -484,31 +587,119 @@ bool FileDeltaProcessor::MergeOperation(vector<AnnotatedOperation>* aops) {
   return true;
 }
 
-FilesystemInterface::File GetOldFile(
-    const map<string, FilesystemInterface::File>& old_files_map,
-    const string& new_file_name) {
-  if (old_files_map.empty())
+OldFileIndex::OldFileIndex(const string& old_part,
+                           const string& new_part,
+                           vector<File> old_files)
+    : old_part_(old_part), new_part_(new_part) {
+  // Keep the last file of each name.
+  map<string, File> files_map;
+  for (File& file : old_files)
+    files_map[file.name] = std::move(file);
+  files_.reserve(files_map.size());
+  for (auto& [name, file] : files_map) {
+    for (uint32_t trigram : NameTrigrams(name))
+      trigrams_[trigram].push_back(files_.size());
+    files_.push_back(std::move(file));
+  }
+}
+
+brillo::Blob OldFileIndex::ContentSignature(const string& part,
+                                            const File& file) {
+  brillo::Blob signature;
+  if (part.empty() || file.extents.empty() ||
+      !image_file::ReadChunk(part,
+                             file.extents[0].start_block() * kBlockSize,
+                             kContentSignatureSize,
+                             &signature)) {
     return {};
+  }
+  return signature;
+}
 
-  auto old_file_iter = old_files_map.find(new_file_name);
-  if (old_file_iter != old_files_map.end())
-    return old_file_iter->second;
+const File& OldFileIndex::Find(const File& new_file) const {
+  if (files_.empty())
+    return empty_file_;
+
+  auto exact = std::lower_bound(
+      files_.begin(),
+      files_.end(),
+      new_file.name,
+      [](const File& file, const string& name) { return file.name < name; });
+  if (exact != files_.end() && exact->name == new_file.name)
+    return *exact;
 
   // No old file matches the new file name. Use a similar file with the
-  // shortest levenshtein distance instead.
-  // This works great if the file has version number in it, but even for
-  // a completely new file, using a similar file can still help.
-  int min_distance =
-      LevenshteinDistance(new_file_name, old_files_map.begin()->first);
-  const FilesystemInterface::File* old_file = &old_files_map.begin()->second;
-  for (const auto& pair : old_files_map) {
-    int distance = LevenshteinDistance(new_file_name, pair.first);
+  // shortest levenshtein distance instead, only looking at the files sharing
+  // the most trigrams with the new file name. This works great if the file has
+  // version number in it, but even for a completely new file, using a similar
+  // file can still help.
+  map<size_t, size_t> shared_trigrams;
+  for (uint32_t trigram : NameTrigrams(new_file.name)) {
+    auto it = trigrams_.find(trigram);
+    if (it == trigrams_.end())
+      continue;
+    for (size_t index : it->second)
+      shared_trigrams[index]++;
+  }
+  vector<size_t> candidates;
+  if (shared_trigrams.empty()) {
+    // Nothing in common, fall back to all the old files.
+    candidates.resize(files_.size());
+    std::iota(candidates.begin(), candidates.end(), 0);
+  } else {
+    vector<std::pair<size_t, size_t>> by_count(shared_trigrams.begin(),
+                                               shared_trigrams.end());
+    const size_t num_candidates =
+        std::min(by_count.size(), kMaxSimilarFileCandidates);
+    std::partial_sort(by_count.begin(),
+                      by_count.begin() + num_candidates,
+                      by_count.end(),
+                      [](const auto& a, const auto& b) {
+                        return a.second > b.second ||
+                               (a.second == b.second && a.first < b.first);
+                      });
+    for (size_t i = 0; i < num_candidates; i++)
+      candidates.push_back(by_count[i].first);
+    std::sort(candidates.begin(), candidates.end());
+  }
+
+  int min_distance = std::numeric_limits<int>::max();
+  vector<size_t> closest;
+  for (size_t index : candidates) {
+    int distance = LevenshteinDistance(new_file.name, files_[index].name);
     if (distance < min_distance) {
       min_distance = distance;
-      old_file = &pair.second;
+      closest.clear();
     }
+    if (distance == min_distance)
+      closest.push_back(index);
   }
-  LOG(INFO) << "Using " << old_file->name << " as source for " << new_file_name;
+
+  // Among the files with the closest names, prefer one which data starts like
+  // the new file, as files of the same format do, then one of the closest
+  // size.
+  const File* old_file = &files_[closest[0]];
+  if (closest.size() > 1) {
+    const brillo::Blob new_signature = ContentSignature(new_part_, new_file);
+    const uint64_t new_blocks = utils::BlocksInExtents(new_file.extents);
+    auto rank = [&](const File& file) {
+      const uint64_t blocks = utils::BlocksInExtents(file.extents);
+      return std::make_pair(
+          new_signature.empty() ||
+              ContentSignature(old_part_, file) != new_signature,
+          blocks > new_blocks ? blocks - new_blocks : new_blocks - blocks);
+    };
+    auto best_rank = rank(*old_file);
+    for (size_t i = 1; i < closest.size(); i++) {
+      auto file_rank = rank(files_[closest[i]]);
+      if (file_rank < best_rank) {
+        best_rank = file_rank;
+        old_file = &files_[closest[i]];
+      }
+    }
+  }
+  LOG(INFO) << "Using " << old_file->name << " as source for "
+            << new_file.name;
   return *old_file;
 }
 
@@ -553,43 +744,69 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
 
   TEST_AND_RETURN_FALSE(new_part.fs_interface);
   vector<FilesystemInterface::File> new_files;
-  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-      new_part, &new_files, puffdiff_allowed));
+  // The cached target files don't depend on the source, so unchanged APEXes
+  // are only left whole when there's no cache. They're split on the source
+  // side only if they were changed, and their unchanged blocks are found
+  // below anyway.
+  if (config.target_cache) {
+    TEST_AND_RETURN_FALSE(config.target_cache->PreprocessPartitionFiles(
+        new_part, &new_files, puffdiff_allowed));
+  } else {
+    TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+        new_part,
+        &new_files,
+        puffdiff_allowed,
+        old_part.fs_interface ? &old_part : nullptr));
+  }
 
   ExtentRanges old_zero_blocks;
   // Prematurely removing moved blocks will render compression info useless.
   // Even if a single block inside a 100MB file is filtered out, the entire
   // 100MB file can't be decompressed. In this case we will fallback to BSDIFF,
-  // which performs much worse than LZ4diff. It's better to let LZ4DIFF perform
-  // decompression, and let underlying BSDIFF to take care of moved blocks.
-  // TODO(b/206729162) Implement block filtering with compression block info
-  const auto no_compressed_files =
-      std::all_of(new_files.begin(), new_files.end(), [](const File& a) {
-        return a.compressed_file_info.blocks.empty();
-      });
-  if (!config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF) ||
-      no_compressed_files) {
-    TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
-                                                  old_part.path,
-                                                  new_part.path,
-                                                  old_part.size / kBlockSize,
-                                                  new_part.size / kBlockSize,
-                                                  soft_chunk_blocks,
-                                                  config,
-                                                  blob_file,
-                                                  &old_visited_blocks,
-                                                  &new_visited_blocks,
-                                                  &old_zero_blocks));
-  }
-
-  map<string, FilesystemInterface::File> old_files_map;
+  // which performs much worse than LZ4diff. So only whole compression clusters
+  // are removed from the compressed files, and their compression info is
+  // updated to the clusters left.
+  const bool lz4diff_allowed =
+      config.OperationEnabled(InstallOperation::LZ4DIFF_BSDIFF);
+  vector<vector<Extent>> new_clusters;
+  if (lz4diff_allowed) {
+    for (const File& file : new_files) {
+      if (file.compressed_file_info.blocks.empty())
+        continue;
+      auto clusters = CompressionClusterExtents(file);
+      new_clusters.insert(new_clusters.end(),
+                          std::make_move_iterator(clusters.begin()),
+                          std::make_move_iterator(clusters.end()));
+    }
+  }
+  TEST_AND_RETURN_FALSE(DeltaMovedAndZeroBlocks(aops,
+                                                old_part.path,
+                                                new_part.path,
+                                                old_part.size / kBlockSize,
+                                                new_part.size / kBlockSize,
+                                                soft_chunk_blocks,
+                                                config,
+                                                blob_file,
+                                                &old_visited_blocks,
+                                                &new_visited_blocks,
+                                                &old_zero_blocks,
+                                                new_clusters));
+
+  vector<FilesystemInterface::File> old_files;
   if (old_part.fs_interface) {
-    vector<FilesystemInterface::File> old_files;
     TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
-        old_part, &old_files, puffdiff_allowed));
-    for (const FilesystemInterface::File& file : old_files)
-      old_files_map[file.name] = file;
+        old_part, &old_files, puffdiff_allowed, &new_part));
+  }
+  const OldFileIndex old_file_index(
+      old_part.path, new_part.path, std::move(old_files));
+
+  size_t max_threads = GetMaxThreads();
+
+  if (config.max_threads > 0 && config.max_threads < max_threads) {
+    max_threads = config.max_threads;
   }
+  const size_t large_file_chunk_blocks =
+      LargeFileChunkBlocks(config, max_threads);
 
   list<FileDeltaProcessor> file_delta_processors;
 
@@ -612,8 +829,7 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     if (new_file_extents.empty())
       continue;
 
-    FilesystemInterface::File old_file =
-        GetOldFile(old_files_map, new_file.name);
+    const FilesystemInterface::File& old_file = old_file_index.Find(new_file);
     old_visited_blocks.AddExtents(old_file.extents);
 
     // TODO(b/177104308) Filtering |new_file_extents| might confuse puffdiff, as
@@ -633,10 +849,46 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
     // whatsoever.
     auto filtered_new_file = new_file;
     filtered_new_file.extents = RemoveDuplicateBlocks(new_file_extents);
+    if (lz4diff_allowed && !new_file.compressed_file_info.blocks.empty() &&
+        utils::BlocksInExtents(filtered_new_file.extents) <
+            utils::BlocksInExtents(new_file.extents)) {
+      filtered_new_file.compressed_file_info =
+          FilterCompressedBlocks(new_file, filtered_new_file.extents);
+    }
+
+    // Files too big for any diff operation are diffed in chunks, in parallel,
+    // instead of being written with full operations. This also applies when
+    // the hard chunks would be too big for some diff operations.
+    const uint64_t new_file_size =
+        utils::BlocksInExtents(filtered_new_file.extents) * kBlockSize;
+    if (large_file_chunk_blocks > 0 && !old_file.extents.empty() &&
+        new_file_size > kMaxDiffDestinationSize &&
+        (hard_chunk_blocks == -1 ||
+         static_cast<uint64_t>(hard_chunk_blocks) * kBlockSize >
+             kMinDiffDestinationSize)) {
+      auto chunks =
+          SplitLargeFile(old_file, filtered_new_file, large_file_chunk_blocks);
+      LOG(INFO) << "Splitting " << new_file.name << " (" << new_file_size
+                << " bytes) in " << chunks.size() << " chunks to diff it.";
+      for (auto& [old_chunk, new_chunk] : chunks) {
+        const string chunk_name = new_chunk.name;
+        file_delta_processors.emplace_back(old_part.path,
+                                           new_part.path,
+                                           config,
+                                           std::move(old_chunk),
+                                           std::move(new_chunk),
+                                           chunk_name,  // operation name
+                                           -1,
+                                           blob_file);
+        file_delta_processors.back().SetLargeFile(new_file.name);
+      }
+      continue;
+    }
+
     file_delta_processors.emplace_back(old_part.path,
                                        new_part.path,
                                        config,
-                                       std::move(old_file),
+                                       old_file,
                                        std::move(filtered_new_file),
                                        new_file.name,  // operation name
                                        hard_chunk_blocks,
@@ -674,11 +926,6 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
                                        blob_file);
   }
 
-  size_t max_threads = GetMaxThreads();
-
-  if (config.max_threads > 0 && config.max_threads < max_threads) {
-    max_threads = config.max_threads;
-  }
   LOG(INFO) << "Using " << max_threads << " threads to process "
             << file_delta_processors.size() << " files on partition "
             << old_part.name;
@@ -700,6 +947,39 @@ bool DeltaReadPartition(vector<AnnotatedOperation>* aops,
   for (auto& processor : file_delta_processors) {
     TEST_AND_RETURN_FALSE(processor.MergeOperation(aops));
   }
+  if (config.generation_profile) {
+    for (auto& processor : file_delta_processors) {
+      config.generation_profile->AddFile(new_part.name,
+                                         processor.TakeProfile());
+    }
+  }
+
+  // Report what diffing the large files in chunks saved, and what it cost.
+  struct LargeFileStats {
+    size_t num_chunks = 0;
+    uint64_t data_size = 0;
+    uint64_t full_data_size = 0;
+    base::TimeDelta elapsed;
+  };
+  map<string, LargeFileStats> large_files;
+  for (const auto& processor : file_delta_processors) {
+    if (processor.large_file().empty())
+      continue;
+    LargeFileStats& stats = large_files[processor.large_file()];
+    stats.num_chunks++;
+    stats.data_size += processor.data_size();
+    stats.full_data_size += processor.full_data_size();
+    stats.elapsed += processor.elapsed();
+  }
+  for (const auto& [name, stats] : large_files) {
+    const int64_t saved = static_cast<int64_t>(stats.full_data_size) -
+                          static_cast<int64_t>(stats.data_size);
+    LOG(INFO) << "Diffed " << name << " in " << stats.num_chunks
+              << " chunks: " << stats.data_size << " bytes instead of "
+              << stats.full_data_size << " bytes of full operations, saving "
+              << saved << " bytes for " << stats.elapsed
+              << " of diffing across threads.";
+  }
 
   return true;
 }
@@ -714,16 +994,28 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
                              BlobFileWriter* blob_file,
                              ExtentRanges* old_visited_blocks,
                              ExtentRanges* new_visited_blocks,
-                             ExtentRanges* old_zero_blocks) {
+                             ExtentRanges* old_zero_blocks,
+                             const vector<vector<Extent>>& new_clusters) {
   vector<BlockMapping::BlockId> old_block_ids;
   vector<BlockMapping::BlockId> new_block_ids;
-  TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part,
-                                           new_part,
-                                           old_num_blocks * kBlockSize,
-                                           new_num_blocks * kBlockSize,
-                                           kBlockSize,
-                                           &old_block_ids,
-                                           &new_block_ids));
+  if (config.target_cache) {
+    TEST_AND_RETURN_FALSE(
+        config.target_cache->MapPartitionBlocks(old_part,
+                                                new_part,
+                                                old_num_blocks * kBlockSize,
+                                                new_num_blocks * kBlockSize,
+                                                kBlockSize,
+                                                &old_block_ids,
+                                                &new_block_ids));
+  } else {
+    TEST_AND_RETURN_FALSE(MapPartitionBlocks(old_part,
+                                             new_part,
+                                             old_num_blocks * kBlockSize,
+                                             new_num_blocks * kBlockSize,
+                                             kBlockSize,
+                                             &old_block_ids,
+                                             &new_block_ids));
+  }
 
   // A mapping from the block_id to the list of block numbers with that block id
   // in the old partition. This is used to lookup where in the old partition
@@ -731,6 +1023,9 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   map<BlockMapping::BlockId, vector<uint64_t>> old_blocks_map;
 
   for (uint64_t block = old_num_blocks; block-- > 0;) {
+    // Blocks that aren't in the new partition at all can't be moved.
+    if (old_block_ids[block] == BlockMapping::kNotFound)
+      continue;
     if (old_block_ids[block] != 0 && !old_visited_blocks->ContainsBlock(block))
       old_blocks_map[old_block_ids[block]].push_back(block);
 
@@ -753,9 +1048,41 @@ bool DeltaMovedAndZeroBlocks(vector<AnnotatedOperation>* aops,
   vector<Extent> old_identical_blocks;
   vector<Extent> new_identical_blocks;
 
+  // Whole compression clusters are moved or zeroed, or none of their blocks.
+  auto moved_or_zero = [&](uint64_t block) {
+    if (new_visited_blocks->ContainsBlock(block) || new_block_ids[block] == 0)
+      return true;
+    auto old_blocks_map_it = old_blocks_map.find(new_block_ids[block]);
+    return old_blocks_map_it != old_blocks_map.end() &&
+           !old_blocks_map_it->second.empty();
+  };
+  ExtentRanges kept_cluster_blocks;
+  size_t kept_clusters = 0;
+  for (const vector<Extent>& cluster : new_clusters) {
+    const bool removable = std::all_of(
+        cluster.begin(), cluster.end(), [&moved_or_zero](const Extent& extent) {
+          for (uint64_t block = extent.start_block();
+               block < extent.start_block() + extent.num_blocks();
+               block++) {
+            if (!moved_or_zero(block))
+              return false;
+          }
+          return true;
+        });
+    if (!removable) {
+      kept_cluster_blocks.AddExtents(cluster);
+      kept_clusters++;
+    }
+  }
+  if (!new_clusters.empty()) {
+    LOG(INFO) << "Keeping " << kept_clusters << " of " << new_clusters.size()
+              << " compression clusters with blocks not moved nor zeroed.";
+  }
+
   for (uint64_t block = 0; block < new_num_blocks; block++) {
     // Only produce operations for blocks that were not yet visited.
-    if (new_visited_blocks->ContainsBlock(block))
+    if (new_visited_blocks->ContainsBlock(block) ||
+        kept_cluster_blocks.ContainsBlock(block))
       continue;
     if (new_block_ids[block] == 0) {
       AppendBlockToExtents(&new_zeros, block);
@@ -860,7 +1187,9 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const File& new_file,
                    ssize_t chunk_blocks,
                    const PayloadGenerationConfig& config,
-                   BlobFileWriter* blob_file) {
+                   BlobFileWriter* blob_file,
+                   uint64_t* full_data_size,
+                   GenerationProfile::File* profile) {
   const auto& old_extents = old_file.extents;
   const auto& new_extents = new_file.extents;
   const auto& name = new_file.name;
@@ -900,7 +1229,9 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                                             new_file,
                                             config,
                                             &data,
-                                            &aop));
+                                            &aop,
+                                            full_data_size,
+                                            profile));
 
     // Check if the operation writes nothing.
     if (aop.op.dst_extents_size() == 0) {
@@ -920,6 +1251,107 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
   return true;
 }
 
+size_t LargeFileChunkBlocks(const PayloadGenerationConfig& config,
+                            size_t num_threads) {
+  if (config.large_file_chunk_size == 0)
+    return 0;
+  // The source region of a chunk has a margin of a quarter of a chunk on each
+  // side, and must stay under the limits of all the diff operations.
+  uint64_t chunk_size = std::min<uint64_t>(config.large_file_chunk_size,
+                                           kMinDiffDestinationSize * 2 / 3);
+  // Every thread may be diffing a chunk at the same time.
+  if (config.large_file_memory_budget > 0) {
+    chunk_size = std::min(chunk_size,
+                          config.large_file_memory_budget /
+                              (std::max<size_t>(num_threads, 1) *
+                               kDiffMemoryPerChunkByte));
+  }
+  return std::max<uint64_t>(chunk_size / kBlockSize, 1);
+}
+
+vector<vector<Extent>> CompressionClusterExtents(const File& file) {
+  vector<vector<Extent>> clusters;
+  const uint64_t num_blocks = utils::BlocksInExtents(file.extents);
+  uint64_t start_block = 0;
+  uint64_t offset = 0;
+  for (const CompressedBlock& block : file.compressed_file_info.blocks) {
+    offset += block.compressed_length;
+    const uint64_t end_block = std::min(offset / kBlockSize, num_blocks);
+    if (offset % kBlockSize != 0 || end_block <= start_block)
+      continue;
+    clusters.push_back(
+        ExtentsSublist(file.extents, start_block, end_block - start_block));
+    start_block = end_block;
+  }
+  if (start_block < num_blocks) {
+    clusters.push_back(
+        ExtentsSublist(file.extents, start_block, num_blocks - start_block));
+  }
+  return clusters;
+}
+
+CompressedFile FilterCompressedBlocks(const File& file,
+                                      const vector<Extent>& extents) {
+  ExtentRanges kept_blocks;
+  kept_blocks.AddExtents(extents);
+  CompressedFile compressed_file = file.compressed_file_info;
+  compressed_file.blocks.clear();
+  uint64_t offset = 0;
+  uint64_t uncompressed_offset = 0;
+  for (CompressedBlock block : file.compressed_file_info.blocks) {
+    const uint64_t start_block = offset / kBlockSize;
+    offset += block.compressed_length;
+    const uint64_t end_block = (offset + kBlockSize - 1) / kBlockSize;
+    const auto block_extents =
+        ExtentsSublist(file.extents, start_block, end_block - start_block);
+    if (std::none_of(block_extents.begin(),
+                     block_extents.end(),
+                     [&kept_blocks](const Extent& extent) {
+                       return kept_blocks.OverlapsWithExtent(extent);
+                     })) {
+      continue;
+    }
+    // The data of the clusters left is decompressed back to back.
+    block.uncompressed_offset = uncompressed_offset;
+    uncompressed_offset += block.uncompressed_length;
+    compressed_file.blocks.push_back(block);
+  }
+  return compressed_file;
+}
+
+vector<std::pair<File, File>> SplitLargeFile(const File& old_file,
+                                             const File& new_file,
+                                             size_t chunk_blocks) {
+  vector<std::pair<File, File>> chunks;
+  const uint64_t old_blocks = utils::BlocksInExtents(old_file.extents);
+  const uint64_t new_blocks = utils::BlocksInExtents(new_file.extents);
+  const uint64_t margin = chunk_blocks / 4;
+  for (uint64_t offset = 0; offset < new_blocks; offset += chunk_blocks) {
+    File old_chunk = old_file;
+    File new_chunk = new_file;
+    // The LZ4 compressed blocks of a file can't be split, so chunks are diffed
+    // with bsdiff. Deflates are kept, they are filtered by the extents.
+    old_chunk.compressed_file_info = {};
+    new_chunk.compressed_file_info = {};
+    new_chunk.name = android::base::StringPrintf(
+        "%s:%" PRIu64, new_file.name.c_str(), offset / chunk_blocks);
+    new_chunk.extents = ExtentsSublist(new_file.extents, offset, chunk_blocks);
+
+    // Data inserted or removed before the chunk shifts it in the old file, so
+    // the chunk is matched with the old data at the same relative offset.
+    const uint64_t old_offset = offset * old_blocks / new_blocks;
+    const uint64_t old_start = old_offset - std::min(old_offset, margin);
+    old_chunk.extents =
+        ExtentsSublist(old_file.extents,
+                       old_start,
+                       old_offset - old_start + chunk_blocks + margin);
+    NormalizeExtents(&old_chunk.extents);
+    NormalizeExtents(&new_chunk.extents);
+    chunks.emplace_back(std::move(old_chunk), std::move(new_chunk));
+  }
+  return chunks;
+}
+
 bool GenerateBestFullOperation(const brillo::Blob& new_data,
                                const PayloadVersion& version,
                                brillo::Blob* out_blob,
@@ -1048,7 +1480,9 @@ bool ReadExtentsToDiff(const string& old_part,
                        const File& new_file,
                        const PayloadGenerationConfig& config,
                        brillo::Blob* out_data,
-                       AnnotatedOperation* out_op) {
+                       AnnotatedOperation* out_op,
+                       uint64_t* full_data_size,
+                       GenerationProfile::File* profile) {
   const auto& version = config.version;
   AnnotatedOperation& aop = *out_op;
   InstallOperation& operation = aop.op;
@@ -1062,11 +1496,11 @@ bool ReadExtentsToDiff(const string& old_part,
 
   // Read in bytes from new data.
   brillo::Blob new_data;
-  TEST_AND_RETURN_FALSE(utils::ReadExtents(new_part,
-                                           dst_extents,
-                                           &new_data,
-                                           kBlockSize * blocks_to_write,
-                                           kBlockSize));
+  TEST_AND_RETURN_FALSE(image_file::ReadExtents(new_part,
+                                                dst_extents,
+                                                &new_data,
+                                                kBlockSize * blocks_to_write,
+                                                kBlockSize));
   TEST_AND_RETURN_FALSE(!new_data.empty());
 
   // Data blob that will be written to delta file.
@@ -1075,18 +1509,35 @@ bool ReadExtentsToDiff(const string& old_part,
   // Try generating a full operation for the given new data, regardless of the
   // old_data.
   InstallOperation::Type op_type{};
-  TEST_AND_RETURN_FALSE(
-      GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
+  const base::TimeTicks full_start = base::TimeTicks::Now();
+  if (!config.target_cache ||
+      !config.target_cache->GetFullOperation(
+          new_part, dst_extents, &op_type, &data_blob)) {
+    TEST_AND_RETURN_FALSE(
+        GenerateBestFullOperation(new_data, version, &data_blob, &op_type));
+    if (config.target_cache) {
+      config.target_cache->AddFullOperation(
+          new_part, dst_extents, op_type, data_blob);
+    }
+  }
   operation.set_type(op_type);
+  if (full_data_size)
+    *full_data_size += data_blob.size();
+  if (profile) {
+    profile->AddCandidate(
+        op_type, base::TimeTicks::Now() - full_start, data_blob.size());
+  }
+  uint64_t data_memory = new_data.size() + data_blob.size();
 
   if (blocks_to_read > 0) {
     brillo::Blob old_data;
     // Read old data.
-    TEST_AND_RETURN_FALSE(utils::ReadExtents(old_part,
-                                             src_extents,
-                                             &old_data,
-                                             kBlockSize * blocks_to_read,
-                                             kBlockSize));
+    TEST_AND_RETURN_FALSE(image_file::ReadExtents(old_part,
+                                                  src_extents,
+                                                  &old_data,
+                                                  kBlockSize * blocks_to_read,
+                                                  kBlockSize));
+    data_memory += old_data.size();
     if (old_data == new_data) {
       // No change in data.
       operation.set_type(InstallOperation::SOURCE_COPY);
@@ -1103,6 +1554,7 @@ bool ReadExtentsToDiff(const string& old_part,
                                             old_file,
                                             new_file,
                                             config);
+      best_diff_generator.set_profile(profile);
       if (!best_diff_generator.GenerateBestDiffOperation(&aop, &data_blob)) {
         LOG(INFO) << "Failed to generate diff for " << new_file.name;
         return false;
@@ -1110,6 +1562,9 @@ bool ReadExtentsToDiff(const string& old_part,
     }
   }
 
+  if (profile)
+    profile->peak_memory = std::max(profile->peak_memory, data_memory);
+
   // WARNING: We always set legacy |src_length| and |dst_length| fields for
   // BSDIFF. For SOURCE_BSDIFF we only set them for minor version 3 and
   // lower. This is needed because we used to use these two parameters in the
@@ -1150,9 +1605,18 @@ bool IsNoSourceOperation(InstallOperation::Type op_type) {
 
 bool InitializePartitionInfo(const PartitionConfig& part, PartitionInfo* info) {
   info->set_size(part.size);
+  FileDescriptorPtr fd = image_file::Open(part.path);
+  TEST_AND_RETURN_FALSE(fd);
   HashCalculator hasher;
-  TEST_AND_RETURN_FALSE(hasher.UpdateFile(part.path, part.size) ==
-                        static_cast<off_t>(part.size));
+  brillo::Blob buffer(128 * 1024);
+  for (uint64_t offset = 0; offset < part.size; offset += buffer.size()) {
+    buffer.resize(std::min<uint64_t>(buffer.size(), part.size - offset));
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(utils::ReadAll(
+        fd, buffer.data(), buffer.size(), offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(buffer.size()));
+    TEST_AND_RETURN_FALSE(hasher.Update(buffer.data(), buffer.size()));
+  }
   TEST_AND_RETURN_FALSE(hasher.Finalize());
   const brillo::Blob& hash = hasher.raw_hash();
   info->set_hash(hash.data(), hash.size());
@@ -1177,7 +1641,7 @@ bool IsExtFilesystem(const string& device) {
   // See include/linux/ext2_fs.h for more details on the structure. We obtain
   // ext2 constants from ext2fs/ext2fs.h header but we don't link with the
   // library.
-  if (!utils::ReadFileChunk(
+  if (!image_file::ReadChunk(
           device, 0, SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE, &header) ||
       header.size() < SUPERBLOCK_OFFSET + SUPERBLOCK_SIZE)
     return false;
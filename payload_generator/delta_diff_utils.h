@@ -19,9 +19,11 @@
 
 #include <map>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <vector>
 
+#include <base/macros.h>
 #include <brillo/secure_blob.h>
 #include <puffin/puffdiff.h>
 
@@ -29,6 +31,7 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/generation_profile.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -64,18 +67,34 @@ bool DeltaReadPartition(std::vector<AnnotatedOperation>* aops,
 // The collections |old_visited_blocks| and |new_visited_blocks| state what
 // blocks already have operations reading or writing them and only operations
 // for unvisited blocks are produced by this function updating both collections
-// with the used blocks.
-bool DeltaMovedAndZeroBlocks(std::vector<AnnotatedOperation>* aops,
-                             const std::string& old_part,
-                             const std::string& new_part,
-                             size_t old_num_blocks,
-                             size_t new_num_blocks,
-                             ssize_t chunk_blocks,
-                             const PayloadGenerationConfig& version,
-                             BlobFileWriter* blob_file,
-                             ExtentRanges* old_visited_blocks,
-                             ExtentRanges* new_visited_blocks,
-                             ExtentRanges* old_zero_blocks);
+// with the used blocks. The blocks of each of the |new_clusters| are only used
+// if all of them are moved or zeroed, see CompressionClusterExtents().
+bool DeltaMovedAndZeroBlocks(
+    std::vector<AnnotatedOperation>* aops,
+    const std::string& old_part,
+    const std::string& new_part,
+    size_t old_num_blocks,
+    size_t new_num_blocks,
+    ssize_t chunk_blocks,
+    const PayloadGenerationConfig& version,
+    BlobFileWriter* blob_file,
+    ExtentRanges* old_visited_blocks,
+    ExtentRanges* new_visited_blocks,
+    ExtentRanges* old_zero_blocks,
+    const std::vector<std::vector<Extent>>& new_clusters = {});
+
+// Returns the extents of the compression clusters of the compressed |file|, in
+// the partition, followed by the blocks after the last one. Clusters ending in
+// the middle of a block are merged with the next ones. Removing only some of
+// the blocks of a cluster from the file would make the other clusters
+// impossible to decompress.
+std::vector<std::vector<Extent>> CompressionClusterExtents(const File& file);
+
+// Returns the compression info of |file| with only the compressed blocks of
+// the clusters which data is in |extents|, a subset of the file extents
+// which keeps or removes whole clusters.
+CompressedFile FilterCompressedBlocks(const File& file,
+                                      const std::vector<Extent>& extents);
 
 // For a given file |name| append operations to |aops| to produce it in the
 // |new_part|. The file will be split in chunks of |chunk_blocks| blocks each
@@ -84,7 +103,9 @@ bool DeltaMovedAndZeroBlocks(std::vector<AnnotatedOperation>* aops,
 // exists, the old version exists in |old_part| in the blocks described by
 // |old_extents|. The operations added to |aops| reference the data blob
 // in the |blob_file|. |old_deflates| and |new_deflates| are all deflate
-// locations in |old_part| and |new_part|. Returns true on success.
+// locations in |old_part| and |new_part|. If not null, the size of the best
+// full operations of the chunks is added to |full_data_size|. If not null, the
+// candidate operations tried are added to |profile|. Returns true on success.
 bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const std::string& old_part,
                    const std::string& new_part,
@@ -92,7 +113,23 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
                    const File& new_file,
                    ssize_t chunk_blocks,
                    const PayloadGenerationConfig& config,
-                   BlobFileWriter* blob_file);
+                   BlobFileWriter* blob_file,
+                   uint64_t* full_data_size = nullptr,
+                   GenerationProfile::File* profile = nullptr);
+
+// Returns the number of blocks of the chunks that the files too big for any
+// diff operation are split in, so that diffing a chunk on each of
+// |num_threads| threads fits in the memory budget of |config|. Returns 0 if
+// such files aren't split.
+size_t LargeFileChunkBlocks(const PayloadGenerationConfig& config,
+                            size_t num_threads);
+
+// Splits |new_file| in chunks of |chunk_blocks| blocks named after the file
+// and the chunk index. Each chunk is paired with the blocks of |old_file| at
+// the same relative offset, plus a quarter of a chunk on each side.
+std::vector<std::pair<File, File>> SplitLargeFile(const File& old_file,
+                                                  const File& new_file,
+                                                  size_t chunk_blocks);
 
 // Reads the blocks |old_extents| from |old_part| (if it exists) and the
 // |new_extents| from |new_part| and determines the smallest way to encode
@@ -102,7 +139,10 @@ bool DeltaReadFile(std::vector<AnnotatedOperation>* aops,
 // operations allowed in the given |version| (REPLACE, REPLACE_BZ, BSDIFF,
 // SOURCE_BSDIFF, PUFFDIFF or ZUCCHINI) wins.
 // |new_extents| must not be empty. |old_deflates| and |new_deflates| are all
-// the deflate locations in |old_part| and |new_part|. Returns true on success.
+// the deflate locations in |old_part| and |new_part|. If not null, the size of
+// the best full operation is added to |full_data_size|. If not null, the
+// candidate operations tried and the data held in memory are added to
+// |profile|. Returns true on success.
 // TODO(197361113) Move logic to calculate deflates inside puffin.
 bool ReadExtentsToDiff(const std::string& old_part,
                        const std::string& new_part,
@@ -112,7 +152,9 @@ bool ReadExtentsToDiff(const std::string& old_part,
                        const File& new_file,
                        const PayloadGenerationConfig& config,
                        brillo::Blob* out_data,
-                       AnnotatedOperation* out_op);
+                       AnnotatedOperation* out_op,
+                       uint64_t* full_data_size = nullptr,
+                       GenerationProfile::File* profile = nullptr);
 
 // Generates the best allowed full operation to produce |new_data|. The allowed
 // operations are based on |payload_version|. The operation blob will be stored
@@ -145,11 +187,50 @@ bool IsExtFilesystem(const std::string& device);
 // Returns the max number of threads to process the files(chunks) in parallel.
 size_t GetMaxThreads();
 
-// Returns the old file which file name has the shortest levenshtein distance to
-// |new_file_name|.
-FilesystemInterface::File GetOldFile(
-    const std::map<std::string, FilesystemInterface::File>& old_files_map,
-    const std::string& new_file_name);
+// Index of the files of the old partition to find the source file of each new
+// file, built once per partition.
+class OldFileIndex {
+ public:
+  // The data of the files is read from |old_part| and |new_part| to compare
+  // their contents, and isn't when they are empty.
+  OldFileIndex(const std::string& old_part,
+               const std::string& new_part,
+               std::vector<File> old_files);
+
+  // Returns the old file with the same name as |new_file|, or else the one
+  // which name has the shortest levenshtein distance to it among the files
+  // sharing the most name trigrams with it. Ties are broken by the first
+  // bytes of the data, then by the size. Returns an empty file if there are
+  // no old files.
+  const File& Find(const File& new_file) const;
+
+ private:
+  // Returns the first bytes of the data of |file| in |part|.
+  static brillo::Blob ContentSignature(const std::string& part,
+                                       const File& file);
+
+  std::string old_part_;
+  std::string new_part_;
+
+  // The old files, sorted by name.
+  std::vector<File> files_;
+
+  // The indexes in |files_| of the files with each trigram in their name.
+  std::unordered_map<uint32_t, std::vector<size_t>> trigrams_;
+
+  const File empty_file_;
+
+  DISALLOW_COPY_AND_ASSIGN(OldFileIndex);
+};
+
+// Appends to |ops| a COW_XOR op of |dst_block| with the source block
+// |src_block| shifted by |src_offset| bytes, extending the last op of |ops| if
+// it's contiguous. The |src_extent| of the ops doesn't include the extra block
+// read when |src_offset| isn't 0.
+void AppendXorBlock(std::vector<CowMergeOperation>* ops,
+                    size_t src_block,
+                    size_t dst_block,
+                    size_t src_offset);
 
 // Read BSDIFF patch data in |data|, compute list of blocks that can be COW_XOR,
 // store these blocks in |aop|.
@@ -220,6 +301,10 @@ class BestDiffGenerator {
       AnnotatedOperation* aop,
       brillo::Blob* data_blob);
 
+  // Sets the profile of the file the candidate operations tried are added
+  // to, or nullptr. Not owned.
+  void set_profile(GenerationProfile::File* profile) { profile_ = profile; }
+
  private:
   std::vector<bsdiff::CompressorType> GetUsableCompressorTypes() const;
   bool TryBsdiffAndUpdateOperation(InstallOperation_Type operation_type,
@@ -239,6 +324,9 @@ class BestDiffGenerator {
   const CompressedFile& old_block_info_;
   const CompressedFile& new_block_info_;
   const PayloadGenerationConfig& config_;
+  GenerationProfile::File* profile_{nullptr};
+  // The size of the blob of the last candidate tried, 0 if it was skipped.
+  uint64_t candidate_size_{0};
 };
 
 }  // namespace diff_utils
@@ -126,8 +126,10 @@ class DeltaDiffUtilsTest : public ::testing::Test {
 
   // Helper function to call DeltaMovedAndZeroBlocks() using this class' data
   // members. This simply avoids repeating all the arguments that never change.
-  bool RunDeltaMovedAndZeroBlocks(ssize_t chunk_blocks,
-                                  uint32_t minor_version) {
+  bool RunDeltaMovedAndZeroBlocks(
+      ssize_t chunk_blocks,
+      uint32_t minor_version,
+      const vector<vector<Extent>>& new_clusters = {}) {
     BlobFileWriter blob_file(tmp_blob_file_.fd(), &blob_size_);
     PayloadVersion version(kBrilloMajorPayloadVersion, minor_version);
     ExtentRanges old_zero_blocks;
@@ -141,7 +143,8 @@ class DeltaDiffUtilsTest : public ::testing::Test {
                                                &blob_file,
                                                &old_visited_blocks_,
                                                &new_visited_blocks_,
-                                               &old_zero_blocks);
+                                               &old_zero_blocks,
+                                               new_clusters);
   }
 
   // Old and new temporary partitions used in the tests. These are initialized
@@ -309,6 +312,42 @@ TEST_F(DeltaDiffUtilsTest, SourceBsdiffTest) {
   ASSERT_EQ(InstallOperation::SOURCE_BSDIFF, op.type());
 }
 
+TEST_F(DeltaDiffUtilsTest, ReadExtentsToDiffProfileTest) {
+  brillo::Blob data_blob(kBlockSize);
+  test_utils::FillWithData(&data_blob);
+  vector<Extent> old_extents = {ExtentForRange(1, 1)};
+  vector<Extent> new_extents = {ExtentForRange(2, 1)};
+  ASSERT_TRUE(WriteExtents(old_part_.path, old_extents, kBlockSize, data_blob));
+  data_blob[0]++;
+  ASSERT_TRUE(WriteExtents(new_part_.path, new_extents, kBlockSize, data_blob));
+
+  brillo::Blob data;
+  AnnotatedOperation aop;
+  GenerationProfile::File profile;
+  ASSERT_TRUE(diff_utils::ReadExtentsToDiff(
+      old_part_.path,
+      new_part_.path,
+      old_extents,
+      new_extents,
+      {},  // old_deflates
+      {},  // new_deflates
+      {.version = PayloadVersion(kBrilloMajorPayloadVersion,
+                                 kSourceMinorPayloadVersion)},
+      &data,
+      &aop,
+      nullptr,
+      &profile));
+  ASSERT_EQ(InstallOperation::SOURCE_BSDIFF, aop.op.type());
+
+  // The best full operation and the diff were both tried.
+  ASSERT_EQ(2u, profile.candidates.size());
+  EXPECT_EQ(1u, profile.candidates.begin()->second.num_operations);
+  const auto bsdiff = profile.candidates.find(InstallOperation::SOURCE_BSDIFF);
+  ASSERT_NE(profile.candidates.end(), bsdiff);
+  EXPECT_EQ(data.size(), bsdiff->second.data_size);
+  EXPECT_GE(profile.peak_memory, 2 * kBlockSize + data.size());
+}
+
 TEST_F(DeltaDiffUtilsTest, BrotliBsdiffTest) {
   // Makes sure SOURCE_BSDIFF operations are emitted whenever src_ops_allowed
   // is true. It is the same setup as BsdiffSmallTest, which checks
@@ -542,6 +581,60 @@ TEST_F(DeltaDiffUtilsTest, IdenticalBlocksAreCopiedFromSource) {
   }
 }
 
+TEST_F(DeltaDiffUtilsTest, PartiallyMovedClustersAreKeptTest) {
+  old_part_.size = kBlockSize * 50;
+  new_part_.size = kBlockSize * 50;
+  InitializePartitionWithUniqueBlocks(old_part_, block_size_, 42);
+  InitializePartitionWithUniqueBlocks(new_part_, block_size_, 42);
+
+  // Only one block of the first cluster changed.
+  ASSERT_TRUE(WriteExtents(new_part_.path,
+                           {ExtentForRange(12, 1)},
+                           kBlockSize,
+                           brillo::Blob(kBlockSize, 'a')));
+
+  ASSERT_TRUE(RunDeltaMovedAndZeroBlocks(
+      -1,  // chunk_blocks
+      kSourceMinorPayloadVersion,
+      {{ExtentForRange(10, 5)},
+       {ExtentForRange(15, 2), ExtentForRange(30, 3)}}));
+
+  ExtentRanges expected_ranges;
+  expected_ranges.AddExtent(ExtentForRange(0, 50));
+  expected_ranges.SubtractExtent(ExtentForRange(10, 5));
+  ASSERT_EQ(expected_ranges.extent_set(), new_visited_blocks_.extent_set());
+}
+
+TEST_F(DeltaDiffUtilsTest, CompressionClusterExtentsTest) {
+  FilesystemInterface::File file;
+  file.extents = {ExtentForRange(10, 4), ExtentForRange(20, 4)};
+  file.compressed_file_info.blocks = {
+      CompressedBlock(0, 2 * kBlockSize, 3 * kBlockSize),
+      CompressedBlock(3 * kBlockSize, kBlockSize + 100, 2 * kBlockSize),
+      CompressedBlock(5 * kBlockSize, kBlockSize - 100, 2 * kBlockSize),
+      CompressedBlock(7 * kBlockSize, 3 * kBlockSize, 4 * kBlockSize),
+  };
+
+  // The second and third blocks share a cluster, the last block of the file
+  // isn't compressed.
+  vector<vector<Extent>> expected_clusters = {
+      {ExtentForRange(10, 2)},
+      {ExtentForRange(12, 2)},
+      {ExtentForRange(20, 3)},
+      {ExtentForRange(23, 1)},
+  };
+  EXPECT_EQ(expected_clusters, diff_utils::CompressionClusterExtents(file));
+
+  const CompressedFile filtered = diff_utils::FilterCompressedBlocks(
+      file, {ExtentForRange(12, 2), ExtentForRange(20, 3)});
+  ASSERT_EQ(3u, filtered.blocks.size());
+  EXPECT_EQ(0u, filtered.blocks[0].uncompressed_offset);
+  EXPECT_EQ(kBlockSize + 100, filtered.blocks[0].compressed_length);
+  EXPECT_EQ(2 * kBlockSize, filtered.blocks[1].uncompressed_offset);
+  EXPECT_EQ(4 * kBlockSize, filtered.blocks[2].uncompressed_offset);
+  EXPECT_EQ(3 * kBlockSize, filtered.blocks[2].compressed_length);
+}
+
 TEST_F(DeltaDiffUtilsTest, IdenticalBlocksAreCopiedInOder) {
   // We use a smaller partition for this test.
   old_part_.size = block_size_ * 50;
@@ -686,12 +779,14 @@ TEST_F(DeltaDiffUtilsTest, IsExtFilesystemTest) {
       test_utils::GetBuildArtifactsPath("gen/disk_ext2_4k.img")));
 }
 
-TEST_F(DeltaDiffUtilsTest, GetOldFileEmptyTest) {
-  ASSERT_TRUE(diff_utils::GetOldFile({}, "filename").name.empty());
+TEST_F(DeltaDiffUtilsTest, OldFileIndexEmptyTest) {
+  FilesystemInterface::File new_file;
+  new_file.name = "filename";
+  ASSERT_TRUE(diff_utils::OldFileIndex("", "", {}).Find(new_file).name.empty());
 }
 
-TEST_F(DeltaDiffUtilsTest, GetOldFileTest) {
-  std::map<string, FilesystemInterface::File> old_files_map;
+TEST_F(DeltaDiffUtilsTest, OldFileIndexTest) {
+  vector<FilesystemInterface::File> old_files;
   auto file_list = {
       "filename",
       "filename.zip",
@@ -704,29 +799,106 @@ TEST_F(DeltaDiffUtilsTest, GetOldFileTest) {
   for (const auto& name : file_list) {
     FilesystemInterface::File file;
     file.name = name;
-    old_files_map.emplace(name, file);
+    old_files.push_back(file);
   }
+  const diff_utils::OldFileIndex index("", "", std::move(old_files));
+  auto find = [&index](const string& name) {
+    FilesystemInterface::File new_file;
+    new_file.name = name;
+    return index.Find(new_file).name;
+  };
 
   // Always return exact match if possible.
   for (const auto& name : file_list)
-    ASSERT_EQ(diff_utils::GetOldFile(old_files_map, name).name, name);
-
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "file_name").name,
-            "filename");
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "filename_new.zip").name,
-            "filename.zip");
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "version1.2").name,
-            "version1.1");
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "version3.0").name,
-            "version2.0");
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "_version").name, "version");
-  ASSERT_EQ(
-      diff_utils::GetOldFile(old_files_map, "update_engine_unittest").name,
-      "update_engine");
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "bin/delta_generator").name,
-            "delta_generator");
+    ASSERT_EQ(find(name), name);
+
+  ASSERT_EQ(find("file_name"), "filename");
+  ASSERT_EQ(find("filename_new.zip"), "filename.zip");
+  ASSERT_EQ(find("version1.2"), "version1.1");
+  ASSERT_EQ(find("version3.0"), "version2.0");
+  ASSERT_EQ(find("_version"), "version");
+  ASSERT_EQ(find("update_engine_unittest"), "update_engine");
+  ASSERT_EQ(find("bin/delta_generator"), "delta_generator");
   // Check file name with minimum size.
-  ASSERT_EQ(diff_utils::GetOldFile(old_files_map, "a").name, "filename");
+  ASSERT_EQ(find("a"), "filename");
+}
+
+TEST_F(DeltaDiffUtilsTest, OldFileIndexTieBreakTest) {
+  // The old libraries are all as close to lib2.so, lib3.so starts like it and
+  // lib4.so has the same size.
+  brillo::Blob old_data(5 * kBlockSize, 'a');
+  std::fill(old_data.begin() + 2 * kBlockSize,
+            old_data.begin() + 4 * kBlockSize,
+            'b');
+  brillo::Blob new_data(kBlockSize, 'b');
+  ASSERT_TRUE(test_utils::WriteFileVector(old_part_.path, old_data));
+  ASSERT_TRUE(test_utils::WriteFileVector(new_part_.path, new_data));
+
+  vector<FilesystemInterface::File> old_files(3);
+  old_files[0].name = "/lib/lib1.so";
+  old_files[0].extents = {ExtentForRange(0, 2)};
+  old_files[1].name = "/lib/lib3.so";
+  old_files[1].extents = {ExtentForRange(2, 2)};
+  old_files[2].name = "/lib/lib4.so";
+  old_files[2].extents = {ExtentForRange(4, 1)};
+  FilesystemInterface::File new_file;
+  new_file.name = "/lib/lib2.so";
+  new_file.extents = {ExtentForRange(0, 1)};
+
+  EXPECT_EQ(
+      "/lib/lib3.so",
+      diff_utils::OldFileIndex(old_part_.path, new_part_.path, old_files)
+          .Find(new_file)
+          .name);
+  // Without the data, the file of the closest size is used.
+  EXPECT_EQ("/lib/lib4.so",
+            diff_utils::OldFileIndex("", "", old_files).Find(new_file).name);
+}
+
+TEST_F(DeltaDiffUtilsTest, LargeFileChunkBlocksTest) {
+  PayloadGenerationConfig config;
+  EXPECT_EQ(64u * 1024 * 1024 / kBlockSize,
+            diff_utils::LargeFileChunkBlocks(config, 4));
+
+  // The source region of a chunk must fit in every diff size limit.
+  config.large_file_chunk_size = 512 * 1024 * 1024;
+  EXPECT_EQ(100u * 1024 * 1024 / kBlockSize,
+            diff_utils::LargeFileChunkBlocks(config, 4));
+
+  // Diffing a chunk on each of the 4 threads must fit in the budget.
+  config.large_file_memory_budget = 4 * 15 * 8 * 1024 * 1024;
+  EXPECT_EQ(8u * 1024 * 1024 / kBlockSize,
+            diff_utils::LargeFileChunkBlocks(config, 4));
+
+  config.large_file_chunk_size = 0;
+  EXPECT_EQ(0u, diff_utils::LargeFileChunkBlocks(config, 4));
+}
+
+TEST_F(DeltaDiffUtilsTest, SplitLargeFileTest) {
+  FilesystemInterface::File old_file;
+  old_file.name = "file";
+  old_file.extents = {ExtentForRange(10, 60), ExtentForRange(200, 40)};
+  FilesystemInterface::File new_file;
+  new_file.name = "file";
+  new_file.extents = {ExtentForRange(1000, 200)};
+
+  // The new file is twice as big, so a chunk of 40 blocks is matched with the
+  // 40 blocks of the old file at half its offset, plus a margin of 10 blocks
+  // on each side.
+  auto chunks = diff_utils::SplitLargeFile(old_file, new_file, 40);
+  ASSERT_EQ(5u, chunks.size());
+  EXPECT_EQ("file:0", chunks[0].second.name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(1000, 40)}, chunks[0].second.extents);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(10, 50)}, chunks[0].first.extents);
+
+  EXPECT_EQ("file:2", chunks[2].second.name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(1080, 40)}, chunks[2].second.extents);
+  EXPECT_EQ((vector<Extent>{ExtentForRange(40, 30), ExtentForRange(200, 30)}),
+            chunks[2].first.extents);
+
+  EXPECT_EQ("file:4", chunks[4].second.name);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(1160, 40)}, chunks[4].second.extents);
+  EXPECT_EQ(vector<Extent>{ExtentForRange(210, 30)}, chunks[4].first.extents);
 }
 
 TEST_F(DeltaDiffUtilsTest, XorOpsSourceNotAligned) {
@@ -18,13 +18,13 @@
 
 #include <endian.h>
 #include <fcntl.h>
+#include <string.h>
 #include <time.h>
 
 #include <array>
 #include <string>
 #include <mutex>
 
-#include <android-base/unique_fd.h>
 #include <erofs/dir.h>
 #include <erofs/io.h>
 #include <erofs_fs.h>
@@ -38,6 +38,7 @@
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
 #include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/image_file.h"
 
 namespace chromeos_update_engine {
 
@@ -157,25 +158,32 @@ static void FillExtentInfo(FilesystemInterface::File* p_file,
   return;
 }
 
-bool IsErofsImage(const char* path) {
-  android::base::unique_fd fd(open(path, O_RDONLY));
-  uint32_t buf{};
-  if (pread(fd.get(), &buf, 4, EROFS_SUPER_OFFSET) < 0) {
+bool IsErofsImage(const std::string& path) {
+  brillo::Blob buf;
+  if (!image_file::ReadChunk(path, EROFS_SUPER_OFFSET, 4, &buf) ||
+      buf.size() != 4) {
     return false;
   }
-  return le32toh(buf) == EROFS_SUPER_MAGIC_V1;
+  uint32_t magic{};
+  memcpy(&magic, buf.data(), sizeof(magic));
+  return le32toh(magic) == EROFS_SUPER_MAGIC_V1;
 }
 
 }  // namespace
 
 std::unique_ptr<ErofsFilesystem> ErofsFilesystem::CreateFromFile(
     const std::string& filename, const CompressionAlgorithm& algo) {
-  if (!IsErofsImage(filename.c_str())) {
+  if (!IsErofsImage(filename)) {
     return {};
   }
+  // liberofs only reads raw files.
+  const std::string raw_path = image_file::GetRawPath(filename);
+  if (raw_path.empty()) {
+    return nullptr;
+  }
   struct erofs_sb_info sbi {};
 
-  if (const auto err = erofs_dev_open(&sbi, filename.c_str(), O_RDONLY); err) {
+  if (const auto err = erofs_dev_open(&sbi, raw_path.c_str(), O_RDONLY); err) {
     PLOG(INFO) << "Failed to open " << filename;
     return nullptr;
   }
@@ -188,9 +196,9 @@ std::unique_ptr<ErofsFilesystem> ErofsFilesystem::CreateFromFile(
     return nullptr;
   }
   const auto block_size = 1UL << sbi.blkszbits;
-  struct stat st {};
-  if (const auto err = stat(filename.c_str(), &st); err) {
-    PLOG(ERROR) << "Failed to stat() " << filename;
+  const off_t image_size = image_file::Size(filename);
+  if (image_size < 0) {
+    PLOG(ERROR) << "Failed to get the size of " << filename;
     return nullptr;
   }
   const time_t time = sbi.build_time;
@@ -198,14 +206,14 @@ std::unique_ptr<ErofsFilesystem> ErofsFilesystem::CreateFromFile(
   CHECK(ErofsFilesystem::GetFiles(&sbi, filename, &files, algo))
       << "Failed to parse EROFS image " << filename;
 
-  LOG(INFO) << "Parsed EROFS image of size " << st.st_size << " built in "
+  LOG(INFO) << "Parsed EROFS image of size " << image_size << " built in "
             << ctime(&time) << " " << filename
             << ", number of files: " << files.size()
             << ", block size: " << block_size;
   LOG(INFO) << "Using compression algo " << algo << " for " << filename;
   // private ctor doesn't work with make_unique
   return std::unique_ptr<ErofsFilesystem>(
-      new ErofsFilesystem(filename, st.st_size, std::move(files)));
+      new ErofsFilesystem(filename, image_size, std::move(files)));
 }
 
 bool ErofsFilesystem::GetFiles(std::vector<File>* files) const {
@@ -272,8 +280,8 @@ bool ErofsFilesystem::GetFiles(struct erofs_sb_info* sbi,
   }
   LOG(INFO) << "EROFS image " << filename << " has " << unaligned_bytes
             << " unaligned bytes, which is "
-            << static_cast<float>(unaligned_bytes) / utils::FileSize(filename) *
-                   100.0f
+            << static_cast<float>(unaligned_bytes) /
+                   image_file::Size(filename) * 100.0f
             << "% of partition data";
   return true;
 }
@@ -17,6 +17,7 @@
 #include "update_engine/payload_generator/ext2_filesystem.h"
 
 #include <et/com_err.h>
+#include <string.h>
 #if defined(__clang__)
 // TODO(*): Remove these pragmas when b/35721782 is fixed.
 #pragma clang diagnostic push
@@ -29,6 +30,7 @@
 #endif
 
 #include <map>
+#include <memory>
 #include <set>
 
 #include <base/logging.h>
@@ -37,6 +39,7 @@
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 #include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/image_file.h"
 #include "update_engine/update_metadata.pb.h"
 
 using std::set;
@@ -124,6 +127,111 @@ int UpdateFileAndAppend(ext2_ino_t dir,
   return 0;
 }
 
+// A read-only libext2fs I/O manager over the partition images registered in
+// image_file, so sparse images are parsed in place.
+using SparseImagePtr = std::shared_ptr<const SparseImage>;
+
+io_manager SparseIoManager();
+
+errcode_t SparseIoOpen(const char* name, int flags, io_channel* channel) {
+  SparseImagePtr image = image_file::GetImage(name);
+  if (!image)
+    return EXT2_ET_BAD_DEVICE_NAME;
+  if (flags & IO_FLAG_RW)
+    return EXT2_ET_UNIMPLEMENTED;
+  io_channel io = nullptr;
+  errcode_t err = ext2fs_get_memzero(sizeof(struct struct_io_channel), &io);
+  if (err)
+    return err;
+  err = ext2fs_get_mem(strlen(name) + 1, &io->name);
+  if (err) {
+    ext2fs_free_mem(&io);
+    return err;
+  }
+  strcpy(io->name, name);
+  io->magic = EXT2_ET_MAGIC_IO_CHANNEL;
+  io->manager = SparseIoManager();
+  io->block_size = 1024;
+  io->refcount = 1;
+  io->private_data = new SparseImagePtr(std::move(image));
+  *channel = io;
+  return 0;
+}
+
+errcode_t SparseIoClose(io_channel channel) {
+  if (--channel->refcount > 0)
+    return 0;
+  delete static_cast<SparseImagePtr*>(channel->private_data);
+  ext2fs_free_mem(&channel->name);
+  ext2fs_free_mem(&channel);
+  return 0;
+}
+
+errcode_t SparseIoSetBlksize(io_channel channel, int blksize) {
+  channel->block_size = blksize;
+  return 0;
+}
+
+errcode_t SparseIoReadBlk64(io_channel channel,
+                            unsigned long long block,  // NOLINT(runtime/int)
+                            int count,
+                            void* data) {
+  // A negative |count| is a number of bytes rather than of blocks.
+  const uint64_t size =
+      count < 0 ? -static_cast<int64_t>(count)
+                : static_cast<uint64_t>(count) * channel->block_size;
+  const SparseImage& image =
+      **static_cast<SparseImagePtr*>(channel->private_data);
+  if (!image.Read(block * channel->block_size, data, size)) {
+    memset(data, 0, size);
+    return EXT2_ET_SHORT_READ;
+  }
+  return 0;
+}
+
+errcode_t SparseIoReadBlk(io_channel channel,
+                          unsigned long block,  // NOLINT(runtime/int)
+                          int count,
+                          void* data) {
+  return SparseIoReadBlk64(channel, block, count, data);
+}
+
+errcode_t SparseIoWriteBlk(io_channel channel,
+                           unsigned long block,  // NOLINT(runtime/int)
+                           int count,
+                           const void* data) {
+  return EXT2_ET_UNIMPLEMENTED;
+}
+
+errcode_t SparseIoWriteBlk64(io_channel channel,
+                             unsigned long long block,  // NOLINT(runtime/int)
+                             int count,
+                             const void* data) {
+  return EXT2_ET_UNIMPLEMENTED;
+}
+
+errcode_t SparseIoFlush(io_channel channel) {
+  return 0;
+}
+
+io_manager SparseIoManager() {
+  static struct struct_io_manager* manager = [] {
+    auto* manager = new struct struct_io_manager();
+    manager->magic = EXT2_ET_MAGIC_IO_MANAGER;
+    manager->name = "Sparse image I/O Manager";
+    manager->open = SparseIoOpen;
+    manager->close = SparseIoClose;
+    manager->set_blksize = SparseIoSetBlksize;
+    manager->read_blk = SparseIoReadBlk;
+    manager->write_blk = SparseIoWriteBlk;
+    manager->flush = SparseIoFlush;
+    manager->read_blk64 = SparseIoReadBlk64;
+    manager->write_blk64 = SparseIoWriteBlk64;
+    return manager;
+  }();
+  return manager;
+}
+
 }  // namespace
 
 unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
@@ -137,7 +245,9 @@ unique_ptr<Ext2Filesystem> Ext2Filesystem::CreateFromFile(
                               0,  // flags (read only)
                               0,  // superblock block number
                               0,  // block_size (autodetect)
-                              unix_io_manager,
+                              image_file::GetImage(filename)
+                                  ? SparseIoManager()
+                                  : unix_io_manager,
                               &result->filsys_);
   if (err) {
     LOG(ERROR) << "Opening ext2fs " << filename;
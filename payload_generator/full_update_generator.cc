@@ -16,12 +16,12 @@
 
 #include "update_engine/payload_generator/full_update_generator.h"
 
-#include <fcntl.h>
 #include <inttypes.h>
 
 #include <algorithm>
 #include <deque>
 #include <memory>
+#include <string>
 
 #include <base/format_macros.h>
 #include <android-base/stringprintf.h>
@@ -31,6 +31,7 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/image_file.h"
 
 using std::vector;
 
@@ -41,19 +42,20 @@ namespace {
 const size_t kDefaultFullChunkSize = 1024 * 1024;  // 1 MiB
 
 // This class encapsulates a full update chunk processing thread work. The
-// processor reads a chunk of data from the input file descriptor and compresses
-// it. The processor will destroy itself when the work is done.
+// processor reads a chunk of data from the input image and compresses it. The
+// processor will destroy itself when the work is done.
 class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
  public:
-  // Read a chunk of |size| bytes from |fd| starting at offset |offset|.
+  // Read a chunk of |size| bytes from the image |path| starting at offset
+  // |offset|.
   ChunkProcessor(const PayloadVersion& version,
-                 int fd,
+                 const std::string& path,
                  off_t offset,
                  size_t size,
                  BlobFileWriter* blob_file,
                  AnnotatedOperation* aop)
       : version_(version),
-        fd_(fd),
+        path_(path),
         offset_(offset),
         size_(size),
         blob_file_(blob_file),
@@ -63,7 +65,7 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
   ~ChunkProcessor() override = default;
 
   // Overrides DelegateSimpleThread::Delegate.
-  // Run() handles the read from |fd| in a thread-safe way, and stores the
+  // Run() handles the read from |path| in a thread-safe way, and stores the
   // new operation to generate the region starting at |offset| of size |size|
   // in the output operation |aop|. The associated blob data is stored in
   // |blob_fd| and |blob_file_size| is updated.
@@ -74,7 +76,7 @@ class ChunkProcessor : public base::DelegateSimpleThread::Delegate {
 
   // Work parameters.
   const PayloadVersion& version_;
-  int fd_;
+  const std::string& path_;
   off_t offset_;
   size_t size_;
   BlobFileWriter* blob_file_;
@@ -94,8 +96,12 @@ bool ChunkProcessor::ProcessChunk() {
   brillo::Blob buffer_in_(size_);
   brillo::Blob op_blob;
   ssize_t bytes_read = -1;
-  TEST_AND_RETURN_FALSE(utils::PReadAll(
-      fd_, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
+  // Each chunk opens the image, as its descriptor can't be shared between
+  // threads.
+  FileDescriptorPtr fd = image_file::Open(path_);
+  TEST_AND_RETURN_FALSE(fd);
+  TEST_AND_RETURN_FALSE(utils::ReadAll(
+      fd, buffer_in_.data(), buffer_in_.size(), offset_, &bytes_read));
   TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size_));
 
   InstallOperation::Type op_type;
@@ -141,10 +147,6 @@ bool FullUpdateGenerator::GenerateOperations(
             << " blocks (" << config.block_size << " bytes each) using "
             << max_threads << " threads";
 
-  int in_fd = open(new_part.path.c_str(), O_RDONLY, 0);
-  TEST_AND_RETURN_FALSE(in_fd >= 0);
-  ScopedFdCloser in_fd_closer(&in_fd);
-
   // We potentially have all the ChunkProcessors in memory but only
   // |max_threads| will actually hold a block in memory while we process.
   size_t partition_blocks = new_part.size / config.block_size;
@@ -171,7 +173,7 @@ bool FullUpdateGenerator::GenerateOperations(
 
     chunk_processors.emplace_back(
         config.version,
-        in_fd,
+        new_part.path,
         static_cast<off_t>(start_block) * config.block_size,
         num_blocks * config.block_size,
         blob_file,
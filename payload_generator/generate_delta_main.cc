@@ -14,8 +14,11 @@
 // limitations under the License.
 //
 
+#include <chrono>
 #include <cstring>
+#include <future>
 #include <map>
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -42,9 +45,17 @@
 #include "update_engine/payload_consumer/filesystem_verifier_action.h"
 #include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/generation_profile.h"
+#include "update_engine/payload_generator/image_file.h"
+#include "update_engine/payload_generator/payload_checker.h"
 #include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/payload_generator/payload_merger.h"
 #include "update_engine/payload_generator/payload_properties.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/sparse_image.h"
+#include "update_engine/payload_generator/target_cache.h"
+#include "update_engine/payload_generator/target_files_archive.h"
 #include "update_engine/payload_generator/xz.h"
 #include "update_engine/update_metadata.pb.h"
 
@@ -272,6 +283,51 @@ bool ExtractProperties(const string& payload_path,
   return true;
 }
 
+bool CheckPayload(const string& payload_path,
+                  const string& report_file,
+                  size_t max_threads) {
+  PayloadChecker checker(payload_path, max_threads);
+  PayloadChecker::Result result;
+  const bool readable = checker.Run(&result);
+  string report;
+  TEST_AND_RETURN_FALSE(result.ToJson(&report));
+  if (report_file.empty() || report_file == "-") {
+    printf("%s\n", report.c_str());
+  } else {
+    TEST_AND_RETURN_FALSE(
+        utils::WriteFile(report_file.c_str(), report.c_str(), report.size()));
+    LOG(INFO) << "Generated payload check report at " << report_file;
+  }
+  return readable && result.valid();
+}
+
+bool MergePayloads(const string& payloads,
+                   const string& partition_names,
+                   const string& out_file,
+                   const string& private_key,
+                   const string& out_metadata_size_file) {
+  vector<string> names;
+  if (!partition_names.empty()) {
+    names = base::SplitString(
+        partition_names, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+  }
+  PayloadMerger merger(names);
+  for (const string& payload : base::SplitString(
+           payloads, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL)) {
+    TEST_AND_RETURN_FALSE(merger.AddPayload(payload));
+  }
+  uint64_t metadata_size{};
+  TEST_AND_RETURN_FALSE(
+      merger.WritePayload(out_file, private_key, &metadata_size));
+  if (!out_metadata_size_file.empty()) {
+    const string metadata_size_string = std::to_string(metadata_size);
+    TEST_AND_RETURN_FALSE(utils::WriteFile(out_metadata_size_file.c_str(),
+                                           metadata_size_string.data(),
+                                           metadata_size_string.size()));
+  }
+  return true;
+}
+
 template <typename Key, typename Val>
 string ToString(const map<Key, Val>& map) {
   vector<string> result;
@@ -314,13 +370,29 @@ DEFINE_string(old_partitions,
               "Path to the old partitions. To pass multiple partitions, use "
               "a single argument with a colon between paths, e.g. "
               "/path/to/part:/path/to/part2::/path/to/last_part . Path can "
-              "be empty, but it has to match the order of partition_names.");
+              "be empty, but it has to match the order of partition_names. "
+              "Android sparse images are accepted.");
 DEFINE_string(new_partitions,
               "",
               "Path to the new partitions. To pass multiple partitions, use "
               "a single argument with a colon between paths, e.g. "
               "/path/to/part:/path/to/part2:/path/to/last_part . Path has "
-              "to match the order of partition_names.");
+              "to match the order of partition_names. Android sparse images "
+              "are accepted.");
+DEFINE_string(old_target_files,
+              "",
+              "Path to the source target-files zip. If set, the paths in "
+              "--old_partitions and --old_mapfiles are names of entries in "
+              "this zip, e.g. IMAGES/system.img, which are read without "
+              "unzipping it.");
+DEFINE_string(new_target_files,
+              "",
+              "Path to the target target-files zip. If set, the paths in "
+              "--new_partitions and --new_mapfiles are names of entries in "
+              "this zip, e.g. IMAGES/system.img, which are read without "
+              "unzipping it. Its META/postinstall_config.txt, "
+              "META/dynamic_partitions_info.txt and META/apex_info.pb are "
+              "used unless the corresponding flag is passed.");
 DEFINE_string(old_mapfiles,
               "",
               "Path to the .map files associated with the partition files "
@@ -391,6 +463,25 @@ DEFINE_string(properties_format,
               kPayloadPropertiesFormatKeyValue,
               "Defines the format of the --properties_file. The acceptable "
               "values are: key-value (default) and json");
+DEFINE_bool(check_payload,
+            false,
+            "If set, statically checks the payload passed in --in_file "
+            "without applying it and exits with a non-zero status if it's "
+            "invalid. Look at --check_report_file.");
+DEFINE_string(check_report_file,
+              "",
+              "Where to write the JSON report of --check_payload, stdout if "
+              "empty or -.");
+DEFINE_string(merge_payloads,
+              "",
+              "Colon separated payloads whose partition updates are copied, "
+              "without generating them again, to the payload --out_file. It "
+              "is signed with --private_key if given.");
+DEFINE_string(merge_partition_names,
+              "",
+              "Colon separated partitions of --merge_payloads to copy, all of "
+              "them if empty. If any partition is left out, the output is a "
+              "partial update.");
 DEFINE_int64(max_timestamp,
              0,
              "The maximum timestamp of the OS allowed to apply this "
@@ -433,6 +524,18 @@ DEFINE_bool(
 DEFINE_bool(enable_vabc_xor,
             false,
             "Whether to use Virtual AB Compression XOR feature");
+DEFINE_bool(enable_xor_similarity_search,
+            false,
+            "Whether to search the source partitions for blocks similar to "
+            "the ones written by full operations, and XOR these blocks with "
+            "them in the COW. Requires --enable_vabc_xor and minor version "
+            "11 or newer.");
+DEFINE_bool(tune_vabc_compression_factor,
+            false,
+            "Whether to estimate the COW of each partition with both the VABC "
+            "compression factor and single blocks, and tell the device to "
+            "compress single blocks where the larger chunks save little space. "
+            "Doubles the time spent estimating the COW sizes.");
 DEFINE_string(apex_info_file,
               "",
               "Path to META/apex_info.pb found in target build");
@@ -464,15 +567,166 @@ DEFINE_int64(max_threads,
              "The maximum number of threads allowed for generating "
              "ota.");
 
+DEFINE_uint64(large_file_chunk_size_mb,
+              64,
+              "Files too big for any diff operation are split in chunks of "
+              "this size, diffed separately, instead of being written with "
+              "full operations. 0 disables the splitting.");
+DEFINE_uint64(large_file_memory_budget_mb,
+              0,
+              "Memory the chunks of large files may use while being diffed "
+              "in parallel; chunks are made smaller to fit. 0 means no limit.");
+DEFINE_string(generation_profile_file,
+              "",
+              "Path to write the profile of the generation of each file of "
+              "the delta partitions to: the source file chosen, the "
+              "operations tried with their time and size, the operations "
+              "kept and the memory used, with the slowest and largest files "
+              "of each partition. Written in CSV if the path ends with .csv, "
+              "without the summary, and in JSON otherwise.");
+DEFINE_uint64(generation_profile_top_files,
+              10,
+              "The number of slowest and largest files of each partition to "
+              "summarize in --generation_profile_file.");
+
+DEFINE_uint64(data_chunk_size_kb,
+              0,
+              "Add the hashes of chunks of this size to the data of full "
+              "operations bigger than it, so the client can apply it as it's "
+              "downloaded. 0 disables the chunk hashes.");
+
+DEFINE_bool(async_verity_verification,
+            false,
+            "Verify the verity hash tree and FEC of the target images in the "
+            "background while generating the payload, instead of before it. "
+            "The output payload is deleted if verification fails.");
+
+DEFINE_string(batch_out_files,
+              "",
+              "Comma separated paths of the delta payloads to generate, one "
+              "for each source build, all to the same target given by "
+              "--new_partitions. The work that only depends on the target is "
+              "done once for all of them. Replaces --out_file.");
+DEFINE_string(batch_old_partitions,
+              "",
+              "Comma separated source builds of --batch_out_files, each a "
+              "list of partitions separated by a colon as with "
+              "--old_partitions. If empty, --old_partitions is used for every "
+              "source, which is useful with --batch_old_target_files.");
+DEFINE_string(batch_old_mapfiles,
+              "",
+              "Comma separated .map files of the source builds of "
+              "--batch_out_files, each separated by a colon as with "
+              "--old_mapfiles.");
+DEFINE_string(batch_old_target_files,
+              "",
+              "Comma separated target-files zips of the source builds of "
+              "--batch_out_files, in which their partitions and .map files "
+              "are read as with --old_target_files.");
+DEFINE_uint64(batch_full_op_cache_mb,
+              1024,
+              "Memory used to keep the compressed full operations of the "
+              "target partitions between the payloads of --batch_out_files.");
+
+// Writes the entry |name| of |archive| to a temporary file kept alive in
+// |temp_files| and returns its path.
+string ExtractArchiveEntry(
+    TargetFilesArchive* archive,
+    const string& name,
+    std::vector<std::unique_ptr<ScopedTempFile>>* temp_files) {
+  temp_files->emplace_back(std::make_unique<ScopedTempFile>(
+      base::FilePath(name).BaseName().value() + ".XXXXXX"));
+  const string& path = temp_files->back()->path();
+  CHECK(archive->ExtractEntry(name, path))
+      << "Failed to read " << name << " from " << archive->path();
+  return path;
+}
+
+// Replaces the partition and .map file paths of |config|, which are names of
+// entries in |archive|. The partition images are read from the archive where
+// possible, registered in |images|, and the rest are temporary files.
+void ExtractArchivePartitions(
+    TargetFilesArchive* archive,
+    ImageConfig* config,
+    std::vector<std::unique_ptr<ScopedTempFile>>* temp_files,
+    std::vector<std::unique_ptr<ScopedImageFile>>* images) {
+  for (auto& part : config->partitions) {
+    if (!part.path.empty()) {
+      temp_files->emplace_back(std::make_unique<ScopedTempFile>(
+          base::FilePath(part.path).BaseName().value() + ".XXXXXX"));
+      string image_path;
+      std::unique_ptr<ScopedImageFile> image;
+      CHECK(archive->OpenImageEntry(
+          part.path, temp_files->back()->path(), &image_path, &image))
+          << "Failed to read " << part.path << " from " << archive->path();
+      part.path = image_path;
+      if (image) {
+        images->push_back(std::move(image));
+      }
+    }
+    if (!part.mapfile_path.empty()) {
+      part.mapfile_path =
+          ExtractArchiveEntry(archive, part.mapfile_path, temp_files);
+    }
+  }
+  const auto& stats = archive->stats();
+  LOG(INFO) << "Read " << stats.entries << " entries of " << archive->path()
+            << " in " << stats.elapsed.count() << " ms, copying "
+            << stats.copied_bytes << " bytes and inflating "
+            << stats.inflated_bytes << " bytes. Unzipping them and "
+            << "expanding the sparse images would have written "
+            << stats.saved_bytes << " more bytes.";
+}
+
+// Returns the path of the file passed in |flag|, or if empty, that of a
+// temporary copy of the entry |name| of |archive| when it exists.
+string GetMetaFile(const string& flag,
+                   TargetFilesArchive* archive,
+                   const string& name,
+                   std::vector<std::unique_ptr<ScopedTempFile>>* temp_files) {
+  if (!flag.empty() || !archive || !archive->HasEntry(name)) {
+    return flag;
+  }
+  return ExtractArchiveEntry(archive, name, temp_files);
+}
+
+// Registers every partition image of |config| which is an Android sparse image
+// in |images|, so its chunks are read in place rather than from a raw copy.
+void RegisterSparseImages(
+    const ImageConfig& config,
+    std::vector<std::unique_ptr<ScopedImageFile>>* images) {
+  for (const auto& part : config.partitions) {
+    if (part.path.empty() || image_file::GetImage(part.path) ||
+        !SparseImage::IsSparseImage(part.path)) {
+      continue;
+    }
+    auto image = SparseImage::Open(part.path);
+    CHECK(image) << "Failed to parse sparse image " << part.path;
+    LOG(INFO) << "Reading sparse image " << part.path << " of partition "
+              << part.name << " in place, " << image->size()
+              << " bytes expanded.";
+    images->emplace_back(
+        std::make_unique<ScopedImageFile>(part.path, std::move(image)));
+  }
+}
+
+// The registered images are resized rather than truncated, as they may be
+// read in place from an archive.
 void RoundDownPartitions(const ImageConfig& config) {
   for (const auto& part : config.partitions) {
     if (part.path.empty()) {
       continue;
     }
-    const auto size = std::max<size_t>(utils::FileSize(part.path), kBlockSize);
+    const auto size =
+        std::max<size_t>(image_file::Size(part.path), kBlockSize);
     if (size % kBlockSize != 0) {
-      const auto err =
-          truncate(part.path.c_str(), size / kBlockSize * kBlockSize);
+      const auto rounded_size = size / kBlockSize * kBlockSize;
+      if (image_file::GetImage(part.path)) {
+        CHECK(image_file::Resize(part.path, rounded_size))
+            << "Failed to resize " << part.path;
+        continue;
+      }
+      const auto err = truncate(part.path.c_str(), rounded_size);
       CHECK_EQ(err, 0) << "Failed to truncate " << part.path << ", error "
                        << strerror(errno);
     }
@@ -484,16 +738,148 @@ void RoundUpPartitions(const ImageConfig& config) {
     if (part.path.empty()) {
       continue;
     }
-    const auto size = utils::FileSize(part.path);
+    const auto size = image_file::Size(part.path);
     if (size % kBlockSize != 0) {
-      const auto err = truncate(
-          part.path.c_str(), (size + kBlockSize - 1) / kBlockSize * kBlockSize);
+      const auto rounded_size =
+          (size + kBlockSize - 1) / kBlockSize * kBlockSize;
+      if (image_file::GetImage(part.path)) {
+        CHECK(image_file::Resize(part.path, rounded_size))
+            << "Failed to resize " << part.path;
+        continue;
+      }
+      const auto err = truncate(part.path.c_str(), rounded_size);
       CHECK_EQ(err, 0) << "Failed to truncate " << part.path << ", error "
                        << strerror(errno);
     }
   }
 }
 
+vector<string> SplitBatchFlag(const string& flag) {
+  if (flag.empty()) {
+    return {};
+  }
+  return base::SplitString(
+      flag, ",", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+}
+
+// Generates a delta payload to the target of |config| from each of the source
+// builds in the --batch_* flags. The block mapping, file list, partition hash
+// and full operations of the target partitions are shared by all the payloads
+// through a TargetCache, and the target verity data is verified only once.
+bool GenerateBatchPayloads(PayloadGenerationConfig* config) {
+  const vector<string> out_files = SplitBatchFlag(FLAGS_batch_out_files);
+  const vector<string> old_target_files =
+      SplitBatchFlag(FLAGS_batch_old_target_files);
+  const vector<string> old_mapfiles = SplitBatchFlag(FLAGS_batch_old_mapfiles);
+  vector<string> old_partitions = SplitBatchFlag(FLAGS_batch_old_partitions);
+  if (old_partitions.empty()) {
+    CHECK(!FLAGS_old_partitions.empty())
+        << "--batch_out_files requires --batch_old_partitions or "
+        << "--old_partitions.";
+    old_partitions.assign(out_files.size(), FLAGS_old_partitions);
+  }
+  CHECK_EQ(old_partitions.size(), out_files.size());
+  CHECK(old_target_files.empty() ||
+        old_target_files.size() == out_files.size());
+  CHECK(old_mapfiles.empty() || old_mapfiles.size() == out_files.size());
+  CHECK(FLAGS_out_metadata_size_file.empty())
+      << "--out_metadata_size_file isn't supported with --batch_out_files.";
+  CHECK(FLAGS_generation_profile_file.empty())
+      << "--generation_profile_file isn't supported with --batch_out_files.";
+
+  if (config->version.minor >= kVerityMinorPayloadVersion &&
+      !FLAGS_disable_verity_computation) {
+    CHECK(config->target.ParseVerityConfig());
+    CHECK(config->target.VerifyVerityConfig(std::min<size_t>(
+        diff_utils::GetMaxThreads(), config->max_threads)));
+  }
+  // The verity of the partitions without a source filesystem is cleared for
+  // each payload, so keep the parsed one.
+  vector<VerityConfig> target_verity;
+  for (const PartitionConfig& part : config->target.partitions) {
+    target_verity.push_back(part.verity);
+  }
+
+  config->target_cache =
+      std::make_shared<TargetCache>(FLAGS_batch_full_op_cache_mb << 20);
+  const auto batch_start = std::chrono::steady_clock::now();
+  for (size_t i = 0; i < out_files.size(); i++) {
+    const auto start = std::chrono::steady_clock::now();
+    // Temporary copies and images read in place of this source, kept until
+    // its payload is generated.
+    std::vector<std::unique_ptr<ScopedTempFile>> temp_files;
+    std::vector<std::unique_ptr<ScopedImageFile>> images;
+    const vector<string> paths = base::SplitString(
+        old_partitions[i], ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    CHECK_EQ(paths.size(), config->target.partitions.size());
+    vector<string> mapfiles;
+    if (!old_mapfiles.empty() && !old_mapfiles[i].empty()) {
+      mapfiles = base::SplitString(
+          old_mapfiles[i], ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
+    }
+
+    ImageConfig source;
+    for (size_t j = 0; j < paths.size(); j++) {
+      source.partitions.emplace_back(config->target.partitions[j].name);
+      source.partitions.back().path = paths[j];
+      if (j < mapfiles.size())
+        source.partitions.back().mapfile_path = mapfiles[j];
+    }
+    if (!old_target_files.empty()) {
+      auto archive = TargetFilesArchive::Open(old_target_files[i]);
+      CHECK(archive);
+      ExtractArchivePartitions(
+          archive.get(), &source, &temp_files, &images);
+    }
+    RegisterSparseImages(source, &images);
+    RoundDownPartitions(source);
+    CHECK(source.LoadImageSize());
+    for (PartitionConfig& part : source.partitions)
+      CHECK(part.OpenFilesystem());
+    config->source = std::move(source);
+
+    for (size_t j = 0; j < config->target.partitions.size(); j++) {
+      PartitionConfig& part = config->target.partitions[j];
+      part.verity = target_verity[j];
+      if (config->source.partitions[j].fs_interface == nullptr &&
+          !part.verity.IsEmpty()) {
+        LOG(INFO) << "Partition " << part.name << " is installed in full OTA "
+                  << "from source " << i << ", disabling verity for it.";
+        part.verity.Clear();
+      }
+    }
+    if (!config->Validate()) {
+      LOG(ERROR) << "Invalid options passed for source " << i
+                 << ". See errors above.";
+      return false;
+    }
+
+    uint64_t metadata_size{};
+    if (!GenerateUpdatePayloadFile(
+            *config, out_files[i], FLAGS_private_key, &metadata_size)) {
+      LOG(ERROR) << "Failed to generate " << out_files[i] << " from source "
+                 << i;
+      return false;
+    }
+    LOG(INFO) << "Generated " << out_files[i] << " from source " << i << " in "
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " ms.";
+  }
+
+  const auto stats = config->target_cache->stats();
+  LOG(INFO) << "Generated " << out_files.size() << " payloads in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - batch_start)
+                   .count()
+            << " ms. Reused " << stats.full_operation_hits << " of "
+            << stats.full_operation_hits + stats.full_operation_misses
+            << " full operations, keeping " << stats.full_operation_bytes
+            << " bytes of them.";
+  return true;
+}
+
 int Main(int argc, char** argv) {
   gflags::SetUsageMessage(
       "Generates a payload to provide to ChromeOS' update_engine.\n\n"
@@ -579,12 +965,47 @@ int Main(int argc, char** argv) {
                ? 0
                : 1;
   }
+  if (FLAGS_check_payload) {
+    CHECK(!FLAGS_in_file.empty()) << "--check_payload requires --in_file.";
+    const size_t max_threads = FLAGS_max_threads > 0
+                                   ? FLAGS_max_threads
+                                   : diff_utils::GetMaxThreads();
+    return CheckPayload(FLAGS_in_file, FLAGS_check_report_file, max_threads)
+               ? 0
+               : 1;
+  }
+
+  if (!FLAGS_merge_payloads.empty()) {
+    CHECK(!FLAGS_out_file.empty()) << "--merge_payloads requires --out_file.";
+    return MergePayloads(FLAGS_merge_payloads,
+                         FLAGS_merge_partition_names,
+                         FLAGS_out_file,
+                         FLAGS_private_key,
+                         FLAGS_out_metadata_size_file)
+               ? 0
+               : 1;
+  }
 
   // A payload generation was requested. Convert the flags to a
   // PayloadGenerationConfig.
   PayloadGenerationConfig payload_config;
+  const bool batch = !FLAGS_batch_out_files.empty();
   vector<string> partition_names, old_partitions, new_partitions;
   vector<string> old_mapfiles, new_mapfiles;
+  // Temporary copies and images read in place of the inputs, kept until the
+  // payload is generated.
+  std::vector<std::unique_ptr<ScopedTempFile>> temp_files;
+  std::vector<std::unique_ptr<ScopedImageFile>> images;
+
+  std::unique_ptr<TargetFilesArchive> old_archive, new_archive;
+  if (!FLAGS_old_target_files.empty()) {
+    old_archive = TargetFilesArchive::Open(FLAGS_old_target_files);
+    CHECK(old_archive);
+  }
+  if (!FLAGS_new_target_files.empty()) {
+    new_archive = TargetFilesArchive::Open(FLAGS_new_target_files);
+    CHECK(new_archive);
+  }
 
   if (!FLAGS_old_mapfiles.empty()) {
     old_mapfiles = base::SplitString(
@@ -604,16 +1025,24 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
-  if (!FLAGS_apex_info_file.empty()) {
+  const string apex_info_file = GetMetaFile(FLAGS_apex_info_file,
+                                           new_archive.get(),
+                                           "META/apex_info.pb",
+                                           &temp_files);
+  if (!apex_info_file.empty()) {
     // apex_info_file should point to a regular file(or symlink to a regular
     // file)
-    CHECK(utils::FileExists(FLAGS_apex_info_file.c_str()));
-    CHECK(utils::IsRegFile(FLAGS_apex_info_file.c_str()) ||
-          utils::IsSymlink(FLAGS_apex_info_file.c_str()));
-    payload_config.apex_info_file = FLAGS_apex_info_file;
+    CHECK(utils::FileExists(apex_info_file.c_str()));
+    CHECK(utils::IsRegFile(apex_info_file.c_str()) ||
+          utils::IsSymlink(apex_info_file.c_str()));
+    payload_config.apex_info_file = apex_info_file;
   }
 
   payload_config.enable_vabc_xor = FLAGS_enable_vabc_xor;
+  payload_config.enable_xor_similarity_search =
+      FLAGS_enable_xor_similarity_search;
+  payload_config.tune_vabc_compression_factor =
+      FLAGS_tune_vabc_compression_factor;
   payload_config.enable_lz4diff = FLAGS_enable_lz4diff;
   payload_config.enable_zucchini = FLAGS_enable_zucchini;
   payload_config.enable_puffdiff = FLAGS_enable_puffdiff;
@@ -628,7 +1057,7 @@ int Main(int argc, char** argv) {
         FLAGS_new_partitions, ":", base::TRIM_WHITESPACE, base::SPLIT_WANT_ALL);
     CHECK(partition_names.size() == new_partitions.size());
 
-    payload_config.is_delta = !FLAGS_old_partitions.empty();
+    payload_config.is_delta = !FLAGS_old_partitions.empty() || batch;
     LOG_IF(FATAL, !FLAGS_old_image.empty() || !FLAGS_old_kernel.empty())
         << "--old_image and --old_kernel are deprecated, please use "
         << "--old_partitions if you are using --new_partitions.";
@@ -641,6 +1070,8 @@ int Main(int argc, char** argv) {
         !FLAGS_old_image.empty() || !FLAGS_old_kernel.empty();
     LOG_IF(FATAL, !FLAGS_old_partitions.empty())
         << "Please use --new_partitions if you are using --old_partitions.";
+    LOG_IF(FATAL, batch)
+        << "Please use --new_partitions if you are using --batch_out_files.";
   }
   for (size_t i = 0; i < partition_names.size(); i++) {
     LOG_IF(FATAL, partition_names[i].empty())
@@ -657,7 +1088,9 @@ int Main(int argc, char** argv) {
       payload_config.target.partitions.back().mapfile_path = new_mapfiles[i];
   }
 
-  if (payload_config.is_delta) {
+  // The sources of a batch are set up one at a time in
+  // GenerateBatchPayloads().
+  if (payload_config.is_delta && !batch) {
     if (!FLAGS_old_partitions.empty()) {
       old_partitions = base::SplitString(FLAGS_old_partitions,
                                          ":",
@@ -681,13 +1114,44 @@ int Main(int argc, char** argv) {
     payload_config.is_partial_update = true;
   }
 
+  // Sparse images are accepted as input partitions. When applying a payload
+  // the target partitions are outputs, so only the source ones are read.
+  if (old_archive) {
+    ExtractArchivePartitions(old_archive.get(),
+                             &payload_config.source,
+                             &temp_files,
+                             &images);
+  }
+  RegisterSparseImages(payload_config.source, &images);
+
   if (!FLAGS_in_file.empty()) {
+    CHECK(!batch) << "--batch_out_files can't be used with --in_file.";
+    // The payload consumer only reads raw partition images.
+    for (auto& part : payload_config.source.partitions) {
+      if (!part.path.empty()) {
+        part.path = image_file::GetRawPath(part.path);
+        CHECK(!part.path.empty());
+      }
+    }
     return ApplyPayload(FLAGS_in_file, payload_config) ? 0 : 1;
   }
 
-  if (!FLAGS_new_postinstall_config_file.empty()) {
+  if (new_archive) {
+    ExtractArchivePartitions(new_archive.get(),
+                             &payload_config.target,
+                             &temp_files,
+                             &images);
+  }
+  RegisterSparseImages(payload_config.target, &images);
+
+  const string postinstall_config_file =
+      GetMetaFile(FLAGS_new_postinstall_config_file,
+                  new_archive.get(),
+                  "META/postinstall_config.txt",
+                  &temp_files);
+  if (!postinstall_config_file.empty()) {
     brillo::KeyValueStore store;
-    CHECK(store.Load(base::FilePath(FLAGS_new_postinstall_config_file)));
+    CHECK(store.Load(base::FilePath(postinstall_config_file)));
     CHECK(payload_config.target.LoadPostInstallConfig(store));
   }
 
@@ -704,9 +1168,14 @@ int Main(int argc, char** argv) {
   RoundUpPartitions(payload_config.target);
   CHECK(payload_config.target.LoadImageSize());
 
-  if (!FLAGS_dynamic_partition_info_file.empty()) {
+  const string dynamic_partition_info_file =
+      GetMetaFile(FLAGS_dynamic_partition_info_file,
+                  new_archive.get(),
+                  "META/dynamic_partitions_info.txt",
+                  &temp_files);
+  if (!dynamic_partition_info_file.empty()) {
     brillo::KeyValueStore store;
-    CHECK(store.Load(base::FilePath(FLAGS_dynamic_partition_info_file)));
+    CHECK(store.Load(base::FilePath(dynamic_partition_info_file)));
     CHECK(payload_config.target.LoadDynamicPartitionMetadata(store));
     CHECK(payload_config.target.ValidateDynamicPartitionMetadata());
     if (FLAGS_disable_vabc) {
@@ -717,7 +1186,8 @@ int Main(int argc, char** argv) {
     }
   }
 
-  CHECK(!FLAGS_out_file.empty());
+  CHECK_NE(FLAGS_out_file.empty(), batch)
+      << "Please use either --out_file or --batch_out_files.";
 
   payload_config.rootfs_partition_size = FLAGS_rootfs_partition_size;
 
@@ -766,16 +1236,33 @@ int Main(int argc, char** argv) {
   if (FLAGS_max_threads > 0) {
     payload_config.max_threads = FLAGS_max_threads;
   }
+  payload_config.large_file_chunk_size = FLAGS_large_file_chunk_size_mb << 20;
+  CHECK_LE(FLAGS_data_chunk_size_kb, 1024u * 1024)
+      << "--data_chunk_size_kb must be at most 1 GiB.";
+  payload_config.data_chunk_size = FLAGS_data_chunk_size_kb << 10;
+  payload_config.large_file_memory_budget = FLAGS_large_file_memory_budget_mb
+                                            << 20;
 
   if (!FLAGS_partition_timestamps.empty()) {
     CHECK(ParsePerPartitionTimestamps(FLAGS_partition_timestamps,
                                       &payload_config));
   }
 
+  if (batch) {
+    return GenerateBatchPayloads(&payload_config) ? 0 : 1;
+  }
+
+  if (!FLAGS_generation_profile_file.empty()) {
+    payload_config.generation_profile = std::make_shared<GenerationProfile>(
+        FLAGS_generation_profile_top_files);
+  }
+
+  bool verify_verity = false;
   if (payload_config.is_delta &&
       payload_config.version.minor >= kVerityMinorPayloadVersion &&
       !FLAGS_disable_verity_computation) {
-    CHECK(payload_config.target.LoadVerityConfig());
+    CHECK(payload_config.target.ParseVerityConfig());
+    verify_verity = true;
     for (size_t i = 0; i < payload_config.target.partitions.size(); ++i) {
       if (payload_config.source.partitions[i].fs_interface != nullptr) {
         continue;
@@ -798,11 +1285,41 @@ int Main(int argc, char** argv) {
     return 1;
   }
 
+  std::future<bool> verity_verified;
+  if (verify_verity) {
+    const size_t verity_threads = std::min<size_t>(diff_utils::GetMaxThreads(),
+                                                   payload_config.max_threads);
+    if (FLAGS_async_verity_verification) {
+      // Verification only reads |payload_config.target|, which is not modified
+      // from this point on, so it can overlap with payload generation.
+      verity_verified =
+          std::async(std::launch::async, [&payload_config, verity_threads]() {
+            return payload_config.target.VerifyVerityConfig(verity_threads);
+          });
+    } else {
+      CHECK(payload_config.target.VerifyVerityConfig(verity_threads));
+    }
+  }
+
   uint64_t metadata_size{};
-  if (!GenerateUpdatePayloadFile(
-          payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size)) {
+  const bool generated = GenerateUpdatePayloadFile(
+      payload_config, FLAGS_out_file, FLAGS_private_key, &metadata_size);
+  if (verity_verified.valid() && !verity_verified.get()) {
+    LOG(ERROR) << "Verity verification failed, deleting " << FLAGS_out_file;
+    unlink(FLAGS_out_file.c_str());
+    return 1;
+  }
+  if (!generated) {
     return 1;
   }
+  if (payload_config.generation_profile) {
+    payload_config.generation_profile->LogSummary();
+    if (!payload_config.generation_profile->WriteReport(
+            FLAGS_generation_profile_file)) {
+      LOG(ERROR) << "Failed to write " << FLAGS_generation_profile_file;
+      return 1;
+    }
+  }
   if (!FLAGS_out_metadata_size_file.empty()) {
     string metadata_size_string = std::to_string(metadata_size);
     CHECK(utils::WriteFile(FLAGS_out_metadata_size_file.c_str(),
@@ -0,0 +1,228 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_profile.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <memory>
+#include <utility>
+
+#include <android-base/strings.h>
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/strings/stringprintf.h>
+#include <base/values.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// Quotes |field| for CSV if it has a separator, a quote or a line break.
+string CsvField(const string& field) {
+  if (field.find_first_of(",\"\r\n") == string::npos)
+    return field;
+  string quoted = "\"";
+  for (char c : field) {
+    if (c == '"')
+      quoted += '"';
+    quoted += c;
+  }
+  return quoted + "\"";
+}
+
+std::unique_ptr<base::ListValue> FileNames(
+    const vector<GenerationProfile::File>& files) {
+  auto names = std::make_unique<base::ListValue>();
+  for (const auto& file : files)
+    names->AppendString(file.name);
+  return names;
+}
+
+}  // namespace
+
+void GenerationProfile::File::AddCandidate(InstallOperation::Type type,
+                                           base::TimeDelta elapsed,
+                                           uint64_t data_size) {
+  Candidate& candidate = candidates[type];
+  candidate.num_operations++;
+  candidate.elapsed += elapsed;
+  candidate.data_size += data_size;
+}
+
+void GenerationProfile::AddFile(const string& partition, File file) {
+  file.partition = partition;
+  std::lock_guard<std::mutex> lock(mutex_);
+  files_.push_back(std::move(file));
+}
+
+vector<GenerationProfile::File> GenerationProfile::files() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return files_;
+}
+
+vector<string> GenerationProfile::Partitions() const {
+  vector<string> partitions;
+  for (const File& file : files()) {
+    if (std::find(partitions.begin(), partitions.end(), file.partition) ==
+        partitions.end()) {
+      partitions.push_back(file.partition);
+    }
+  }
+  return partitions;
+}
+
+vector<GenerationProfile::File> GenerationProfile::TopFiles(
+    const string& partition, bool by_size) const {
+  vector<File> files;
+  for (File& file : this->files()) {
+    if (file.partition == partition)
+      files.push_back(std::move(file));
+  }
+  const size_t num_files = std::min(files.size(), top_files_);
+  std::partial_sort(files.begin(),
+                    files.begin() + num_files,
+                    files.end(),
+                    [by_size](const File& a, const File& b) {
+                      return by_size ? a.data_size > b.data_size
+                                     : a.elapsed > b.elapsed;
+                    });
+  files.resize(num_files);
+  return files;
+}
+
+bool GenerationProfile::ToJson(string* json) const {
+  // JSON integers are 32 bits in base::Value, so sizes are written as doubles.
+  base::DictionaryValue value;
+  auto file_list = std::make_unique<base::ListValue>();
+  for (const File& file : files()) {
+    auto file_value = std::make_unique<base::DictionaryValue>();
+    file_value->SetString("partition", file.partition);
+    file_value->SetString("name", file.name);
+    file_value->SetString("large_file", file.large_file);
+    file_value->SetString("source_file", file.source_file);
+    file_value->SetDouble("num_blocks", file.num_blocks);
+    file_value->SetDouble("elapsed_ms", file.elapsed.InMillisecondsF());
+    file_value->SetDouble("data_size", file.data_size);
+    file_value->SetDouble("full_data_size", file.full_data_size);
+    file_value->SetDouble("peak_memory", file.peak_memory);
+    auto operation_types = std::make_unique<base::DictionaryValue>();
+    for (const auto& [type, count] : file.operation_types)
+      operation_types->SetInteger(InstallOperationTypeName(type), count);
+    file_value->Set("operation_types", std::move(operation_types));
+    auto candidate_list = std::make_unique<base::ListValue>();
+    for (const auto& [type, candidate] : file.candidates) {
+      auto candidate_value = std::make_unique<base::DictionaryValue>();
+      candidate_value->SetString("type", InstallOperationTypeName(type));
+      candidate_value->SetInteger("num_operations", candidate.num_operations);
+      candidate_value->SetDouble("elapsed_ms",
+                                 candidate.elapsed.InMillisecondsF());
+      candidate_value->SetDouble("data_size", candidate.data_size);
+      candidate_list->Append(std::move(candidate_value));
+    }
+    file_value->Set("candidates", std::move(candidate_list));
+    file_list->Append(std::move(file_value));
+  }
+  value.Set("files", std::move(file_list));
+
+  auto partition_list = std::make_unique<base::ListValue>();
+  for (const string& partition : Partitions()) {
+    auto partition_value = std::make_unique<base::DictionaryValue>();
+    partition_value->SetString("name", partition);
+    partition_value->Set("slowest_files",
+                         FileNames(TopFiles(partition, false)));
+    partition_value->Set("largest_files",
+                         FileNames(TopFiles(partition, true)));
+    partition_list->Append(std::move(partition_value));
+  }
+  value.Set("partitions", std::move(partition_list));
+  return base::JSONWriter::Write(value, json);
+}
+
+string GenerationProfile::ToCsv() const {
+  string csv =
+      "partition,name,large_file,source_file,num_blocks,elapsed_ms,data_size,"
+      "full_data_size,peak_memory,operation_types,candidates\n";
+  for (const File& file : files()) {
+    // The operation types are listed as TYPE:count, and the candidates as
+    // TYPE:num_operations:elapsed_ms:data_size, separated by spaces.
+    vector<string> operation_types;
+    for (const auto& [type, count] : file.operation_types) {
+      operation_types.push_back(base::StringPrintf(
+          "%s:%zu", InstallOperationTypeName(type), count));
+    }
+    vector<string> candidates;
+    for (const auto& [type, candidate] : file.candidates) {
+      candidates.push_back(
+          base::StringPrintf("%s:%zu:%.3f:%" PRIu64,
+                             InstallOperationTypeName(type),
+                             candidate.num_operations,
+                             candidate.elapsed.InMillisecondsF(),
+                             candidate.data_size));
+    }
+    csv += base::StringPrintf(
+        "%s,%s,%s,%s,%" PRIu64 ",%.3f,%" PRIu64 ",%" PRIu64 ",%" PRIu64
+        ",%s,%s\n",
+        CsvField(file.partition).c_str(),
+        CsvField(file.name).c_str(),
+        CsvField(file.large_file).c_str(),
+        CsvField(file.source_file).c_str(),
+        file.num_blocks,
+        file.elapsed.InMillisecondsF(),
+        file.data_size,
+        file.full_data_size,
+        file.peak_memory,
+        android::base::Join(operation_types, ' ').c_str(),
+        android::base::Join(candidates, ' ').c_str());
+  }
+  return csv;
+}
+
+bool GenerationProfile::WriteReport(const string& path) const {
+  string report;
+  if (android::base::EndsWithIgnoreCase(path, ".csv")) {
+    report = ToCsv();
+  } else {
+    TEST_AND_RETURN_FALSE(ToJson(&report));
+  }
+  TEST_AND_RETURN_FALSE(
+      utils::WriteFile(path.c_str(), report.data(), report.size()));
+  LOG(INFO) << "Wrote the generation profile of " << files().size()
+            << " files to " << path;
+  return true;
+}
+
+void GenerationProfile::LogSummary() const {
+  for (const string& partition : Partitions()) {
+    for (const File& file : TopFiles(partition, false)) {
+      LOG(INFO) << "Slowest in " << partition << ": " << file.name << " took "
+                << file.elapsed << " for " << file.num_blocks << " blocks.";
+    }
+    for (const File& file : TopFiles(partition, true)) {
+      LOG(INFO) << "Largest in " << partition << ": " << file.name << " has "
+                << file.data_size << " bytes of data instead of "
+                << file.full_data_size << " bytes of full operations.";
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,110 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <base/time/time.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Collects, for each file of the delta partitions, how long its operations
+// took to generate, which operation types were tried and how big the result
+// is, to find the files that make the payload generation slow or the payload
+// large. All the methods are thread-safe.
+class GenerationProfile {
+ public:
+  // The operations of one type tried for a file, kept or not.
+  struct Candidate {
+    size_t num_operations{0};
+    base::TimeDelta elapsed;
+    uint64_t data_size{0};
+  };
+
+  // The generation of the operations of a file, or of a chunk of a file too
+  // big to be diffed as a whole.
+  struct File {
+    std::string partition;
+    std::string name;
+    // The file the chunk is part of, empty for whole files.
+    std::string large_file;
+    // The old file the file is diffed against, if any.
+    std::string source_file;
+    uint64_t num_blocks{0};
+    std::map<InstallOperation::Type, Candidate> candidates;
+    // The number of operations of each type generated for the file.
+    std::map<InstallOperation::Type, size_t> operation_types;
+    uint64_t data_size{0};
+    // The size of the best full operations of the file.
+    uint64_t full_data_size{0};
+    // The most data held in memory to generate one operation of the file: its
+    // old and new data, and the biggest candidate blob.
+    uint64_t peak_memory{0};
+    base::TimeDelta elapsed;
+
+    // Adds a candidate operation of |type| that took |elapsed| to generate a
+    // blob of |data_size| bytes.
+    void AddCandidate(InstallOperation::Type type,
+                      base::TimeDelta elapsed,
+                      uint64_t data_size);
+  };
+
+  // The report summarizes the |top_files| slowest and largest files of each
+  // partition.
+  explicit GenerationProfile(size_t top_files) : top_files_(top_files) {}
+
+  // Adds the profile of |file| of the partition |partition|.
+  void AddFile(const std::string& partition, File file);
+
+  std::vector<File> files() const;
+
+  // Returns the |top_files_| files of |partition| that took the longest to
+  // generate, or that have the biggest operation blobs if |by_size|.
+  std::vector<File> TopFiles(const std::string& partition, bool by_size) const;
+
+  // Returns the report with one row per file and the top files of each
+  // partition in JSON, or one line per file in CSV.
+  bool ToJson(std::string* json) const;
+  std::string ToCsv() const;
+
+  // Writes the report to |path|, in CSV if it ends with ".csv" and in JSON
+  // otherwise.
+  bool WriteReport(const std::string& path) const;
+
+  // Logs the top files of each partition.
+  void LogSummary() const;
+
+ private:
+  std::vector<std::string> Partitions() const;
+
+  const size_t top_files_;
+  mutable std::mutex mutex_;
+  std::vector<File> files_;
+
+  DISALLOW_COPY_AND_ASSIGN(GenerationProfile);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_GENERATION_PROFILE_H_
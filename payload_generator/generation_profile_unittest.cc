@@ -0,0 +1,108 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/generation_profile.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class GenerationProfileTest : public ::testing::Test {
+ protected:
+  void AddFile(const string& partition,
+               const string& name,
+               int elapsed_ms,
+               uint64_t data_size) {
+    GenerationProfile::File file;
+    file.name = name;
+    file.num_blocks = 4;
+    file.data_size = data_size;
+    file.full_data_size = 4096;
+    file.elapsed = base::TimeDelta::FromMilliseconds(elapsed_ms);
+    file.operation_types[InstallOperation::SOURCE_BSDIFF] = 1;
+    file.AddCandidate(InstallOperation::REPLACE_XZ,
+                      base::TimeDelta::FromMilliseconds(1),
+                      4096);
+    file.AddCandidate(InstallOperation::SOURCE_BSDIFF,
+                      base::TimeDelta::FromMilliseconds(elapsed_ms - 1),
+                      data_size);
+    profile_.AddFile(partition, std::move(file));
+  }
+
+  GenerationProfile profile_{2};
+};
+
+TEST_F(GenerationProfileTest, TopFilesTest) {
+  AddFile("system", "/lib/a.so", 30, 100);
+  AddFile("system", "/lib/b.so", 10, 300);
+  AddFile("system", "/lib/c.so", 20, 200);
+  AddFile("vendor", "/bin/d", 50, 500);
+
+  vector<GenerationProfile::File> slowest = profile_.TopFiles("system", false);
+  ASSERT_EQ(2u, slowest.size());
+  EXPECT_EQ("/lib/a.so", slowest[0].name);
+  EXPECT_EQ("/lib/c.so", slowest[1].name);
+
+  vector<GenerationProfile::File> largest = profile_.TopFiles("system", true);
+  ASSERT_EQ(2u, largest.size());
+  EXPECT_EQ("/lib/b.so", largest[0].name);
+  EXPECT_EQ("/lib/c.so", largest[1].name);
+
+  ASSERT_EQ(1u, profile_.TopFiles("vendor", true).size());
+  EXPECT_TRUE(profile_.TopFiles("product", true).empty());
+}
+
+TEST_F(GenerationProfileTest, ReportTest) {
+  AddFile("system", "/lib/a.so", 30, 100);
+  AddFile("system", "/app/with,comma.apk", 10, 300);
+
+  string json;
+  ASSERT_TRUE(profile_.ToJson(&json));
+  EXPECT_NE(string::npos, json.find("\"name\":\"/lib/a.so\""));
+  EXPECT_NE(string::npos, json.find("\"partition\":\"system\""));
+  EXPECT_NE(string::npos, json.find("\"SOURCE_BSDIFF\":1"));
+  EXPECT_NE(string::npos,
+            json.find("\"slowest_files\":[\"/lib/a.so\","
+                      "\"/app/with,comma.apk\"]"));
+
+  const string csv = profile_.ToCsv();
+  EXPECT_EQ(0u, csv.find("partition,name,"));
+  EXPECT_NE(string::npos,
+            csv.find("system,/lib/a.so,,,4,30.000,100,4096,0,"
+                     "SOURCE_BSDIFF:1 SOURCE_BSDIFF:1:29.000:100 "
+                     "REPLACE_XZ:1:1.000:4096\n"));
+  EXPECT_NE(string::npos, csv.find("system,\"/app/with,comma.apk\","));
+
+  // The format of the report file depends on its extension.
+  ScopedTempFile report("GenerationProfileTest_report.XXXXXX");
+  const string csv_path = report.path() + ".csv";
+  ScopedPathUnlinker unlinker(csv_path);
+  ASSERT_TRUE(profile_.WriteReport(csv_path));
+  string contents;
+  ASSERT_TRUE(utils::ReadFile(csv_path, &contents));
+  EXPECT_EQ(csv, contents);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,258 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/image_file.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+
+#include <base/files/file_path.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// A read-only FileDescriptor over the expanded contents of a SparseImage.
+class SparseFileDescriptor final : public FileDescriptor {
+ public:
+  explicit SparseFileDescriptor(std::shared_ptr<const SparseImage> image)
+      : image_(std::move(image)) {}
+
+  // The image is given to the constructor.
+  bool Open(const char* path, int flags, mode_t mode) override {
+    errno = EINVAL;
+    return false;
+  }
+  bool Open(const char* path, int flags) override {
+    errno = EINVAL;
+    return false;
+  }
+
+  ssize_t Read(void* buf, size_t count) override {
+    if (offset_ >= image_->size()) {
+      return 0;
+    }
+    count = std::min<uint64_t>(count, image_->size() - offset_);
+    if (!image_->Read(offset_, buf, count)) {
+      errno = EIO;
+      return -1;
+    }
+    offset_ += count;
+    return count;
+  }
+
+  ssize_t Write(const void* buf, size_t count) override {
+    errno = EBADF;
+    return -1;
+  }
+
+  off64_t Seek(off64_t offset, int whence) override {
+    const off64_t size = image_->size();
+    switch (whence) {
+      case SEEK_SET:
+        break;
+      case SEEK_CUR:
+        offset += offset_;
+        break;
+      case SEEK_END:
+        offset += size;
+        break;
+      case SEEK_DATA:
+      case SEEK_HOLE:
+        if (offset < 0 || offset >= size) {
+          errno = ENXIO;
+          return -1;
+        }
+        offset = image_->FindRegion(offset, whence == SEEK_HOLE);
+        if (offset == size && whence == SEEK_DATA) {
+          errno = ENXIO;
+          return -1;
+        }
+        break;
+      default:
+        errno = EINVAL;
+        return -1;
+    }
+    if (offset < 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    offset_ = offset;
+    return offset_;
+  }
+
+  uint64_t BlockDevSize() override { return 0; }
+  bool BlkIoctl(int request,
+                uint64_t start,
+                uint64_t length,
+                int* result) override {
+    return false;
+  }
+  bool Flush() override { return true; }
+  bool Close() override { return true; }
+  bool IsSettingErrno() override { return true; }
+  bool IsOpen() override { return true; }
+
+ private:
+  std::shared_ptr<const SparseImage> image_;
+  uint64_t offset_{0};
+};
+
+struct RegisteredImage {
+  std::shared_ptr<const SparseImage> image;
+  // The raw copy made by GetRawPath(), if any.
+  std::unique_ptr<ScopedTempFile> raw_file;
+};
+
+// The images registered by ScopedImageFile, guarded by ImagesMutex().
+std::map<string, RegisteredImage>& Images() {
+  static auto* images = new std::map<string, RegisteredImage>();
+  return *images;
+}
+
+std::mutex& ImagesMutex() {
+  static auto* mutex = new std::mutex();
+  return *mutex;
+}
+
+}  // namespace
+
+ScopedImageFile::ScopedImageFile(const string& path,
+                                 std::unique_ptr<SparseImage> image)
+    : path_(path) {
+  std::lock_guard<std::mutex> lock(ImagesMutex());
+  RegisteredImage& registered = Images()[path_];
+  CHECK(!registered.image) << path_ << " is already registered.";
+  registered.image = std::move(image);
+}
+
+ScopedImageFile::~ScopedImageFile() {
+  std::lock_guard<std::mutex> lock(ImagesMutex());
+  Images().erase(path_);
+}
+
+namespace image_file {
+
+std::shared_ptr<const SparseImage> GetImage(const string& path) {
+  std::lock_guard<std::mutex> lock(ImagesMutex());
+  auto it = Images().find(path);
+  return it == Images().end() ? nullptr : it->second.image;
+}
+
+FileDescriptorPtr Open(const string& path) {
+  if (auto image = GetImage(path)) {
+    return std::make_shared<SparseFileDescriptor>(std::move(image));
+  }
+  FileDescriptorPtr fd = std::make_shared<EintrSafeFileDescriptor>();
+  if (!fd->Open(path.c_str(), O_RDONLY)) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return nullptr;
+  }
+  return fd;
+}
+
+off_t Size(const string& path) {
+  if (auto image = GetImage(path)) {
+    return image->size();
+  }
+  return utils::FileSize(path);
+}
+
+bool ReadChunk(const string& path,
+               off_t offset,
+               off_t count,
+               brillo::Blob* out_data) {
+  auto image = GetImage(path);
+  if (!image) {
+    return utils::ReadFileChunk(path, offset, count, out_data);
+  }
+  // Like utils::ReadFileChunk(), the data is appended to |out_data|, a |count|
+  // of -1 reads up to the end and the read stops at the end of the image.
+  TEST_AND_RETURN_FALSE(offset >= 0);
+  const uint64_t size = image->size();
+  if (static_cast<uint64_t>(offset) >= size) {
+    return true;
+  }
+  uint64_t bytes = size - offset;
+  if (count >= 0) {
+    bytes = std::min<uint64_t>(bytes, count);
+  }
+  const size_t old_size = out_data->size();
+  out_data->resize(old_size + bytes);
+  TEST_AND_RETURN_FALSE(
+      image->Read(offset, out_data->data() + old_size, bytes));
+  return true;
+}
+
+bool ReadExtents(const string& path,
+                 const vector<Extent>& extents,
+                 brillo::Blob* out_data,
+                 ssize_t out_data_size,
+                 size_t block_size) {
+  FileDescriptorPtr fd = Open(path);
+  TEST_AND_RETURN_FALSE(fd);
+  return utils::ReadExtents(fd, extents, out_data, out_data_size, block_size);
+}
+
+bool Resize(const string& path, uint64_t size) {
+  std::lock_guard<std::mutex> lock(ImagesMutex());
+  auto it = Images().find(path);
+  TEST_AND_RETURN_FALSE(it != Images().end());
+  std::unique_ptr<SparseImage> image = it->second.image->Resized(size);
+  TEST_AND_RETURN_FALSE(image);
+  it->second.image = std::move(image);
+  it->second.raw_file.reset();
+  return true;
+}
+
+string GetRawPath(const string& path) {
+  std::lock_guard<std::mutex> lock(ImagesMutex());
+  auto it = Images().find(path);
+  if (it == Images().end()) {
+    return path;
+  }
+  RegisteredImage& registered = it->second;
+  if (!registered.raw_file) {
+    auto raw_file = std::make_unique<ScopedTempFile>(
+        base::FilePath(path).BaseName().value() + "_raw.XXXXXX");
+    uint64_t bytes_written = 0;
+    if (!registered.image->Expand(raw_file->path(), &bytes_written)) {
+      LOG(ERROR) << "Failed to expand " << path;
+      return "";
+    }
+    LOG(INFO) << "Expanded " << path << " to " << registered.image->size()
+              << " bytes for a reader of raw files only, writing "
+              << bytes_written << " bytes.";
+    registered.raw_file = std::move(raw_file);
+  }
+  return registered.raw_file->path();
+}
+
+}  // namespace image_file
+
+}  // namespace chromeos_update_engine
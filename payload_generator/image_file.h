@@ -0,0 +1,92 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_FILE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_FILE_H_
+
+// The partition images are passed around the payload generator by path. An
+// image registered with a ScopedImageFile, such as an Android sparse image, is
+// read in place from its chunks by the functions below instead of from a raw
+// copy, and every reader of partition images goes through them.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/sparse_image.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Registers |image| as the contents of the partition image |path| while in
+// scope. The registered images must not change while they are read from other
+// threads.
+class ScopedImageFile {
+ public:
+  ScopedImageFile(const std::string& path, std::unique_ptr<SparseImage> image);
+  ~ScopedImageFile();
+
+ private:
+  std::string path_;
+
+  DISALLOW_COPY_AND_ASSIGN(ScopedImageFile);
+};
+
+namespace image_file {
+
+// Returns the image registered for |path|, or nullptr if |path| is read as is.
+std::shared_ptr<const SparseImage> GetImage(const std::string& path);
+
+// Opens the partition image |path| read-only. The returned descriptor
+// supports SEEK_DATA and SEEK_HOLE, and must not be shared between threads.
+// Returns nullptr on error.
+FileDescriptorPtr Open(const std::string& path);
+
+// Returns the size of the partition image |path|, or -1 on error.
+off_t Size(const std::string& path);
+
+// Like utils::ReadFileChunk() and utils::ReadExtents() on the partition image
+// |path|.
+bool ReadChunk(const std::string& path,
+               off_t offset,
+               off_t count,
+               brillo::Blob* out_data);
+bool ReadExtents(const std::string& path,
+                 const std::vector<Extent>& extents,
+                 brillo::Blob* out_data,
+                 ssize_t out_data_size,
+                 size_t block_size);
+
+// Truncates the registered image |path| to |size| bytes or extends it with
+// zeros, like truncate() does for raw files. Returns false if |path| isn't
+// registered or |size| isn't a whole number of its blocks.
+bool Resize(const std::string& path, uint64_t size);
+
+// Returns the path of a raw file with the contents of the partition image
+// |path|, for the external tools and libraries which only read paths. A
+// registered image is expanded to a temporary file the first time, which is
+// kept until the image is unregistered. Returns an empty string on error.
+std::string GetRawPath(const std::string& path);
+
+}  // namespace image_file
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_IMAGE_FILE_H_
@@ -0,0 +1,270 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/image_file.h"
+
+#include <endian.h>
+#include <errno.h>
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kBlockSize = 4096;
+
+void AppendLE16(brillo::Blob* blob, uint16_t value) {
+  for (size_t i = 0; i < sizeof(value); i++) {
+    blob->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+void AppendLE32(brillo::Blob* blob, uint32_t value) {
+  for (size_t i = 0; i < sizeof(value); i++) {
+    blob->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+void AppendChunkHeader(brillo::Blob* blob,
+                       uint16_t type,
+                       uint32_t num_blocks,
+                       uint32_t data_size) {
+  AppendLE16(blob, type);
+  AppendLE16(blob, 0);
+  AppendLE32(blob, num_blocks);
+  AppendLE32(blob, 12 + data_size);
+}
+
+}  // namespace
+
+class ImageFileTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Header: 8 blocks in 4 chunks.
+    brillo::Blob sparse;
+    AppendLE32(&sparse, 0xed26ff3a);
+    AppendLE16(&sparse, 1);
+    AppendLE16(&sparse, 0);
+    AppendLE16(&sparse, 28);
+    AppendLE16(&sparse, 12);
+    AppendLE32(&sparse, kBlockSize);
+    AppendLE32(&sparse, 8);
+    AppendLE32(&sparse, 4);
+    AppendLE32(&sparse, 0);
+
+    // Two raw blocks.
+    AppendChunkHeader(&sparse, 0xCAC1, 2, 2 * kBlockSize);
+    for (size_t i = 0; i < 2 * kBlockSize; i++) {
+      sparse.push_back(i % 251);
+    }
+    // Three don't care blocks.
+    AppendChunkHeader(&sparse, 0xCAC3, 3, 0);
+    // Two blocks filled with a pattern.
+    AppendChunkHeader(&sparse, 0xCAC2, 2, 4);
+    AppendLE32(&sparse, 0xdeadbeef);
+    // One block filled with zeros.
+    AppendChunkHeader(&sparse, 0xCAC2, 1, 4);
+    AppendLE32(&sparse, 0);
+
+    expected_.resize(8 * kBlockSize);
+    for (size_t i = 0; i < 2 * kBlockSize; i++) {
+      expected_[i] = i % 251;
+    }
+    for (size_t i = 5 * kBlockSize; i < 7 * kBlockSize; i += 4) {
+      uint32_t value = htole32(0xdeadbeef);
+      memcpy(expected_.data() + i, &value, sizeof(value));
+    }
+
+    ASSERT_TRUE(test_utils::WriteFileVector(sparse_file_.path(), sparse));
+    ASSERT_TRUE(test_utils::WriteFileVector(raw_file_.path(), expected_));
+  }
+
+  // Registers |sparse_file_| while in scope.
+  std::unique_ptr<ScopedImageFile> Register() {
+    auto image = SparseImage::Open(sparse_file_.path());
+    EXPECT_NE(nullptr, image);
+    return std::make_unique<ScopedImageFile>(sparse_file_.path(),
+                                             std::move(image));
+  }
+
+  brillo::Blob expected_;
+  ScopedTempFile sparse_file_{"ImageFileTest_sparse.XXXXXX"};
+  ScopedTempFile raw_file_{"ImageFileTest_raw.XXXXXX"};
+};
+
+TEST_F(ImageFileTest, RawFileTest) {
+  const string& path = raw_file_.path();
+  EXPECT_EQ(nullptr, image_file::GetImage(path));
+  EXPECT_EQ(static_cast<off_t>(expected_.size()), image_file::Size(path));
+  EXPECT_EQ(path, image_file::GetRawPath(path));
+
+  brillo::Blob data;
+  EXPECT_TRUE(image_file::ReadChunk(path, kBlockSize, 10, &data));
+  EXPECT_EQ(brillo::Blob(expected_.begin() + kBlockSize,
+                         expected_.begin() + kBlockSize + 10),
+            data);
+}
+
+TEST_F(ImageFileTest, RegisterTest) {
+  const string& path = sparse_file_.path();
+  {
+    auto registered = Register();
+    EXPECT_NE(nullptr, image_file::GetImage(path));
+    EXPECT_EQ(static_cast<off_t>(expected_.size()), image_file::Size(path));
+  }
+  EXPECT_EQ(nullptr, image_file::GetImage(path));
+  EXPECT_NE(static_cast<off_t>(expected_.size()), image_file::Size(path));
+}
+
+TEST_F(ImageFileTest, ReadChunkTest) {
+  auto registered = Register();
+  const string& path = sparse_file_.path();
+
+  // The data is appended.
+  brillo::Blob data(1, 'x');
+  EXPECT_TRUE(image_file::ReadChunk(path, kBlockSize - 2, 4, &data));
+  EXPECT_EQ((brillo::Blob{'x',
+                          expected_[kBlockSize - 2],
+                          expected_[kBlockSize - 1],
+                          expected_[kBlockSize],
+                          expected_[kBlockSize + 1]}),
+            data);
+
+  // A count of -1 and reads past the end stop at the end of the image.
+  data.clear();
+  EXPECT_TRUE(image_file::ReadChunk(path, 0, -1, &data));
+  EXPECT_EQ(expected_, data);
+  data.clear();
+  EXPECT_TRUE(
+      image_file::ReadChunk(path, expected_.size() - 3, kBlockSize, &data));
+  EXPECT_EQ(3u, data.size());
+  data.clear();
+  EXPECT_TRUE(image_file::ReadChunk(path, expected_.size(), 1, &data));
+  EXPECT_TRUE(data.empty());
+}
+
+TEST_F(ImageFileTest, ReadExtentsTest) {
+  auto registered = Register();
+  brillo::Blob data;
+  EXPECT_TRUE(image_file::ReadExtents(sparse_file_.path(),
+                                      {ExtentForRange(1, 1),
+                                       ExtentForRange(6, 2)},
+                                      &data,
+                                      3 * kBlockSize,
+                                      kBlockSize));
+  brillo::Blob expected(expected_.begin() + kBlockSize,
+                        expected_.begin() + 2 * kBlockSize);
+  expected.insert(
+      expected.end(), expected_.begin() + 6 * kBlockSize, expected_.end());
+  EXPECT_EQ(expected, data);
+}
+
+TEST_F(ImageFileTest, OpenTest) {
+  auto registered = Register();
+  FileDescriptorPtr fd = image_file::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, fd);
+  EXPECT_EQ(-1, fd->Write("x", 1));
+
+  brillo::Blob data(kBlockSize);
+  ssize_t bytes_read = 0;
+  EXPECT_TRUE(utils::ReadAll(
+      fd, data.data(), data.size(), 5 * kBlockSize, &bytes_read));
+  EXPECT_EQ(static_cast<ssize_t>(kBlockSize), bytes_read);
+  EXPECT_EQ(brillo::Blob(expected_.begin() + 5 * kBlockSize,
+                         expected_.begin() + 6 * kBlockSize),
+            data);
+  // Reads stop at the end of the image.
+  EXPECT_EQ(static_cast<off64_t>(expected_.size() - 10),
+            fd->Seek(-10, SEEK_END));
+  EXPECT_EQ(10, fd->Read(data.data(), data.size()));
+  EXPECT_EQ(0, fd->Read(data.data(), data.size()));
+
+  // Don't care and zero fill chunks are holes.
+  const off64_t block_size = kBlockSize;
+  EXPECT_EQ(2 * block_size, fd->Seek(0, SEEK_HOLE));
+  EXPECT_EQ(5 * block_size, fd->Seek(2 * block_size + 1, SEEK_DATA));
+  EXPECT_EQ(7 * block_size, fd->Seek(5 * block_size, SEEK_HOLE));
+  EXPECT_EQ(-1, fd->Seek(7 * kBlockSize, SEEK_DATA));
+  EXPECT_EQ(ENXIO, errno);
+}
+
+TEST_F(ImageFileTest, GetRawPathTest) {
+  auto registered = Register();
+  const string raw_path = image_file::GetRawPath(sparse_file_.path());
+  ASSERT_FALSE(raw_path.empty());
+  EXPECT_NE(sparse_file_.path(), raw_path);
+  // The raw copy is made once.
+  EXPECT_EQ(raw_path, image_file::GetRawPath(sparse_file_.path()));
+
+  brillo::Blob data;
+  EXPECT_TRUE(utils::ReadFile(raw_path, &data));
+  EXPECT_EQ(expected_, data);
+
+  registered.reset();
+  EXPECT_FALSE(utils::FileExists(raw_path.c_str()));
+}
+
+TEST_F(ImageFileTest, ResizeTest) {
+  const string& path = sparse_file_.path();
+  EXPECT_FALSE(image_file::Resize(path, 4 * kBlockSize));
+
+  auto registered = Register();
+  const string raw_path = image_file::GetRawPath(path);
+  EXPECT_FALSE(image_file::Resize(path, 4 * kBlockSize + 1));
+  EXPECT_TRUE(image_file::Resize(path, 4 * kBlockSize));
+  EXPECT_EQ(static_cast<off_t>(4 * kBlockSize), image_file::Size(path));
+  // The raw copy of the old size is dropped.
+  EXPECT_FALSE(utils::FileExists(raw_path.c_str()));
+  brillo::Blob data;
+  EXPECT_TRUE(utils::ReadFile(image_file::GetRawPath(path), &data));
+  EXPECT_EQ(brillo::Blob(expected_.begin(), expected_.begin() + data.size()),
+            data);
+  EXPECT_EQ(4u * kBlockSize, data.size());
+}
+
+TEST_F(ImageFileTest, MapPartitionBlocksTest) {
+  auto registered = Register();
+  vector<BlockMapping::BlockId> sparse_ids, raw_ids;
+  EXPECT_TRUE(MapPartitionBlocks(sparse_file_.path(),
+                                 raw_file_.path(),
+                                 expected_.size(),
+                                 expected_.size(),
+                                 kBlockSize,
+                                 &sparse_ids,
+                                 &raw_ids));
+  EXPECT_EQ(raw_ids, sparse_ids);
+  ASSERT_EQ(8u, sparse_ids.size());
+  EXPECT_EQ(0u, sparse_ids[2]);
+  EXPECT_EQ(sparse_ids[5], sparse_ids[6]);
+}
+
+}  // namespace chromeos_update_engine
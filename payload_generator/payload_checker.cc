@@ -0,0 +1,615 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_checker.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <map>
+#include <set>
+#include <utility>
+
+#include <android-base/stringprintf.h>
+#include <android-base/unique_fd.h>
+#include <base/json/json_writer.h>
+#include <base/logging.h>
+#include <base/threading/simple_thread.h>
+#include <base/values.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using android::base::StringPrintf;
+using google::protobuf::RepeatedPtrField;
+using std::map;
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+bool HashMatches(const uint8_t* data, uint64_t length, const string& expected) {
+  brillo::Blob hash;
+  return HashCalculator::RawHashOfBytes(data, length, &hash) &&
+         brillo::Blob(expected.begin(), expected.end()) == hash;
+}
+
+// Hashes one data blob of the mapped payload, and its chunks if they have
+// hashes too.
+class BlobHasher : public base::DelegateSimpleThread::Delegate {
+ public:
+  BlobHasher(const uint8_t* data,
+             uint64_t length,
+             const string& expected_hash,
+             uint64_t chunk_size,
+             const vector<string>& chunk_hashes)
+      : data_(data),
+        length_(length),
+        expected_hash_(expected_hash),
+        chunk_size_(chunk_size),
+        chunk_hashes_(chunk_hashes) {}
+
+  void Run() override {
+    matches_ = expected_hash_.empty() ||
+               HashMatches(data_, length_, expected_hash_);
+    for (size_t i = 0; i < chunk_hashes_.size(); i++) {
+      const uint64_t offset = i * chunk_size_;
+      if (offset >= length_ ||
+          !HashMatches(data_ + offset,
+                       std::min(chunk_size_, length_ - offset),
+                       chunk_hashes_[i])) {
+        mismatched_chunks_.push_back(i);
+      }
+    }
+  }
+
+  bool matches() const { return matches_; }
+  const vector<size_t>& mismatched_chunks() const {
+    return mismatched_chunks_;
+  }
+
+ private:
+  const uint8_t* data_;
+  uint64_t length_;
+  const string& expected_hash_;
+  uint64_t chunk_size_;
+  const vector<string>& chunk_hashes_;
+  bool matches_{false};
+  vector<size_t> mismatched_chunks_;
+};
+
+}  // namespace
+
+bool PayloadChecker::Result::ToJson(string* json) const {
+  base::DictionaryValue value;
+  value.SetBoolean("valid", valid());
+  value.SetInteger("num_partitions", num_partitions);
+  value.SetInteger("num_operations", num_operations);
+  value.SetInteger("num_merge_operations", num_merge_operations);
+  value.SetInteger("num_blobs", num_blobs);
+  value.SetInteger("num_reused_blobs", num_reused_blobs);
+  // JSON integers are 32 bits in base::Value.
+  value.SetString("blobs_size", std::to_string(blobs_size));
+  auto error_list = std::make_unique<base::ListValue>();
+  for (const auto& error : errors) {
+    error_list->AppendString(error);
+  }
+  value.Set("errors", std::move(error_list));
+  return base::JSONWriter::Write(value, json);
+}
+
+PayloadChecker::PayloadChecker(const string& payload_path, size_t max_threads)
+    : payload_path_(payload_path),
+      max_threads_(std::max<size_t>(max_threads, 1)) {}
+
+void PayloadChecker::AddError(const string& error) {
+  LOG(ERROR) << error;
+  result_->errors.push_back(error);
+}
+
+bool PayloadChecker::Run(Result* result) {
+  *result = Result();
+  result_ = result;
+  blobs_.clear();
+
+  android::base::unique_fd fd(
+      open(payload_path_.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    AddError("Failed to open " + payload_path_ + ".");
+    return false;
+  }
+  const off_t payload_size = utils::FileSize(fd.get());
+  if (payload_size <= 0) {
+    AddError("Payload " + payload_path_ + " is empty.");
+    return false;
+  }
+  payload_ =
+      android::base::MappedFile::FromFd(fd.get(), 0, payload_size, PROT_READ);
+  if (!payload_) {
+    AddError("Failed to map " + payload_path_ + ".");
+    return false;
+  }
+
+  const auto* data = reinterpret_cast<const unsigned char*>(payload_->data());
+  PayloadMetadata metadata;
+  ErrorCode error;
+  if (metadata.ParsePayloadHeader(data, payload_size, &error) !=
+          MetadataParseResult::kSuccess ||
+      !metadata.GetManifest(data, payload_size, &manifest_)) {
+    AddError("Failed to parse the metadata of " + payload_path_ + ".");
+    return false;
+  }
+  data_offset_ =
+      metadata.GetMetadataSize() + metadata.GetMetadataSignatureSize();
+  if (data_offset_ > static_cast<uint64_t>(payload_size)) {
+    AddError("The metadata is larger than the payload.");
+    return false;
+  }
+  data_size_ = payload_size - data_offset_;
+
+  block_size_ = manifest_.block_size();
+  if (block_size_ == 0 || (block_size_ & (block_size_ - 1)) != 0) {
+    AddError(StringPrintf("Invalid block size %" PRIu64 ".", block_size_));
+    return false;
+  }
+  version_ = PayloadVersion(metadata.GetMajorVersion(),
+                            manifest_.minor_version());
+  if (!version_.Validate()) {
+    AddError(StringPrintf("Unsupported payload version %" PRIu64 ".%" PRIu32,
+                          version_.major,
+                          version_.minor));
+  }
+
+  for (const auto& partition : manifest_.partitions()) {
+    CheckPartition(partition);
+  }
+  CheckBlobs();
+
+  LOG(INFO) << "Checked " << result_->num_partitions << " partitions, "
+            << result_->num_operations << " operations, "
+            << result_->num_merge_operations << " merge operations and "
+            << result_->num_blobs << " data blobs: "
+            << result_->errors.size() << " errors.";
+  return true;
+}
+
+uint64_t PayloadChecker::CheckExtents(const RepeatedPtrField<Extent>& extents,
+                                      uint64_t num_blocks,
+                                      const string& name) {
+  uint64_t total_blocks = 0;
+  for (int i = 0; i < extents.size(); i++) {
+    const Extent& extent = extents[i];
+    if (extent.num_blocks() == 0) {
+      AddError(StringPrintf("%s[%d] is empty.", name.c_str(), i));
+    } else if (extent.start_block() >= num_blocks ||
+               extent.num_blocks() > num_blocks - extent.start_block()) {
+      AddError(StringPrintf("%s[%d] (%" PRIu64 ", %" PRIu64
+                            ") is past the end of the partition (%" PRIu64
+                            " blocks).",
+                            name.c_str(),
+                            i,
+                            extent.start_block(),
+                            extent.num_blocks(),
+                            num_blocks));
+    }
+    total_blocks += extent.num_blocks();
+  }
+  return total_blocks;
+}
+
+void PayloadChecker::CheckPartition(const PartitionUpdate& partition) {
+  const string& name = partition.partition_name();
+  result_->num_partitions++;
+
+  const uint64_t new_size = partition.new_partition_info().size();
+  if (new_size % block_size_ != 0) {
+    AddError(StringPrintf("%s: new size %" PRIu64
+                          " isn't a multiple of the block size.",
+                          name.c_str(),
+                          new_size));
+  }
+  const uint64_t new_num_blocks = new_size / block_size_;
+  const uint64_t old_num_blocks =
+      partition.has_old_partition_info()
+          ? partition.old_partition_info().size() / block_size_
+          : 0;
+
+  vector<bool> written_blocks(new_num_blocks);
+  vector<int64_t> copied_from(new_num_blocks, -1);
+  for (int i = 0; i < partition.operations_size(); i++) {
+    CheckOperation(partition.operations(i),
+                   StringPrintf("%s.operations[%d]", name.c_str(), i),
+                   old_num_blocks,
+                   new_num_blocks,
+                   &written_blocks,
+                   &copied_from);
+  }
+
+  // A partition without a source is written in full, except for the verity
+  // data which is computed on the device.
+  if (!partition.has_old_partition_info()) {
+    ExtentRanges unwritten;
+    for (uint64_t block = 0; block < new_num_blocks; block++) {
+      if (!written_blocks[block]) {
+        unwritten.AddBlock(block);
+      }
+    }
+    if (partition.has_hash_tree_extent()) {
+      unwritten.SubtractExtent(partition.hash_tree_extent());
+    }
+    if (partition.has_fec_extent()) {
+      unwritten.SubtractExtent(partition.fec_extent());
+    }
+    if (unwritten.blocks() > 0) {
+      AddError(StringPrintf("%s: %" PRIu64
+                            " blocks of the full partition aren't written.",
+                            name.c_str(),
+                            unwritten.blocks()));
+    }
+  }
+
+  CheckMergeOperations(partition, old_num_blocks, new_num_blocks, copied_from);
+}
+
+void PayloadChecker::CheckOperation(const InstallOperation& operation,
+                                    const string& name,
+                                    uint64_t old_num_blocks,
+                                    uint64_t new_num_blocks,
+                                    vector<bool>* written_blocks,
+                                    vector<int64_t>* copied_from) {
+  result_->num_operations++;
+  const auto type = operation.type();
+  const string type_name =
+      name + " (" + InstallOperationTypeName(type) + ")";
+  if (type == InstallOperation::MOVE || type == InstallOperation::BSDIFF ||
+      !version_.OperationAllowed(type)) {
+    AddError(StringPrintf("%s: not allowed in minor version %" PRIu32 ".",
+                          type_name.c_str(),
+                          version_.minor));
+  }
+
+  const uint64_t src_blocks =
+      CheckExtents(operation.src_extents(), old_num_blocks, name + ".src");
+  const uint64_t dst_blocks =
+      CheckExtents(operation.dst_extents(), new_num_blocks, name + ".dst");
+  if (dst_blocks == 0) {
+    AddError(type_name + ": no dst extents.");
+  }
+
+  // Each block of the new partition is written by one operation at most.
+  for (const Extent& extent : operation.dst_extents()) {
+    bool overlaps = false;
+    const uint64_t end =
+        std::min(extent.start_block() + extent.num_blocks(), new_num_blocks);
+    for (uint64_t block = extent.start_block(); block < end; block++) {
+      overlaps |= (*written_blocks)[block];
+      (*written_blocks)[block] = true;
+    }
+    if (overlaps) {
+      AddError(StringPrintf("%s: dst extent (%" PRIu64 ", %" PRIu64
+                            ") overlaps the dst of a previous operation.",
+                            type_name.c_str(),
+                            extent.start_block(),
+                            extent.num_blocks()));
+    }
+  }
+
+  if (operation.has_data_offset() != operation.has_data_length()) {
+    AddError(type_name + ": only one of data_offset and data_length is set.");
+  }
+  const bool has_data =
+      operation.has_data_offset() && operation.has_data_length();
+  if (has_data) {
+    if (!operation.has_data_sha256_hash()) {
+      AddError(type_name + ": data blob without data_sha256_hash.");
+    }
+    blobs_.push_back({name,
+                      operation.data_offset(),
+                      operation.data_length(),
+                      operation.data_sha256_hash()});
+  }
+  if (operation.data_chunk_sha256_hash_size() > 0) {
+    if (!has_data || !diff_utils::IsAReplaceOperation(operation.type())) {
+      AddError(type_name + ": data chunk hashes on an operation other than "
+                           "a REPLACE with a data blob.");
+    } else if (operation.data_chunk_size() == 0 ||
+               static_cast<uint64_t>(operation.data_chunk_sha256_hash_size()) !=
+                   utils::DivRoundUp(operation.data_length(),
+                                     operation.data_chunk_size())) {
+      AddError(StringPrintf("%s: %d data chunk hashes don't match the %" PRIu64
+                            " bytes blob in chunks of %u bytes.",
+                            type_name.c_str(),
+                            operation.data_chunk_sha256_hash_size(),
+                            operation.data_length(),
+                            operation.data_chunk_size()));
+    } else {
+      blobs_.back().chunk_size = operation.data_chunk_size();
+      blobs_.back().chunk_hashes.assign(
+          operation.data_chunk_sha256_hash().begin(),
+          operation.data_chunk_sha256_hash().end());
+    }
+  }
+
+  const uint64_t dst_size = dst_blocks * block_size_;
+  if (operation.has_src_length() &&
+      (operation.src_length() > src_blocks * block_size_ ||
+       operation.src_length() + block_size_ <= src_blocks * block_size_)) {
+    AddError(type_name + ": src_length doesn't match the src extents.");
+  }
+  if (operation.has_dst_length() &&
+      (operation.dst_length() > dst_size ||
+       operation.dst_length() + block_size_ <= dst_size)) {
+    AddError(type_name + ": dst_length doesn't match the dst extents.");
+  }
+
+  switch (type) {
+    case InstallOperation::REPLACE:
+    case InstallOperation::REPLACE_BZ:
+    case InstallOperation::REPLACE_XZ:
+      if (src_blocks > 0) {
+        AddError(type_name + ": has src extents.");
+      }
+      if (!has_data) {
+        AddError(type_name + ": has no data.");
+      } else if (type == InstallOperation::REPLACE
+                     ? operation.data_length() != dst_size
+                     : operation.data_length() >= dst_size) {
+        AddError(type_name + ": data_length doesn't match the dst extents.");
+      }
+      break;
+
+    case InstallOperation::ZERO:
+    case InstallOperation::DISCARD:
+      if (src_blocks > 0 || has_data) {
+        AddError(type_name + ": has src extents or data.");
+      }
+      break;
+
+    case InstallOperation::SOURCE_COPY: {
+      if (has_data) {
+        AddError(type_name + ": has data.");
+      }
+      if (src_blocks != dst_blocks) {
+        AddError(StringPrintf("%s: copies %" PRIu64 " blocks to %" PRIu64 ".",
+                              type_name.c_str(),
+                              src_blocks,
+                              dst_blocks));
+        break;
+      }
+      // Remember where each copied block comes from for the COW_COPY merge
+      // operations.
+      vector<uint64_t> src = ExpandExtents(operation.src_extents());
+      vector<uint64_t> dst = ExpandExtents(operation.dst_extents());
+      for (size_t i = 0; i < dst.size(); i++) {
+        if (dst[i] < new_num_blocks) {
+          (*copied_from)[dst[i]] = src[i];
+        }
+      }
+      break;
+    }
+
+    default:
+      // The diff operations.
+      if (!has_data) {
+        AddError(type_name + ": has no data.");
+      } else if (operation.data_length() >= dst_size) {
+        AddError(type_name + ": data isn't smaller than a REPLACE.");
+      }
+      break;
+  }
+
+  if (type != InstallOperation::REPLACE &&
+      type != InstallOperation::REPLACE_BZ &&
+      type != InstallOperation::REPLACE_XZ &&
+      type != InstallOperation::ZERO && type != InstallOperation::DISCARD) {
+    if (src_blocks == 0) {
+      AddError(type_name + ": has no src extents.");
+    } else if (!operation.has_src_sha256_hash()) {
+      AddError(type_name + ": src extents without src_sha256_hash.");
+    }
+  }
+}
+
+void PayloadChecker::CheckMergeOperations(const PartitionUpdate& partition,
+                                          uint64_t old_num_blocks,
+                                          uint64_t new_num_blocks,
+                                          const vector<int64_t>& copied_from) {
+  // The same rules as MergeSequenceGenerator::ValidateSequence(): each merge
+  // operation must read blocks not yet overwritten by the previous ones, and
+  // each block is only written once.
+  ExtentRanges visited;
+  const string& partition_name = partition.partition_name();
+  for (int i = 0; i < partition.merge_operations_size(); i++) {
+    const CowMergeOperation& op = partition.merge_operations(i);
+    const string name =
+        StringPrintf("%s.merge_operations[%d]", partition_name.c_str(), i);
+    result_->num_merge_operations++;
+
+    RepeatedPtrField<Extent> src;
+    RepeatedPtrField<Extent> dst;
+    *src.Add() = op.src_extent();
+    *dst.Add() = op.dst_extent();
+    CheckExtents(src, old_num_blocks, name + ".src");
+    CheckExtents(dst, new_num_blocks, name + ".dst");
+
+    const uint64_t expected_src_blocks =
+        op.dst_extent().num_blocks() + (op.src_offset() > 0 ? 1 : 0);
+    if (op.src_extent().num_blocks() != expected_src_blocks) {
+      AddError(StringPrintf("%s: src has %" PRIu64
+                            " blocks but %" PRIu64 " are expected.",
+                            name.c_str(),
+                            op.src_extent().num_blocks(),
+                            expected_src_blocks));
+    }
+    if (op.src_offset() >= block_size_) {
+      AddError(name + ": src_offset isn't within a block.");
+    }
+    if (visited.OverlapsWithExtent(op.src_extent())) {
+      AddError(name + ": src was overwritten by a previous merge operation.");
+    }
+    if (visited.OverlapsWithExtent(op.dst_extent())) {
+      AddError(name + ": dst was written by a previous merge operation.");
+    }
+    visited.AddExtent(op.dst_extent());
+
+    if (op.type() == CowMergeOperation::COW_COPY) {
+      const uint64_t end = std::min(
+          op.dst_extent().start_block() + op.dst_extent().num_blocks(),
+          new_num_blocks);
+      for (uint64_t block = op.dst_extent().start_block(); block < end;
+           block++) {
+        const uint64_t src_block = op.src_extent().start_block() + block -
+                                   op.dst_extent().start_block();
+        if (copied_from[block] != static_cast<int64_t>(src_block)) {
+          AddError(StringPrintf("%s: block %" PRIu64 " isn't SOURCE_COPY'ed "
+                                "from block %" PRIu64 ".",
+                                name.c_str(),
+                                block,
+                                src_block));
+          break;
+        }
+      }
+    }
+  }
+}
+
+void PayloadChecker::CheckReusedBlobsSize() {
+  // The client keeps a blob used by several operations from the first one to
+  // the last one, in the order of the operations.
+  map<std::pair<uint64_t, uint64_t>, size_t> uses;
+  for (const Blob& blob : blobs_) {
+    uses[{blob.offset, blob.length}]++;
+  }
+  uint64_t kept_size = 0;
+  uint64_t max_kept_size = 0;
+  set<std::pair<uint64_t, uint64_t>> kept;
+  for (const Blob& blob : blobs_) {
+    const std::pair<uint64_t, uint64_t> key{blob.offset, blob.length};
+    size_t& remaining = --uses[key];
+    if (kept.count(key) == 0 && remaining > 0) {
+      kept.insert(key);
+      kept_size += blob.length;
+      max_kept_size = std::max(max_kept_size, kept_size);
+    } else if (kept.count(key) != 0 && remaining == 0) {
+      kept.erase(key);
+      kept_size -= blob.length;
+    }
+  }
+  if (max_kept_size > kMaxReusedBlobsSize) {
+    AddError(StringPrintf("The reused data blobs need %" PRIu64
+                          " bytes of memory, more than %" PRIu64 ".",
+                          max_kept_size,
+                          kMaxReusedBlobsSize));
+  }
+}
+
+void PayloadChecker::CheckBlobs() {
+  result_->num_blobs = blobs_.size();
+  const bool blob_reuse = version_.minor >= kBlobReuseMinorPayloadVersion;
+  if (blob_reuse) {
+    CheckReusedBlobsSize();
+  }
+  std::sort(blobs_.begin(), blobs_.end(), [](const Blob& a, const Blob& b) {
+    return a.offset < b.offset;
+  });
+
+  // The blobs must follow each other without gaps, then come the signatures
+  // if the payload is signed.
+  uint64_t end = 0;
+  for (size_t i = 0; i < blobs_.size(); i++) {
+    const Blob& blob = blobs_[i];
+    // Operations with the same data share one blob.
+    if (blob_reuse && i > 0 && blob.offset == blobs_[i - 1].offset &&
+        blob.length == blobs_[i - 1].length) {
+      result_->num_reused_blobs++;
+      continue;
+    }
+    if (blob.offset != end) {
+      AddError(StringPrintf("%s: data at offset %" PRIu64
+                            " but the previous blob ends at %" PRIu64 ".",
+                            blob.name.c_str(),
+                            blob.offset,
+                            end));
+    }
+    end = std::max(end, blob.offset + blob.length);
+    result_->blobs_size += blob.length;
+  }
+  if (manifest_.has_signatures_offset()) {
+    if (manifest_.signatures_offset() != end) {
+      AddError(StringPrintf("The signatures at offset %" PRIu64
+                            " don't follow the data blobs ending at %" PRIu64
+                            ".",
+                            manifest_.signatures_offset(),
+                            end));
+    }
+    end = manifest_.signatures_offset() + manifest_.signatures_size();
+  }
+  if (end != data_size_) {
+    AddError(StringPrintf("The data section is %" PRIu64
+                          " bytes but the blobs and signatures cover %" PRIu64
+                          ".",
+                          data_size_,
+                          end));
+  }
+
+  // Hash the blobs that are within the payload.
+  const auto* data =
+      reinterpret_cast<const uint8_t*>(payload_->data()) + data_offset_;
+  vector<size_t> hashed;
+  vector<BlobHasher> hashers;
+  for (size_t i = 0; i < blobs_.size(); i++) {
+    const Blob& blob = blobs_[i];
+    if ((blob.expected_hash.empty() && blob.chunk_hashes.empty()) ||
+        blob.offset > data_size_ || blob.length > data_size_ - blob.offset) {
+      continue;
+    }
+    hashed.push_back(i);
+    hashers.emplace_back(data + blob.offset,
+                         blob.length,
+                         blob.expected_hash,
+                         blob.chunk_size,
+                         blob.chunk_hashes);
+  }
+  base::DelegateSimpleThreadPool thread_pool("payload-checker", max_threads_);
+  thread_pool.Start();
+  for (auto& hasher : hashers) {
+    thread_pool.AddWork(&hasher);
+  }
+  thread_pool.JoinAll();
+
+  for (size_t i = 0; i < hashers.size(); i++) {
+    if (!hashers[i].matches()) {
+      AddError(blobs_[hashed[i]].name + ": data_sha256_hash mismatch.");
+    }
+    for (size_t chunk : hashers[i].mismatched_chunks()) {
+      AddError(StringPrintf("%s: data_chunk_sha256_hash mismatch for chunk "
+                            "%zu.",
+                            blobs_[hashed[i]].name.c_str(),
+                            chunk));
+    }
+  }
+}
+
+}  // namespace chromeos_update_engine
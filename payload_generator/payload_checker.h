@@ -0,0 +1,133 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_CHECKER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_CHECKER_H_
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/mapped_file.h>
+#include <base/macros.h>
+
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Statically checks that a payload file is consistent without applying it, as
+// update_payload/checker.py does: the operation extents are within the
+// partitions and don't overlap, the data blobs exactly cover the data section
+// and match their hashes, and the COW merge sequence is valid. The data blobs
+// are hashed in parallel straight from a mapping of the payload.
+class PayloadChecker {
+ public:
+  struct Result {
+    // Every problem found, one per line.
+    std::vector<std::string> errors;
+
+    size_t num_partitions{0};
+    size_t num_operations{0};
+    size_t num_merge_operations{0};
+    size_t num_blobs{0};
+    // The operations using the blob of another one, in payloads that reuse
+    // blobs. Their data isn't counted in |blobs_size|.
+    size_t num_reused_blobs{0};
+    uint64_t blobs_size{0};
+
+    bool valid() const { return errors.empty(); }
+
+    // Serializes the result as a JSON object.
+    bool ToJson(std::string* json) const;
+  };
+
+  // Hashes the data blobs with up to |max_threads| threads.
+  PayloadChecker(const std::string& payload_path, size_t max_threads);
+
+  // Checks the payload and stores the problems found in |result|. Returns
+  // false only if the payload couldn't be read or parsed at all, in which case
+  // |result| has the reason too.
+  bool Run(Result* result);
+
+ private:
+  // A data blob of an operation and the hashes it should have.
+  struct Blob {
+    std::string name;
+    uint64_t offset;
+    uint64_t length;
+    std::string expected_hash;
+    // The hashes of the |chunk_size| bytes chunks of the blob, if any.
+    uint64_t chunk_size{0};
+    std::vector<std::string> chunk_hashes;
+  };
+
+  // Checks the operations and merge operations of |partition|, adding their
+  // data blobs to |blobs_|.
+  void CheckPartition(const PartitionUpdate& partition);
+
+  // Checks that the extents of |operation| are within the partitions and
+  // consistent with its type and data blob.
+  void CheckOperation(const InstallOperation& operation,
+                      const std::string& name,
+                      uint64_t old_num_blocks,
+                      uint64_t new_num_blocks,
+                      std::vector<bool>* written_blocks,
+                      std::vector<int64_t>* copied_from);
+
+  // Checks that |merge_ops| can be merged in order and match the operations.
+  void CheckMergeOperations(const PartitionUpdate& partition,
+                            uint64_t old_num_blocks,
+                            uint64_t new_num_blocks,
+                            const std::vector<int64_t>& copied_from);
+
+  // Checks that the blobs exactly cover the data section and that each one
+  // matches its hash.
+  void CheckBlobs();
+
+  // Checks that the blobs a client keeps for the operations that reuse them
+  // don't exceed kMaxReusedBlobsSize at any time.
+  void CheckReusedBlobsSize();
+
+  // Checks that |extents| are all within |num_blocks| and returns the total
+  // number of blocks in them.
+  uint64_t CheckExtents(
+      const google::protobuf::RepeatedPtrField<Extent>& extents,
+      uint64_t num_blocks,
+      const std::string& name);
+
+  void AddError(const std::string& error);
+
+  const std::string payload_path_;
+  const size_t max_threads_;
+
+  std::unique_ptr<android::base::MappedFile> payload_;
+  DeltaArchiveManifest manifest_;
+  PayloadVersion version_;
+  uint64_t block_size_{0};
+  // Offset and size of the data section in the payload.
+  uint64_t data_offset_{0};
+  uint64_t data_size_{0};
+
+  std::vector<Blob> blobs_;
+  Result* result_{nullptr};
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadChecker);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_CHECKER_H_
@@ -0,0 +1,218 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_checker.h"
+
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint64_t kBlockSize = 4096;
+
+}  // namespace
+
+class PayloadCheckerTest : public ::testing::Test {
+ protected:
+  // Builds a delta "system" partition of 4 blocks updated with a REPLACE, a
+  // SOURCE_COPY and a ZERO operation, and a full "vendor" partition of 2
+  // blocks written by a single REPLACE.
+  void SetUp() override {
+    manifest_.set_block_size(kBlockSize);
+    manifest_.set_minor_version(kMaxSupportedMinorPayloadVersion);
+
+    PartitionUpdate* system = manifest_.add_partitions();
+    system->set_partition_name("system");
+    system->mutable_old_partition_info()->set_size(4 * kBlockSize);
+    system->mutable_new_partition_info()->set_size(4 * kBlockSize);
+
+    InstallOperation* replace = system->add_operations();
+    replace->set_type(InstallOperation::REPLACE);
+    *replace->add_dst_extents() = ExtentForRange(0, 1);
+    AddBlob(replace, brillo::Blob(kBlockSize, 'a'));
+
+    InstallOperation* copy = system->add_operations();
+    copy->set_type(InstallOperation::SOURCE_COPY);
+    *copy->add_src_extents() = ExtentForRange(2, 2);
+    *copy->add_dst_extents() = ExtentForRange(1, 2);
+    copy->set_src_sha256_hash(string(32, 'h'));
+
+    InstallOperation* zero = system->add_operations();
+    zero->set_type(InstallOperation::ZERO);
+    *zero->add_dst_extents() = ExtentForRange(3, 1);
+
+    CowMergeOperation* merge_op = system->add_merge_operations();
+    merge_op->set_type(CowMergeOperation::COW_COPY);
+    *merge_op->mutable_src_extent() = ExtentForRange(2, 2);
+    *merge_op->mutable_dst_extent() = ExtentForRange(1, 2);
+
+    PartitionUpdate* vendor = manifest_.add_partitions();
+    vendor->set_partition_name("vendor");
+    vendor->mutable_new_partition_info()->set_size(2 * kBlockSize);
+    InstallOperation* full = vendor->add_operations();
+    full->set_type(InstallOperation::REPLACE);
+    *full->add_dst_extents() = ExtentForRange(0, 2);
+    AddBlob(full, brillo::Blob(2 * kBlockSize, 'b'));
+  }
+
+  void AddBlob(InstallOperation* operation, const brillo::Blob& data) {
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data, &hash));
+    operation->set_data_offset(blobs_.size());
+    operation->set_data_length(data.size());
+    operation->set_data_sha256_hash(hash.data(), hash.size());
+    blobs_.insert(blobs_.end(), data.begin(), data.end());
+  }
+
+  PartitionUpdate* system() { return manifest_.mutable_partitions(0); }
+  PartitionUpdate* vendor() { return manifest_.mutable_partitions(1); }
+
+  // Writes the payload and checks it, expecting one error containing
+  // |expected_error| if not empty.
+  void CheckPayload(const string& expected_error) {
+    ASSERT_TRUE(test_utils::WriteFileVector(blobs_file_.path(), blobs_));
+    uint64_t metadata_size;
+    ASSERT_TRUE(PayloadFile::WritePayload(payload_file_.path(),
+                                          blobs_file_.path(),
+                                          "",
+                                          kBrilloMajorPayloadVersion,
+                                          manifest_,
+                                          &metadata_size));
+
+    PayloadChecker checker(payload_file_.path(), 2);
+    ASSERT_TRUE(checker.Run(&result_));
+    if (expected_error.empty()) {
+      EXPECT_TRUE(result_.valid());
+      return;
+    }
+    ASSERT_EQ(1u, result_.errors.size());
+    EXPECT_NE(string::npos, result_.errors[0].find(expected_error))
+        << result_.errors[0];
+  }
+
+  DeltaArchiveManifest manifest_;
+  brillo::Blob blobs_;
+  PayloadChecker::Result result_;
+  ScopedTempFile blobs_file_{"PayloadCheckerTest_blobs.XXXXXX"};
+  ScopedTempFile payload_file_{"PayloadCheckerTest_payload.XXXXXX"};
+};
+
+TEST_F(PayloadCheckerTest, ValidPayloadTest) {
+  CheckPayload("");
+  EXPECT_EQ(2u, result_.num_partitions);
+  EXPECT_EQ(4u, result_.num_operations);
+  EXPECT_EQ(1u, result_.num_merge_operations);
+  EXPECT_EQ(2u, result_.num_blobs);
+  EXPECT_EQ(3 * kBlockSize, result_.blobs_size);
+
+  string json;
+  EXPECT_TRUE(result_.ToJson(&json));
+  EXPECT_NE(string::npos, json.find("\"valid\":true"));
+}
+
+TEST_F(PayloadCheckerTest, MissingPayloadTest) {
+  PayloadChecker checker("/non/existent/payload.bin", 1);
+  EXPECT_FALSE(checker.Run(&result_));
+  EXPECT_FALSE(result_.valid());
+}
+
+TEST_F(PayloadCheckerTest, DataHashMismatchTest) {
+  blobs_[kBlockSize] = 'c';
+  CheckPayload("vendor.operations[0]: data_sha256_hash mismatch");
+}
+
+TEST_F(PayloadCheckerTest, DataChunkHashesTest) {
+  InstallOperation* full = vendor()->mutable_operations(0);
+  brillo::Blob hash;
+  ASSERT_TRUE(
+      HashCalculator::RawHashOfData(brillo::Blob(kBlockSize, 'b'), &hash));
+  full->set_data_chunk_size(kBlockSize);
+  full->add_data_chunk_sha256_hash(hash.data(), hash.size());
+  full->add_data_chunk_sha256_hash(string(32, 'h'));
+  CheckPayload("vendor.operations[0]: data_chunk_sha256_hash mismatch for "
+               "chunk 1");
+
+  full->set_data_chunk_size(kBlockSize / 2);
+  CheckPayload("vendor.operations[0] (REPLACE): 2 data chunk hashes");
+}
+
+TEST_F(PayloadCheckerTest, ExtentPastEndTest) {
+  *system()->mutable_operations(2)->mutable_dst_extents(0) =
+      ExtentForRange(4, 1);
+  CheckPayload("system.operations[2].dst[0] (4, 1) is past the end");
+}
+
+TEST_F(PayloadCheckerTest, OverlappingDstTest) {
+  *system()->mutable_operations(2)->mutable_dst_extents(0) =
+      ExtentForRange(2, 1);
+  CheckPayload("system.operations[2] (ZERO): dst extent (2, 1) overlaps");
+}
+
+TEST_F(PayloadCheckerTest, DataGapTest) {
+  InstallOperation* full = vendor()->mutable_operations(0);
+  full->set_data_offset(full->data_offset() + 1);
+  blobs_.insert(blobs_.begin() + kBlockSize, 'x');
+  CheckPayload("vendor.operations[0]: data at offset 4097");
+}
+
+TEST_F(PayloadCheckerTest, ReusedBlobTest) {
+  // A third vendor block is written with the data of the system REPLACE.
+  vendor()->mutable_new_partition_info()->set_size(3 * kBlockSize);
+  InstallOperation* reuse = vendor()->add_operations();
+  *reuse = system()->operations(0);
+  *reuse->mutable_dst_extents(0) = ExtentForRange(2, 1);
+  CheckPayload("");
+  EXPECT_EQ(3u, result_.num_blobs);
+  EXPECT_EQ(1u, result_.num_reused_blobs);
+  EXPECT_EQ(3 * kBlockSize, result_.blobs_size);
+
+  // Older minor versions don't allow it.
+  manifest_.set_minor_version(kLZ4DIFFMinorPayloadVersion);
+  CheckPayload("vendor.operations[1]: data at offset 0");
+}
+
+TEST_F(PayloadCheckerTest, UnwrittenFullPartitionTest) {
+  vendor()->mutable_new_partition_info()->set_size(3 * kBlockSize);
+  CheckPayload("vendor: 1 blocks of the full partition aren't written");
+}
+
+TEST_F(PayloadCheckerTest, MergeOperationDoesntMatchCopyTest) {
+  *system()->mutable_merge_operations(0)->mutable_src_extent() =
+      ExtentForRange(1, 2);
+  CheckPayload("block 1 isn't SOURCE_COPY'ed from block 1");
+}
+
+TEST_F(PayloadCheckerTest, InvalidMergeSequenceTest) {
+  CowMergeOperation* merge_op = system()->add_merge_operations();
+  merge_op->set_type(CowMergeOperation::COW_XOR);
+  *merge_op->mutable_src_extent() = ExtentForRange(1, 1);
+  *merge_op->mutable_dst_extent() = ExtentForRange(3, 1);
+  CheckPayload("merge_operations[1]: src was overwritten");
+}
+
+}  // namespace chromeos_update_engine
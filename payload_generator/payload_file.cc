@@ -17,9 +17,13 @@
 #include "update_engine/payload_generator/payload_file.h"
 
 #include <endian.h>
+#include <inttypes.h>
 
+#include <algorithm>
+#include <limits>
 #include <map>
 #include <utility>
+#include <vector>
 
 #include <android-base/stringprintf.h>
 
@@ -30,6 +34,7 @@
 #include "update_engine/payload_generator/annotated_operation.h"
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/payload_signer.h"
+#include "update_engine/payload_generator/target_cache.h"
 
 using std::string;
 using std::vector;
@@ -65,6 +70,9 @@ bool PayloadFile::Init(const PayloadGenerationConfig& config) {
   manifest_.set_minor_version(config.version.minor);
   manifest_.set_block_size(config.block_size);
   manifest_.set_max_timestamp(config.max_timestamp);
+  target_cache_ = config.target_cache;
+  blob_reuse_ = config.version.minor >= kBlobReuseMinorPayloadVersion;
+  data_chunk_size_ = config.data_chunk_size;
   if (!config.security_patch_level.empty()) {
     manifest_.set_security_patch_level(config.security_patch_level);
   }
@@ -97,7 +105,8 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
                                const PartitionConfig& new_conf,
                                vector<AnnotatedOperation> aops,
                                vector<CowMergeOperation> merge_sequence,
-                               const android::snapshot::CowSizeInfo& cow_info) {
+                               const android::snapshot::CowSizeInfo& cow_info,
+                               uint64_t compression_factor) {
   Partition part;
   part.name = new_conf.name;
   part.aops = std::move(aops);
@@ -106,12 +115,18 @@ bool PayloadFile::AddPartition(const PartitionConfig& old_conf,
   part.verity = new_conf.verity;
   part.version = new_conf.version;
   part.cow_info = cow_info;
+  part.compression_factor = compression_factor;
   // Initialize the PartitionInfo objects if present.
   if (!old_conf.path.empty())
     TEST_AND_RETURN_FALSE(
         diff_utils::InitializePartitionInfo(old_conf, &part.old_info));
-  TEST_AND_RETURN_FALSE(
-      diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+  if (target_cache_) {
+    TEST_AND_RETURN_FALSE(
+        target_cache_->InitializePartitionInfo(new_conf, &part.new_info));
+  } else {
+    TEST_AND_RETURN_FALSE(
+        diff_utils::InitializePartitionInfo(new_conf, &part.new_info));
+  }
   part_vec_.push_back(std::move(part));
   return true;
 }
@@ -131,6 +146,9 @@ bool PayloadFile::WritePayload(const string& payload_file,
     for (const auto& aop : part.aops) {
       if (!aop.op.has_data_offset())
         continue;
+      // A reused blob was already written for a previous operation.
+      if (blob_reuse_ && aop.op.data_offset() < next_blob_offset)
+        continue;
       if (aop.op.data_offset() != next_blob_offset) {
         LOG(FATAL) << "bad blob offset! " << aop.op.data_offset()
                    << " != " << next_blob_offset;
@@ -153,6 +171,9 @@ bool PayloadFile::WritePayload(const string& payload_file,
     if (part.cow_info.op_count_max > 0) {
       partition->set_estimate_op_count_max(part.cow_info.op_count_max);
     }
+    if (part.compression_factor > 0) {
+      partition->set_compression_factor(part.compression_factor);
+    }
     if (part.postinstall.run) {
       partition->set_run_postinstall(true);
       if (!part.postinstall.path.empty())
@@ -320,23 +341,103 @@ bool PayloadFile::ReorderDataBlobs(const string& data_blobs_path,
   ScopedFileWriterCloser writer_closer(&writer);
   uint64_t out_file_size = 0;
 
+  // When blobs can be reused, hash the data of every operation first, and find
+  // the next operation with the same data as each one.
+  const size_t kNoNextUse = std::numeric_limits<size_t>::max();
+  std::vector<size_t> next_uses;
+  if (blob_reuse_) {
+    std::map<brillo::Blob, size_t> last_uses;
+    for (auto& part : part_vec_) {
+      for (AnnotatedOperation& aop : part.aops) {
+        const size_t op_index = next_uses.size();
+        next_uses.push_back(kNoNextUse);
+        if (!aop.op.has_data_offset())
+          continue;
+        brillo::Blob buf(aop.op.data_length());
+        ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
+        TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
+        TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+        brillo::Blob hash(aop.op.data_sha256_hash().begin(),
+                          aop.op.data_sha256_hash().end());
+        auto last_use = last_uses.find(hash);
+        if (last_use != last_uses.end()) {
+          next_uses[last_use->second] = op_index;
+          last_use->second = op_index;
+        } else {
+          last_uses.emplace(std::move(hash), op_index);
+        }
+      }
+    }
+  }
+  // The blobs the client keeps for the operations left that use them, by hash.
+  // Whether a blob is kept is decided when it's written, so that the blobs
+  // kept at any time don't exceed kMaxReusedBlobsSize, and a blob is only
+  // reused by the kMaxReusedBlobOperations operations after it.
+  struct KeptBlob {
+    uint64_t offset;
+    // The index of the last operation that may reuse the blob.
+    size_t last_op_index;
+  };
+  std::map<brillo::Blob, KeptBlob> kept_blobs;
+  uint64_t kept_blobs_size = 0;
+  reused_blobs_ = 0;
+  reused_blobs_size_ = 0;
+
+  size_t op_index = 0;
   for (auto& part : part_vec_) {
     for (AnnotatedOperation& aop : part.aops) {
+      const size_t next_use = blob_reuse_ ? next_uses[op_index] : kNoNextUse;
+      const size_t index = op_index++;
       if (!aop.op.has_data_offset())
         continue;
       CHECK(aop.op.has_data_length());
+      // A blob kept for reuse is applied whole, its chunks aren't hashed.
+      bool kept_for_reuse = false;
+      if (blob_reuse_) {
+        const brillo::Blob hash(aop.op.data_sha256_hash().begin(),
+                                aop.op.data_sha256_hash().end());
+        auto kept = kept_blobs.find(hash);
+        if (kept != kept_blobs.end()) {
+          aop.op.set_data_offset(kept->second.offset);
+          reused_blobs_++;
+          reused_blobs_size_ += aop.op.data_length();
+          if (next_use > kept->second.last_op_index) {
+            kept_blobs_size -= aop.op.data_length();
+            kept_blobs.erase(kept);
+          }
+          continue;
+        }
+        if (next_use - index <= kMaxReusedBlobOperations &&
+            kept_blobs_size + aop.op.data_length() <= kMaxReusedBlobsSize) {
+          kept_blobs[hash] = {out_file_size, index + kMaxReusedBlobOperations};
+          kept_blobs_size += aop.op.data_length();
+          kept_for_reuse = true;
+        }
+      }
+
       brillo::Blob buf(aop.op.data_length());
       ssize_t rc = pread(in_fd, buf.data(), buf.size(), aop.op.data_offset());
       TEST_AND_RETURN_FALSE(rc == static_cast<ssize_t>(buf.size()));
 
       // Add the hash of the data blobs for this operation
-      TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      if (!blob_reuse_)
+        TEST_AND_RETURN_FALSE(AddOperationHash(&aop.op, buf));
+      if (data_chunk_size_ > 0 && buf.size() > data_chunk_size_ &&
+          !kept_for_reuse && diff_utils::IsAReplaceOperation(aop.op.type())) {
+        TEST_AND_RETURN_FALSE(
+            AddDataChunkHashes(&aop.op, buf, data_chunk_size_));
+      }
 
       aop.op.set_data_offset(out_file_size);
       TEST_AND_RETURN_FALSE_ERRNO(writer.Write(buf.data(), buf.size()));
       out_file_size += buf.size();
     }
   }
+  if (reused_blobs_ > 0) {
+    LOG(INFO) << "Reused the data blobs of previous operations for "
+              << reused_blobs_ << " operations, saving " << reused_blobs_size_
+              << " bytes.";
+  }
   return true;
 }
 
@@ -348,6 +449,23 @@ bool PayloadFile::AddOperationHash(InstallOperation* op,
   return true;
 }
 
+bool PayloadFile::AddDataChunkHashes(InstallOperation* op,
+                                     const brillo::Blob& buf,
+                                     uint32_t chunk_size) {
+  TEST_AND_RETURN_FALSE(chunk_size > 0);
+  op->set_data_chunk_size(chunk_size);
+  op->clear_data_chunk_sha256_hash();
+  for (size_t offset = 0; offset < buf.size(); offset += chunk_size) {
+    brillo::Blob hash;
+    TEST_AND_RETURN_FALSE(HashCalculator::RawHashOfBytes(
+        buf.data() + offset,
+        std::min<size_t>(chunk_size, buf.size() - offset),
+        &hash));
+    op->add_data_chunk_sha256_hash(hash.data(), hash.size());
+  }
+  return true;
+}
+
 void PayloadFile::ReportPayloadUsage(uint64_t metadata_size) const {
   std::map<DeltaObject, int> object_counts;
   off_t total_size = 0;
@@ -383,6 +501,15 @@ void PayloadFile::ReportPayloadUsage(uint64_t metadata_size) const {
            object_count.second);
   }
   printf(kFormatString, 100.0, total_size, "", "<total>", total_op);
+  if (reused_blobs_ > 0) {
+    // The operations reusing a blob are counted above, but their data is only
+    // stored once.
+    printf("Reused data blobs save %" PRIu64 " bytes (%.2f%%) in %zu "
+           "operations.\n",
+           reused_blobs_size_,
+           reused_blobs_size_ * 100.0 / total_size,
+           reused_blobs_);
+  }
   fflush(stdout);
 }
 
@@ -17,6 +17,7 @@
 #ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 #define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_FILE_H_
 
+#include <memory>
 #include <string>
 #include <vector>
 
@@ -43,11 +44,14 @@ class PayloadFile {
   // Add a partition to the payload manifest. Including partition name, list of
   // operations and partition info. The operations in |aops|
   // reference a blob stored in the file provided to WritePayload().
+  // |compression_factor| is the COW compression factor recommended for the
+  // partition, 0 if it's the one of the dynamic partition metadata.
   bool AddPartition(const PartitionConfig& old_conf,
                     const PartitionConfig& new_conf,
                     std::vector<AnnotatedOperation> aops,
                     std::vector<CowMergeOperation> merge_sequence,
-                    const android::snapshot::CowSizeInfo& cow_info);
+                    const android::snapshot::CowSizeInfo& cow_info,
+                    uint64_t compression_factor = 0);
 
   // Write the payload to the |payload_file| file. The operations reference
   // blobs in the |data_blobs_path| file and the blobs will be reordered in the
@@ -67,6 +71,9 @@ class PayloadFile {
 
  private:
   FRIEND_TEST(PayloadFileTest, ReorderBlobsTest);
+  FRIEND_TEST(PayloadFileTest, ReorderBlobsReuseTest);
+  FRIEND_TEST(PayloadFileTest, ReorderBlobsReuseDistanceTest);
+  FRIEND_TEST(PayloadFileTest, DataChunkHashesTest);
 
   // Computes a SHA256 hash of the given buf and sets the hash value in the
   // operation so that update_engine could verify. This hash should be set
@@ -76,6 +83,12 @@ class PayloadFile {
   // gracefully ignore the fake signature operation.
   static bool AddOperationHash(InstallOperation* op, const brillo::Blob& buf);
 
+  // Sets the hashes of the chunks of |chunk_size| bytes of |buf| in the
+  // operation, for update_engine to validate its data as it's downloaded.
+  static bool AddDataChunkHashes(InstallOperation* op,
+                                 const brillo::Blob& buf,
+                                 uint32_t chunk_size);
+
   // Install operations in the manifest may reference data blobs, which
   // are in data_blobs_path. This function creates a new data blobs file
   // with the data blobs in the same order as the referencing install
@@ -94,6 +107,20 @@ class PayloadFile {
 
   DeltaArchiveManifest manifest_;
 
+  // Used for the target partition info, if set.
+  std::shared_ptr<TargetCache> target_cache_;
+
+  // Whether operations with the same data can share one data blob.
+  bool blob_reuse_{false};
+  // The number of operations that reuse the blob of a previous one, and the
+  // size of their data.
+  size_t reused_blobs_{0};
+  uint64_t reused_blobs_size_{0};
+
+  // The size of the chunks of the blobs of full operations hashed separately,
+  // 0 if they aren't.
+  uint32_t data_chunk_size_{0};
+
   // Struct has necessary information to write PartitionUpdate in protobuf.
   struct Partition {
     // The name of the partition.
@@ -111,6 +138,7 @@ class PayloadFile {
     // Per partition timestamp.
     std::string version;
     android::snapshot::CowSizeInfo cow_info;
+    uint64_t compression_factor = 0;
   };
 
   std::vector<Partition> part_vec_;
@@ -22,7 +22,9 @@
 
 #include <gtest/gtest.h>
 
+#include "update_engine/common/hash_calculator.h"
 #include "update_engine/common/test_utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
 #include "update_engine/payload_generator/extent_ranges.h"
 
 using std::string;
@@ -84,4 +86,108 @@ TEST_F(PayloadFileTest, ReorderBlobsTest) {
   EXPECT_EQ(6U, part1_aops[0].op.data_length());
 }
 
+TEST_F(PayloadFileTest, ReorderBlobsReuseTest) {
+  ScopedTempFile orig_blobs("ReorderBlobsReuseTest.orig.XXXXXX");
+
+  // Rootfs operation 1: [0, 2] ab
+  // Rootfs operation 2: [2, 1] c
+  // Kernel operation 1: [3, 2] ab, the same data as rootfs operation 1.
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcab"));
+
+  ScopedTempFile new_blobs("ReorderBlobsReuseTest.new.XXXXXX");
+
+  payload_.blob_reuse_ = true;
+  payload_.part_vec_.resize(2);
+
+  AnnotatedOperation aop;
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(2);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(2);
+  aop.op.set_data_length(1);
+  payload_.part_vec_[0].aops.push_back(aop);
+  aop.op.set_data_offset(3);
+  aop.op.set_data_length(2);
+  payload_.part_vec_[1].aops = {aop};
+
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
+  EXPECT_EQ("abc", new_data);
+
+  const InstallOperation& first = payload_.part_vec_[0].aops[0].op;
+  const InstallOperation& kernel = payload_.part_vec_[1].aops[0].op;
+  EXPECT_EQ(0U, kernel.data_offset());
+  EXPECT_EQ(2U, kernel.data_length());
+  EXPECT_EQ(first.data_sha256_hash(), kernel.data_sha256_hash());
+  EXPECT_EQ(2U, payload_.part_vec_[0].aops[1].op.data_offset());
+  EXPECT_EQ(1U, payload_.reused_blobs_);
+  EXPECT_EQ(2U, payload_.reused_blobs_size_);
+}
+
+TEST_F(PayloadFileTest, ReorderBlobsReuseDistanceTest) {
+  ScopedTempFile orig_blobs("ReorderBlobsReuseDistanceTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "ababab"));
+  ScopedTempFile new_blobs("ReorderBlobsReuseDistanceTest.new.XXXXXX");
+
+  payload_.blob_reuse_ = true;
+  payload_.part_vec_.resize(1);
+  auto& aops = payload_.part_vec_[0].aops;
+  AnnotatedOperation aop;
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(2);
+  aops.push_back(aop);
+  // The same data too many operations later is stored again, and that copy
+  // is reused by the next operation.
+  aops.resize(aops.size() + kMaxReusedBlobOperations);
+  aop.op.set_data_offset(2);
+  aops.push_back(aop);
+  aop.op.set_data_offset(4);
+  aops.push_back(aop);
+
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+
+  string new_data;
+  EXPECT_TRUE(utils::ReadFile(new_blobs.path(), &new_data));
+  EXPECT_EQ("abab", new_data);
+  EXPECT_EQ(0U, aops[0].op.data_offset());
+  EXPECT_EQ(2U, aops[aops.size() - 2].op.data_offset());
+  EXPECT_EQ(2U, aops.back().op.data_offset());
+  EXPECT_EQ(1U, payload_.reused_blobs_);
+}
+
+TEST_F(PayloadFileTest, DataChunkHashesTest) {
+  ScopedTempFile orig_blobs("DataChunkHashesTest.orig.XXXXXX");
+  EXPECT_TRUE(test_utils::WriteFileString(orig_blobs.path(), "abcdefgxyz"));
+  ScopedTempFile new_blobs("DataChunkHashesTest.new.XXXXXX");
+
+  payload_.data_chunk_size_ = 3;
+  payload_.part_vec_.resize(1);
+  AnnotatedOperation aop;
+  aop.op.set_type(InstallOperation::REPLACE_XZ);
+  aop.op.set_data_offset(0);
+  aop.op.set_data_length(7);
+  payload_.part_vec_[0].aops.push_back(aop);
+  // Only the blobs of full operations bigger than a chunk are hashed.
+  aop.op.set_type(InstallOperation::SOURCE_BSDIFF);
+  aop.op.set_data_offset(7);
+  aop.op.set_data_length(3);
+  payload_.part_vec_[0].aops.push_back(aop);
+  EXPECT_TRUE(payload_.ReorderDataBlobs(orig_blobs.path(), new_blobs.path()));
+
+  const InstallOperation& replace = payload_.part_vec_[0].aops[0].op;
+  EXPECT_EQ(3U, replace.data_chunk_size());
+  ASSERT_EQ(3, replace.data_chunk_sha256_hash_size());
+  const string chunks[] = {"abc", "def", "g"};
+  for (int i = 0; i < 3; i++) {
+    brillo::Blob hash;
+    EXPECT_TRUE(HashCalculator::RawHashOfData(
+        brillo::Blob(chunks[i].begin(), chunks[i].end()), &hash));
+    EXPECT_EQ(string(hash.begin(), hash.end()),
+              replace.data_chunk_sha256_hash(i));
+  }
+  EXPECT_EQ(0, payload_.part_vec_[0].aops[1].op.data_chunk_sha256_hash_size());
+}
+
 }  // namespace chromeos_update_engine
@@ -33,6 +33,7 @@
 #include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/erofs_filesystem.h"
 #include "update_engine/payload_generator/ext2_filesystem.h"
+#include "update_engine/payload_generator/image_file.h"
 #include "update_engine/payload_generator/mapfile_filesystem.h"
 #include "update_engine/payload_generator/raw_filesystem.h"
 #include "update_engine/payload_generator/squashfs_filesystem.h"
@@ -65,11 +66,11 @@ void VerityConfig::Clear() {
 
 bool PartitionConfig::ValidateExists() const {
   TEST_AND_RETURN_FALSE(!path.empty());
-  TEST_AND_RETURN_FALSE(utils::FileExists(path.c_str()));
+  const off_t file_size = image_file::Size(path);
+  TEST_AND_RETURN_FALSE(file_size >= 0);
   TEST_AND_RETURN_FALSE(size > 0);
   // The requested size is within the limits of the file.
-  TEST_AND_RETURN_FALSE(static_cast<off_t>(size) <=
-                        utils::FileSize(path.c_str()));
+  TEST_AND_RETURN_FALSE(static_cast<off_t>(size) <= file_size);
   return true;
 }
 
@@ -128,7 +129,7 @@ bool ImageConfig::LoadImageSize() {
   for (PartitionConfig& part : partitions) {
     if (part.path.empty())
       continue;
-    part.size = utils::FileSize(part.path);
+    part.size = image_file::Size(part.path);
   }
   return true;
 }
@@ -291,7 +292,9 @@ bool PayloadVersion::Validate() const {
                         minor == kVerityMinorPayloadVersion ||
                         minor == kPartialUpdateMinorPayloadVersion ||
                         minor == kZucchiniMinorPayloadVersion ||
-                        minor == kLZ4DIFFMinorPayloadVersion);
+                        minor == kLZ4DIFFMinorPayloadVersion ||
+                        minor == kBlobReuseMinorPayloadVersion ||
+                        minor == kReplaceXorMinorPayloadVersion);
   return true;
 }
 
@@ -372,6 +375,11 @@ bool PayloadGenerationConfig::Validate() const {
     TEST_AND_RETURN_FALSE(!is_partial_update);
   }
 
+  if (enable_xor_similarity_search) {
+    TEST_AND_RETURN_FALSE(enable_vabc_xor);
+    TEST_AND_RETURN_FALSE(version.minor >= kReplaceXorMinorPayloadVersion);
+  }
+
   TEST_AND_RETURN_FALSE(hard_chunk_size == -1 ||
                         hard_chunk_size % block_size == 0);
   TEST_AND_RETURN_FALSE(soft_chunk_size % block_size == 0);
@@ -32,6 +32,9 @@
 
 namespace chromeos_update_engine {
 
+class GenerationProfile;
+class TargetCache;
+
 struct PostInstallConfig {
   // Whether the postinstall config is empty.
   bool IsEmpty() const;
@@ -156,9 +159,21 @@ struct ImageConfig {
   // Load postinstall config from a key value store.
   bool LoadPostInstallConfig(const brillo::KeyValueStore& store);
 
-  // Load verity config by parsing the partition images.
+  // Load verity config by parsing the partition images, then verify it with
+  // VerifyVerityConfig().
   bool LoadVerityConfig();
 
+  // Parse the verity config of the partition images without verifying the
+  // hash tree and FEC stored in them.
+  bool ParseVerityConfig();
+
+  // Regenerate the hash tree and FEC of every partition with a non-empty
+  // verity config and check that they match the ones stored in the images.
+  // Partitions are verified concurrently on up to |max_threads| threads, each
+  // opened only once. This only reads the config, so it may run in parallel
+  // with payload generation.
+  bool VerifyVerityConfig(size_t max_threads) const;
+
   // Load dynamic partition info from a key value store.
   bool LoadDynamicPartitionMetadata(const brillo::KeyValueStore& store);
 
@@ -239,6 +254,22 @@ struct PayloadGenerationConfig {
   // chunks.
   size_t soft_chunk_size = 2 * 1024 * 1024;
 
+  // Files too big for any diff operation are split in chunks of at most
+  // |large_file_chunk_size| bytes, diffed in parallel against the same region
+  // of the old file, instead of being written with full operations. A value
+  // of 0 disables the splitting.
+  size_t large_file_chunk_size = 64 * 1024 * 1024;
+
+  // The memory the diffs of the chunks of large files may use at once. Chunks
+  // are made smaller so that diffing one on every thread stays under it. A
+  // value of 0 means no limit.
+  uint64_t large_file_memory_budget = 0;
+
+  // The blobs of full operations bigger than |data_chunk_size| bytes get the
+  // hashes of their chunks of this size, for the client to apply them as they
+  // are downloaded. A value of 0 disables the chunk hashes.
+  uint32_t data_chunk_size = 0;
+
   // TODO(deymo): Remove the block_size member and maybe replace it with a
   // minimum alignment size for blocks (if needed). Algorithms should be able to
   // pick the block_size they want, but for now only 4 KiB is supported.
@@ -255,6 +286,15 @@ struct PayloadGenerationConfig {
   // Whether to enable VABC xor op
   bool enable_vabc_xor = false;
 
+  // Whether to also search the source partition for XOR sources of the blocks
+  // written by full operations, when VABC xor ops are enabled.
+  bool enable_xor_similarity_search = false;
+
+  // Whether to measure, for each partition, if compressing its COW in chunks
+  // of the VABC compression factor saves space over compressing single blocks,
+  // and to recommend single blocks to the device when it doesn't.
+  bool tune_vabc_compression_factor = false;
+
   // Whether to enable LZ4diff ops
   bool enable_lz4diff = false;
 
@@ -270,6 +310,14 @@ struct PayloadGenerationConfig {
   // count by number of CPU cores
   uint32_t max_threads = 256;
 
+  // Shared by the payloads generated from several sources to the same target
+  // in one run, null otherwise.
+  std::shared_ptr<TargetCache> target_cache;
+
+  // Collects the profile of the generation of each file of the delta
+  // partitions if not null.
+  std::shared_ptr<GenerationProfile> generation_profile;
+
   std::vector<bsdiff::CompressorType> compressors{
       bsdiff::CompressorType::kBZ2, bsdiff::CompressorType::kBrotli};
 
@@ -16,10 +16,19 @@
 
 #include "update_engine/payload_generator/payload_generation_config.h"
 
+#include <fcntl.h>
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+
 #include <android-base/parseint.h>
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
+#include <base/threading/simple_thread.h>
 #include <brillo/secure_blob.h>
 #include <fec/io.h>
 #include <libavb/libavb.h>
@@ -27,7 +36,9 @@
 
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_consumer/verity_writer_android.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/image_file.h"
 
 namespace chromeos_update_engine {
 
@@ -74,68 +85,131 @@ bool AvbDescriptorCallback(const AvbDescriptor* descriptor, void* user_data) {
   return true;
 }
 
-// Generate hash tree and FEC based on the verity config and verify that it
-// matches the hash tree and FEC stored in the image.
-bool VerifyVerityConfig(const PartitionConfig& part) {
-  const size_t block_size = part.fs_interface->GetBlockSize();
-  if (part.verity.hash_tree_extent.num_blocks() != 0) {
+// Number of FEC rounds verified by a single task. Each round reads
+// |block_size| * rs_n bytes scattered across the whole partition, so this keeps
+// tasks small enough to balance across threads.
+constexpr uint64_t kFECRoundsPerTask = 64;
+
+// A unit of work of verity verification: either the whole hash tree of a
+// partition or a range of its FEC rounds. Each task reads the partition image
+// through its own |fd|, as the descriptors can't be shared between threads.
+class VerityVerifyTask : public base::DelegateSimpleThread::Delegate {
+ public:
+  // Create a task verifying the hash tree if |verify_hash_tree|, or FEC rounds
+  // [first_fec_round, last_fec_round) otherwise.
+  VerityVerifyTask(const PartitionConfig& part,
+                   FileDescriptorPtr fd,
+                   bool verify_hash_tree,
+                   uint64_t first_fec_round,
+                   uint64_t last_fec_round)
+      : part_(part),
+        fd_(std::move(fd)),
+        verify_hash_tree_(verify_hash_tree),
+        first_fec_round_(first_fec_round),
+        last_fec_round_(last_fec_round) {}
+  VerityVerifyTask(VerityVerifyTask&&) noexcept = default;
+
+  void Run() override {
+    if (verify_hash_tree_) {
+      success_ = VerifyHashTree();
+      LOG_IF(ERROR, !success_)
+          << "Hash tree verification failed for partition " << part_.name;
+    } else {
+      success_ = VerifyFEC();
+      LOG_IF(ERROR, !success_)
+          << "FEC verification failed for partition " << part_.name
+          << ", rounds [" << first_fec_round_ << ", " << last_fec_round_
+          << ")";
+    }
+  }
+
+  bool success() const { return success_; }
+
+ private:
+  // Generate hash tree based on the verity config and verify that it matches
+  // the hash tree stored in the image.
+  bool VerifyHashTree() {
+    const size_t block_size = part_.fs_interface->GetBlockSize();
     auto hash_function =
-        HashTreeBuilder::HashFunction(part.verity.hash_tree_algorithm);
+        HashTreeBuilder::HashFunction(part_.verity.hash_tree_algorithm);
     TEST_AND_RETURN_FALSE(hash_function != nullptr);
     HashTreeBuilder hash_tree_builder(block_size, hash_function);
     uint64_t data_size =
-        part.verity.hash_tree_data_extent.num_blocks() * block_size;
+        part_.verity.hash_tree_data_extent.num_blocks() * block_size;
     uint64_t tree_size = hash_tree_builder.CalculateSize(data_size);
     TEST_AND_RETURN_FALSE(
-        tree_size == part.verity.hash_tree_extent.num_blocks() * block_size);
+        tree_size == part_.verity.hash_tree_extent.num_blocks() * block_size);
     TEST_AND_RETURN_FALSE(
-        hash_tree_builder.Initialize(data_size, part.verity.hash_tree_salt));
+        hash_tree_builder.Initialize(data_size, part_.verity.hash_tree_salt));
 
-    brillo::Blob buffer;
-    for (uint64_t offset = part.verity.hash_tree_data_extent.start_block() *
+    constexpr uint64_t kBufferSize = 1024 * 1024;
+    brillo::Blob buffer(std::min(kBufferSize, data_size));
+    for (uint64_t offset = part_.verity.hash_tree_data_extent.start_block() *
                            block_size,
                   data_end = offset + data_size;
          offset < data_end;) {
-      constexpr uint64_t kBufferSize = 1024 * 1024;
       size_t bytes_to_read = std::min(kBufferSize, data_end - offset);
+      TEST_AND_RETURN_FALSE(Read(buffer.data(), bytes_to_read, offset));
       TEST_AND_RETURN_FALSE(
-          utils::ReadFileChunk(part.path, offset, bytes_to_read, &buffer));
-      TEST_AND_RETURN_FALSE(
-          hash_tree_builder.Update(buffer.data(), buffer.size()));
-      offset += buffer.size();
-      buffer.clear();
+          hash_tree_builder.Update(buffer.data(), bytes_to_read));
+      offset += bytes_to_read;
     }
     TEST_AND_RETURN_FALSE(hash_tree_builder.BuildHashTree());
-    TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
-        part.path,
-        part.verity.hash_tree_extent.start_block() * block_size,
-        tree_size,
-        &buffer));
-    TEST_AND_RETURN_FALSE(hash_tree_builder.CheckHashTree(buffer));
+    buffer.resize(tree_size);
+    TEST_AND_RETURN_FALSE(
+        Read(buffer.data(),
+             tree_size,
+             part_.verity.hash_tree_extent.start_block() * block_size));
+    return hash_tree_builder.CheckHashTree(buffer);
   }
 
-  if (part.verity.fec_extent.num_blocks() != 0) {
-    TEST_AND_RETURN_FALSE(VerityWriterAndroid::EncodeFEC(
-        part.path,
-        part.verity.fec_data_extent.start_block() * block_size,
-        part.verity.fec_data_extent.num_blocks() * block_size,
-        part.verity.fec_extent.start_block() * block_size,
-        part.verity.fec_extent.num_blocks() * block_size,
-        part.verity.fec_roots,
+  // Generate FEC for rounds [first_fec_round_, last_fec_round_) and verify
+  // that it matches the FEC stored in the image.
+  bool VerifyFEC() {
+    const size_t block_size = part_.fs_interface->GetBlockSize();
+    return VerityWriterAndroid::VerifyFECRounds(
+        fd_.get(),
+        part_.verity.fec_data_extent.start_block() * block_size,
+        part_.verity.fec_data_extent.num_blocks() * block_size,
+        part_.verity.fec_extent.start_block() * block_size,
+        part_.verity.fec_extent.num_blocks() * block_size,
+        part_.verity.fec_roots,
         block_size,
-        true /* verify_mode */));
+        first_fec_round_,
+        last_fec_round_);
   }
-  return true;
-}
+
+  bool Read(uint8_t* buffer, size_t size, uint64_t offset) {
+    ssize_t bytes_read = 0;
+    TEST_AND_RETURN_FALSE(
+        utils::ReadAll(fd_, buffer, size, offset, &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(size));
+    return true;
+  }
+
+  const PartitionConfig& part_;
+  FileDescriptorPtr fd_;
+  bool verify_hash_tree_;
+  uint64_t first_fec_round_;
+  uint64_t last_fec_round_;
+  bool success_ = false;
+
+  DISALLOW_COPY_AND_ASSIGN(VerityVerifyTask);
+};
 }  // namespace
 
 bool ImageConfig::LoadVerityConfig() {
+  TEST_AND_RETURN_FALSE(ParseVerityConfig());
+  return VerifyVerityConfig(diff_utils::GetMaxThreads());
+}
+
+bool ImageConfig::ParseVerityConfig() {
   for (PartitionConfig& part : partitions) {
     // Parse AVB devices.
     if (part.size > sizeof(AvbFooter)) {
       uint64_t footer_offset = part.size - sizeof(AvbFooter);
       brillo::Blob buffer;
-      TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+      TEST_AND_RETURN_FALSE(image_file::ReadChunk(
           part.path, footer_offset, sizeof(AvbFooter), &buffer));
       if (memcmp(buffer.data(), AVB_FOOTER_MAGIC, AVB_FOOTER_MAGIC_LEN) == 0) {
         LOG(INFO) << "Parsing verity config from AVB footer for " << part.name;
@@ -146,7 +220,7 @@ bool ImageConfig::LoadVerityConfig() {
 
         TEST_AND_RETURN_FALSE(
             footer.vbmeta_offset + sizeof(AvbVBMetaImageHeader) <= part.size);
-        TEST_AND_RETURN_FALSE(utils::ReadFileChunk(
+        TEST_AND_RETURN_FALSE(image_file::ReadChunk(
             part.path, footer.vbmeta_offset, footer.vbmeta_size, &buffer));
         TEST_AND_RETURN_FALSE(avb_descriptor_foreach(
             buffer.data(), buffer.size(), AvbDescriptorCallback, &part));
@@ -157,10 +231,10 @@ bool ImageConfig::LoadVerityConfig() {
     // FEC will be skipped for now.
     if (part.verity.IsEmpty() && part.size > FEC_BLOCKSIZE) {
       brillo::Blob fec_metadata;
-      TEST_AND_RETURN_FALSE(utils::ReadFileChunk(part.path,
-                                                 part.size - FEC_BLOCKSIZE,
-                                                 sizeof(fec_header),
-                                                 &fec_metadata));
+      TEST_AND_RETURN_FALSE(image_file::ReadChunk(part.path,
+                                                  part.size - FEC_BLOCKSIZE,
+                                                  sizeof(fec_header),
+                                                  &fec_metadata));
       const fec_header* header =
           reinterpret_cast<const fec_header*>(fec_metadata.data());
       if (header->magic == FEC_MAGIC) {
@@ -169,8 +243,10 @@ bool ImageConfig::LoadVerityConfig() {
             << part.name;
         const size_t block_size = part.fs_interface->GetBlockSize();
         // FEC_VERITY_DISABLE skips verifying verity hash tree, because we will
-        // verify it ourselves later.
-        fec::io fh(part.path, O_RDONLY, FEC_VERITY_DISABLE);
+        // verify it ourselves later. libfec only reads raw files.
+        const std::string raw_path = image_file::GetRawPath(part.path);
+        TEST_AND_RETURN_FALSE(!raw_path.empty());
+        fec::io fh(raw_path, O_RDONLY, FEC_VERITY_DISABLE);
         TEST_AND_RETURN_FALSE(fh);
         fec_verity_metadata verity_data;
         if (fh.get_verity_metadata(verity_data)) {
@@ -218,12 +294,69 @@ bool ImageConfig::LoadVerityConfig() {
         }
       }
     }
+  }
+  return true;
+}
 
-    if (!part.verity.IsEmpty()) {
-      TEST_AND_RETURN_FALSE(VerifyVerityConfig(part));
+bool ImageConfig::VerifyVerityConfig(size_t max_threads) const {
+  size_t num_partitions = 0;
+  std::vector<VerityVerifyTask> tasks;
+  for (const PartitionConfig& part : partitions) {
+    if (part.verity.IsEmpty()) {
+      continue;
+    }
+    if (part.verity.hash_tree_extent.num_blocks() != 0) {
+      FileDescriptorPtr fd = image_file::Open(part.path);
+      TEST_AND_RETURN_FALSE(fd);
+      tasks.emplace_back(part, std::move(fd), true, 0, 0);
     }
+    if (part.verity.fec_extent.num_blocks() != 0) {
+      const size_t block_size = part.fs_interface->GetBlockSize();
+      const uint64_t rounds = VerityWriterAndroid::GetFECRounds(
+          part.verity.fec_data_extent.num_blocks() * block_size,
+          part.verity.fec_roots,
+          block_size);
+      // Always add at least one task so that a mismatching FEC size is caught.
+      uint64_t round = 0;
+      do {
+        const uint64_t last_round = std::min(round + kFECRoundsPerTask, rounds);
+        FileDescriptorPtr fd = image_file::Open(part.path);
+        TEST_AND_RETURN_FALSE(fd);
+        tasks.emplace_back(part, std::move(fd), false, round, last_round);
+        round = last_round;
+      } while (round < rounds);
+    }
+    num_partitions++;
   }
-  return true;
+  if (tasks.empty()) {
+    return true;
+  }
+
+  const size_t thread_count =
+      std::max<size_t>(1, std::min(max_threads, tasks.size()));
+  LOG(INFO) << "Verifying verity data of " << num_partitions
+            << " partitions with " << tasks.size() << " tasks on "
+            << thread_count << " threads";
+  const auto start = std::chrono::steady_clock::now();
+  base::DelegateSimpleThreadPool thread_pool("verity-verifier",
+                                             static_cast<int>(thread_count));
+  thread_pool.Start();
+  for (auto& task : tasks) {
+    thread_pool.AddWork(&task);
+  }
+  thread_pool.JoinAll();
+
+  const bool success =
+      std::all_of(tasks.begin(), tasks.end(), [](const auto& task) {
+        return task.success();
+      });
+  LOG(INFO) << "Verity verification " << (success ? "succeeded" : "failed")
+            << " in "
+            << std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - start)
+                   .count()
+            << " ms";
+  return success;
 }
 
 }  // namespace chromeos_update_engine
@@ -196,6 +196,39 @@ TEST_F(PayloadGenerationConfigAndroidTest, LoadVerityConfigInvalidFECTest) {
   EXPECT_FALSE(image_config_.LoadVerityConfig());
 }
 
+TEST_F(PayloadGenerationConfigAndroidTest,
+       ParseVerityConfigSkipsVerificationTest) {
+  brillo::Blob part = GetAVBPartition();
+  part[kFECOffset] ^= 1;  // flip one bit
+  test_utils::WriteFileVector(temp_file_.path(), part);
+  EXPECT_TRUE(image_config_.LoadImageSize());
+  EXPECT_TRUE(image_config_.partitions[0].OpenFilesystem());
+  EXPECT_TRUE(image_config_.ParseVerityConfig());
+  EXPECT_FALSE(image_config_.partitions[0].verity.IsEmpty());
+  EXPECT_FALSE(image_config_.VerifyVerityConfig(4));
+}
+
+TEST_F(PayloadGenerationConfigAndroidTest,
+       VerifyVerityConfigMultiplePartitionsTest) {
+  ScopedTempFile other_file("PayloadGenerationConfigAndroidTest.XXXXXX");
+  image_config_.partitions.emplace_back("vendor");
+  image_config_.partitions[1].path = other_file.path();
+  brillo::Blob part = GetAVBPartition();
+  test_utils::WriteFileVector(temp_file_.path(), part);
+  test_utils::WriteFileVector(other_file.path(), part);
+  EXPECT_TRUE(image_config_.LoadImageSize());
+  for (auto& partition : image_config_.partitions) {
+    EXPECT_TRUE(partition.OpenFilesystem());
+  }
+  EXPECT_TRUE(image_config_.ParseVerityConfig());
+  EXPECT_TRUE(image_config_.VerifyVerityConfig(1));
+  EXPECT_TRUE(image_config_.VerifyVerityConfig(4));
+
+  part[kHashTreeOffset] ^= 1;  // flip one bit
+  test_utils::WriteFileVector(other_file.path(), part);
+  EXPECT_FALSE(image_config_.VerifyVerityConfig(4));
+}
+
 TEST_F(PayloadGenerationConfigAndroidTest, LoadVerityConfigEmptyImageTest) {
   brillo::Blob part(kImageSize);
   test_utils::WriteFileVector(temp_file_.path(), part);
@@ -22,4 +22,12 @@ bool ImageConfig::LoadVerityConfig() {
   return true;
 }
 
+bool ImageConfig::ParseVerityConfig() {
+  return true;
+}
+
+bool ImageConfig::VerifyVerityConfig(size_t /* max_threads */) const {
+  return true;
+}
+
 }  // namespace chromeos_update_engine
@@ -0,0 +1,275 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_merger.h"
+
+#include <fcntl.h>
+
+#include <algorithm>
+
+#include <android-base/unique_fd.h>
+#include <base/logging.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/payload_file.h"
+#include "update_engine/payload_generator/payload_signer.h"
+
+using std::set;
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The size of the chunks the data blobs are copied in.
+constexpr size_t kCopyBufferSize = 1024 * 1024;
+
+}  // namespace
+
+PayloadMerger::PayloadMerger(const vector<string>& partition_names)
+    : partition_names_(partition_names.begin(), partition_names.end()) {}
+
+bool PayloadMerger::AddPayload(const string& payload_path) {
+  PayloadMetadata metadata;
+  DeltaArchiveManifest manifest;
+  if (!metadata.ParsePayloadFile(payload_path, &manifest, nullptr)) {
+    LOG(ERROR) << "Failed to parse the metadata of " << payload_path;
+    return false;
+  }
+
+  if (inputs_.empty()) {
+    major_version_ = metadata.GetMajorVersion();
+    manifest_.set_block_size(manifest.block_size());
+  } else if (metadata.GetMajorVersion() != major_version_ ||
+             manifest.block_size() != manifest_.block_size()) {
+    LOG(ERROR) << payload_path << " has major version "
+               << metadata.GetMajorVersion() << " and block size "
+               << manifest.block_size() << ", expected " << major_version_
+               << " and " << manifest_.block_size();
+    return false;
+  }
+
+  // Full payloads only have REPLACE operations, which every delta minor
+  // version supports, but two different delta minor versions can't be mixed.
+  if (manifest.minor_version() != kFullPayloadMinorVersion) {
+    if (manifest_.minor_version() != kFullPayloadMinorVersion &&
+        manifest_.minor_version() != manifest.minor_version()) {
+      LOG(ERROR) << payload_path << " has minor version "
+                 << manifest.minor_version() << ", but the partitions added "
+                 << "so far have minor version " << manifest_.minor_version();
+      return false;
+    }
+    manifest_.set_minor_version(manifest.minor_version());
+  }
+
+  const size_t input = inputs_.size();
+  set<string> added_partitions;
+  for (PartitionUpdate& partition : *manifest.mutable_partitions()) {
+    const string& name = partition.partition_name();
+    if (!partition_names_.empty() && partition_names_.count(name) == 0) {
+      // The partitions left out won't be updated, instead of being removed.
+      manifest_.set_partial_update(true);
+      continue;
+    }
+    for (const PartitionUpdate& added : manifest_.partitions()) {
+      if (added.partition_name() == name) {
+        LOG(ERROR) << "Partition " << name << " of " << payload_path
+                   << " was already added by another payload.";
+        return false;
+      }
+    }
+    added_partitions.insert(name);
+    *manifest_.add_partitions() = std::move(partition);
+    partition_inputs_.push_back(input);
+  }
+  LOG(INFO) << "Adding " << added_partitions.size() << " of "
+            << manifest.partitions_size() << " partitions of " << payload_path;
+
+  if (manifest.partial_update()) {
+    manifest_.set_partial_update(true);
+  }
+  manifest_.set_max_timestamp(
+      std::max(manifest_.max_timestamp(), manifest.max_timestamp()));
+  if (manifest_.security_patch_level().empty()) {
+    manifest_.set_security_patch_level(manifest.security_patch_level());
+  }
+  for (const ApexInfo& apex : manifest.apex_info()) {
+    const bool added = std::any_of(
+        manifest_.apex_info().begin(),
+        manifest_.apex_info().end(),
+        [&apex](const ApexInfo& other) {
+          return other.package_name() == apex.package_name();
+        });
+    if (!added) {
+      *manifest_.add_apex_info() = apex;
+    }
+  }
+  if (manifest.has_dynamic_partition_metadata()) {
+    MergeDynamicPartitionMetadata(manifest.dynamic_partition_metadata(),
+                                  added_partitions);
+  }
+
+  inputs_.push_back({payload_path,
+                     metadata.GetMetadataSize() +
+                         metadata.GetMetadataSignatureSize()});
+  return true;
+}
+
+void PayloadMerger::MergeDynamicPartitionMetadata(
+    const DynamicPartitionMetadata& metadata,
+    const set<string>& added_partitions) {
+  // The settings of the first payload which has them are kept.
+  if (!manifest_.has_dynamic_partition_metadata()) {
+    *manifest_.mutable_dynamic_partition_metadata() = metadata;
+    manifest_.mutable_dynamic_partition_metadata()->clear_groups();
+  }
+  DynamicPartitionMetadata* merged =
+      manifest_.mutable_dynamic_partition_metadata();
+  for (const DynamicPartitionGroup& group : metadata.groups()) {
+    DynamicPartitionGroup* merged_group = nullptr;
+    for (DynamicPartitionGroup& other : *merged->mutable_groups()) {
+      if (other.name() == group.name()) {
+        merged_group = &other;
+        break;
+      }
+    }
+    if (merged_group == nullptr) {
+      merged_group = merged->add_groups();
+      merged_group->set_name(group.name());
+      merged_group->set_size(group.size());
+    }
+    for (const string& name : group.partition_names()) {
+      if (added_partitions.count(name) != 0) {
+        merged_group->add_partition_names(name);
+      }
+    }
+  }
+}
+
+bool PayloadMerger::CopyBlob(const Input& input,
+                             int in_fd,
+                             int out_fd,
+                             InstallOperation* operation,
+                             uint64_t* out_offset) {
+  HashCalculator hasher;
+  brillo::Blob buffer(std::min<uint64_t>(kCopyBufferSize,
+                                         operation->data_length()));
+  const uint64_t in_offset = input.data_offset + operation->data_offset();
+  for (uint64_t copied = 0; copied < operation->data_length();) {
+    const size_t size = std::min<uint64_t>(
+        buffer.size(), operation->data_length() - copied);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(utils::PReadAll(
+        in_fd, buffer.data(), size, in_offset + copied, &bytes_read));
+    if (static_cast<size_t>(bytes_read) != size) {
+      LOG(ERROR) << "The data of an operation of " << input.path
+                 << " is past the end of the payload.";
+      return false;
+    }
+    TEST_AND_RETURN_FALSE(hasher.Update(buffer.data(), size));
+    TEST_AND_RETURN_FALSE(utils::WriteAll(out_fd, buffer.data(), size));
+    copied += size;
+  }
+  TEST_AND_RETURN_FALSE(hasher.Finalize());
+
+  if (!operation->has_data_sha256_hash()) {
+    operation->set_data_sha256_hash(hasher.raw_hash().data(),
+                                    hasher.raw_hash().size());
+  } else if (brillo::Blob(operation->data_sha256_hash().begin(),
+                          operation->data_sha256_hash().end()) !=
+             hasher.raw_hash()) {
+    LOG(ERROR) << "The data of an operation of " << input.path
+               << " doesn't match its hash.";
+    return false;
+  }
+  operation->set_data_offset(*out_offset);
+  *out_offset += operation->data_length();
+  return true;
+}
+
+bool PayloadMerger::WritePayload(const string& payload_file,
+                                 const string& private_key_path,
+                                 uint64_t* metadata_size_out) {
+  TEST_AND_RETURN_FALSE(!inputs_.empty());
+  for (const string& name : partition_names_) {
+    const bool found = std::any_of(
+        manifest_.partitions().begin(),
+        manifest_.partitions().end(),
+        [&name](const PartitionUpdate& partition) {
+          return partition.partition_name() == name;
+        });
+    if (!found) {
+      LOG(ERROR) << "Partition " << name << " isn't in any of the payloads.";
+      return false;
+    }
+  }
+
+  DeltaArchiveManifest manifest = manifest_;
+  ScopedTempFile blobs_file("PayloadMerger_blobs.XXXXXX");
+  android::base::unique_fd blobs_fd(
+      open(blobs_file.path().c_str(), O_WRONLY | O_TRUNC | O_CLOEXEC));
+  TEST_AND_RETURN_FALSE_ERRNO(blobs_fd.ok());
+
+  // The blobs are written in the order of the operations, as PayloadFile
+  // does.
+  uint64_t blobs_size = 0;
+  android::base::unique_fd in_fd;
+  size_t in_fd_input = inputs_.size();
+  for (int i = 0; i < manifest.partitions_size(); i++) {
+    const Input& input = inputs_[partition_inputs_[i]];
+    if (in_fd_input != partition_inputs_[i]) {
+      in_fd.reset(open(input.path.c_str(), O_RDONLY | O_CLOEXEC));
+      TEST_AND_RETURN_FALSE_ERRNO(in_fd.ok());
+      in_fd_input = partition_inputs_[i];
+    }
+    for (InstallOperation& operation :
+         *manifest.mutable_partitions(i)->mutable_operations()) {
+      if (operation.data_length() == 0) {
+        operation.clear_data_offset();
+        continue;
+      }
+      TEST_AND_RETURN_FALSE(CopyBlob(
+          input, in_fd.get(), blobs_fd.get(), &operation, &blobs_size));
+    }
+  }
+  blobs_fd.reset();
+
+  manifest.clear_signatures_offset();
+  manifest.clear_signatures_size();
+  if (!private_key_path.empty()) {
+    uint64_t signature_blob_length = 0;
+    TEST_AND_RETURN_FALSE(PayloadSigner::SignatureBlobLength(
+        {private_key_path}, &signature_blob_length));
+    PayloadSigner::AddSignatureToManifest(
+        blobs_size, signature_blob_length, &manifest);
+  }
+  TEST_AND_RETURN_FALSE(PayloadFile::WritePayload(payload_file,
+                                                  blobs_file.path(),
+                                                  private_key_path,
+                                                  major_version_,
+                                                  manifest,
+                                                  metadata_size_out));
+  LOG(INFO) << "Wrote " << manifest.partitions_size() << " partitions of "
+            << inputs_.size() << " payloads to " << payload_file << ", with "
+            << blobs_size << " bytes of data.";
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,91 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_MERGER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_MERGER_H_
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include <base/macros.h>
+
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Builds a payload out of the partition updates of existing payloads, without
+// generating their operations again: it can extract some of the partitions of
+// a payload, or merge the partitions of several payloads into one. The data
+// blobs of the operations are copied as is, in chunks, so memory use doesn't
+// depend on the size of the payloads.
+class PayloadMerger {
+ public:
+  // Only the partitions in |partition_names| are kept, or all of them if it's
+  // empty.
+  explicit PayloadMerger(const std::vector<std::string>& partition_names);
+
+  // Adds the partitions of the payload in |payload_path|. A partition can't be
+  // added by more than one payload, and all the payloads must have the same
+  // major version and block size.
+  bool AddPayload(const std::string& payload_path);
+
+  // Writes the payload with the partitions added so far to |payload_file|,
+  // signed with |private_key_path| if not empty. The data hash of every
+  // operation is checked while its blob is copied. The size of the metadata
+  // is stored in |metadata_size_out|.
+  bool WritePayload(const std::string& payload_file,
+                    const std::string& private_key_path,
+                    uint64_t* metadata_size_out);
+
+ private:
+  // A payload added with AddPayload().
+  struct Input {
+    std::string path;
+    // Offset of the data section in the payload.
+    uint64_t data_offset;
+  };
+
+  // Appends the blob of |operation| in |input| to |out_fd| at |*out_offset|,
+  // and updates the operation to point to it.
+  bool CopyBlob(const Input& input,
+                int in_fd,
+                int out_fd,
+                InstallOperation* operation,
+                uint64_t* out_offset);
+
+  // Adds the groups of |metadata| to the output, with only the partitions in
+  // |added_partitions|.
+  void MergeDynamicPartitionMetadata(
+      const DynamicPartitionMetadata& metadata,
+      const std::set<std::string>& added_partitions);
+
+  const std::set<std::string> partition_names_;
+
+  uint64_t major_version_{0};
+  std::vector<Input> inputs_;
+  // The manifest of the output, without data offsets or signatures yet.
+  DeltaArchiveManifest manifest_;
+  // The index in |inputs_| of the payload each partition of |manifest_| comes
+  // from.
+  std::vector<size_t> partition_inputs_;
+
+  DISALLOW_COPY_AND_ASSIGN(PayloadMerger);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_PAYLOAD_MERGER_H_
@@ -0,0 +1,204 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/payload_merger.h"
+
+#include <string>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/hash_calculator.h"
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_consumer/payload_constants.h"
+#include "update_engine/payload_consumer/payload_metadata.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/payload_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint64_t kBlockSize = 4096;
+
+}  // namespace
+
+class PayloadMergerTest : public ::testing::Test {
+ protected:
+  // Writes a full payload with a "system" and a "vendor" partition and a delta
+  // payload with a "product" partition, each written by one REPLACE of its
+  // own data.
+  void SetUp() override {
+    DeltaArchiveManifest full;
+    full.set_block_size(kBlockSize);
+    full.set_minor_version(kFullPayloadMinorVersion);
+    full.set_max_timestamp(10);
+    brillo::Blob full_blobs;
+    AddPartition(&full, "system", brillo::Blob(kBlockSize, 's'), &full_blobs);
+    AddPartition(&full, "vendor", brillo::Blob(kBlockSize, 'v'), &full_blobs);
+    DynamicPartitionGroup* group =
+        full.mutable_dynamic_partition_metadata()->add_groups();
+    group->set_name("group");
+    group->add_partition_names("system");
+    group->add_partition_names("vendor");
+    WritePayload(full, full_blobs, full_payload_.path());
+
+    DeltaArchiveManifest delta;
+    delta.set_block_size(kBlockSize);
+    delta.set_minor_version(kMaxSupportedMinorPayloadVersion);
+    delta.set_max_timestamp(20);
+    brillo::Blob delta_blobs;
+    AddPartition(
+        &delta, "product", brillo::Blob(2 * kBlockSize, 'p'), &delta_blobs);
+    WritePayload(delta, delta_blobs, delta_payload_.path());
+  }
+
+  void AddPartition(DeltaArchiveManifest* manifest,
+                    const string& name,
+                    const brillo::Blob& data,
+                    brillo::Blob* blobs) {
+    PartitionUpdate* partition = manifest->add_partitions();
+    partition->set_partition_name(name);
+    partition->mutable_new_partition_info()->set_size(data.size());
+    InstallOperation* operation = partition->add_operations();
+    operation->set_type(InstallOperation::REPLACE);
+    *operation->add_dst_extents() = ExtentForRange(0, data.size() / kBlockSize);
+    brillo::Blob hash;
+    ASSERT_TRUE(HashCalculator::RawHashOfData(data, &hash));
+    operation->set_data_offset(blobs->size());
+    operation->set_data_length(data.size());
+    operation->set_data_sha256_hash(hash.data(), hash.size());
+    blobs->insert(blobs->end(), data.begin(), data.end());
+  }
+
+  void WritePayload(const DeltaArchiveManifest& manifest,
+                    const brillo::Blob& blobs,
+                    const string& path) {
+    ScopedTempFile blobs_file("PayloadMergerTest_blobs.XXXXXX");
+    ASSERT_TRUE(test_utils::WriteFileVector(blobs_file.path(), blobs));
+    uint64_t metadata_size;
+    ASSERT_TRUE(PayloadFile::WritePayload(path,
+                                          blobs_file.path(),
+                                          "",
+                                          kBrilloMajorPayloadVersion,
+                                          manifest,
+                                          &metadata_size));
+  }
+
+  // Parses the output payload into |manifest_| and |blobs_|.
+  void ReadOutput() {
+    PayloadMetadata metadata;
+    ASSERT_TRUE(
+        metadata.ParsePayloadFile(out_payload_.path(), &manifest_, nullptr));
+    brillo::Blob payload;
+    ASSERT_TRUE(utils::ReadFile(out_payload_.path(), &payload));
+    blobs_.assign(payload.begin() + metadata.GetMetadataSize() +
+                      metadata.GetMetadataSignatureSize(),
+                  payload.end());
+  }
+
+  // Returns the data of the first operation of the |index|th partition.
+  brillo::Blob OperationData(int index) {
+    const InstallOperation& operation =
+        manifest_.partitions(index).operations(0);
+    return brillo::Blob(
+        blobs_.begin() + operation.data_offset(),
+        blobs_.begin() + operation.data_offset() + operation.data_length());
+  }
+
+  ScopedTempFile full_payload_{"PayloadMergerTest_full.XXXXXX"};
+  ScopedTempFile delta_payload_{"PayloadMergerTest_delta.XXXXXX"};
+  ScopedTempFile out_payload_{"PayloadMergerTest_out.XXXXXX"};
+
+  DeltaArchiveManifest manifest_;
+  brillo::Blob blobs_;
+  uint64_t metadata_size_{0};
+};
+
+TEST_F(PayloadMergerTest, ExtractPartitionTest) {
+  PayloadMerger merger({"vendor"});
+  EXPECT_TRUE(merger.AddPayload(full_payload_.path()));
+  EXPECT_TRUE(merger.WritePayload(out_payload_.path(), "", &metadata_size_));
+  ReadOutput();
+
+  ASSERT_EQ(1, manifest_.partitions_size());
+  EXPECT_EQ("vendor", manifest_.partitions(0).partition_name());
+  EXPECT_TRUE(manifest_.partial_update());
+  EXPECT_EQ(0u, manifest_.partitions(0).operations(0).data_offset());
+  EXPECT_EQ(brillo::Blob(kBlockSize, 'v'), OperationData(0));
+  EXPECT_EQ(brillo::Blob(kBlockSize, 'v'), blobs_);
+  const auto& groups = manifest_.dynamic_partition_metadata().groups();
+  ASSERT_EQ(1, groups.size());
+  EXPECT_EQ(vector<string>{"vendor"},
+            vector<string>(groups[0].partition_names().begin(),
+                           groups[0].partition_names().end()));
+}
+
+TEST_F(PayloadMergerTest, MergePayloadsTest) {
+  PayloadMerger merger({});
+  EXPECT_TRUE(merger.AddPayload(delta_payload_.path()));
+  EXPECT_TRUE(merger.AddPayload(full_payload_.path()));
+  EXPECT_TRUE(merger.WritePayload(out_payload_.path(), "", &metadata_size_));
+  ReadOutput();
+
+  ASSERT_EQ(3, manifest_.partitions_size());
+  EXPECT_EQ("product", manifest_.partitions(0).partition_name());
+  EXPECT_EQ("system", manifest_.partitions(1).partition_name());
+  EXPECT_EQ("vendor", manifest_.partitions(2).partition_name());
+  EXPECT_FALSE(manifest_.partial_update());
+  EXPECT_EQ(kMaxSupportedMinorPayloadVersion, manifest_.minor_version());
+  EXPECT_EQ(20, manifest_.max_timestamp());
+  EXPECT_EQ(brillo::Blob(2 * kBlockSize, 'p'), OperationData(0));
+  EXPECT_EQ(brillo::Blob(kBlockSize, 's'), OperationData(1));
+  EXPECT_EQ(brillo::Blob(kBlockSize, 'v'), OperationData(2));
+  EXPECT_EQ(4 * kBlockSize, blobs_.size());
+}
+
+TEST_F(PayloadMergerTest, DuplicatePartitionTest) {
+  PayloadMerger merger({});
+  EXPECT_TRUE(merger.AddPayload(full_payload_.path()));
+  EXPECT_FALSE(merger.AddPayload(full_payload_.path()));
+}
+
+TEST_F(PayloadMergerTest, MissingPartitionTest) {
+  PayloadMerger merger({"vendor", "odm"});
+  EXPECT_TRUE(merger.AddPayload(full_payload_.path()));
+  EXPECT_FALSE(merger.WritePayload(out_payload_.path(), "", &metadata_size_));
+}
+
+TEST_F(PayloadMergerTest, DataHashMismatchTest) {
+  // Corrupt the last byte of the data of "vendor".
+  brillo::Blob payload;
+  ASSERT_TRUE(utils::ReadFile(full_payload_.path(), &payload));
+  payload.back() ^= 1;
+  ASSERT_TRUE(test_utils::WriteFileVector(full_payload_.path(), payload));
+
+  PayloadMerger merger({"system"});
+  EXPECT_TRUE(merger.AddPayload(full_payload_.path()));
+  EXPECT_TRUE(merger.WritePayload(out_payload_.path(), "", &metadata_size_));
+
+  PayloadMerger vendor_merger({"vendor"});
+  EXPECT_TRUE(vendor_merger.AddPayload(full_payload_.path()));
+  EXPECT_FALSE(
+      vendor_merger.WritePayload(out_payload_.path(), "", &metadata_size_));
+}
+
+}  // namespace chromeos_update_engine
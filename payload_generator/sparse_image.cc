@@ -0,0 +1,366 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_image.h"
+
+#include <endian.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <utility>
+
+#include <base/logging.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kSparseHeaderMagic = 0xed26ff3a;
+constexpr uint16_t kChunkTypeRaw = 0xCAC1;
+constexpr uint16_t kChunkTypeFill = 0xCAC2;
+constexpr uint16_t kChunkTypeDontCare = 0xCAC3;
+constexpr uint16_t kChunkTypeCrc32 = 0xCAC4;
+
+// On-disk structures, all fields are little endian.
+struct __attribute__((packed)) SparseHeader {
+  uint32_t magic;
+  uint16_t major_version;
+  uint16_t minor_version;
+  uint16_t file_hdr_sz;
+  uint16_t chunk_hdr_sz;
+  uint32_t blk_sz;
+  uint32_t total_blks;
+  uint32_t total_chunks;
+  uint32_t image_checksum;
+};
+
+struct __attribute__((packed)) ChunkHeader {
+  uint16_t chunk_type;
+  uint16_t reserved1;
+  // Size of the chunk in blocks of the expanded image.
+  uint32_t chunk_sz;
+  // Size of the chunk in bytes of the sparse file, including this header.
+  uint32_t total_sz;
+};
+
+bool PReadExactly(int fd, void* buf, size_t count, off_t offset) {
+  ssize_t bytes_read = 0;
+  TEST_AND_RETURN_FALSE(utils::PReadAll(fd, buf, count, offset, &bytes_read));
+  TEST_AND_RETURN_FALSE(bytes_read == static_cast<ssize_t>(count));
+  return true;
+}
+
+}  // namespace
+
+bool SparseImage::IsSparseImage(const std::string& path, uint64_t offset) {
+  android::base::unique_fd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (fd < 0) {
+    return false;
+  }
+  uint32_t magic = 0;
+  return PReadExactly(fd.get(), &magic, sizeof(magic), offset) &&
+         le32toh(magic) == kSparseHeaderMagic;
+}
+
+std::unique_ptr<SparseImage> SparseImage::Open(const std::string& path,
+                                               uint64_t offset) {
+  std::unique_ptr<SparseImage> image(new SparseImage());
+  image->fd_.reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (image->fd_ < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return nullptr;
+  }
+  const int fd = image->fd_.get();
+
+  SparseHeader header;
+  if (!PReadExactly(fd, &header, sizeof(header), offset) ||
+      le32toh(header.magic) != kSparseHeaderMagic) {
+    LOG(ERROR) << path << " is not an Android sparse image.";
+    return nullptr;
+  }
+  const uint16_t file_hdr_sz = le16toh(header.file_hdr_sz);
+  const uint16_t chunk_hdr_sz = le16toh(header.chunk_hdr_sz);
+  image->block_size_ = le32toh(header.blk_sz);
+  if (le16toh(header.major_version) != 1 ||
+      file_hdr_sz < sizeof(SparseHeader) ||
+      chunk_hdr_sz < sizeof(ChunkHeader) || image->block_size_ == 0 ||
+      image->block_size_ % 4 != 0) {
+    LOG(ERROR) << "Unsupported sparse image header in " << path;
+    return nullptr;
+  }
+
+  const uint32_t total_chunks = le32toh(header.total_chunks);
+  image->chunks_.reserve(total_chunks);
+  offset += file_hdr_sz;
+  uint64_t block = 0;
+  for (uint32_t i = 0; i < total_chunks; i++) {
+    ChunkHeader chunk_header;
+    if (!PReadExactly(fd, &chunk_header, sizeof(chunk_header), offset)) {
+      LOG(ERROR) << "Failed to read chunk " << i << " of " << path;
+      return nullptr;
+    }
+    const uint16_t type = le16toh(chunk_header.chunk_type);
+    const uint64_t num_blocks = le32toh(chunk_header.chunk_sz);
+    const uint64_t total_sz = le32toh(chunk_header.total_sz);
+    if (total_sz < chunk_hdr_sz) {
+      LOG(ERROR) << "Invalid size of chunk " << i << " in " << path;
+      return nullptr;
+    }
+    const uint64_t data_offset = offset + chunk_hdr_sz;
+    const uint64_t data_size = total_sz - chunk_hdr_sz;
+
+    Chunk chunk{.start_block = block, .num_blocks = num_blocks};
+    switch (type) {
+      case kChunkTypeRaw:
+        if (data_size != num_blocks * image->block_size_) {
+          LOG(ERROR) << "Invalid size of raw chunk " << i << " in " << path;
+          return nullptr;
+        }
+        chunk.type = ChunkType::kRaw;
+        chunk.data_offset = data_offset;
+        break;
+      case kChunkTypeFill:
+        if (data_size != sizeof(chunk.fill_value) ||
+            !PReadExactly(fd, &chunk.fill_value, data_size, data_offset)) {
+          LOG(ERROR) << "Invalid fill chunk " << i << " in " << path;
+          return nullptr;
+        }
+        // The fill value is repeated as is, so keep it in file byte order.
+        chunk.type = ChunkType::kFill;
+        break;
+      case kChunkTypeDontCare:
+        chunk.type = ChunkType::kDontCare;
+        break;
+      case kChunkTypeCrc32:
+        // Checksums of the preceding data, they don't add any blocks.
+        offset += total_sz;
+        continue;
+      default:
+        LOG(ERROR) << "Unknown chunk type 0x" << std::hex << type << std::dec
+                   << " of chunk " << i << " in " << path;
+        return nullptr;
+    }
+    if (num_blocks > 0) {
+      image->chunks_.push_back(chunk);
+    }
+    block += num_blocks;
+    offset += total_sz;
+  }
+  image->num_blocks_ = block;
+  if (image->num_blocks_ != le32toh(header.total_blks)) {
+    LOG(ERROR) << "Sparse image " << path << " has " << image->num_blocks_
+               << " blocks in its chunks but " << le32toh(header.total_blks)
+               << " in its header.";
+    return nullptr;
+  }
+  return image;
+}
+
+std::unique_ptr<SparseImage> SparseImage::OpenRaw(const std::string& path,
+                                                  uint64_t offset,
+                                                  uint64_t size) {
+  std::unique_ptr<SparseImage> image(new SparseImage());
+  image->fd_.reset(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+  if (image->fd_ < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return nullptr;
+  }
+  image->block_size_ = 1;
+  image->num_blocks_ = size;
+  if (size > 0) {
+    image->chunks_.push_back(Chunk{.type = ChunkType::kRaw,
+                                   .start_block = 0,
+                                   .num_blocks = size,
+                                   .data_offset = offset});
+  }
+  return image;
+}
+
+std::unique_ptr<SparseImage> SparseImage::Resized(uint64_t size) const {
+  if (size % block_size_ != 0) {
+    LOG(ERROR) << "Can't resize an image of " << block_size_
+               << " byte blocks to " << size << " bytes.";
+    return nullptr;
+  }
+  std::unique_ptr<SparseImage> image(new SparseImage());
+  image->fd_.reset(fcntl(fd_.get(), F_DUPFD_CLOEXEC, 0));
+  if (image->fd_ < 0) {
+    PLOG(ERROR) << "Failed to duplicate the sparse image descriptor";
+    return nullptr;
+  }
+  image->block_size_ = block_size_;
+  image->num_blocks_ = size / block_size_;
+  for (Chunk chunk : chunks_) {
+    if (chunk.start_block >= image->num_blocks_) {
+      break;
+    }
+    chunk.num_blocks =
+        std::min(chunk.num_blocks, image->num_blocks_ - chunk.start_block);
+    image->chunks_.push_back(chunk);
+  }
+  if (image->num_blocks_ > num_blocks_) {
+    image->chunks_.push_back(
+        Chunk{.type = ChunkType::kDontCare,
+              .start_block = num_blocks_,
+              .num_blocks = image->num_blocks_ - num_blocks_});
+  }
+  return image;
+}
+
+std::unique_ptr<SparseImage> SparseImage::Slice(
+    const std::vector<Range>& ranges) const {
+  std::unique_ptr<SparseImage> image(new SparseImage());
+  image->fd_.reset(fcntl(fd_.get(), F_DUPFD_CLOEXEC, 0));
+  if (image->fd_ < 0) {
+    PLOG(ERROR) << "Failed to duplicate the sparse image descriptor";
+    return nullptr;
+  }
+  image->block_size_ = block_size_;
+  for (const Range& range : ranges) {
+    if (range.offset % block_size_ != 0 || range.size % block_size_ != 0 ||
+        range.offset > size() || range.size > size() - range.offset) {
+      LOG(ERROR) << "Can't slice " << range.size << " bytes at "
+                 << range.offset << " of an image of " << size()
+                 << " bytes in " << block_size_ << " byte blocks.";
+      return nullptr;
+    }
+    uint64_t block = range.offset / block_size_;
+    const uint64_t end_block = block + range.size / block_size_;
+    while (block < end_block) {
+      Chunk chunk = chunks_[FindChunk(block)];
+      const uint64_t skipped_blocks = block - chunk.start_block;
+      chunk.num_blocks =
+          std::min(chunk.num_blocks - skipped_blocks, end_block - block);
+      if (chunk.type == ChunkType::kRaw) {
+        chunk.data_offset += skipped_blocks * block_size_;
+      }
+      chunk.start_block = image->num_blocks_;
+      image->chunks_.push_back(chunk);
+      image->num_blocks_ += chunk.num_blocks;
+      block += chunk.num_blocks;
+    }
+  }
+  return image;
+}
+
+size_t SparseImage::FindChunk(uint64_t block) const {
+  auto it = std::upper_bound(
+      chunks_.begin(), chunks_.end(), block, [](uint64_t b, const Chunk& c) {
+        return b < c.start_block;
+      });
+  return std::distance(chunks_.begin(), it) - 1;
+}
+
+bool SparseImage::Read(uint64_t offset, void* buf, size_t count) const {
+  TEST_AND_RETURN_FALSE(offset + count <= size());
+  uint8_t* out = static_cast<uint8_t*>(buf);
+  while (count > 0) {
+    const Chunk& chunk = chunks_[FindChunk(offset / block_size_)];
+    const uint64_t chunk_offset = offset - chunk.start_block * block_size_;
+    const size_t bytes = std::min<uint64_t>(
+        count, chunk.num_blocks * block_size_ - chunk_offset);
+    switch (chunk.type) {
+      case ChunkType::kRaw:
+        TEST_AND_RETURN_FALSE(PReadExactly(
+            fd_.get(), out, bytes, chunk.data_offset + chunk_offset));
+        break;
+      case ChunkType::kFill: {
+        const uint8_t* fill =
+            reinterpret_cast<const uint8_t*>(&chunk.fill_value);
+        for (size_t i = 0; i < bytes; i++) {
+          out[i] = fill[(chunk_offset + i) % sizeof(chunk.fill_value)];
+        }
+        break;
+      }
+      case ChunkType::kDontCare:
+        std::fill(out, out + bytes, 0);
+        break;
+    }
+    out += bytes;
+    offset += bytes;
+    count -= bytes;
+  }
+  return true;
+}
+
+uint64_t SparseImage::FindRegion(uint64_t offset, bool hole) const {
+  if (offset >= size()) {
+    return size();
+  }
+  for (size_t i = FindChunk(offset / block_size_); i < chunks_.size(); i++) {
+    const Chunk& chunk = chunks_[i];
+    const bool is_hole =
+        chunk.type == ChunkType::kDontCare ||
+        (chunk.type == ChunkType::kFill && chunk.fill_value == 0);
+    if (is_hole == hole) {
+      return std::max(offset, chunk.start_block * block_size_);
+    }
+  }
+  return size();
+}
+
+bool SparseImage::Expand(const std::string& path,
+                         uint64_t* bytes_written) const {
+  android::base::unique_fd out_fd(
+      open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (out_fd < 0) {
+    PLOG(ERROR) << "Failed to open " << path;
+    return false;
+  }
+  // Everything not written below stays a hole and reads back as zeros.
+  TEST_AND_RETURN_FALSE_ERRNO(ftruncate(out_fd.get(), size()) == 0);
+
+  *bytes_written = 0;
+  brillo::Blob fill_buffer;
+  for (const Chunk& chunk : chunks_) {
+    const uint64_t out_offset = chunk.start_block * block_size_;
+    const uint64_t chunk_size = chunk.num_blocks * block_size_;
+    switch (chunk.type) {
+      case ChunkType::kRaw:
+        TEST_AND_RETURN_FALSE(utils::SendFileRange(out_fd.get(),
+                                                   out_offset,
+                                                   fd_.get(),
+                                                   chunk.data_offset,
+                                                   chunk_size));
+        *bytes_written += chunk_size;
+        break;
+      case ChunkType::kFill:
+        if (chunk.fill_value == 0) {
+          break;
+        }
+        fill_buffer.resize(block_size_);
+        TEST_AND_RETURN_FALSE(
+            Read(out_offset, fill_buffer.data(), block_size_));
+        for (uint64_t i = 0; i < chunk.num_blocks; i++) {
+          TEST_AND_RETURN_FALSE(utils::PWriteAll(out_fd.get(),
+                                                 fill_buffer.data(),
+                                                 fill_buffer.size(),
+                                                 out_offset + i * block_size_));
+        }
+        *bytes_written += chunk_size;
+        break;
+      case ChunkType::kDontCare:
+        break;
+    }
+  }
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
+
+// A reader for the Android sparse image format produced by img2simg and the
+// build system. See system/core/libsparse/sparse_format.h for the format.
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <android-base/unique_fd.h>
+#include <base/macros.h>
+
+namespace chromeos_update_engine {
+
+class SparseImage {
+ public:
+  enum class ChunkType {
+    kRaw,
+    kFill,
+    kDontCare,
+  };
+
+  // A run of blocks of the expanded image.
+  struct Chunk {
+    ChunkType type;
+    // Location of the chunk in the expanded image, in blocks.
+    uint64_t start_block;
+    uint64_t num_blocks;
+    // For kRaw chunks, the offset in bytes of the chunk data in the file
+    // containing the sparse image.
+    uint64_t data_offset;
+    // For kFill chunks, the 32-bit value repeated over the whole chunk.
+    uint32_t fill_value;
+  };
+
+  // A run of bytes of the expanded image.
+  struct Range {
+    uint64_t offset;
+    uint64_t size;
+  };
+
+  // Returns whether the file at |path| has the sparse image magic at |offset|.
+  static bool IsSparseImage(const std::string& path, uint64_t offset = 0);
+
+  // Parses the sparse image header and chunk table of the sparse image stored
+  // at |offset| of |path|, for example in a stored zip entry. Returns nullptr
+  // if there's no valid sparse image there.
+  static std::unique_ptr<SparseImage> Open(const std::string& path,
+                                           uint64_t offset = 0);
+
+  // Returns an image of the |size| bytes stored as is at |offset| of |path|,
+  // for example a raw image in a stored zip entry, so they're read in place
+  // like the raw chunks of a sparse image. Its blocks are one byte long so it
+  // can have any size.
+  static std::unique_ptr<SparseImage> OpenRaw(const std::string& path,
+                                              uint64_t offset,
+                                              uint64_t size);
+
+  // Returns a copy of the image truncated to |size| bytes or extended with
+  // don't care blocks, or nullptr if |size| isn't a whole number of blocks.
+  std::unique_ptr<SparseImage> Resized(uint64_t size) const;
+
+  // Returns an image of the |ranges| of this image put one after the other,
+  // for example the blocks of a file in a filesystem image, which are still
+  // read in place. Returns nullptr if a range isn't a whole number of blocks
+  // of this image or goes past its end.
+  std::unique_ptr<SparseImage> Slice(const std::vector<Range>& ranges) const;
+
+  uint32_t block_size() const { return block_size_; }
+  uint64_t num_blocks() const { return num_blocks_; }
+  // Size in bytes of the expanded image.
+  uint64_t size() const { return num_blocks_ * block_size_; }
+  const std::vector<Chunk>& chunks() const { return chunks_; }
+
+  // Reads |count| bytes at |offset| of the expanded image into |buf|. Fill and
+  // don't care chunks are generated in memory without touching the file.
+  bool Read(uint64_t offset, void* buf, size_t count) const;
+
+  // Returns the offset of the first byte at or after |offset| which is in a
+  // hole if |hole|, or data otherwise, like lseek() with SEEK_HOLE and
+  // SEEK_DATA. Don't care chunks and fill chunks of zeros are holes, and so is
+  // the end of the image, so size() is returned if there's no such byte.
+  uint64_t FindRegion(uint64_t offset, bool hole) const;
+
+  // Writes the expanded image to |path|. Blocks which read as zeros, don't
+  // care chunks and fill chunks of zeros, are left as holes in |path| so they
+  // take neither I/O nor disk space, and raw chunks are copied in the kernel
+  // when possible. Stores the number of bytes actually written in
+  // |bytes_written|.
+  bool Expand(const std::string& path, uint64_t* bytes_written) const;
+
+ private:
+  SparseImage() = default;
+
+  // Returns the index in |chunks_| of the chunk containing |block|.
+  size_t FindChunk(uint64_t block) const;
+
+  android::base::unique_fd fd_;
+  uint32_t block_size_{0};
+  uint64_t num_blocks_{0};
+  std::vector<Chunk> chunks_;
+
+  DISALLOW_COPY_AND_ASSIGN(SparseImage);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_SPARSE_IMAGE_H_
@@ -0,0 +1,279 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/sparse_image.h"
+
+#include <endian.h>
+
+#include <algorithm>
+#include <cstring>
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kBlockSize = 4096;
+
+void AppendLE16(brillo::Blob* blob, uint16_t value) {
+  for (size_t i = 0; i < sizeof(value); i++) {
+    blob->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+void AppendLE32(brillo::Blob* blob, uint32_t value) {
+  for (size_t i = 0; i < sizeof(value); i++) {
+    blob->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+void AppendChunkHeader(brillo::Blob* blob,
+                       uint16_t type,
+                       uint32_t num_blocks,
+                       uint32_t data_size) {
+  AppendLE16(blob, type);
+  AppendLE16(blob, 0);
+  AppendLE32(blob, num_blocks);
+  AppendLE32(blob, 12 + data_size);
+}
+
+}  // namespace
+
+class SparseImageTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Header: 10 blocks in 5 chunks.
+    AppendLE32(&sparse_, 0xed26ff3a);
+    AppendLE16(&sparse_, 1);
+    AppendLE16(&sparse_, 0);
+    AppendLE16(&sparse_, 28);
+    AppendLE16(&sparse_, 12);
+    AppendLE32(&sparse_, kBlockSize);
+    AppendLE32(&sparse_, 10);
+    AppendLE32(&sparse_, 5);
+    AppendLE32(&sparse_, 0);
+
+    // Two raw blocks.
+    AppendChunkHeader(&sparse_, 0xCAC1, 2, 2 * kBlockSize);
+    for (size_t i = 0; i < 2 * kBlockSize; i++) {
+      sparse_.push_back(i % 251);
+    }
+    // Three don't care blocks.
+    AppendChunkHeader(&sparse_, 0xCAC3, 3, 0);
+    // A checksum, which doesn't add any block.
+    AppendChunkHeader(&sparse_, 0xCAC4, 0, 4);
+    AppendLE32(&sparse_, 0x12345678);
+    // Four blocks filled with a pattern.
+    AppendChunkHeader(&sparse_, 0xCAC2, 4, 4);
+    AppendLE32(&sparse_, 0xdeadbeef);
+    // One block filled with zeros.
+    AppendChunkHeader(&sparse_, 0xCAC2, 1, 4);
+    AppendLE32(&sparse_, 0);
+
+    expected_.resize(10 * kBlockSize);
+    std::copy(sparse_.begin() + 28 + 12,
+              sparse_.begin() + 28 + 12 + 2 * kBlockSize,
+              expected_.begin());
+    for (size_t i = 5 * kBlockSize; i < 9 * kBlockSize; i += 4) {
+      uint32_t value = htole32(0xdeadbeef);
+      memcpy(expected_.data() + i, &value, sizeof(value));
+    }
+
+    ASSERT_TRUE(test_utils::WriteFileVector(sparse_file_.path(), sparse_));
+  }
+
+  brillo::Blob sparse_;
+  brillo::Blob expected_;
+  ScopedTempFile sparse_file_{"SparseImageTest_sparse.XXXXXX"};
+};
+
+TEST_F(SparseImageTest, IsSparseImageTest) {
+  EXPECT_TRUE(SparseImage::IsSparseImage(sparse_file_.path()));
+
+  ScopedTempFile raw_file("SparseImageTest_raw.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(raw_file.path(), expected_));
+  EXPECT_FALSE(SparseImage::IsSparseImage(raw_file.path()));
+  EXPECT_EQ(nullptr, SparseImage::Open(raw_file.path()));
+}
+
+TEST_F(SparseImageTest, OpenTest) {
+  auto image = SparseImage::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(kBlockSize, image->block_size());
+  EXPECT_EQ(10u, image->num_blocks());
+  EXPECT_EQ(expected_.size(), image->size());
+
+  const auto& chunks = image->chunks();
+  ASSERT_EQ(4u, chunks.size());
+  EXPECT_EQ(SparseImage::ChunkType::kRaw, chunks[0].type);
+  EXPECT_EQ(0u, chunks[0].start_block);
+  EXPECT_EQ(2u, chunks[0].num_blocks);
+  EXPECT_EQ(28u + 12, chunks[0].data_offset);
+  EXPECT_EQ(SparseImage::ChunkType::kDontCare, chunks[1].type);
+  EXPECT_EQ(2u, chunks[1].start_block);
+  EXPECT_EQ(3u, chunks[1].num_blocks);
+  EXPECT_EQ(SparseImage::ChunkType::kFill, chunks[2].type);
+  EXPECT_EQ(5u, chunks[2].start_block);
+  EXPECT_EQ(4u, chunks[2].num_blocks);
+  EXPECT_EQ(SparseImage::ChunkType::kFill, chunks[3].type);
+  EXPECT_EQ(9u, chunks[3].start_block);
+  EXPECT_EQ(0u, chunks[3].fill_value);
+}
+
+TEST_F(SparseImageTest, OpenAtOffsetTest) {
+  brillo::Blob data(100, 'x');
+  data.insert(data.end(), sparse_.begin(), sparse_.end());
+  ASSERT_TRUE(test_utils::WriteFileVector(sparse_file_.path(), data));
+  EXPECT_FALSE(SparseImage::IsSparseImage(sparse_file_.path()));
+  EXPECT_TRUE(SparseImage::IsSparseImage(sparse_file_.path(), 100));
+
+  auto image = SparseImage::Open(sparse_file_.path(), 100);
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(100u + 28 + 12, image->chunks()[0].data_offset);
+  brillo::Blob expanded(expected_.size());
+  EXPECT_TRUE(image->Read(0, expanded.data(), expanded.size()));
+  EXPECT_EQ(expected_, expanded);
+}
+
+TEST_F(SparseImageTest, OpenRejectsWrongBlockCountTest) {
+  // Claim 11 blocks in the header.
+  sparse_[16] = 11;
+  ASSERT_TRUE(test_utils::WriteFileVector(sparse_file_.path(), sparse_));
+  EXPECT_EQ(nullptr, SparseImage::Open(sparse_file_.path()));
+}
+
+TEST_F(SparseImageTest, ReadTest) {
+  auto image = SparseImage::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, image);
+
+  brillo::Blob data(expected_.size());
+  EXPECT_TRUE(image->Read(0, data.data(), data.size()));
+  EXPECT_EQ(expected_, data);
+
+  // A read crossing chunk boundaries at an unaligned offset.
+  const uint64_t offset = kBlockSize + 17;
+  data.resize(5 * kBlockSize);
+  EXPECT_TRUE(image->Read(offset, data.data(), data.size()));
+  EXPECT_EQ(brillo::Blob(expected_.begin() + offset,
+                         expected_.begin() + offset + data.size()),
+            data);
+
+  // Reads past the end of the image fail.
+  EXPECT_FALSE(image->Read(expected_.size() - 1, data.data(), 2));
+}
+
+TEST_F(SparseImageTest, FindRegionTest) {
+  auto image = SparseImage::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, image);
+
+  EXPECT_EQ(0u, image->FindRegion(0, false));
+  EXPECT_EQ(2u * kBlockSize, image->FindRegion(0, true));
+  EXPECT_EQ(2u * kBlockSize + 1, image->FindRegion(2 * kBlockSize + 1, true));
+  EXPECT_EQ(5u * kBlockSize, image->FindRegion(3 * kBlockSize + 5, false));
+  // The zero fill block and the end of the image are holes.
+  EXPECT_EQ(9u * kBlockSize, image->FindRegion(5 * kBlockSize, true));
+  EXPECT_EQ(image->size(), image->FindRegion(9 * kBlockSize, false));
+  EXPECT_EQ(image->size(), image->FindRegion(image->size(), true));
+}
+
+TEST_F(SparseImageTest, OpenRawTest) {
+  ASSERT_TRUE(test_utils::WriteFileVector(sparse_file_.path(), expected_));
+  auto image = SparseImage::OpenRaw(sparse_file_.path(), 10, 100);
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(100u, image->size());
+  brillo::Blob data(image->size());
+  EXPECT_TRUE(image->Read(0, data.data(), data.size()));
+  EXPECT_EQ(brillo::Blob(expected_.begin() + 10, expected_.begin() + 110),
+            data);
+  EXPECT_EQ(image->size(), image->FindRegion(0, true));
+}
+
+TEST_F(SparseImageTest, ResizedTest) {
+  auto image = SparseImage::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(nullptr, image->Resized(kBlockSize + 1));
+
+  // Truncated in the middle of the fill chunk.
+  auto truncated = image->Resized(6 * kBlockSize);
+  ASSERT_NE(nullptr, truncated);
+  EXPECT_EQ(6u, truncated->num_blocks());
+  ASSERT_EQ(3u, truncated->chunks().size());
+  EXPECT_EQ(1u, truncated->chunks()[2].num_blocks);
+  brillo::Blob data(truncated->size());
+  EXPECT_TRUE(truncated->Read(0, data.data(), data.size()));
+  EXPECT_EQ(brillo::Blob(expected_.begin(), expected_.begin() + data.size()),
+            data);
+
+  // Extended with zeros.
+  auto extended = image->Resized(12 * kBlockSize);
+  ASSERT_NE(nullptr, extended);
+  data.resize(extended->size());
+  EXPECT_TRUE(extended->Read(0, data.data(), data.size()));
+  brillo::Blob expected = expected_;
+  expected.resize(data.size());
+  EXPECT_EQ(expected, data);
+  EXPECT_EQ(9u * kBlockSize, extended->FindRegion(5 * kBlockSize, true));
+}
+
+TEST_F(SparseImageTest, SliceTest) {
+  auto image = SparseImage::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, image);
+  EXPECT_EQ(nullptr, image->Slice({{kBlockSize + 1, kBlockSize}}));
+  EXPECT_EQ(nullptr, image->Slice({{9 * kBlockSize, 2 * kBlockSize}}));
+
+  // The second raw block and a don't care block, then two fill blocks from the
+  // middle of their chunk and the first raw block again.
+  auto slice = image->Slice({{kBlockSize, 2 * kBlockSize},
+                             {6 * kBlockSize, 2 * kBlockSize},
+                             {0, kBlockSize}});
+  ASSERT_NE(nullptr, slice);
+  EXPECT_EQ(5u, slice->num_blocks());
+  EXPECT_EQ(28u + 12 + kBlockSize, slice->chunks()[0].data_offset);
+  brillo::Blob expected(expected_.begin() + kBlockSize,
+                        expected_.begin() + 3 * kBlockSize);
+  expected.insert(expected.end(),
+                  expected_.begin() + 6 * kBlockSize,
+                  expected_.begin() + 8 * kBlockSize);
+  expected.insert(
+      expected.end(), expected_.begin(), expected_.begin() + kBlockSize);
+  brillo::Blob data(slice->size());
+  EXPECT_TRUE(slice->Read(0, data.data(), data.size()));
+  EXPECT_EQ(expected, data);
+  EXPECT_EQ(kBlockSize, slice->FindRegion(0, true));
+}
+
+TEST_F(SparseImageTest, ExpandTest) {
+  auto image = SparseImage::Open(sparse_file_.path());
+  ASSERT_NE(nullptr, image);
+
+  ScopedTempFile expanded_file("SparseImageTest_expanded.XXXXXX");
+  uint64_t bytes_written = 0;
+  EXPECT_TRUE(image->Expand(expanded_file.path(), &bytes_written));
+  // Only the raw and the non-zero fill blocks are written.
+  EXPECT_EQ(6u * kBlockSize, bytes_written);
+
+  brillo::Blob expanded;
+  EXPECT_TRUE(utils::ReadFile(expanded_file.path(), &expanded));
+  EXPECT_EQ(expected_, expanded);
+}
+
+}  // namespace chromeos_update_engine
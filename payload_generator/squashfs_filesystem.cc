@@ -27,16 +27,15 @@
 #include <base/logging.h>
 #include <base/strings/string_number_conversions.h>
 #include <base/strings/string_split.h>
-#include <brillo/streams/file_stream.h>
 
 #include "update_engine/common/subprocess.h"
 #include "update_engine/common/utils.h"
 #include "update_engine/payload_generator/deflate_utils.h"
 #include "update_engine/payload_generator/delta_diff_generator.h"
 #include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/image_file.h"
 #include "update_engine/update_metadata.pb.h"
 
-using base::FilePath;
 using base::ScopedTempDir;
 using std::string;
 using std::unique_ptr;
@@ -256,19 +255,10 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
   if (sqfs_path.empty())
     return nullptr;
 
-  brillo::StreamPtr sqfs_file =
-      brillo::FileStream::Open(FilePath(sqfs_path),
-                               brillo::Stream::AccessMode::READ,
-                               brillo::FileStream::Disposition::OPEN_EXISTING,
-                               nullptr);
-  if (!sqfs_file) {
-    LOG(ERROR) << "Unable to open " << sqfs_path << " for reading.";
-    return nullptr;
-  }
-
   SquashfsHeader header;
-  brillo::Blob blob(kSquashfsSuperBlockSize);
-  if (!sqfs_file->ReadAllBlocking(blob.data(), blob.size(), nullptr)) {
+  brillo::Blob blob;
+  if (!image_file::ReadChunk(sqfs_path, 0, kSquashfsSuperBlockSize, &blob) ||
+      blob.size() != kSquashfsSuperBlockSize) {
     LOG(ERROR) << "Unable to read from file: " << sqfs_path;
     return nullptr;
   }
@@ -277,16 +267,25 @@ unique_ptr<SquashfsFilesystem> SquashfsFilesystem::CreateFromFile(
     return nullptr;
   }
 
+  // unsquashfs and puffin only read raw files.
+  const string raw_path = image_file::GetRawPath(sqfs_path);
+  if (raw_path.empty()) {
+    return nullptr;
+  }
+
   // Read the map file.
   string filemap;
-  if (!GetFileMapContent(sqfs_path, &filemap)) {
+  if (!GetFileMapContent(raw_path, &filemap)) {
     LOG(ERROR) << "Failed to produce squashfs map file: " << sqfs_path;
     return nullptr;
   }
 
   unique_ptr<SquashfsFilesystem> sqfs(new SquashfsFilesystem());
-  if (!sqfs->Init(
-          filemap, sqfs_path, sqfs_file->GetSize(), header, extract_deflates)) {
+  if (!sqfs->Init(filemap,
+                  raw_path,
+                  image_file::Size(sqfs_path),
+                  header,
+                  extract_deflates)) {
     LOG(ERROR) << "Failed to initialized the Squashfs file system";
     return nullptr;
   }
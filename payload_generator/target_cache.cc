@@ -0,0 +1,152 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/target_cache.h"
+
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/deflate_utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/image_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+bool TargetCache::InitializePartitionInfo(const PartitionConfig& part,
+                                          PartitionInfo* info) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = partition_infos_.find(part.path);
+    if (it != partition_infos_.end()) {
+      *info = it->second;
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(diff_utils::InitializePartitionInfo(part, info));
+  std::lock_guard<std::mutex> lock(mutex_);
+  partition_infos_[part.path] = *info;
+  return true;
+}
+
+bool TargetCache::PreprocessPartitionFiles(
+    const PartitionConfig& part,
+    vector<FilesystemInterface::File>* result,
+    bool extract_deflates) {
+  const auto key = std::make_pair(part.path, extract_deflates);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = partition_files_.find(key);
+    if (it != partition_files_.end()) {
+      *result = it->second;
+      return true;
+    }
+  }
+  TEST_AND_RETURN_FALSE(deflate_utils::PreprocessPartitionFiles(
+      part, result, extract_deflates));
+  std::lock_guard<std::mutex> lock(mutex_);
+  partition_files_[key] = *result;
+  return true;
+}
+
+bool TargetCache::MapPartitionBlocks(const string& old_part,
+                                     const string& new_part,
+                                     size_t old_size,
+                                     size_t new_size,
+                                     size_t block_size,
+                                     vector<BlockMapping::BlockId>* old_ids,
+                                     vector<BlockMapping::BlockId>* new_ids) {
+  PartitionBlocks* blocks;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& entry = partition_blocks_[new_part];
+    if (!entry) {
+      entry = std::make_unique<PartitionBlocks>();
+    }
+    blocks = entry.get();
+  }
+
+  // BlockMapping isn't thread-safe, so lookups in the same target partition
+  // are serialized.
+  std::lock_guard<std::mutex> lock(blocks->mutex);
+  if (!blocks->mapping) {
+    blocks->fd = image_file::Open(new_part);
+    TEST_AND_RETURN_FALSE(blocks->fd);
+    auto mapping = std::make_unique<BlockMapping>(block_size);
+    TEST_AND_RETURN_FALSE(mapping->AddBlock(brillo::Blob(block_size, 0)) == 0);
+    TEST_AND_RETURN_FALSE(mapping->AddManyDiskBlocks(
+        blocks->fd.get(), 0, new_size / block_size, &blocks->block_ids));
+    blocks->mapping = std::move(mapping);
+    blocks->size = new_size;
+  }
+  TEST_AND_RETURN_FALSE(blocks->size == new_size);
+  *new_ids = blocks->block_ids;
+
+  FileDescriptorPtr old_fd = image_file::Open(old_part);
+  TEST_AND_RETURN_FALSE(old_fd);
+  return blocks->mapping->FindManyDiskBlocks(
+      old_fd.get(), 0, old_size / block_size, old_ids);
+}
+
+string TargetCache::FullOperationKey(const string& part,
+                                     const vector<Extent>& extents) {
+  string key = part;
+  for (const Extent& extent : extents) {
+    key += ":" + std::to_string(extent.start_block()) + "+" +
+           std::to_string(extent.num_blocks());
+  }
+  return key;
+}
+
+bool TargetCache::GetFullOperation(const string& part,
+                                   const vector<Extent>& extents,
+                                   InstallOperation::Type* type,
+                                   brillo::Blob* blob) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = full_operations_.find(FullOperationKey(part, extents));
+  if (it == full_operations_.end()) {
+    stats_.full_operation_misses++;
+    return false;
+  }
+  stats_.full_operation_hits++;
+  *type = it->second.first;
+  *blob = it->second.second;
+  return true;
+}
+
+void TargetCache::AddFullOperation(const string& part,
+                                   const vector<Extent>& extents,
+                                   InstallOperation::Type type,
+                                   const brillo::Blob& blob) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (stats_.full_operation_bytes + blob.size() > max_full_operation_bytes_) {
+    return;
+  }
+  if (full_operations_
+          .emplace(FullOperationKey(part, extents), std::make_pair(type, blob))
+          .second) {
+    stats_.full_operation_bytes += blob.size();
+  }
+}
+
+TargetCache::Stats TargetCache::stats() const {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return stats_;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,125 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_TARGET_CACHE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_TARGET_CACHE_H_
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <base/macros.h>
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/block_mapping.h"
+#include "update_engine/payload_generator/filesystem_interface.h"
+#include "update_engine/payload_generator/payload_generation_config.h"
+#include "update_engine/update_metadata.pb.h"
+
+namespace chromeos_update_engine {
+
+// Keeps the results of payload generation that only depend on the target
+// partitions, so that the payloads generated from several source builds to the
+// same target in one process compute them only once. Target partitions are
+// identified by their path. All the methods are thread-safe.
+class TargetCache {
+ public:
+  struct Stats {
+    size_t full_operation_hits{0};
+    size_t full_operation_misses{0};
+    // Size of the full operation blobs kept in memory.
+    uint64_t full_operation_bytes{0};
+  };
+
+  // Keeps up to |max_full_operation_bytes| of full operation blobs.
+  explicit TargetCache(uint64_t max_full_operation_bytes)
+      : max_full_operation_bytes_(max_full_operation_bytes) {}
+
+  // Like diff_utils::InitializePartitionInfo() for the target partition
+  // |part|.
+  bool InitializePartitionInfo(const PartitionConfig& part,
+                               PartitionInfo* info);
+
+  // Like deflate_utils::PreprocessPartitionFiles() for the target partition
+  // |part|.
+  bool PreprocessPartitionFiles(const PartitionConfig& part,
+                                std::vector<FilesystemInterface::File>* result,
+                                bool extract_deflates);
+
+  // Like MapPartitionBlocks(), but the target partition |new_part| is only
+  // read and hashed the first time. The blocks of |old_part| that aren't in
+  // |new_part| get the id BlockMapping::kNotFound.
+  bool MapPartitionBlocks(const std::string& old_part,
+                          const std::string& new_part,
+                          size_t old_size,
+                          size_t new_size,
+                          size_t block_size,
+                          std::vector<BlockMapping::BlockId>* old_block_ids,
+                          std::vector<BlockMapping::BlockId>* new_block_ids);
+
+  // Returns the operation diff_utils::GenerateBestFullOperation() found for
+  // the data at |extents| of the target partition |part| in a previous
+  // payload, if any.
+  bool GetFullOperation(const std::string& part,
+                        const std::vector<Extent>& extents,
+                        InstallOperation::Type* type,
+                        brillo::Blob* blob);
+
+  // Stores the result of diff_utils::GenerateBestFullOperation() for the data
+  // at |extents| of |part|, unless the cache is full.
+  void AddFullOperation(const std::string& part,
+                        const std::vector<Extent>& extents,
+                        InstallOperation::Type type,
+                        const brillo::Blob& blob);
+
+  Stats stats() const;
+
+ private:
+  // The block mapping of a target partition, which source partitions are
+  // looked up in.
+  struct PartitionBlocks {
+    std::mutex mutex;
+    std::unique_ptr<BlockMapping> mapping;
+    // The mapping reads the blocks it doesn't keep in memory from here.
+    FileDescriptorPtr fd;
+    size_t size{0};
+    std::vector<BlockMapping::BlockId> block_ids;
+  };
+
+  static std::string FullOperationKey(const std::string& part,
+                                      const std::vector<Extent>& extents);
+
+  mutable std::mutex mutex_;
+  std::map<std::string, PartitionInfo> partition_infos_;
+  std::map<std::pair<std::string, bool>,
+           std::vector<FilesystemInterface::File>>
+      partition_files_;
+  std::map<std::string, std::unique_ptr<PartitionBlocks>> partition_blocks_;
+  std::map<std::string, std::pair<InstallOperation::Type, brillo::Blob>>
+      full_operations_;
+  const uint64_t max_full_operation_bytes_;
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(TargetCache);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_TARGET_CACHE_H_
@@ -0,0 +1,116 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/target_cache.h"
+
+#include <string>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class TargetCacheTest : public ::testing::Test {
+ protected:
+  ScopedTempFile old_part_{"TargetCacheTest_old.XXXXXX"};
+  ScopedTempFile other_old_part_{"TargetCacheTest_other_old.XXXXXX"};
+  ScopedTempFile new_part_{"TargetCacheTest_new.XXXXXX"};
+
+  size_t block_size_{1024};
+  TargetCache cache_{4096};
+};
+
+TEST_F(TargetCacheTest, MapPartitionBlocksTest) {
+  // The blocks of the new partition are "b", zeros, "a" and "c".
+  string new_contents = string(block_size_, 'b') + string(block_size_, '\0') +
+                        string(block_size_, 'a') + string(block_size_, 'c');
+  test_utils::WriteFileString(new_part_.path(), new_contents);
+  test_utils::WriteFileString(
+      old_part_.path(),
+      string(block_size_, 'a') + string(block_size_, 'x') +
+          string(block_size_, '\0') + string(block_size_, 'c'));
+  test_utils::WriteFileString(
+      other_old_part_.path(),
+      string(block_size_, 'c') + string(block_size_, 'b'));
+
+  vector<BlockMapping::BlockId> old_ids, new_ids;
+  EXPECT_TRUE(cache_.MapPartitionBlocks(old_part_.path(),
+                                        new_part_.path(),
+                                        4 * block_size_,
+                                        4 * block_size_,
+                                        block_size_,
+                                        &old_ids,
+                                        &new_ids));
+  ASSERT_EQ(4u, new_ids.size());
+  EXPECT_EQ(0, new_ids[1]);
+  EXPECT_EQ((vector<BlockMapping::BlockId>{
+                new_ids[2], BlockMapping::kNotFound, 0, new_ids[3]}),
+            old_ids);
+
+  // The blocks of another source are looked up in the same mapping.
+  vector<BlockMapping::BlockId> other_new_ids;
+  EXPECT_TRUE(cache_.MapPartitionBlocks(other_old_part_.path(),
+                                        new_part_.path(),
+                                        2 * block_size_,
+                                        4 * block_size_,
+                                        block_size_,
+                                        &old_ids,
+                                        &other_new_ids));
+  EXPECT_EQ(new_ids, other_new_ids);
+  EXPECT_EQ((vector<BlockMapping::BlockId>{new_ids[3], new_ids[0]}), old_ids);
+}
+
+TEST_F(TargetCacheTest, FullOperationTest) {
+  const vector<Extent> extents = {ExtentForRange(1, 2), ExtentForRange(5, 1)};
+  InstallOperation::Type type{};
+  brillo::Blob blob;
+  EXPECT_FALSE(
+      cache_.GetFullOperation(new_part_.path(), extents, &type, &blob));
+
+  cache_.AddFullOperation(new_part_.path(),
+                          extents,
+                          InstallOperation::REPLACE_XZ,
+                          brillo::Blob(3000, 'x'));
+  EXPECT_TRUE(cache_.GetFullOperation(new_part_.path(), extents, &type, &blob));
+  EXPECT_EQ(InstallOperation::REPLACE_XZ, type);
+  EXPECT_EQ(brillo::Blob(3000, 'x'), blob);
+  EXPECT_FALSE(cache_.GetFullOperation(
+      new_part_.path(), {ExtentForRange(1, 3)}, &type, &blob));
+  EXPECT_FALSE(cache_.GetFullOperation(
+      old_part_.path(), extents, &type, &blob));
+
+  // Past the 4096 bytes budget, operations aren't kept.
+  cache_.AddFullOperation(new_part_.path(),
+                          {ExtentForRange(1, 3)},
+                          InstallOperation::REPLACE,
+                          brillo::Blob(2000, 'y'));
+  EXPECT_FALSE(cache_.GetFullOperation(
+      new_part_.path(), {ExtentForRange(1, 3)}, &type, &blob));
+
+  const auto stats = cache_.stats();
+  EXPECT_EQ(1u, stats.full_operation_hits);
+  EXPECT_EQ(4u, stats.full_operation_misses);
+  EXPECT_EQ(3000u, stats.full_operation_bytes);
+}
+
+}  // namespace chromeos_update_engine
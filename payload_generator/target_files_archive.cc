@@ -0,0 +1,176 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/target_files_archive.h"
+
+#include <fcntl.h>
+
+#include <android-base/unique_fd.h>
+#include <base/logging.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/sparse_image.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+std::unique_ptr<TargetFilesArchive> TargetFilesArchive::Open(
+    const string& path) {
+  ZipArchiveHandle handle;
+  int32_t open_status = OpenArchive(path.c_str(), &handle);
+  if (open_status != 0) {
+    LOG(ERROR) << "Failed to open " << path << ": "
+               << ErrorCodeString(open_status);
+    CloseArchive(handle);
+    return nullptr;
+  }
+  return std::unique_ptr<TargetFilesArchive>(
+      new TargetFilesArchive(path, handle));
+}
+
+TargetFilesArchive::~TargetFilesArchive() {
+  CloseArchive(handle_);
+}
+
+bool TargetFilesArchive::FindEntry(const string& name,
+                                   ZipEntry64* entry) const {
+  return ::FindEntry(handle_, name, entry) == 0;
+}
+
+bool TargetFilesArchive::HasEntry(const string& name) const {
+  ZipEntry64 entry;
+  return FindEntry(name, &entry);
+}
+
+bool TargetFilesArchive::ReadEntry(const string& name, string* out) {
+  const auto start = std::chrono::steady_clock::now();
+  ZipEntry64 entry;
+  if (!FindEntry(name, &entry)) {
+    LOG(ERROR) << "Failed to find " << name << " in " << path_;
+    return false;
+  }
+  out->resize(entry.uncompressed_length);
+  int32_t extract_status = ExtractToMemory(
+      handle_, &entry, reinterpret_cast<uint8_t*>(out->data()), out->size());
+  if (extract_status != 0) {
+    LOG(ERROR) << "Failed to extract " << name << " from " << path_ << ": "
+               << ErrorCodeString(extract_status);
+    return false;
+  }
+  stats_.entries++;
+  stats_.elapsed += std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  return true;
+}
+
+bool TargetFilesArchive::ExtractRawEntry(const string& name,
+                                         const ZipEntry64& entry,
+                                         const string& out_path) {
+  android::base::unique_fd out_fd(
+      open(out_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (out_fd < 0) {
+    PLOG(ERROR) << "Failed to open " << out_path;
+    return false;
+  }
+  if (entry.method == kCompressStored) {
+    TEST_AND_RETURN_FALSE(utils::SendFileRange(out_fd.get(),
+                                               0,
+                                               GetFileDescriptor(handle_),
+                                               entry.offset,
+                                               entry.uncompressed_length));
+    stats_.copied_bytes += entry.uncompressed_length;
+    return true;
+  }
+  int32_t extract_status = ExtractEntryToFile(handle_, &entry, out_fd.get());
+  if (extract_status != 0) {
+    LOG(ERROR) << "Failed to extract " << name << " from " << path_ << ": "
+               << ErrorCodeString(extract_status);
+    return false;
+  }
+  stats_.inflated_bytes += entry.uncompressed_length;
+  return true;
+}
+
+bool TargetFilesArchive::ExtractEntry(const string& name,
+                                      const string& out_path) {
+  const auto start = std::chrono::steady_clock::now();
+  ZipEntry64 entry;
+  if (!FindEntry(name, &entry)) {
+    LOG(ERROR) << "Failed to find " << name << " in " << path_;
+    return false;
+  }
+  TEST_AND_RETURN_FALSE(ExtractRawEntry(name, entry, out_path));
+  stats_.entries++;
+  stats_.elapsed += std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  return true;
+}
+
+bool TargetFilesArchive::OpenImageEntry(
+    const string& name,
+    const string& temp_path,
+    string* image_path,
+    std::unique_ptr<ScopedImageFile>* image) {
+  const auto start = std::chrono::steady_clock::now();
+  ZipEntry64 entry;
+  if (!FindEntry(name, &entry)) {
+    LOG(ERROR) << "Failed to find " << name << " in " << path_;
+    return false;
+  }
+
+  // What unzip would write, plus simg2img for sparse images.
+  uint64_t extract_bytes = entry.uncompressed_length;
+  uint64_t written_bytes = 0;
+  std::unique_ptr<SparseImage> contents;
+  if (entry.method == kCompressStored) {
+    *image_path = path_ + "/" + name;
+    // The same entry may be opened for both the source and the target, and is
+    // registered only once.
+    if (!image_file::GetImage(*image_path)) {
+      if (SparseImage::IsSparseImage(path_, entry.offset)) {
+        contents = SparseImage::Open(path_, entry.offset);
+        TEST_AND_RETURN_FALSE(contents);
+        extract_bytes += contents->size();
+      } else {
+        contents = SparseImage::OpenRaw(
+            path_, entry.offset, entry.uncompressed_length);
+        TEST_AND_RETURN_FALSE(contents);
+      }
+    }
+  } else {
+    TEST_AND_RETURN_FALSE(ExtractRawEntry(name, entry, temp_path));
+    written_bytes = entry.uncompressed_length;
+    *image_path = temp_path;
+    if (SparseImage::IsSparseImage(temp_path)) {
+      contents = SparseImage::Open(temp_path);
+      TEST_AND_RETURN_FALSE(contents);
+      extract_bytes += contents->size();
+    }
+  }
+  image->reset();
+  if (contents) {
+    *image =
+        std::make_unique<ScopedImageFile>(*image_path, std::move(contents));
+  }
+  stats_.entries++;
+  stats_.saved_bytes += extract_bytes - written_bytes;
+  stats_.elapsed += std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - start);
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,98 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_TARGET_FILES_ARCHIVE_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_TARGET_FILES_ARCHIVE_H_
+
+#include <chrono>
+#include <memory>
+#include <string>
+
+#include <base/macros.h>
+#include <ziparchive/zip_archive.h>
+
+#include "update_engine/payload_generator/image_file.h"
+
+namespace chromeos_update_engine {
+
+// Reads partition images, .map files and META files directly from an Android
+// target-files zip, so they don't need to be unzipped into a work directory
+// before generating a payload.
+class TargetFilesArchive {
+ public:
+  // Accounting of the I/O done to read the entries of the archive.
+  struct Stats {
+    size_t entries{0};
+    // Bytes of stored entries copied from the archive in the kernel.
+    uint64_t copied_bytes{0};
+    // Bytes written while inflating deflated entries.
+    uint64_t inflated_bytes{0};
+    // Bytes that unzipping the entries and then converting the sparse images
+    // with simg2img would have written on top of the above.
+    uint64_t saved_bytes{0};
+    std::chrono::milliseconds elapsed{0};
+  };
+
+  static std::unique_ptr<TargetFilesArchive> Open(const std::string& path);
+  ~TargetFilesArchive();
+
+  const std::string& path() const { return path_; }
+  const Stats& stats() const { return stats_; }
+
+  // Returns whether the archive has an entry called |name|.
+  bool HasEntry(const std::string& name) const;
+
+  // Reads the whole entry |name| into |out|. Meant for small files such as
+  // the ones in META/.
+  bool ReadEntry(const std::string& name, std::string* out);
+
+  // Writes the contents of the entry |name| to the file at |out_path|. Stored
+  // entries are copied from the archive in the kernel and deflated ones are
+  // inflated straight into |out_path|.
+  bool ExtractEntry(const std::string& name, const std::string& out_path);
+
+  // Makes the partition image entry |name| readable through image_file and
+  // stores the path to read it from in |image_path|. Stored entries are read
+  // in place from the archive under a path which doesn't exist on disk, and
+  // deflated ones are inflated once to |temp_path|. The images read in place
+  // and the Android sparse images are registered in |image|, which is left
+  // empty if the image is read as a raw file or is already registered.
+  bool OpenImageEntry(const std::string& name,
+                      const std::string& temp_path,
+                      std::string* image_path,
+                      std::unique_ptr<ScopedImageFile>* image);
+
+ private:
+  TargetFilesArchive(const std::string& path, ZipArchiveHandle handle)
+      : path_(path), handle_(handle) {}
+
+  bool FindEntry(const std::string& name, ZipEntry64* entry) const;
+
+  // Inflates or copies |entry| to |out_path| without interpreting it.
+  bool ExtractRawEntry(const std::string& name,
+                       const ZipEntry64& entry,
+                       const std::string& out_path);
+
+  const std::string path_;
+  ZipArchiveHandle handle_;
+  Stats stats_;
+
+  DISALLOW_COPY_AND_ASSIGN(TargetFilesArchive);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_TARGET_FILES_ARCHIVE_H_
@@ -0,0 +1,223 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/target_files_archive.h"
+
+#include <stdio.h>
+
+#include <memory>
+#include <string>
+
+#include <brillo/secure_blob.h>
+#include <gtest/gtest.h>
+#include <ziparchive/zip_writer.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/image_file.h"
+
+using std::string;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+constexpr uint32_t kBlockSize = 4096;
+
+void AppendLE(brillo::Blob* blob, uint32_t value, size_t size) {
+  for (size_t i = 0; i < size; i++) {
+    blob->push_back((value >> (8 * i)) & 0xff);
+  }
+}
+
+// Returns an Android sparse image of 3 blocks: |data| in the first block
+// followed by 2 don't care blocks.
+brillo::Blob MakeSparseImage(const brillo::Blob& data) {
+  brillo::Blob sparse;
+  AppendLE(&sparse, 0xed26ff3a, 4);
+  AppendLE(&sparse, 1, 2);
+  AppendLE(&sparse, 0, 2);
+  AppendLE(&sparse, 28, 2);
+  AppendLE(&sparse, 12, 2);
+  AppendLE(&sparse, kBlockSize, 4);
+  AppendLE(&sparse, 3, 4);
+  AppendLE(&sparse, 2, 4);
+  AppendLE(&sparse, 0, 4);
+  AppendLE(&sparse, 0xCAC1, 2);
+  AppendLE(&sparse, 0, 2);
+  AppendLE(&sparse, 1, 4);
+  AppendLE(&sparse, 12 + kBlockSize, 4);
+  sparse.insert(sparse.end(), data.begin(), data.end());
+  AppendLE(&sparse, 0xCAC3, 2);
+  AppendLE(&sparse, 0, 2);
+  AppendLE(&sparse, 2, 4);
+  AppendLE(&sparse, 12, 4);
+  return sparse;
+}
+
+}  // namespace
+
+class TargetFilesArchiveTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    data_.resize(kBlockSize);
+    for (size_t i = 0; i < data_.size(); i++) {
+      data_[i] = i % 251;
+    }
+    raw_image_ = data_;
+    raw_image_.resize(3 * kBlockSize);
+    sparse_image_ = MakeSparseImage(data_);
+
+    FILE* fp = fopen(zip_file_.path().c_str(), "wb");
+    ASSERT_NE(nullptr, fp);
+    ZipWriter writer(fp);
+    AddEntry(&writer, "IMAGES/stored.img", 0, raw_image_);
+    AddEntry(&writer, "IMAGES/deflated.img", ZipWriter::kCompress, raw_image_);
+    AddEntry(&writer, "IMAGES/stored_sparse.img", 0, sparse_image_);
+    AddEntry(&writer,
+             "IMAGES/deflated_sparse.img",
+             ZipWriter::kCompress,
+             sparse_image_);
+    const string config = "RUN_POSTINSTALL_system=true\n";
+    AddEntry(&writer,
+             "META/postinstall_config.txt",
+             ZipWriter::kCompress,
+             brillo::Blob(config.begin(), config.end()));
+    ASSERT_EQ(0, writer.Finish());
+    ASSERT_EQ(0, fclose(fp));
+
+    archive_ = TargetFilesArchive::Open(zip_file_.path());
+    ASSERT_NE(nullptr, archive_);
+  }
+
+  void AddEntry(ZipWriter* writer,
+                const string& name,
+                size_t flags,
+                const brillo::Blob& contents) {
+    ASSERT_EQ(0, writer->StartAlignedEntry(name, flags, kBlockSize));
+    ASSERT_EQ(0, writer->WriteBytes(contents.data(), contents.size()));
+    ASSERT_EQ(0, writer->FinishEntry());
+  }
+
+  void ExpectEntry(const string& name, const brillo::Blob& expected) {
+    ScopedTempFile out_file("TargetFilesArchiveTest_out.XXXXXX");
+    EXPECT_TRUE(archive_->ExtractEntry(name, out_file.path()));
+    brillo::Blob contents;
+    EXPECT_TRUE(utils::ReadFile(out_file.path(), &contents));
+    EXPECT_EQ(expected, contents) << name;
+  }
+
+  // Opens the partition image entry |name| and checks that it reads as
+  // |raw_image_|. Returns the path to read it from.
+  string ExpectImageEntry(const string& name,
+                          const string& temp_path,
+                          std::unique_ptr<ScopedImageFile>* image) {
+    string image_path;
+    EXPECT_TRUE(archive_->OpenImageEntry(name, temp_path, &image_path, image));
+    brillo::Blob contents;
+    EXPECT_TRUE(image_file::ReadChunk(image_path, 0, -1, &contents));
+    EXPECT_EQ(raw_image_, contents) << name;
+    return image_path;
+  }
+
+  brillo::Blob data_;
+  brillo::Blob raw_image_;
+  brillo::Blob sparse_image_;
+  ScopedTempFile zip_file_{"TargetFilesArchiveTest_zip.XXXXXX"};
+  std::unique_ptr<TargetFilesArchive> archive_;
+};
+
+TEST_F(TargetFilesArchiveTest, OpenFailureTest) {
+  ScopedTempFile not_zip("TargetFilesArchiveTest_not_zip.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(not_zip.path(), data_));
+  EXPECT_EQ(nullptr, TargetFilesArchive::Open(not_zip.path()));
+}
+
+TEST_F(TargetFilesArchiveTest, HasEntryTest) {
+  EXPECT_TRUE(archive_->HasEntry("IMAGES/stored.img"));
+  EXPECT_TRUE(archive_->HasEntry("META/postinstall_config.txt"));
+  EXPECT_FALSE(archive_->HasEntry("IMAGES/missing.img"));
+}
+
+TEST_F(TargetFilesArchiveTest, ReadEntryTest) {
+  string config;
+  EXPECT_TRUE(archive_->ReadEntry("META/postinstall_config.txt", &config));
+  EXPECT_EQ("RUN_POSTINSTALL_system=true\n", config);
+  EXPECT_FALSE(archive_->ReadEntry("META/missing.txt", &config));
+}
+
+TEST_F(TargetFilesArchiveTest, ExtractEntryTest) {
+  ExpectEntry("IMAGES/stored.img", raw_image_);
+  ExpectEntry("IMAGES/deflated.img", raw_image_);
+  // Sparse images are written as is.
+  ExpectEntry("IMAGES/stored_sparse.img", sparse_image_);
+  ExpectEntry("IMAGES/deflated_sparse.img", sparse_image_);
+
+  ScopedTempFile out_file("TargetFilesArchiveTest_out.XXXXXX");
+  EXPECT_FALSE(archive_->ExtractEntry("IMAGES/missing.img", out_file.path()));
+
+  const auto& stats = archive_->stats();
+  EXPECT_EQ(4u, stats.entries);
+  EXPECT_EQ(raw_image_.size() + sparse_image_.size(), stats.copied_bytes);
+  EXPECT_EQ(raw_image_.size() + sparse_image_.size(), stats.inflated_bytes);
+  EXPECT_EQ(0u, stats.saved_bytes);
+}
+
+TEST_F(TargetFilesArchiveTest, OpenImageEntryTest) {
+  ScopedTempFile temp_file("TargetFilesArchiveTest_temp.XXXXXX");
+  std::unique_ptr<ScopedImageFile> stored, deflated, stored_sparse,
+      deflated_sparse, stored_again;
+
+  // Stored entries are read in place from the archive.
+  const string stored_path =
+      ExpectImageEntry("IMAGES/stored.img", temp_file.path(), &stored);
+  EXPECT_EQ(zip_file_.path() + "/IMAGES/stored.img", stored_path);
+  EXPECT_NE(nullptr, stored);
+  EXPECT_EQ(zip_file_.path() + "/IMAGES/stored_sparse.img",
+            ExpectImageEntry(
+                "IMAGES/stored_sparse.img", temp_file.path(), &stored_sparse));
+  EXPECT_NE(nullptr, stored_sparse);
+  // They are registered only once.
+  EXPECT_EQ(stored_path,
+            ExpectImageEntry("IMAGES/stored.img", "", &stored_again));
+  EXPECT_EQ(nullptr, stored_again);
+
+  // Deflated entries are inflated once, and sparse ones are read in place
+  // from the inflated file.
+  ScopedTempFile deflated_file("TargetFilesArchiveTest_deflated.XXXXXX");
+  EXPECT_EQ(deflated_file.path(),
+            ExpectImageEntry(
+                "IMAGES/deflated.img", deflated_file.path(), &deflated));
+  EXPECT_EQ(nullptr, deflated);
+  EXPECT_EQ(temp_file.path(),
+            ExpectImageEntry("IMAGES/deflated_sparse.img",
+                             temp_file.path(),
+                             &deflated_sparse));
+  EXPECT_NE(nullptr, deflated_sparse);
+  brillo::Blob contents;
+  EXPECT_TRUE(utils::ReadFile(temp_file.path(), &contents));
+  EXPECT_EQ(sparse_image_, contents);
+
+  const auto& stats = archive_->stats();
+  EXPECT_EQ(5u, stats.entries);
+  EXPECT_EQ(0u, stats.copied_bytes);
+  EXPECT_EQ(raw_image_.size() + sparse_image_.size(), stats.inflated_bytes);
+  // Only the deflated entries were written, as they are: unzip would also have
+  // written the stored ones, and simg2img the raw images of the sparse ones.
+  EXPECT_EQ(4 * raw_image_.size() + sparse_image_.size(), stats.saved_bytes);
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,263 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/xor_source_finder.h"
+
+#include <algorithm>
+#include <functional>
+
+#include <base/logging.h>
+#include <lz4.h>
+
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_utils.h"
+#include "update_engine/payload_generator/extent_utils.h"
+#include "update_engine/payload_generator/image_file.h"
+
+using std::string;
+using std::vector;
+
+namespace chromeos_update_engine {
+
+namespace {
+
+// The multiplier of the rolling hash, and the one of the byte leaving the
+// window: kHashMultiplier ^ kWindowSize.
+constexpr uint64_t kHashMultiplier = 0x100000001b3;
+constexpr uint64_t RemoveMultiplier() {
+  uint64_t multiplier = 1;
+  for (size_t i = 0; i < XorSourceFinder::kWindowSize; i++)
+    multiplier *= kHashMultiplier;
+  return multiplier;
+}
+constexpr uint64_t kRemoveMultiplier = RemoveMultiplier();
+
+// An XOR source is only used if it makes the compressed block at most this
+// big, in percents, to be worth the source read and the merge dependency.
+constexpr size_t kMaxXorSizePercent = 50;
+
+// The number of blocks read at once while indexing the source partition.
+constexpr size_t kIndexReadBlocks = 256;
+
+// Spreads the bits of the rolling hash, whose low bits only depend on the
+// last bytes of the window, so the smallest hashes are evenly picked.
+uint64_t MixHash(uint64_t hash) {
+  hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9;
+  hash = (hash ^ (hash >> 27)) * 0x94d049bb133111eb;
+  return hash ^ (hash >> 31);
+}
+
+bool IsZero(const uint8_t* data, size_t size) {
+  return std::all_of(data, data + size, [](uint8_t x) { return x == 0; });
+}
+
+}  // namespace
+
+XorSourceFinder::WindowHashes XorSourceFinder::MinHashes(const uint8_t* data,
+                                                         size_t size) {
+  WindowHashes hashes;
+  uint64_t hash = 0;
+  for (size_t i = 0; i < size; i++) {
+    hash = hash * kHashMultiplier + data[i];
+    if (i >= kWindowSize)
+      hash -= kRemoveMultiplier * data[i - kWindowSize];
+    if (i + 1 < kWindowSize)
+      continue;
+    const uint64_t mixed = MixHash(hash);
+    if (hashes.size() == kHashesPerBlock && mixed >= hashes.back().first)
+      continue;
+    auto it = std::lower_bound(
+        hashes.begin(), hashes.end(), mixed, [](const auto& entry, uint64_t h) {
+          return entry.first < h;
+        });
+    if (it != hashes.end() && it->first == mixed)
+      continue;
+    hashes.emplace(it, mixed, i + 1 - kWindowSize);
+    if (hashes.size() > kHashesPerBlock)
+      hashes.pop_back();
+  }
+  return hashes;
+}
+
+size_t XorSourceFinder::CompressedSize(const brillo::Blob& data) {
+  brillo::Blob compressed(LZ4_compressBound(data.size()));
+  const int size =
+      LZ4_compress_default(reinterpret_cast<const char*>(data.data()),
+                           reinterpret_cast<char*>(compressed.data()),
+                           data.size(),
+                           compressed.size());
+  return size > 0 ? std::min<size_t>(size, data.size()) : data.size();
+}
+
+bool XorSourceFinder::Init(const string& source_path, uint64_t source_size) {
+  source_fd_ = image_file::Open(source_path);
+  TEST_AND_RETURN_FALSE(source_fd_);
+  source_size_ = source_size;
+
+  const uint64_t num_blocks = source_size / block_size_;
+  brillo::Blob data(kIndexReadBlocks * block_size_);
+  for (uint64_t block = 0; block < num_blocks; block += kIndexReadBlocks) {
+    const size_t read_blocks =
+        std::min<uint64_t>(kIndexReadBlocks, num_blocks - block);
+    ssize_t bytes_read;
+    TEST_AND_RETURN_FALSE(utils::ReadAll(source_fd_,
+                                         data.data(),
+                                         read_blocks * block_size_,
+                                         block * block_size_,
+                                         &bytes_read));
+    TEST_AND_RETURN_FALSE(bytes_read ==
+                          static_cast<ssize_t>(read_blocks * block_size_));
+    for (size_t i = 0; i < read_blocks; i++) {
+      const uint8_t* block_data = data.data() + i * block_size_;
+      if (IsZero(block_data, block_size_))
+        continue;
+      const uint64_t block_offset = (block + i) * block_size_;
+      for (const auto& [hash, pos] : MinHashes(block_data, block_size_))
+        index_.emplace_back(hash, block_offset + pos);
+    }
+  }
+  // Keep the first block of each hash.
+  std::stable_sort(
+      index_.begin(), index_.end(), [](const auto& a, const auto& b) {
+        return a.first < b.first;
+      });
+  index_.erase(std::unique(index_.begin(),
+                           index_.end(),
+                           [](const auto& a, const auto& b) {
+                             return a.first == b.first;
+                           }),
+               index_.end());
+  index_.shrink_to_fit();
+  LOG(INFO) << "Indexed " << num_blocks << " blocks of " << source_path
+            << " with " << index_.size() << " hashes.";
+  return true;
+}
+
+vector<uint64_t> XorSourceFinder::FindCandidates(const uint8_t* block) const {
+  vector<uint64_t> candidates;
+  for (const auto& [hash, pos] : MinHashes(block, block_size_)) {
+    auto it = std::lower_bound(
+        index_.begin(), index_.end(), hash, [](const auto& entry, uint64_t h) {
+          return entry.first < h;
+        });
+    if (it == index_.end() || it->first != hash || it->second < pos)
+      continue;
+    const uint64_t src_offset = it->second - pos;
+    if (src_offset + block_size_ > source_size_)
+      continue;
+    if (std::find(candidates.begin(), candidates.end(), src_offset) ==
+        candidates.end()) {
+      candidates.push_back(src_offset);
+    }
+  }
+  return candidates;
+}
+
+bool XorSourceFinder::FindXorSource(const uint8_t* block,
+                                    uint64_t* src_offset,
+                                    size_t* compressed_size,
+                                    size_t* compressed_xor_size) const {
+  const vector<uint64_t> candidates = FindCandidates(block);
+  if (candidates.empty())
+    return false;
+
+  *compressed_size = CompressedSize(brillo::Blob(block, block + block_size_));
+  size_t best_size = *compressed_size * kMaxXorSizePercent / 100 + 1;
+  brillo::Blob xor_data(block_size_);
+  for (uint64_t candidate : candidates) {
+    ssize_t bytes_read;
+    if (!utils::ReadAll(source_fd_,
+                        xor_data.data(),
+                        block_size_,
+                        candidate,
+                        &bytes_read) ||
+        bytes_read != static_cast<ssize_t>(block_size_)) {
+      continue;
+    }
+    std::transform(xor_data.begin(),
+                   xor_data.end(),
+                   block,
+                   xor_data.begin(),
+                   std::bit_xor<uint8_t>{});
+    const size_t size = CompressedSize(xor_data);
+    if (size < best_size) {
+      best_size = size;
+      *src_offset = candidate;
+    }
+  }
+  if (best_size > *compressed_size * kMaxXorSizePercent / 100)
+    return false;
+  *compressed_xor_size = best_size;
+  return true;
+}
+
+bool XorSourceFinder::PopulateXorOps(const string& target_path,
+                                     vector<AnnotatedOperation>* aops,
+                                     uint64_t* saved_bytes) const {
+  FileDescriptorPtr target_fd = image_file::Open(target_path);
+  TEST_AND_RETURN_FALSE(target_fd);
+
+  uint64_t total_blocks = 0, xor_blocks = 0;
+  brillo::Blob block(block_size_);
+  for (AnnotatedOperation& aop : *aops) {
+    if (!diff_utils::IsAReplaceOperation(aop.op.type()) ||
+        !aop.xor_ops.empty()) {
+      continue;
+    }
+    for (const Extent& extent : aop.op.dst_extents()) {
+      for (uint64_t dst_block = extent.start_block();
+           dst_block < extent.start_block() + extent.num_blocks();
+           dst_block++) {
+        total_blocks++;
+        ssize_t bytes_read;
+        TEST_AND_RETURN_FALSE(utils::ReadAll(target_fd,
+                                             block.data(),
+                                             block_size_,
+                                             dst_block * block_size_,
+                                             &bytes_read));
+        TEST_AND_RETURN_FALSE(bytes_read ==
+                              static_cast<ssize_t>(block_size_));
+        uint64_t src_offset;
+        size_t compressed_size, compressed_xor_size;
+        if (IsZero(block.data(), block_size_) ||
+            !FindXorSource(block.data(),
+                           &src_offset,
+                           &compressed_size,
+                           &compressed_xor_size)) {
+          continue;
+        }
+        diff_utils::AppendXorBlock(&aop.xor_ops,
+                                   src_offset / block_size_,
+                                   dst_block,
+                                   src_offset % block_size_);
+        xor_blocks++;
+        *saved_bytes += compressed_size - compressed_xor_size;
+      }
+    }
+    // Unaligned XOR ops also read the block after their source extent.
+    for (CowMergeOperation& op : aop.xor_ops) {
+      if (op.src_offset() > 0) {
+        op.mutable_src_extent()->set_num_blocks(op.dst_extent().num_blocks() +
+                                                1);
+      }
+    }
+  }
+  LOG(INFO) << "Found XOR sources for " << xor_blocks << " of the "
+            << total_blocks << " blocks of full operations in " << target_path;
+  return true;
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,99 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#ifndef UPDATE_ENGINE_PAYLOAD_GENERATOR_XOR_SOURCE_FINDER_H_
+#define UPDATE_ENGINE_PAYLOAD_GENERATOR_XOR_SOURCE_FINDER_H_
+
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <brillo/secure_blob.h>
+
+#include "update_engine/payload_consumer/file_descriptor.h"
+#include "update_engine/payload_generator/annotated_operation.h"
+
+namespace chromeos_update_engine {
+
+// Finds source blocks similar to the blocks written by the full operations of
+// a delta payload, so the COW can store these blocks XORed with a source block
+// instead of whole. bsdiff already gives XOR sources to the blocks of diff
+// operations; the blocks of full operations are those of files that changed
+// too much to be diffed or have no source file, but may still be close to
+// other source blocks, for example after relinking or a version bump.
+//
+// Blocks are indexed by the smallest hashes of their windows of
+// |kWindowSize| bytes (min-hashes): similar blocks likely share their smallest
+// hashes, even when their data is shifted, and the positions of a shared
+// window in both blocks give the source offset to XOR with.
+class XorSourceFinder {
+ public:
+  // The number of bytes hashed together, and the number of smallest hashes
+  // indexed for each block.
+  static constexpr size_t kWindowSize = 64;
+  static constexpr size_t kHashesPerBlock = 4;
+
+  explicit XorSourceFinder(size_t block_size) : block_size_(block_size) {}
+
+  // Indexes the blocks of the |source_size| bytes of |source_path|.
+  bool Init(const std::string& source_path, uint64_t source_size);
+
+  // Returns the offsets in the source partition of data possibly similar to
+  // |block|, which may not be aligned to blocks.
+  std::vector<uint64_t> FindCandidates(const uint8_t* block) const;
+
+  // Returns in |src_offset| the offset in the source partition of the data
+  // with which |block| XORed compresses the best, if it compresses to at most
+  // half of |block| compressed. |compressed_size| and |compressed_xor_size|
+  // are the compressed sizes of both. Returns false if there's none.
+  bool FindXorSource(const uint8_t* block,
+                     uint64_t* src_offset,
+                     size_t* compressed_size,
+                     size_t* compressed_xor_size) const;
+
+  // Adds COW_XOR ops to the full operations of |aops| for the blocks of
+  // |target_path| with an XOR source. The bytes these ops are estimated to
+  // save in the COW are added to |saved_bytes|.
+  bool PopulateXorOps(const std::string& target_path,
+                      std::vector<AnnotatedOperation>* aops,
+                      uint64_t* saved_bytes) const;
+
+ private:
+  // The hashes and the start of their windows in the data.
+  using WindowHashes = std::vector<std::pair<uint64_t, uint32_t>>;
+
+  // Returns the |kHashesPerBlock| smallest distinct hashes of the windows of
+  // the |size| bytes of |data|.
+  static WindowHashes MinHashes(const uint8_t* data, size_t size);
+
+  // Returns the size of |data| compressed like in the COW.
+  static size_t CompressedSize(const brillo::Blob& data);
+
+  const size_t block_size_;
+
+  FileDescriptorPtr source_fd_;
+  uint64_t source_size_{0};
+
+  // The min-hashes of the source blocks and the source offsets of their
+  // windows, sorted by hash.
+  std::vector<std::pair<uint64_t, uint64_t>> index_;
+
+  DISALLOW_COPY_AND_ASSIGN(XorSourceFinder);
+};
+
+}  // namespace chromeos_update_engine
+
+#endif  // UPDATE_ENGINE_PAYLOAD_GENERATOR_XOR_SOURCE_FINDER_H_
@@ -0,0 +1,128 @@
+//
+// Copyright (C) 2026 The Android Open Source Project
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      http://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+//
+
+#include "update_engine/payload_generator/xor_source_finder.h"
+
+#include <algorithm>
+#include <random>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#include "update_engine/common/test_utils.h"
+#include "update_engine/common/utils.h"
+#include "update_engine/payload_generator/delta_diff_generator.h"
+#include "update_engine/payload_generator/extent_ranges.h"
+#include "update_engine/payload_generator/extent_utils.h"
+
+using std::vector;
+
+namespace chromeos_update_engine {
+
+class XorSourceFinderTest : public ::testing::Test {
+ protected:
+  void SetUp() override {
+    // Random data doesn't compress, and the XOR of similar data does.
+    std::mt19937 gen(42);
+    source_.resize(kSourceBlocks * kBlockSize);
+    std::generate(source_.begin(), source_.end(), [&gen] { return gen(); });
+    ASSERT_TRUE(test_utils::WriteFileVector(source_file_.path(), source_));
+    ASSERT_TRUE(finder_.Init(source_file_.path(), source_.size()));
+  }
+
+  // Returns the block of the source at |offset| with a few bytes changed.
+  brillo::Blob SimilarBlock(uint64_t offset) {
+    brillo::Blob block(source_.begin() + offset,
+                       source_.begin() + offset + kBlockSize);
+    for (size_t i = 0; i < kBlockSize; i += 512)
+      block[i] ^= 0xff;
+    return block;
+  }
+
+  static constexpr size_t kSourceBlocks = 16;
+
+  brillo::Blob source_;
+  ScopedTempFile source_file_{"XorSourceFinderTest_source.XXXXXX"};
+  XorSourceFinder finder_{kBlockSize};
+};
+
+TEST_F(XorSourceFinderTest, FindsShiftedSourceTest) {
+  for (uint64_t offset : {5 * kBlockSize, 7 * kBlockSize + 1000}) {
+    const brillo::Blob block = SimilarBlock(offset);
+    const vector<uint64_t> candidates = finder_.FindCandidates(block.data());
+    EXPECT_NE(candidates.end(),
+              std::find(candidates.begin(), candidates.end(), offset));
+
+    uint64_t src_offset = 0;
+    size_t compressed_size = 0, compressed_xor_size = 0;
+    ASSERT_TRUE(finder_.FindXorSource(
+        block.data(), &src_offset, &compressed_size, &compressed_xor_size));
+    EXPECT_EQ(offset, src_offset);
+    EXPECT_LT(compressed_xor_size * 2, compressed_size);
+  }
+
+  // Unrelated data has no XOR source.
+  brillo::Blob block(kBlockSize);
+  std::mt19937 gen(7);
+  std::generate(block.begin(), block.end(), [&gen] { return gen(); });
+  uint64_t src_offset;
+  size_t compressed_size, compressed_xor_size;
+  EXPECT_FALSE(finder_.FindXorSource(
+      block.data(), &src_offset, &compressed_size, &compressed_xor_size));
+}
+
+TEST_F(XorSourceFinderTest, PopulateXorOpsTest) {
+  // Blocks 1 and 2 are close to source blocks 3 and 4, block 3 is close to
+  // the source data 100 bytes into block 9, block 0 is new.
+  brillo::Blob target(4 * kBlockSize);
+  std::mt19937 gen(7);
+  std::generate(target.begin(), target.end(), [&gen] { return gen(); });
+  const brillo::Blob block1 = SimilarBlock(3 * kBlockSize);
+  const brillo::Blob block2 = SimilarBlock(4 * kBlockSize);
+  const brillo::Blob block3 = SimilarBlock(9 * kBlockSize + 100);
+  std::copy(block1.begin(), block1.end(), target.begin() + kBlockSize);
+  std::copy(block2.begin(), block2.end(), target.begin() + 2 * kBlockSize);
+  std::copy(block3.begin(), block3.end(), target.begin() + 3 * kBlockSize);
+  ScopedTempFile target_file("XorSourceFinderTest_target.XXXXXX");
+  ASSERT_TRUE(test_utils::WriteFileVector(target_file.path(), target));
+
+  vector<AnnotatedOperation> aops(2);
+  aops[0].op.set_type(InstallOperation::REPLACE_XZ);
+  *aops[0].op.add_dst_extents() = ExtentForRange(0, 4);
+  // Diff operations get their XOR ops from bsdiff.
+  aops[1].op.set_type(InstallOperation::SOURCE_BSDIFF);
+  *aops[1].op.add_dst_extents() = ExtentForRange(1, 1);
+
+  uint64_t saved_bytes = 0;
+  ASSERT_TRUE(finder_.PopulateXorOps(target_file.path(), &aops, &saved_bytes));
+  EXPECT_GT(saved_bytes, 0u);
+  EXPECT_TRUE(aops[1].xor_ops.empty());
+  ASSERT_EQ(2u, aops[0].xor_ops.size());
+
+  const CowMergeOperation& aligned = aops[0].xor_ops[0];
+  EXPECT_EQ(CowMergeOperation::COW_XOR, aligned.type());
+  EXPECT_EQ(ExtentForRange(3, 2), aligned.src_extent());
+  EXPECT_EQ(ExtentForRange(1, 2), aligned.dst_extent());
+  EXPECT_EQ(0u, aligned.src_offset());
+
+  // The unaligned op also reads the next source block.
+  const CowMergeOperation& unaligned = aops[0].xor_ops[1];
+  EXPECT_EQ(ExtentForRange(9, 2), unaligned.src_extent());
+  EXPECT_EQ(ExtentForRange(3, 1), unaligned.dst_extent());
+  EXPECT_EQ(100u, unaligned.src_offset());
+}
+
+}  // namespace chromeos_update_engine
@@ -0,0 +1,420 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2026 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Generate reproducible source and target images to benchmark updates.
+
+The source image is filled with synthetic files looking like the ones of a
+system partition: text files, shared libraries, APKs, incompressible data and
+files with zero regions. The target image is the source changed by churn
+models, each applied to a fraction of the files it applies to:
+
+  edit:        overwrite a few small ranges of a file.
+  insert:      insert data in the middle of a file, shifting the rest.
+  move:        move a file to another directory.
+  recompress:  change an entry of an APK and recompress all its entries.
+  rename_lib:  bump the version in the name of a library and edit it.
+  zero:        zero a few blocks of a file.
+  add:         add new files.
+  delete:      delete files.
+
+The same seed and options always give the same images, so the source and
+target images can be regenerated on any Linux host to reproduce a benchmark:
+
+  generate_workload_images.py --seed 1 --size 512M --fs ext4 out/
+  delta_generator --old_partitions out/source.img \\
+      --new_partitions out/target.img --partition_names system \\
+      --out_file out/payload.bin
+
+The churn applied is listed in workload.json next to the images.
+"""
+
+import argparse
+import io
+import json
+import os
+import random
+import shutil
+import subprocess
+import sys
+import tempfile
+import uuid
+import zipfile
+
+
+CHURN_MODELS = ('edit', 'insert', 'move', 'recompress', 'rename_lib', 'zero',
+                'add', 'delete')
+
+DEFAULT_CHURN = {
+    'edit': 0.05,
+    'insert': 0.02,
+    'move': 0.02,
+    'recompress': 0.2,
+    'rename_lib': 0.1,
+    'zero': 0.05,
+    'add': 0.02,
+    'delete': 0.02,
+}
+
+# The kinds of files, and how much of the data of the partition they hold.
+FILE_KINDS = {
+    'text': 0.15,
+    'lib': 0.35,
+    'apk': 0.3,
+    'data': 0.1,
+    'sparse': 0.1,
+}
+
+DIRS = ('app', 'bin', 'etc', 'fonts', 'framework', 'lib64', 'priv-app',
+        'usr/share', 'vendor/firmware')
+
+# The time of all the files and images, for them to be reproducible.
+TIMESTAMP = 1656466080
+
+BLOCK_SIZE = 4096
+
+_WORDS = ('android', 'system', 'update', 'engine', 'partition', 'block',
+          'extent', 'payload', 'install', 'operation', 'source', 'target',
+          'manifest', 'signature', 'verity', 'snapshot', 'merge', 'config',
+          'value', 'true', 'false', 'null', 'string', 'int', 'import',
+          'return', 'class', 'public', 'static', 'final', 'void', '{', '}',
+          '=', ';', '\n', '\n', '  ')
+
+
+def ParseSize(size):
+  """Parse a size like 512M or 2G into bytes."""
+  units = {'K': 1 << 10, 'M': 1 << 20, 'G': 1 << 30}
+  if size and size[-1].upper() in units:
+    return int(size[:-1]) * units[size[-1].upper()]
+  return int(size)
+
+
+def ParseChurn(churn):
+  """Parse model=fraction pairs separated by commas over the defaults."""
+  result = dict(DEFAULT_CHURN)
+  if not churn:
+    return result
+  for item in churn.split(','):
+    model, fraction = item.split('=')
+    if model not in CHURN_MODELS:
+      raise ValueError('Unknown churn model ' + model)
+    result[model] = float(fraction)
+  return result
+
+
+class WorkloadGenerator(object):
+  """Generates the files of the source and the churn of the target."""
+
+  def __init__(self, seed):
+    self.rng = random.Random(seed)
+    # Code is made of common snippets with a few changing bytes in between,
+    # which compresses and diffs like real libraries.
+    self.snippets = [self.rng.randbytes(self.rng.randint(8, 64))
+                     for _ in range(512)]
+    self.next_id = 0
+    self.max_file_size = 64 << 20
+
+  def _Text(self, size):
+    data = ' '.join(self.rng.choices(_WORDS, k=size // 5 + 1)).encode()
+    return data[:size]
+
+  def _Code(self, size):
+    chunks = []
+    total = 0
+    while total < size:
+      chunk = self.rng.choice(self.snippets) + self.rng.randbytes(4)
+      chunks.append(chunk)
+      total += len(chunk)
+    return b''.join(chunks)[:size]
+
+  def _Sparse(self, size):
+    data = bytearray(self.rng.randbytes(size))
+    for _ in range(max(1, size // (16 * BLOCK_SIZE))):
+      start = self.rng.randrange(0, size, BLOCK_SIZE)
+      length = self.rng.randint(1, 8) * BLOCK_SIZE
+      data[start:start + length] = bytes(len(data[start:start + length]))
+    return bytes(data)
+
+  def _Apk(self, entries):
+    """Return a zip of |entries|, a list of (name, data, compresslevel)."""
+    out = io.BytesIO()
+    with zipfile.ZipFile(out, 'w') as apk:
+      for name, data, level in entries:
+        info = zipfile.ZipInfo(name, date_time=(2022, 6, 29, 0, 0, 0))
+        info.compress_type = zipfile.ZIP_DEFLATED
+        apk.writestr(info, data, compresslevel=level)
+    return out.getvalue()
+
+  def _ApkEntries(self, size):
+    entries = [('AndroidManifest.xml', self._Text(4096), 6)]
+    while sum(len(data) for _, data, _ in entries) < size:
+      index = len(entries)
+      if index % 2:
+        entries.append(('classes%d.dex' % index,
+                        self._Code(self.rng.randint(16, 256) * 1024), 6))
+      else:
+        entries.append(('res/raw/r%d' % index,
+                        self._Text(self.rng.randint(4, 64) * 1024), 6))
+    return entries
+
+  def NewFile(self, kind, size):
+    """Return the relative path and data of a new file of |kind|."""
+    self.next_id += 1
+    if kind == 'text':
+      return ('etc/file%d.txt' % self.next_id, self._Text(size))
+    if kind == 'lib':
+      return ('lib64/lib%d.so.1' % self.next_id, self._Code(size))
+    if kind == 'apk':
+      directory = self.rng.choice(('app', 'priv-app'))
+      return ('%s/App%d.apk' % (directory, self.next_id),
+              self._Apk(self._ApkEntries(size)))
+    if kind == 'data':
+      directory = self.rng.choice(('fonts', 'usr/share', 'vendor/firmware'))
+      return ('%s/data%d.bin' % (directory, self.next_id),
+              self.rng.randbytes(size))
+    return ('framework/sparse%d.img' % self.next_id, self._Sparse(size))
+
+  def _FileSize(self):
+    # Most files are small, a few are big, like in a real partition.
+    return min(int(self.rng.lognormvariate(10.5, 1.5)) + 1,
+               self.max_file_size)
+
+  def GenerateTree(self, root, size):
+    """Fill |root| with about |size| bytes of files, return their paths."""
+    # Leave room in small images for the files added by the churn.
+    self.max_file_size = min(self.max_file_size, max(BLOCK_SIZE, size // 32))
+    for directory in DIRS:
+      os.makedirs(os.path.join(root, directory), exist_ok=True)
+    files = []
+    for kind, fraction in FILE_KINDS.items():
+      kind_size = 0
+      while kind_size < size * fraction:
+        path, data = self.NewFile(kind, self._FileSize())
+        self._Write(root, path, data)
+        files.append(path)
+        kind_size += len(data)
+    return files
+
+  @staticmethod
+  def _Write(root, path, data):
+    with open(os.path.join(root, path), 'wb') as f:
+      f.write(data)
+
+  @staticmethod
+  def _Read(root, path):
+    with open(os.path.join(root, path), 'rb') as f:
+      return f.read()
+
+  def _Pick(self, files, fraction, predicate=lambda path: True):
+    candidates = sorted(path for path in files if predicate(path))
+    return self.rng.sample(candidates, round(len(candidates) * fraction))
+
+  def _Edit(self, root, path):
+    data = bytearray(self._Read(root, path))
+    for _ in range(1 + len(data) // (64 * 1024)):
+      length = self.rng.randint(16, 256)
+      start = self.rng.randrange(0, max(1, len(data) - length))
+      data[start:start + length] = self.rng.randbytes(length)
+    self._Write(root, path, data)
+
+  def ApplyChurn(self, root, files, churn):
+    """Apply the |churn| models to the |files| of |root|.
+
+    Returns the list of changes made, and updates |files|.
+    """
+    # APKs are only changed whole, by recompressing them.
+    def IsRaw(path):
+      return not path.endswith('.apk')
+
+    changes = []
+    for path in self._Pick(files, churn['edit'], IsRaw):
+      self._Edit(root, path)
+      changes.append({'model': 'edit', 'path': path})
+
+    for path in self._Pick(files, churn['insert'], IsRaw):
+      data = self._Read(root, path)
+      offset = self.rng.randrange(0, len(data) + 1)
+      length = self.rng.randint(1, 2 * BLOCK_SIZE)
+      self._Write(root, path,
+                  data[:offset] + self.rng.randbytes(length) + data[offset:])
+      changes.append({'model': 'insert', 'path': path, 'offset': offset,
+                      'length': length})
+
+    for path in self._Pick(files, churn['move']):
+      directory = self.rng.choice(
+          [d for d in DIRS if d != os.path.dirname(path)])
+      new_path = os.path.join(directory, os.path.basename(path))
+      if new_path in files:
+        continue
+      os.rename(os.path.join(root, path), os.path.join(root, new_path))
+      files[files.index(path)] = new_path
+      changes.append({'model': 'move', 'path': path, 'new_path': new_path})
+
+    for path in self._Pick(files, churn['recompress'],
+                           lambda p: p.endswith('.apk')):
+      with zipfile.ZipFile(os.path.join(root, path)) as apk:
+        entries = [(info.filename, apk.read(info)) for info in apk.infolist()]
+      # Changing any entry changes the compressed data of all the entries
+      # after it when the APK is recompressed with another level.
+      level = self.rng.choice((1, 4, 9))
+      index = self.rng.randrange(len(entries))
+      name, data = entries[index]
+      data = bytearray(data)
+      start = self.rng.randrange(0, len(data))
+      data[start:start + 64] = self.rng.randbytes(64)
+      entries[index] = (name, bytes(data))
+      self._Write(root, path,
+                  self._Apk([(n, d, level) for n, d in entries]))
+      changes.append({'model': 'recompress', 'path': path, 'entry': name,
+                      'level': level})
+
+    for path in self._Pick(files, churn['rename_lib'],
+                           lambda p: '.so.' in p):
+      base, version = path.rsplit('.so.', 1)
+      new_path = '%s.so.%d' % (base, int(version) + 1)
+      os.rename(os.path.join(root, path), os.path.join(root, new_path))
+      self._Edit(root, new_path)
+      files[files.index(path)] = new_path
+      changes.append({'model': 'rename_lib', 'path': path,
+                      'new_path': new_path})
+
+    for path in self._Pick(
+        files, churn['zero'],
+        lambda p: IsRaw(p) and
+        os.path.getsize(os.path.join(root, p)) > BLOCK_SIZE):
+      data = bytearray(self._Read(root, path))
+      start = self.rng.randrange(0, len(data), BLOCK_SIZE)
+      length = min(self.rng.randint(1, 16) * BLOCK_SIZE, len(data) - start)
+      data[start:start + length] = bytes(length)
+      self._Write(root, path, data)
+      changes.append({'model': 'zero', 'path': path, 'offset': start,
+                      'length': length})
+
+    for path in self._Pick(files, churn['delete']):
+      os.remove(os.path.join(root, path))
+      files.remove(path)
+      changes.append({'model': 'delete', 'path': path})
+
+    for _ in range(round(len(files) * churn['add'])):
+      kind = self.rng.choice(sorted(FILE_KINDS))
+      path, data = self.NewFile(kind, self._FileSize())
+      self._Write(root, path, data)
+      files.append(path)
+      changes.append({'model': 'add', 'path': path})
+    return changes
+
+
+def NormalizeTimes(root):
+  """Set the time of all the files and directories of |root|."""
+  for dirpath, dirnames, filenames in os.walk(root):
+    for name in dirnames + filenames:
+      os.utime(os.path.join(dirpath, name), (TIMESTAMP, TIMESTAMP))
+  os.utime(root, (TIMESTAMP, TIMESTAMP))
+
+
+def FixExt4Times(root, image, env):
+  """Set the times mke2fs copies from the host in the inodes of |image|.
+
+  mke2fs -d takes the access, change and creation times of the inodes from
+  the files of |root|, and the host sets the change time of files.
+  """
+  paths = ['/', '/lost+found']
+  for dirpath, dirnames, filenames in os.walk(root):
+    for name in sorted(dirnames + filenames):
+      paths.append('/' + os.path.relpath(os.path.join(dirpath, name), root))
+  commands = []
+  for path in paths:
+    for field in ('atime', 'ctime', 'mtime', 'crtime'):
+      commands.append('set_inode_field "%s" %s %d' % (path, field, TIMESTAMP))
+      commands.append('set_inode_field "%s" %s_extra 0' % (path, field))
+  subprocess.run(['debugfs', '-w', '-f', '-', image], check=True, env=env,
+                 input='\n'.join(commands).encode(),
+                 stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def MakeImage(fs, root, image, size, fs_uuid, mkfs):
+  """Make the |fs| image |image| of |size| bytes with the files of |root|."""
+  NormalizeTimes(root)
+  if fs == 'ext4':
+    env = dict(os.environ, E2FSPROGS_FAKE_TIME=str(TIMESTAMP))
+    # Like the images of the Android build, without a journal.
+    subprocess.check_call(
+        [mkfs or 'mke2fs', '-q', '-F', '-t', 'ext4', '-O', '^has_journal',
+         '-b', str(BLOCK_SIZE), '-U', fs_uuid, '-E', 'hash_seed=' + fs_uuid,
+         '-d', root, image, str(size // BLOCK_SIZE)], env=env)
+    FixExt4Times(root, image, env)
+  else:
+    subprocess.check_call(
+        [mkfs or 'mkfs.erofs', '-z', 'lz4hc,9', '-T', str(TIMESTAMP),
+         '-U', fs_uuid, '--ignore-mtime', image, root])
+
+
+def main(argv):
+  parser = argparse.ArgumentParser(
+      description='Generate reproducible source and target images to '
+      'benchmark updates.',
+      formatter_class=argparse.RawDescriptionHelpFormatter,
+      epilog=__doc__)
+  parser.add_argument('output_dir', help='Where to write the images.')
+  parser.add_argument('--seed', type=int, default=0,
+                      help='The seed of all the generated data.')
+  parser.add_argument('--size', default='256M',
+                      help='The size of the images, like 512M or 2G.')
+  parser.add_argument('--fill', type=float, default=0.7,
+                      help='The fraction of the images filled with files.')
+  parser.add_argument('--fs', choices=('ext4', 'erofs'), default='ext4',
+                      help='The filesystem of the images.')
+  parser.add_argument('--churn',
+                      help='Comma separated model=fraction pairs overriding '
+                      'the default churn, e.g. edit=0.1,move=0.')
+  parser.add_argument('--mkfs', help='The mke2fs or mkfs.erofs to use.')
+  args = parser.parse_args(argv[1:])
+
+  size = ParseSize(args.size)
+  churn = ParseChurn(args.churn)
+  generator = WorkloadGenerator(args.seed)
+  # The UUIDs depend on the seed only, like everything else.
+  source_uuid = str(uuid.UUID(int=generator.rng.getrandbits(128)))
+  target_uuid = str(uuid.UUID(int=generator.rng.getrandbits(128)))
+
+  os.makedirs(args.output_dir, exist_ok=True)
+  work_dir = tempfile.mkdtemp(prefix='workload-')
+  try:
+    source_dir = os.path.join(work_dir, 'source')
+    target_dir = os.path.join(work_dir, 'target')
+    files = generator.GenerateTree(source_dir, int(size * args.fill))
+    shutil.copytree(source_dir, target_dir)
+    source_files = len(files)
+    changes = generator.ApplyChurn(target_dir, files, churn)
+
+    MakeImage(args.fs, source_dir, os.path.join(args.output_dir, 'source.img'),
+              size, source_uuid, args.mkfs)
+    MakeImage(args.fs, target_dir, os.path.join(args.output_dir, 'target.img'),
+              size, target_uuid, args.mkfs)
+  finally:
+    shutil.rmtree(work_dir)
+
+  with open(os.path.join(args.output_dir, 'workload.json'), 'w') as f:
+    json.dump({'seed': args.seed, 'size': size, 'fill': args.fill,
+               'fs': args.fs, 'churn': churn, 'source_files': source_files,
+               'target_files': len(files), 'changes': changes}, f, indent=2)
+  print('Generated %d source files and %d changes in %s' %
+        (source_files, len(changes), args.output_dir))
+  return 0
+
+
+if __name__ == '__main__':
+  sys.exit(main(sys.argv))
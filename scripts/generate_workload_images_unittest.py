@@ -0,0 +1,133 @@
+#!/usr/bin/env python3
+#
+# Copyright (C) 2026 The Android Open Source Project
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#      http://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+#
+
+"""Unit testing generate_workload_images.py."""
+
+# Disable check for function names to avoid errors based on old code
+# pylint: disable-msg=invalid-name
+
+import filecmp
+import os
+import shutil
+import tempfile
+import unittest
+import zipfile
+
+import generate_workload_images
+
+
+def TreeContents(root):
+  """Return the contents of the files of |root| by relative path."""
+  contents = {}
+  for dirpath, _, filenames in os.walk(root):
+    for name in filenames:
+      path = os.path.join(dirpath, name)
+      with open(path, 'rb') as f:
+        contents[os.path.relpath(path, root)] = f.read()
+  return contents
+
+
+class GenerateWorkloadImagesTest(unittest.TestCase):
+  """Test the workload generator."""
+
+  def setUp(self):
+    self.work_dir = tempfile.mkdtemp(prefix='workload_unittest-')
+
+  def tearDown(self):
+    shutil.rmtree(self.work_dir)
+
+  def testParse(self):
+    self.assertEqual(512 << 20, generate_workload_images.ParseSize('512M'))
+    self.assertEqual(4096, generate_workload_images.ParseSize('4096'))
+    churn = generate_workload_images.ParseChurn('edit=0.5,move=0')
+    self.assertEqual(0.5, churn['edit'])
+    self.assertEqual(0, churn['move'])
+    self.assertEqual(generate_workload_images.DEFAULT_CHURN['insert'],
+                     churn['insert'])
+    with self.assertRaises(ValueError):
+      generate_workload_images.ParseChurn('shuffle=0.1')
+
+  def testSameSeedSameTree(self):
+    trees = []
+    for name in ('a', 'b'):
+      root = os.path.join(self.work_dir, name)
+      generator = generate_workload_images.WorkloadGenerator(7)
+      files = generator.GenerateTree(root, 4 << 20)
+      changes = generator.ApplyChurn(
+          root, files, generate_workload_images.DEFAULT_CHURN)
+      trees.append((TreeContents(root), changes))
+    self.assertEqual(trees[0], trees[1])
+
+    other = os.path.join(self.work_dir, 'other')
+    generate_workload_images.WorkloadGenerator(8).GenerateTree(other, 4 << 20)
+    self.assertNotEqual(trees[0][0], TreeContents(other))
+
+  def testChurnModels(self):
+    source = os.path.join(self.work_dir, 'source')
+    target = os.path.join(self.work_dir, 'target')
+    generator = generate_workload_images.WorkloadGenerator(1)
+    files = generator.GenerateTree(source, 4 << 20)
+    shutil.copytree(source, target)
+    # Apply every model to all the files it applies to.
+    churn = {model: 1.0 for model in generate_workload_images.CHURN_MODELS}
+    churn['delete'] = 0.1
+    churn['add'] = 0.1
+    changes = generator.ApplyChurn(target, files, churn)
+
+    self.assertEqual(set(generate_workload_images.CHURN_MODELS),
+                     {change['model'] for change in changes})
+    self.assertEqual(sorted(files), sorted(TreeContents(target)))
+    # The source paths of the files moved before being changed again.
+    moved_from = {}
+    for change in changes:
+      if change['model'] in ('move', 'rename_lib'):
+        moved_from[change['new_path']] = change['path']
+        self.assertFalse(
+            os.path.exists(os.path.join(target, change['path'])))
+      if change['model'] == 'rename_lib':
+        self.assertTrue(change['new_path'].endswith('.so.2'))
+      # Inserted files may be moved after.
+      if change['model'] == 'insert' and change['path'] in files:
+        self.assertEqual(
+            os.path.getsize(os.path.join(source, change['path'])) +
+            change['length'],
+            os.path.getsize(os.path.join(target, change['path'])))
+      if change['model'] == 'recompress' and change['path'] in files:
+        path = os.path.join(target, change['path'])
+        self.assertIsNone(zipfile.ZipFile(path).testzip())
+        source_path = moved_from.get(change['path'], change['path'])
+        self.assertFalse(filecmp.cmp(os.path.join(source, source_path), path,
+                                     shallow=False))
+
+  @unittest.skipUnless(shutil.which('mke2fs') and shutil.which('debugfs'),
+                       'mke2fs and debugfs are needed')
+  def testReproducibleImages(self):
+    images = []
+    for name in ('a', 'b'):
+      output_dir = os.path.join(self.work_dir, name)
+      self.assertEqual(0, generate_workload_images.main(
+          ['generate_workload_images.py', '--seed', '3', '--size', '16M',
+           output_dir]))
+      images.append(output_dir)
+    for image in ('source.img', 'target.img', 'workload.json'):
+      self.assertTrue(filecmp.cmp(os.path.join(images[0], image),
+                                  os.path.join(images[1], image),
+                                  shallow=False))
+
+
+if __name__ == '__main__':
+  unittest.main()
@@ -57,6 +57,10 @@ def extract_img(zip_archive: zipfile.ZipFile, img_name, output_path, is_source):
     print("Faild to extract", img_name, "from IMAGES/ dir, trying RADIO/", e)
     extract_file(zip_archive, "RADIO/" + img_name + ".img", output_path)
   if is_sparse_image(output_path):
+    if is_source:
+      # delta_generator reads sparse source images directly, and their size is
+      # always a multiple of the block size.
+      return
     raw_img_path = output_path + ".raw"
     subprocess.check_output(["simg2img", output_path, raw_img_path])
     os.rename(raw_img_path, output_path)